@@ -0,0 +1,250 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "BgzfWriter.h"
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+namespace phppreg {
+
+static const size_t HEADER_SIZE = 18;
+static const size_t FOOTER_SIZE = 8;
+static const size_t MAX_BLOCK_SIZE = 65536;
+
+static const char EOF_BLOCK[] = "\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+
+BgzfWriter::BgzfWriter(OutputWriter *dest, int threads, int level, size_t blocksize)
+	: dest(dest), level(level), blocksize(blocksize)
+{
+	if (threads <= 0) threads = thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+	maxpending = threads * 4;
+
+	buffer.reserve(blocksize);
+
+	for (int i = 0; i < threads; ++i) workers.emplace_back(&BgzfWriter::workerMain, this);
+}
+
+void BgzfWriter::write(const char *data, size_t length)
+{
+	while (length) {
+		size_t chunk = min(length, blocksize - buffer.length());
+		buffer.append(data, chunk);
+		data += chunk;
+		length -= chunk;
+
+		if (buffer.length() == blocksize) queueBlock();
+	}
+}
+
+void BgzfWriter::queueBlock()
+{
+	shared_ptr<Block> block = make_shared<Block>();
+	block->data.swap(buffer);
+	buffer.reserve(blocksize);
+
+	pending.push_back(block);
+
+	{
+		lock_guard<mutex> lock(queuemutex);
+		jobs.push_back(block);
+	}
+
+	jobcv.notify_one();
+
+	writeDone(pending.size() >= maxpending);
+}
+
+/**
+ * Write the compressed blocks at the front of the pending queue.
+ *
+ * @param wait Wait for the front block
+ */
+void BgzfWriter::writeDone(bool wait)
+{
+	for (;;) {
+		{
+			unique_lock<mutex> lock(queuemutex);
+			if (pending.empty()) return;
+			if (wait) donecv.wait(lock, [&]() { return pending.front()->done; });
+			else if (! pending.front()->done) return;
+		}
+
+		shared_ptr<Block> block = pending.front();
+		pending.pop_front();
+		wait = false;
+
+		if (block->failed) failed = true;
+
+		blocks.push_back(compressedoffset);
+		dest->write(block->compressed);
+		compressedoffset += block->compressed.length();
+	}
+}
+
+void BgzfWriter::workerMain()
+{
+	for (;;) {
+		shared_ptr<Block> block;
+
+		{
+			unique_lock<mutex> lock(queuemutex);
+			jobcv.wait(lock, [&]() { return stopping || ! jobs.empty(); });
+			if (jobs.empty()) return;
+			block = jobs.front();
+			jobs.pop_front();
+		}
+
+		bool ok = compressBlock(block.get(), level);
+
+		{
+			lock_guard<mutex> lock(queuemutex);
+			block->failed = ! ok;
+			block->done = true;
+		}
+
+		donecv.notify_all();
+	}
+}
+
+static void putLE(string *dest, unsigned long value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i) {
+		*dest += (char)(value & 0xff);
+		value >>= 8;
+	}
+}
+
+static unsigned long getLE(const unsigned char *src, int bytes)
+{
+	unsigned long value = 0;
+	for (int i = bytes - 1; i >= 0; --i) value = (value << 8) | src[i];
+	return value;
+}
+
+bool BgzfWriter::compressBlock(Block *block, int level)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+
+	// Raw deflate, the gzip header is written here to include the BC extra field
+	if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+	string cdata(deflateBound(&strm, block->data.length()), '\0');
+	strm.next_in = (Bytef *)block->data.data();
+	strm.avail_in = block->data.length();
+	strm.next_out = (Bytef *)&cdata[0];
+	strm.avail_out = cdata.length();
+
+	int rc = deflate(&strm, Z_FINISH);
+	cdata.resize(cdata.length() - strm.avail_out);
+	deflateEnd(&strm);
+
+	if (rc != Z_STREAM_END) return false;
+
+	size_t total = HEADER_SIZE + cdata.length() + FOOTER_SIZE;
+	if (total > MAX_BLOCK_SIZE) return false;
+
+	string& out = block->compressed;
+	out.reserve(total);
+	out.append("\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00", 16);
+	putLE(&out, total - 1, 2);
+	out += cdata;
+	putLE(&out, crc32(crc32(0L, Z_NULL, 0), (const Bytef *)block->data.data(), block->data.length()), 4);
+	putLE(&out, block->data.length(), 4);
+
+	string().swap(block->data);
+
+	return true;
+}
+
+bool BgzfWriter::close()
+{
+	if (closed) return ! failed;
+	closed = true;
+
+	if (! buffer.empty()) queueBlock();
+
+	{
+		lock_guard<mutex> lock(queuemutex);
+		stopping = true;
+	}
+
+	jobcv.notify_all();
+	while (! pending.empty()) writeDone(true);
+
+	for (auto &worker : workers) worker.join();
+	workers.clear();
+
+	dest->write(EOF_BLOCK, sizeof(EOF_BLOCK) - 1);
+
+	return ! failed && dest->flush();
+}
+
+long long BgzfWriter::getBlockOffset(size_t blockindex) const
+{
+	if (blockindex < blocks.size()) return blocks[blockindex];
+	if (closed && blockindex == blocks.size()) return compressedoffset; // End of data
+	return -1;
+}
+
+bool BgzfWriter::decompressBlock(const char *block, size_t length, string *data, size_t *blocksize)
+{
+	const unsigned char *ublock = (const unsigned char *)block;
+
+	if (length < HEADER_SIZE + FOOTER_SIZE || ublock[0] != 0x1f || ublock[1] != 0x8b || ublock[3] != 0x04
+		|| ublock[12] != 'B' || ublock[13] != 'C') return false;
+
+	size_t total = getLE(ublock + 16, 2) + 1;
+	if (total > length || total < HEADER_SIZE + FOOTER_SIZE) return false;
+
+	size_t isize = getLE(ublock + total - 4, 4);
+	unsigned long crc = getLE(ublock + total - 8, 4);
+
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, -15) != Z_OK) return false;
+
+	size_t start = data->length();
+	data->resize(start + isize);
+
+	strm.next_in = (Bytef *)(block + HEADER_SIZE);
+	strm.avail_in = total - HEADER_SIZE - FOOTER_SIZE;
+	strm.next_out = (Bytef *)&(*data)[start];
+	strm.avail_out = isize;
+
+	int rc = (isize == 0) ? Z_STREAM_END : inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+
+	if (rc != Z_STREAM_END || strm.avail_out != 0
+		|| crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data->data() + start, isize) != crc) {
+		data->resize(start);
+		return false;
+	}
+
+	*blocksize = total;
+
+	return true;
+}
+
+BgzfWriter::~BgzfWriter()
+{
+	close();
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,131 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef BGZFWRITER_H_
+#define BGZFWRITER_H_
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * BGZF (blocked gzip, as used by samtools/tabix) writer. The output is a series of independent
+ * gzip members of at most 64K, so it can be read with zcat, and a reader can seek to any block
+ * start and inflate from there. Blocks are compressed by worker threads and written in order.
+ */
+class BgzfWriter
+{
+public:
+	static const size_t BLOCK_SIZE = 0xff00;
+
+	/**
+	 * constructor
+	 *
+	 * @param dest Compressed output
+	 * @param threads Compression threads, 0 = hardware concurrency
+	 * @param level zlib compression level
+	 * @param blocksize Uncompressed bytes per block
+	 */
+	BgzfWriter(OutputWriter *dest, int threads = 0, int level = 6, size_t blocksize = BLOCK_SIZE);
+
+	void write(const char *data, size_t length);
+	void write(const std::string& data) { write(data.data(), data.length()); }
+
+	/**
+	 * @return Index of the block the next byte written goes into
+	 */
+	size_t getBlockIndex() const { return blocks.size() + pending.size(); }
+
+	/**
+	 * @return Offset of the next byte written in its uncompressed block
+	 */
+	size_t getInBlockOffset() const { return buffer.length(); }
+
+	/**
+	 * Write the last block and the EOF marker block, and stop the workers.
+	 *
+	 * @return false = compression or write failed
+	 */
+	bool close();
+
+	/**
+	 * Compressed file offset of a block. All blocks before the last are known once written, all after close().
+	 *
+	 * @param blockindex Block index
+	 * @return offset, -1 = not written yet
+	 */
+	long long getBlockOffset(size_t blockindex) const;
+
+	/**
+	 * Inflate one block.
+	 *
+	 * @param block Compressed data starting at a block start
+	 * @param length Available compressed bytes
+	 * @param data Uncompressed block is appended
+	 * @param blocksize Compressed size of the block
+	 * @return false = not a valid block
+	 */
+	static bool decompressBlock(const char *block, size_t length, std::string *data, size_t *blocksize);
+
+	virtual ~BgzfWriter();
+
+protected:
+	struct Block {
+		std::string data;
+		std::string compressed;
+		bool done = false;
+		bool failed = false;
+	};
+
+	OutputWriter *dest;
+	int level;
+	size_t blocksize;
+	std::string buffer;
+	std::vector<long long> blocks; // Compressed offsets of the written blocks
+	long long compressedoffset = 0;
+	bool failed = false;
+	bool closed = false;
+
+	std::vector<std::thread> workers;
+	std::deque<std::shared_ptr<Block>> pending; // In output order
+	std::deque<std::shared_ptr<Block>> jobs;
+	std::mutex queuemutex;
+	std::condition_variable jobcv;
+	std::condition_variable donecv;
+	bool stopping = false;
+	size_t maxpending;
+
+	void queueBlock();
+	void writeDone(bool wait);
+	void workerMain();
+	static bool compressBlock(Block *block, int level);
+
+private:
+	BgzfWriter() = delete;
+	BgzfWriter(const BgzfWriter& other) = delete;
+	BgzfWriter& operator= (const BgzfWriter& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* BGZFWRITER_H_ */
@@ -0,0 +1,192 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ExternalSort.h"
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+namespace phppreg {
+
+static const size_t LINE_OVERHEAD = sizeof(string) + 16;
+
+bool ExternalSort::add(const string& line)
+{
+	lines.push_back(line);
+	memoryused += line.capacity() + LINE_OVERHEAD;
+
+	if (memoryused >= memorylimit) return writeRun();
+
+	return true;
+}
+
+void ExternalSort::sortLines()
+{
+	sort(lines.begin(), lines.end(), less);
+}
+
+string ExternalSort::nextRunPath()
+{
+	return tempprefix + ".sort" + to_string(runcount++);
+}
+
+bool ExternalSort::writeRun()
+{
+	if (lines.empty()) return true;
+
+	sortLines();
+
+	string runpath = nextRunPath();
+	runpaths.push_back(runpath);
+
+	ofstream run(runpath.c_str(), ios::out|ios::binary|ios::trunc);
+	if (run.fail()) return false;
+
+	for (auto &line : lines) run.write(line.data(), line.length());
+
+	lines.clear();
+	lines.shrink_to_fit();
+	memoryused = 0;
+
+	return ! run.fail();
+}
+
+bool ExternalSort::finish(OutputFunc output)
+{
+	// Everything fit in memory
+	if (runpaths.empty()) {
+		sortLines();
+		for (auto &line : lines) output(line);
+		lines.clear();
+		memoryused = 0;
+		return true;
+	}
+
+	if (! writeRun()) return false;
+
+	// Merge passes until one merge can take all the runs, each pass merges consecutive runs so ties keep their order
+	while (runpaths.size() > maxmergeruns) {
+		vector<string> merged;
+
+		for (size_t first = 0; first < runpaths.size(); first += maxmergeruns) {
+			size_t last = min(first + maxmergeruns, runpaths.size());
+
+			string mergedpath = nextRunPath();
+			ofstream mergedrun(mergedpath.c_str(), ios::out|ios::binary|ios::trunc);
+			merged.push_back(mergedpath);
+
+			bool ok = ! mergedrun.fail() && mergeRuns(first, last, [&](const string& line) {
+				mergedrun.write(line.data(), line.length());
+			});
+
+			mergedrun.close();
+			if (! ok || mergedrun.fail()) {
+				for (size_t i = last; i < runpaths.size(); ++i) merged.push_back(runpaths[i]);
+				runpaths.swap(merged);
+				return false;
+			}
+		}
+
+		runpaths.swap(merged);
+	}
+
+	bool ok = mergeRuns(0, runpaths.size(), output);
+	runpaths.clear();
+
+	return ok;
+}
+
+bool ExternalSort::mergeRuns(size_t first, size_t last, OutputFunc output)
+{
+	// k-way merge of the runs, ties go to the earlier run to keep the sort stable
+	size_t count = last - first;
+	vector<unique_ptr<ifstream>> runs;
+	vector<string> heads(count);
+
+	auto greater = [&](size_t a, size_t b) {
+		if (less(heads[a], heads[b])) return false;
+		if (less(heads[b], heads[a])) return true;
+		return a > b;
+	};
+
+	priority_queue<size_t, vector<size_t>, decltype(greater)> queue(greater);
+	bool ok = true;
+
+	for (size_t i = 0; i < count && ok; ++i) {
+		runs.emplace_back(new ifstream(runpaths[first + i].c_str(), ios::in|ios::binary));
+		if (runs[i]->fail()) {
+			ok = false;
+		} else if (getline(*runs[i], heads[i])) {
+			heads[i] += '\n';
+			queue.push(i);
+		}
+	}
+
+	while (ok && ! queue.empty()) {
+		size_t i = queue.top();
+		queue.pop();
+		output(heads[i]);
+
+		if (getline(*runs[i], heads[i])) {
+			heads[i] += '\n';
+			queue.push(i);
+		}
+	}
+
+	// getline stops on a read error like on end of file, only bad() tells them apart
+	for (size_t i = 0; i < runs.size(); ++i) {
+		if (runs[i]->bad()) ok = false;
+		runs[i].reset();
+	}
+
+	for (size_t i = first; i < last; ++i) remove(runpaths[i].c_str());
+
+	return ok;
+}
+
+bool ExternalSort::paramsLess(const string& a, const string& b)
+{
+	const char *aptr = a.c_str();
+	const char *bptr = b.c_str();
+	char *aend;
+	char *bend;
+
+	unsigned long aid = strtoul(aptr, &aend, 10);
+	unsigned long bid = strtoul(bptr, &bend, 10);
+	if (aid != bid) return aid < bid;
+
+	unsigned long apage = (*aend == '\t') ? strtoul(aend + 1, NULL, 10) : 0;
+	unsigned long bpage = (*bend == '\t') ? strtoul(bend + 1, NULL, 10) : 0;
+	if (apage != bpage) return apage < bpage;
+
+	// Whole line without the newline
+	size_t alen = a.length() - (a.length() && a.back() == '\n');
+	size_t blen = b.length() - (b.length() && b.back() == '\n');
+
+	return a.compare(0, alen, b, 0, blen) < 0;
+}
+
+ExternalSort::~ExternalSort()
+{
+	for (auto &runpath : runpaths) remove(runpath.c_str());
+}
+
+} /* namespace phppreg */
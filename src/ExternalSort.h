@@ -0,0 +1,101 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef EXTERNALSORT_H_
+#define EXTERNALSORT_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace phppreg {
+
+/**
+ * Bounded memory sort of newline terminated lines. Lines are sorted in memory until
+ * the memory limit is reached, then written to a sorted run file. finish() merges the runs,
+ * at most maxmergeruns at a time.
+ */
+class ExternalSort
+{
+public:
+	typedef std::function<bool(const std::string&, const std::string&)> LessFunc;
+	typedef std::function<void(const std::string&)> OutputFunc;
+
+	static const size_t MAX_MERGE_RUNS = 64;
+
+	/**
+	 * constructor
+	 *
+	 * @param tempprefix Path prefix for the run files, .sortN is appended
+	 * @param memorylimit Approximate bytes of lines to hold before writing a run
+	 * @param less Line comparison
+	 * @param maxmergeruns Most run files open at once, more runs are merged in passes
+	 */
+	ExternalSort(const std::string& tempprefix, size_t memorylimit, LessFunc less, size_t maxmergeruns = MAX_MERGE_RUNS)
+		: tempprefix(tempprefix), memorylimit(memorylimit), less(less), maxmergeruns(maxmergeruns < 2 ? 2 : maxmergeruns) {}
+
+	/**
+	 * add
+	 *
+	 * @param line Newline terminated line
+	 * @return false = run file write failed
+	 */
+	bool add(const std::string& line);
+
+	/**
+	 * finish
+	 *
+	 * Merge the runs, calling output for each line in sorted order. The run files are deleted.
+	 *
+	 * @param output Line handler
+	 * @return false = run file read/write failed
+	 */
+	bool finish(OutputFunc output);
+
+	size_t getRunCount() const { return runpaths.size(); }
+	size_t getMemoryUsed() const { return memoryused; }
+
+	/**
+	 * Compare tab separated lines like LC_ALL=C sort -n -k 1,1 -k 2,2 (template id, page id, then whole line)
+	 */
+	static bool paramsLess(const std::string& a, const std::string& b);
+
+	virtual ~ExternalSort();
+
+protected:
+	std::string tempprefix;
+	size_t memorylimit;
+	LessFunc less;
+	size_t maxmergeruns;
+	std::vector<std::string> lines;
+	size_t memoryused = 0;
+	std::vector<std::string> runpaths;
+	size_t runcount = 0; // Run files created, for unique names
+
+	std::string nextRunPath();
+	bool writeRun();
+	bool mergeRuns(size_t first, size_t last, OutputFunc output);
+	void sortLines();
+
+private:
+	ExternalSort() = delete;
+	ExternalSort(const ExternalSort& other) = delete;
+	ExternalSort& operator= (const ExternalSort& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* EXTERNALSORT_H_ */
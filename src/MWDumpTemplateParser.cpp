@@ -21,21 +21,100 @@
 #include <memory>
 #include <sstream>
 #include <set>
+#include <unordered_map>
 #include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "PregMatch.h"
 #include "PhpPreg.h"
+#include "PhpPregRegistry.h"
 #include "MWDumpHandler.h"
 #include "MWTemplateParamParser.h"
 #include "MWTemplate.h"
+#include "TemplateCache.h"
+#include "ParamValidator.h"
+#include "ExternalSort.h"
+#include "OutputWriter.h"
+#include "BgzfWriter.h"
+#include "ParamsBinaryWriter.h"
+#include "ParamsBinaryReader.h"
+#include "OffsetsScanner.h"
+#include "PageIndex.h"
+#include "QueryServer.h"
+#include "ValueIndexWriter.h"
+#include "ValueIndex.h"
+#include "TemplateBitmapIndex.h"
+#include "ParamsDiff.h"
+#include "ValuesExport.h"
+#include "TemplateFilter.h"
+#include "ParamSketch.h"
+#include "TemplateSketches.h"
+#include "PageArena.h"
+#include "MappedFile.h"
 #include "string_util.h"
 #include <expat.h>
+#ifdef MWDTP_COUNT_ALLOCS
+#include <atomic>
+#include <new>
+#endif
 
 using namespace std;
 using namespace phppreg;
 
 int performTests();
-int calcOffsets(string infilepath, string outfilepath);
-int dumpValues(string infilepath, string outfilepath, string templatenames, bool verbose);
+int performBenchmarks();
+int calcOffsets(string infilepath, string outfilepath, bool pageindex = false);
+int lookupPage(string paramsfilepath, string indexfilepath, string pageid, bool verbose);
+int serveQueries(string paramsfilepath, string totalsfilepath, string socketpath, bool verbose);
+int readBinaryParams(string infilepath, string outfilepath);
+int buildValueIndex(string paramsfilepath, string indexfilepath, bool verbose);
+int queryValues(string indexfilepath, string tmplid, string query, bool verbose);
+int queryBitmaps(string indexfilepath, string expression, bool verbose);
+int diffParams(string oldfilepath, string newfilepath, string outfilepath, bool verbose);
+int mergeSketches(string sketchesfilepaths, string sketchesoutfilepath, string totalsoutfilepath);
+#ifdef MWDTP_COUNT_ALLOCS
+/**
+ * Heap allocation counter reported by -b, build with -DMWDTP_COUNT_ALLOCS
+ */
+static atomic<long long> alloccount(0);
+
+void *operator new(size_t size)
+{
+	++alloccount;
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL) throw bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+#endif
+
+bool loadTemplateRanges(const string& paramsfilepath, const MappedFile& params, vector<TemplateRange> *ranges, bool verbose);
+void writeOffset(OutputWriter *dest, const TemplateRange& range, long long offset, long long inblockoffset = -1);
+void writeSketch(OutputWriter *dest, const string& param_name, long long paramcount, const ParamSketch& sketch);
+int writeSortedParams(ExternalSort& sorter, OutputWriter *dest, OutputWriter *offsets, BgzfWriter *bgzf = 0);
+int dumpValues(string infilepath, string outfilepath, string templatenames, bool verbose, bool sortbytitle = true);
+
+/**
+ * Output file and template names of a -values group.
+ */
+struct ValuesGroup {
+	string outfilepath;
+	vector<string> templatenames;
+};
+
+int dumpValuesGroups(string infilepath, const vector<ValuesGroup>& groups, bool verbose, bool sortbytitle = true);
+bool loadValuesGroups(const string& groupsfilepath, const string& outfilepath, vector<ValuesGroup> *groups);
+string valuesOutfilePath(const string& outfilepath, string groupname);
+size_t parseByteSize(const string& size);
 map<int, bool> excludelist;
 void loadExclusions(const string& wikiProject);
 map<int, bool> namespaces;
@@ -47,7 +126,61 @@ void loadNamespaces(const string& wikiProject);
  * LC_ALL=C sort -n -k 1,1 -k 2,2 enwikiTemplateParams >enwikiTemplateParams.sorted
  * ./MWDumpTemplateParser -offsets enwikiTemplateParams.sorted enwikiTemplateOffsets
  *
+ * Or sorted with offsets (enwikiTemplateOffsets) in one pass:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -sort - enwikiTemplateParams enwikiTemplateTotals&
+ *
+ * The offsets are template id, start offset (negative = excludelisted), row count, byte length.
+ *
+ * With a page id index (enwikiTemplatePageIndex), and page lookup:
+ * ./MWDumpTemplateParser -offsets -pageindex enwikiTemplateParams.sorted enwikiTemplateOffsets
+ * ./MWDumpTemplateParser -lookup-page enwikiTemplateParams.sorted enwikiTemplatePageIndex 12345
+ *
+ * Query server for the sorted params, offsets, totals and page index files:
+ * ./MWDumpTemplateParser -v -serve enwikiTemplateParams.sorted enwikiTemplateTotals /tmp/enwikiTemplates.sock&
+ * printf 'template 3382507\n' | nc -U /tmp/enwikiTemplates.sock
+ *
+ * Value index (enwikiTemplateValueIndex), and page ids of a param value (param=value), value prefix (param^=prefix) or any value (param):
+ * ./MWDumpTemplateParser -valueindex enwikiTemplateParams.sorted enwikiTemplateValueIndex
+ * ./MWDumpTemplateParser -query-values enwikiTemplateValueIndex 3382507 "occupation^=actor"
+ *
+ * With per template page id bitmaps (enwikiTemplateBitmaps), and the page ids of a set expression:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -bitmaps - enwikiTemplateParams enwikiTemplateTotals&
+ * ./MWDumpTemplateParser -query-bitmaps enwikiTemplateBitmaps "(3382507 OR 6594285) ANDNOT 1234"
+ *
+ * Added (+), removed (-) and changed (~) param values between two dumps' sorted params, using their offsets files if present:
+ * ./MWDumpTemplateParser -v -diff 20260901/enwikiTemplateParams.sorted 20261001/enwikiTemplateParams.sorted enwikiTemplateDiff
+ *
+ * Or sorted and BGZF compressed, the offsets are compressed block offset, offset in the block, row count, uncompressed byte length:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -sort -bgzf - enwikiTemplateParams.gz enwikiTemplateTotals&
+ *
+ * Or sorted in the binary format, the footer index replaces the offsets file:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -sort -binary - enwikiTemplateParams.bin enwikiTemplateTotals&
+ * ./MWDumpTemplateParser -readbinary enwikiTemplateParams.bin enwikiTemplateParams.sorted
+ *
  * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -values - enwiki "IMDb name;IMDB name"&
+ *
+ * Or the values of many template groups in one pass, the groups file lines are output name, tab, template names separated by ;
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -value-groups - enwiki ValueGroups.tsv&
+ *
+ * Totals with the estimated distinct value count and the top values of each param, with error bounds:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -sketch-totals - enwikiTemplateParams enwikiTemplateTotals&
+ *
+ * The sketches are also written to enwikiTemplateSketches, the sketches of dump shards are merged into the totals of the dump:
+ * ./MWDumpTemplateParser -merge-sketches "shard1TemplateSketches;shard2TemplateSketches" enwikiTemplateSketches enwikiTemplateTotals
+ *
+ * With the totals counts spilled to disk and the sort memory bounded to stay near 12GB:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -sort -memory-limit 12G - commonswikiTemplateParams commonswikiTemplateTotals&
+ *
+ * With the pages over 2 cpu seconds finished by a linear scan and listed in enwikiTemplatePathological:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -page-budget 2 - enwikiTemplateParams enwikiTemplateTotals&
+ *
+ * With the pages of 1MB or more parsed whole instead of in segments on one thread per cpu:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -page-threads 1 - enwikiTemplateParams enwikiTemplateTotals&
+ *
+ * With the parsed template invocation cache raised from 65536 to a million entries:
+ * bunzip2 -c *pages-articles.xml.bz2 | ./MWDumpTemplateParser -v -template-cache 1000000 - enwikiTemplateParams enwikiTemplateTotals&
+ *
+ * Per template params projection and value predicates are read from TemplateFilters.tsv if it exists, see TemplateFilter.
  */
 
 class TemplateInfo
@@ -59,11 +192,19 @@ public:
 	string name;
 	map<string, int> param_name_cnt;
 	map<string, map<string, int>> param_value_cnt;
+	map<string, ParamSketch> param_sketches; // -sketch-totals, replaces param_value_cnt
+	map<string, vector<uint64_t>> param_value_seen; // Hashes of the distinct values counted, after a totals spill
+	bool valuesspilled = false;
 	map<string, char> param_valid;
-	map<string, char> param_validation;
-	map<string, PhpPreg *> param_validation_regex;
-	map<string, set<string> *> param_validation_values;
+	unordered_map<string, int> param_ids;
+	vector<string> param_names; // by param id
+	vector<int> param_rules; // ParamValidator rule id by param id, -1 = no validation
+	vector<int> param_id_cnt; // excludelisted template param_name_cnt by param id
+	vector<uint64_t> deprecated_mask; // by param id
+	vector<uint64_t> required_mask; // by param id
+	bool has_validation = false;
 	map<string, string> param_aliases;
+	shared_ptr<TemplateFilter> filter; // TemplateFilters.tsv projection/predicates, 0 = write all
 };
 
 class MainClass : IPageHandler
@@ -72,41 +213,171 @@ public:
 	int parseTemplates(const string& infilepath, const string& outfilepath, const string& totalsoutfilepath);
 	void processPage(int mwnamespace, unsigned int page_id, unsigned int revision_id, const std::string& page_data, const std::string& page_title);
 	void loadTemplateIds();
-	void writeTotals(const string& totalsoutfilepath);
+	bool loadFilters(const string& wikiProject);
+	bool validateParams(TemplateInfo *ti, const map<string, string>& templ_params);
+	void processExcluded(TemplateInfo *ti, int tmplid, unsigned int page_id, map<string, string>& templ_params);
+	void countFiltered(TemplateInfo *ti, const string& name, const string& value, bool excludelisted, bool writevaliderror);
+	void countParam(TemplateInfo *ti, const string& key);
+	map<string, int>& paramValues(TemplateInfo *ti, const string& key);
+	bool valuesFull(TemplateInfo *ti, const string& key, const map<string, int>& value_cnt);
+	void countValue(TemplateInfo *ti, const string& key, map<string, int>& value_cnt, const string& value);
+	ParamSketch& paramSketch(TemplateInfo *ti, const string& key);
+	bool sketchFull(TemplateInfo *ti, const string& key, const ParamSketch& sketch);
+	void countSketchValue(TemplateInfo *ti, const string& key, ParamSketch& sketch, const char *value, size_t length);
+	void countSeen(TemplateInfo *ti, const string& key, uint64_t hashvalue);
+	bool spillTotals();
+	bool writeTotals(const string& totalsoutfilepath);
+	void writeRow();
+	void reportPathological(unsigned int page_id, const string& page_title, size_t page_size, const PageParseStats& stats);
+	string siblingPath(const string& outfilepath, const char *suffix);
 	bool verbose = false;
+	bool sortoutput = false;
+	bool compressoutput = false;
+	bool binaryoutput = false;
+	bool writebitmaps = false;
+	bool sketchtotals = false;
+	string sketchesoutfilepath; // -sketch-totals ...TemplateSketches, "" = not written
+	size_t sortmemory = 1024 * 1024 * 1024;
+	size_t memorylimit = 0; // 0 = no limit, else half for the totals counts, a quarter for the sort
+	size_t aggregatebytes = 0; // Approximate bytes of the totals counts and sketches
+	size_t retainedbytes = 0; // Part of aggregatebytes kept by a spill
+	string spillprefix;
+	vector<string> spillpaths;
+	vector<string> sketchspillpaths;
 	map<string, int> template_ids;
-    ostream *dest = 0;
+    OutputWriter *dest = 0;
+    ExternalSort *sorter = 0;
+    BgzfWriter *bgzf = 0;
+    ParamsBinaryWriter *binwriter = 0;
+    TemplateBitmapIndex *bitmaps = 0;
     map<int, TemplateInfo *> template_info;
-    static set<string> yesno;
+    ParamValidator validator;
+    long long filteredinstances = 0; // Not written because of a filter predicate
+    long long filteredparams = 0; // Not written because of a filter projection
+    long long filteredbytes = 0;
+    vector<uint64_t> param_bits;
+    string row; // output row buffer
+    string keybuf;
+    string valuebuf;
     string wikiProject;
-};
-
-set<string> MainClass::yesno = {
-		"yes", "y", "true", "1",
-		"no", "n", "false", "0"
+    string pathological; // Report of the pages over the parse budget
+    int pathologicalcount = 0;
 };
 
 int main(int argc, char **argv) {
 	int i;
 	bool testmode = false;
+	bool benchmode = false;
 	bool verbose = false;
 	bool calcoffsets = false;
 	bool dumpvalues = false;
+	bool sortoutput = false;
+	bool compressoutput = false;
+	bool binaryoutput = false;
+	bool readbinary = false;
+	bool pageindex = false;
+	bool lookuppage = false;
+	bool servequeries = false;
+	bool valueindex = false;
+	bool queryvalues = false;
+	bool writebitmaps = false;
+	bool querybitmaps = false;
+	bool diffparams = false;
+	bool dumporder = false;
+	bool valuegroups = false;
+	bool sketchtotals = false;
+	bool mergesketches = false;
+	size_t memorylimit = 0;
 
 	for (i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "-v") == 0) verbose = true;
 		else if (strcmp(argv[i], "-t") == 0) testmode = true;
+		else if (strcmp(argv[i], "-b") == 0) benchmode = true;
 		else if (strcmp(argv[i], "-offsets") == 0) calcoffsets = true;
 		else if (strcmp(argv[i], "-values") == 0) dumpvalues = true;
+		else if (strcmp(argv[i], "-sort") == 0) sortoutput = true;
+		else if (strcmp(argv[i], "-bgzf") == 0) compressoutput = true;
+		else if (strcmp(argv[i], "-binary") == 0) binaryoutput = true;
+		else if (strcmp(argv[i], "-readbinary") == 0) readbinary = true;
+		else if (strcmp(argv[i], "-pageindex") == 0) pageindex = true;
+		else if (strcmp(argv[i], "-lookup-page") == 0) lookuppage = true;
+		else if (strcmp(argv[i], "-serve") == 0) servequeries = true;
+		else if (strcmp(argv[i], "-valueindex") == 0) valueindex = true;
+		else if (strcmp(argv[i], "-query-values") == 0) queryvalues = true;
+		else if (strcmp(argv[i], "-bitmaps") == 0) writebitmaps = true;
+		else if (strcmp(argv[i], "-query-bitmaps") == 0) querybitmaps = true;
+		else if (strcmp(argv[i], "-diff") == 0) diffparams = true;
+		else if (strcmp(argv[i], "-dump-order") == 0) dumporder = true;
+		else if (strcmp(argv[i], "-value-groups") == 0) valuegroups = true;
+		else if (strcmp(argv[i], "-sketch-totals") == 0) sketchtotals = true;
+		else if (strcmp(argv[i], "-merge-sketches") == 0) mergesketches = true;
+		else if (strcmp(argv[i], "-page-budget") == 0 && i + 1 < argc) {
+			char *end;
+			MWTemplateParamParser::maxPageSeconds = strtod(argv[++i], &end);
+			if (*end || MWTemplateParamParser::maxPageSeconds < 0) {
+				cerr << "invalid page budget " << argv[i] << "\n";
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-page-threads") == 0 && i + 1 < argc) {
+			char *end;
+			MWTemplateParamParser::pageThreads = strtol(argv[++i], &end, 10);
+			if (*end || MWTemplateParamParser::pageThreads < 0) {
+				cerr << "invalid page threads " << argv[i] << "\n";
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-template-cache") == 0 && i + 1 < argc) {
+			char *end;
+			long entries = strtol(argv[++i], &end, 10);
+			if (*end || entries < 0) {
+				cerr << "invalid template cache entries " << argv[i] << "\n";
+				return 1;
+			}
+			TemplateCache::capacity = entries;
+		}
+		else if ((strcmp(argv[i], "-memory-limit") == 0 || strcmp(argv[i], "--memory-limit") == 0) && i + 1 < argc) {
+			memorylimit = parseByteSize(argv[++i]);
+			if (! memorylimit) {
+				cerr << "invalid memory limit " << argv[i] << "\n";
+				return 1;
+			}
+		}
 		else break;
 	}
 
-	if ((! calcoffsets && argc - i != 3) || (calcoffsets && argc - i != 2)) {
-		cout << "Usage: MWDumpTemplateParser [-v] [-t] [-offsets] [infilepath|-] [outfilepath|-] [totals outfilepath|values template name(s)|-]\n";
+	bool twoargs = calcoffsets || readbinary || valueindex || querybitmaps;
+
+	if ((! twoargs && argc - i != 3) || (twoargs && argc - i != 2) || (compressoutput && binaryoutput)) {
+		cout << "Usage: MWDumpTemplateParser [-v] [-t] [-b] [-offsets] [-sort] [-bgzf|-binary] [-readbinary] [-pageindex] [-lookup-page] [-serve] [-valueindex] [-query-values] [-bitmaps] [-query-bitmaps] [-diff] [-dump-order] [-value-groups] [-sketch-totals] [-merge-sketches] [-memory-limit bytes[K|M|G]] [-page-budget seconds] [-page-threads n] [-template-cache entries] [infilepath|-] [outfilepath|-] [totals outfilepath|values template name(s)|page id|socket path|query|-]\n";
 		cout << "\t -v: verbose\n";
 		cout << "\t -t: testmode\n";
+		cout << "\t -b: benchmark mode\n";
 		cout << "\t -offsets: calc template start offsets\n";
 		cout << "\t -values: dump template parameter values\n";
+		cout << "\t -dump-order: with -values, write the rows in dump order instead of sorted by page name\n";
+		cout << "\t -value-groups: dump the parameter values of template groups, arguments are dump file, output path prefix, groups file\n";
+		cout << "\t -sketch-totals: write the estimated distinct value count and the top values with error bounds of each param to the totals, and the sketches to ...TemplateSketches\n";
+		cout << "\t -merge-sketches: merge the ...TemplateSketches of runs over disjoint pages, arguments are sketches files (separated by ;), merged sketches output file, totals output file\n";
+		cout << "\t -memory-limit: spill the totals counts to disk and bound the sort memory to stay near the limit, ie. 12G\n";
+		cout << "\t -page-budget: cpu seconds per page (default 10, 0 = no limit), a page over it or " << MWTemplateParamParser::MAX_ITERATIONS
+			<< " rescans is finished by a linear brace scan and reported in ...TemplatePathological\n";
+		cout << "\t -page-threads: threads to parse a page of " << (MWTemplateParamParser::parallelPageSize >> 20)
+			<< "MB or more in segments (default 0 = one per cpu, 1 = parse it whole)\n";
+		cout << "\t -template-cache: parsed template invocations kept for the next pages they are on (default " << TemplateCache::capacity
+			<< ", 0 = no caching)\n";
+		cout << "\t -sort: write the parameter values sorted, and the template start offsets to ...TemplateOffsets\n";
+		cout << "\t -bgzf: write the parameter values BGZF (blocked gzip) compressed\n";
+		cout << "\t -binary: write the parameter values in the binary params format\n";
+		cout << "\t -readbinary: write a binary params file as tsv\n";
+		cout << "\t -pageindex: with -offsets, also write the page id index ...TemplatePageIndex\n";
+		cout << "\t -lookup-page: write the rows of a page id, arguments are sorted params file, page index file, page id\n";
+		cout << "\t -serve: answer queries on a Unix domain socket, arguments are sorted params file, totals file, socket path\n";
+		cout << "\t -valueindex: write the value index of a sorted params file, arguments are sorted params file, index file\n";
+		cout << "\t -query-values: write the page ids of a value query, arguments are index file, template id, param=value, param^=prefix or param\n";
+		cout << "\t -bitmaps: also write the page id bitmaps of the templates to ...TemplateBitmaps\n";
+		cout << "\t -query-bitmaps: write the page ids of a template id set expression with AND, OR, ANDNOT and (), arguments are bitmaps file, expression\n";
+		cout << "\t -diff: write the added, removed and changed param values, arguments are old sorted params file, new sorted params file, diff output file\n";
 		cout << "\t [infilepath|-]: input file path or - for stdin\n";
 		cout << "\t [outfilepath|-]: output file path or - for stdout\n";
 		cout << "\t [totals outfilepath|values template name(s)|-]: totals output file path or values template name(s) (separated by ;) or - for stderr\n";
@@ -116,18 +387,51 @@ int main(int argc, char **argv) {
 	string infilepath = argv[i];
 	string outfilepath = argv[i+1];
 	string totalsoutfilepath;
-	if (! calcoffsets) totalsoutfilepath = argv[i+2];
+	if (! twoargs) totalsoutfilepath = argv[i+2];
 
 	if (testmode) {
 		return performTests();
+	} else if (benchmode) {
+		return performBenchmarks();
 	} else if (calcoffsets) {
-		return calcOffsets(infilepath, outfilepath);
+		return calcOffsets(infilepath, outfilepath, pageindex);
+	} else if (servequeries) {
+		return serveQueries(infilepath, outfilepath, totalsoutfilepath, verbose);
+	} else if (lookuppage) {
+		return lookupPage(infilepath, outfilepath, totalsoutfilepath, verbose);
+	} else if (readbinary) {
+		return readBinaryParams(infilepath, outfilepath);
+	} else if (valueindex) {
+		return buildValueIndex(infilepath, outfilepath, verbose);
+	} else if (queryvalues) {
+		return queryValues(infilepath, outfilepath, totalsoutfilepath, verbose);
+	} else if (querybitmaps) {
+		return queryBitmaps(infilepath, outfilepath, verbose);
+	} else if (diffparams) {
+		return diffParams(infilepath, outfilepath, totalsoutfilepath, verbose);
+	} else if (mergesketches) {
+		return mergeSketches(infilepath, outfilepath, totalsoutfilepath);
+	} else if (valuegroups) {
+		vector<ValuesGroup> groups;
+		if (outfilepath == "-") {
+			cerr << "-value-groups needs an output path prefix\n";
+			return 1;
+		}
+		if (! loadValuesGroups(totalsoutfilepath, outfilepath, &groups)) return 1;
+		return dumpValuesGroups(infilepath, groups, verbose, ! dumporder);
 	} else if (dumpvalues) {
-		return dumpValues(infilepath, outfilepath, totalsoutfilepath, verbose);
+		return dumpValues(infilepath, outfilepath, totalsoutfilepath, verbose, ! dumporder);
 	}
 
 	MainClass mc;
 	mc.verbose = verbose;
+	mc.sortoutput = sortoutput;
+	mc.compressoutput = compressoutput;
+	mc.binaryoutput = binaryoutput;
+	mc.writebitmaps = writebitmaps;
+	mc.sketchtotals = sketchtotals;
+	mc.memorylimit = memorylimit;
+	if (memorylimit) mc.sortmemory = min(mc.sortmemory, memorylimit / 4);
 	mc.loadTemplateIds();
 	return mc.parseTemplates(infilepath, outfilepath, totalsoutfilepath);
 }
@@ -287,6 +591,26 @@ int performTests()
 		return 20;
 	}
 
+	// PhpPregRegistry
+	PhpPreg& sharedPreg = PhpPregRegistry::get("!^\\d{4}$!u");
+	if (&sharedPreg != &PhpPregRegistry::get("!^\\d{4}$!u") || sharedPreg.isStudied()) {
+		cout << "PhpPregRegistry::get shared instance failed\n";
+		return 40;
+	}
+
+	if (! sharedPreg.match("1984") || sharedPreg.match("84") || ! sharedPreg.isStudied()) {
+		cout << "PhpPregRegistry::get lazy jit failed\n";
+		return 41;
+	}
+
+	// matchAll empty matches
+	PhpPreg phpPreg7("!x*!");
+	matchcnt = phpPreg7.matchAll("axb", &mvs);
+	if (matchcnt != 4 || mvs[1]->at(0)->text != "x" || mvs[1]->at(0)->textOffset != 1 || mvs[3]->at(0)->textOffset != 3) {
+		cout << "matchAll empty matches failed\n";
+		return 39;
+	}
+
 	/**
 	 * string_util tests
 	 */
@@ -307,6 +631,23 @@ int performTests()
 		return 22;
 	}
 
+	// string_append_field
+	subject = "x";
+	string_append_field(&subject, "a\tb\nc\x01 \xc3\xa9", 9, 8);
+	if (subject != "xa b c  ") {
+		cout << "string_append_field failed\n";
+		return 47;
+	}
+
+	subject.clear();
+	string field(40, '\t');
+	field += "\xe2\x82\xac"; // euro sign, cut mid character
+	string_append_field(&subject, field, 41);
+	if (subject != string(40, ' ')) {
+		cout << "string_append_field utf8 cut failed\n";
+		return 48;
+	}
+
 	// string_split
 	subject ="abc|def|hij";
 	vector<string> splits;
@@ -323,6 +664,52 @@ int performTests()
 		return 24;
 	}
 
+	/**
+	 * ParamValidator
+	 */
+
+	ParamValidator validator;
+	int yesnorule = validator.addRule('Y', "");
+	if (! validator.validate(yesnorule, "YES") || ! validator.validate(yesnorule, "n") || validator.validate(yesnorule, "maybe")) {
+		cout << "ParamValidator yes/no failed\n";
+		return 42;
+	}
+
+	int valuesrule = validator.addRule('V', "red|blue|black");
+	if (! validator.validate(valuesrule, "blue") || validator.validate(valuesrule, "Blue") || validator.validate(valuesrule, "red|blue")) {
+		cout << "ParamValidator values failed\n";
+		return 43;
+	}
+
+	// A long list gets a table of about 1.25 slots per value
+	string manyvalues;
+	for (int x = 0; x < 5000; ++x) manyvalues += (x ? "|v" : "v") + to_string(x);
+	int manyrule = validator.addRule('V', manyvalues);
+	bool manyok = true;
+	for (int x = 0; x < 5000 && manyok; ++x) manyok = validator.validate(manyrule, "v" + to_string(x));
+
+	if (! manyok || validator.validate(manyrule, "v5000") || validator.validate(manyrule, "x1")) {
+		cout << "ParamValidator many values failed\n";
+		return 96;
+	}
+
+	int digitsrule = validator.addRule('R', "\\d{1,2}");
+	if (validator.getRule(digitsrule).type != ParamRule::DIGITS || digitsrule != validator.addRule('R', "\\d{1,2}")
+			|| ! validator.validate(digitsrule, "07") || validator.validate(digitsrule, "123") || validator.validate(digitsrule, "1a")
+			|| ! validator.validate(digitsrule, "\xd9\xa7")) { // Arabic-indic digit seven is left to pcre
+		cout << "ParamValidator digits failed\n";
+		return 44;
+	}
+
+	int literalrule = validator.addRule('R', "(?:left|right|center)");
+	int regexrule = validator.addRule('R', "left|right");
+	if (validator.getRule(literalrule).type != ParamRule::LITERAL || ! validator.validate(literalrule, "right")
+			|| validator.validate(literalrule, "rightish") || validator.getRule(regexrule).type != ParamRule::REGEX
+			|| ! validator.validate(regexrule, "leftish")) {
+		cout << "ParamValidator literal failed\n";
+		return 45;
+	}
+
 	/**
 	 * MWTemplateParamParser
 	 */
@@ -416,6 +803,442 @@ int performTests()
 		return 34;
 	}
 
+	/**
+	 * OffsetsScanner chunk edge test, every line is a chunk
+	 */
+
+	ifstream scansource(infilepath.c_str(), ios::in|ios::binary);
+	string scandata((istreambuf_iterator<char>(scansource)), istreambuf_iterator<char>());
+	scandata.insert(0, "\n"); // Empty lines are counted in the length, not the rows
+	vector<TemplateRange> scanranges;
+	vector<TemplateRange> chunkedranges;
+	vector<PageIndexEntry> scanpages;
+	vector<PageIndexEntry> chunkedpages;
+	OffsetsScanner::scan(scandata.data(), scandata.length(), 0, &scanranges, &scanpages);
+
+	for (size_t chunkstart = 0; chunkstart < scandata.length(); ) {
+		size_t chunkend = scandata.find('\n', chunkstart) + 1;
+		vector<TemplateRange> chunkranges;
+		vector<PageIndexEntry> chunkpages;
+		OffsetsScanner::scan(scandata.data() + chunkstart, chunkend - chunkstart, chunkstart, &chunkranges, &chunkpages);
+		OffsetsScanner::append(&chunkedranges, chunkranges);
+		OffsetsScanner::append(&chunkedpages, chunkpages);
+		chunkstart = chunkend;
+	}
+
+	if (scanranges.size() != 2 || chunkedranges.size() != 2 || scanranges[1].tmplid != 6594285 || scanranges[1].offset != 1043
+		|| scanranges[1].rows != 13 || scanranges[1].length != 373 || scanranges[0].offset != 1 || scanranges[0].rows != 13) {
+		cout << "OffsetsScanner failed\n";
+		return 58;
+	}
+
+	for (size_t r = 0; r < scanranges.size(); ++r) {
+		if (scanranges[r].tmplid != chunkedranges[r].tmplid || scanranges[r].offset != chunkedranges[r].offset
+			|| scanranges[r].rows != chunkedranges[r].rows || scanranges[r].length != chunkedranges[r].length) {
+			cout << "OffsetsScanner append failed\n";
+			return 59;
+		}
+	}
+
+	/**
+	 * Page index test, page 110 has two rows per template
+	 */
+
+	if (scanpages.size() != 24 || chunkedpages.size() != 24) {
+		cout << "OffsetsScanner pages failed\n";
+		return 60;
+	}
+
+	PageIndex::write("PageIndexTest", &chunkedpages);
+	PageIndex pageindex;
+	bool pageindexok = pageindex.open("PageIndexTest");
+	remove("PageIndexTest");
+
+	const PageIndexEntry *pageend;
+	const PageIndexEntry *pageentry = pageindex.find(110, &pageend);
+
+	if (! pageindexok || pageindex.size() != 24 || pageend - pageentry != 2 || pageentry[0].tmplid != 3382507
+		|| scandata.compare(pageentry[0].offset, 12, "3382507\t110\t") != 0
+		|| pageentry[1].tmplid != 6594285 || scandata.compare(pageentry[1].offset, 12, "6594285\t110\t") != 0) {
+		cout << "PageIndex failed\n";
+		return 61;
+	}
+
+	pageentry = pageindex.find(100, &pageend);
+	if (pageentry != pageend) {
+		cout << "PageIndex missing page failed\n";
+		return 62;
+	}
+
+	/**
+	 * Sorted output test, runs are forced by the small memory limit
+	 */
+
+	ifstream calcoffsetsource(infilepath.c_str(), ios::in|ios::binary);
+	vector<string> sortlines;
+	string sortline;
+	while (getline(calcoffsetsource, sortline)) sortlines.push_back(sortline + "\n");
+	vector<string> sortedlines(sortlines);
+	sort(sortedlines.begin(), sortedlines.end(), ExternalSort::paramsLess);
+	string sortedexpected;
+	for (auto &line : sortedlines) sortedexpected += line;
+
+	ExternalSort sorter("ExternalSortTest", 256, ExternalSort::paramsLess);
+	for (auto it = sortlines.rbegin(); it != sortlines.rend(); ++it) sorter.add(*it);
+	size_t sortruns = sorter.getRunCount();
+
+	ostringstream sorteddest;
+	ostringstream sortedoffsets;
+	{
+		OutputWriter sortedwriter(&sorteddest, 64);
+		OutputWriter offsetswriter(&sortedoffsets, 64);
+		retval = writeSortedParams(sorter, &sortedwriter, &offsetswriter);
+	}
+	if (retval || sortruns < 2 || sorter.getRunCount() != 0 || sorteddest.str() != sortedexpected) {
+		cout << "writeSortedParams failed = " << retval << "\n";
+		return 49;
+	}
+
+	if (sortedoffsets.str().find("6594285\t-") == string::npos) {
+		cout << "writeSortedParams offsets failed\n";
+		return 50;
+	}
+
+	// One run per line, merged 3 at a time in several passes
+	ExternalSort passsorter("ExternalSortTest", 1, ExternalSort::paramsLess, 3);
+	for (auto it = sortlines.rbegin(); it != sortlines.rend(); ++it) passsorter.add(*it);
+	size_t passruns = passsorter.getRunCount();
+
+	string passsorted;
+	bool passok = passsorter.finish([&](const string& line) { passsorted += line; });
+	if (! passok || passruns != sortlines.size() || passsorted != sortedexpected) {
+		cout << "ExternalSort merge passes failed\n";
+		return 97;
+	}
+
+	/**
+	 * OutputWriter test, integer formatting and writes larger than the buffer
+	 */
+
+	ostringstream writerdest;
+	string writerexpected;
+	{
+		OutputWriter writer(&writerdest, 32);
+		const long long writervalues[] = {0, 9, 10, 99, 100, 12345, -1, -1000000007LL, 4294967295LL, 9223372036854775807LL};
+		for (auto value : writervalues) {
+			writer.writeInt(value);
+			writer.put('\t');
+			writerexpected += to_string(value) + "\t";
+		}
+
+		writer.writeUInt(18446744073709551615ULL);
+		writer.write(sortedexpected);
+		writerexpected += "18446744073709551615" + sortedexpected;
+
+		if (writer.tellp() != (long long)writerexpected.length()) {
+			cout << "OutputWriter tellp failed\n";
+			return 51;
+		}
+	}
+
+	if (writerdest.str() != writerexpected) {
+		cout << "OutputWriter failed\n";
+		return 52;
+	}
+
+	/**
+	 * BGZF sorted output test, small blocks so templates span blocks
+	 */
+
+	ExternalSort bgzfsorter("ExternalSortTest", 1024 * 1024, ExternalSort::paramsLess);
+	for (auto &line : sortlines) bgzfsorter.add(line);
+
+	ostringstream compresseddest;
+	ostringstream compressedoffsets;
+	{
+		OutputWriter compressedwriter(&compresseddest);
+		OutputWriter offsetswriter(&compressedoffsets);
+		BgzfWriter bgzf(&compressedwriter, 2, 6, 100);
+		retval = writeSortedParams(bgzfsorter, &compressedwriter, &offsetswriter, &bgzf);
+	}
+
+	string compressed = compresseddest.str();
+	string decompressed;
+	size_t blockstart = 0;
+	size_t blocksize;
+	int blockcnt = 0;
+
+	while (blockstart < compressed.length()
+		&& BgzfWriter::decompressBlock(compressed.data() + blockstart, compressed.length() - blockstart, &decompressed, &blocksize)) {
+		blockstart += blocksize;
+		++blockcnt;
+	}
+
+	if (retval || blockstart != compressed.length() || blockcnt < 10 || decompressed != sortedexpected) {
+		cout << "BgzfWriter failed = " << retval << "\n";
+		return 53;
+	}
+
+	vector<string> offsetlines;
+	string_split(compressedoffsets.str(), "\n", &offsetlines);
+	offsetlines.pop_back();
+
+	for (auto &offsetline : offsetlines) {
+		vector<string> offsetpieces;
+		string_split(offsetline, "\t", &offsetpieces);
+		long long blockoffset = llabs(stoll(offsetpieces[1]));
+		string blockdata;
+
+		// The template rows can start at the end of a block
+		for (blockstart = blockoffset; blockdata.length() < 200 && blockstart < compressed.length(); blockstart += blocksize) {
+			BgzfWriter::decompressBlock(compressed.data() + blockstart, compressed.length() - blockstart, &blockdata, &blocksize);
+		}
+
+		if (offsetpieces.size() != 5 || blockdata.compare(stoul(offsetpieces[2]), offsetpieces[0].length() + 1, offsetpieces[0] + "\t") != 0) {
+			cout << "BgzfWriter offsets failed: " << offsetline << "\n";
+			return 54;
+		}
+	}
+
+	/**
+	 * Binary params test, small sections so templates span sections
+	 */
+
+	ostringstream binarydest;
+	string binaryexpected;
+	string binarytemplate;
+	{
+		OutputWriter binarywriter(&binarydest);
+		ParamsBinaryWriter paramswriter(&binarywriter, 200);
+
+		for (auto it = sortlines.rbegin(); it != sortlines.rend(); ++it) {
+			paramswriter.addRow(*it);
+			binaryexpected += *it;
+			if (it->compare(0, 8, "6594285\t") == 0) binarytemplate = *it + binarytemplate;
+		}
+
+		string emptyrow = "6594285\t1\tbirth_date\t\tdf\t\n";
+		paramswriter.addRow(emptyrow);
+		binaryexpected += emptyrow;
+		binarytemplate += emptyrow;
+
+		if (paramswriter.addRow("6594285\tx\n") || paramswriter.addRow("6594285\t1\tname\n")) {
+			cout << "ParamsBinaryWriter malformed row accepted\n";
+			return 55;
+		}
+	}
+
+	string binary = binarydest.str();
+	ParamsBinaryReader binaryreader;
+	string binaryoutput;
+	bool binaryok = binaryreader.init(binary.data(), binary.length())
+		&& binaryreader.readAll([&](const string& line) { binaryoutput += line; });
+
+	if (! binaryok || binaryoutput != binaryexpected || binaryreader.getIndex().size() < 4 || binary.length() >= binaryexpected.length()) {
+		cout << "ParamsBinaryReader readAll failed\n";
+		return 56;
+	}
+
+	binaryoutput.clear();
+	binaryok = binaryreader.readTemplate(6594285, [&](const string& line) { binaryoutput += line; });
+
+	// Sections are returned in file order
+	vector<string> binarylines;
+	vector<string> expectedlines;
+	string_split(binaryoutput, "\n", &binarylines);
+	string_split(binarytemplate, "\n", &expectedlines);
+	sort(binarylines.begin(), binarylines.end());
+	sort(expectedlines.begin(), expectedlines.end());
+
+	if (! binaryok || binarylines != expectedlines) {
+		cout << "ParamsBinaryReader readTemplate failed\n";
+		return 57;
+	}
+
+	/**
+	 * Query server test
+	 */
+
+	{
+		ofstream queryparams("QueryServerTestParams", ios::out|ios::binary|ios::trunc);
+		queryparams << sortedexpected;
+		ofstream queryoffsets("QueryServerTestOffsets", ios::out|ios::binary|ios::trunc);
+		queryoffsets << sortedoffsets.str();
+		ofstream querytotals("QueryServerTestTotals", ios::out|ios::binary|ios::trunc);
+		querytotals << "T3382507\t13\t13\tInfobox person\nPbirth_date\t13\nT6594285\t13\t13\tBirth date\nP1\t13\n";
+	}
+
+	vector<TemplateRange> queryranges;
+	vector<PageIndexEntry> querypages;
+	OffsetsScanner::scan(sortedexpected.data(), sortedexpected.length(), 0, &queryranges, &querypages);
+	PageIndex::write("QueryServerTestPageIndex", &querypages);
+
+	QueryServer queryserver(1024 * 1024);
+	string queryerr;
+	bool queryok = queryserver.open("QueryServerTestParams", "QueryServerTestOffsets", "QueryServerTestTotals", "QueryServerTestPageIndex", &queryerr);
+
+	string templateresponse = queryserver.handleRequest("template 6594285");
+	string paramresponse = queryserver.handleRequest("param 3382507 honorific");
+	string pageresponse = queryserver.handleRequest("page 110");
+	string unknownresponse = queryserver.handleRequest("template 1");
+	queryserver.handleRequest("template 6594285");
+	queryserver.handleRequest("param 3382507 birth_date");
+
+	remove("QueryServerTestParams");
+	remove("QueryServerTestOffsets");
+	remove("QueryServerTestTotals");
+	remove("QueryServerTestPageIndex");
+
+	vector<string> responselines;
+	string_split(templateresponse, "\n", &responselines);
+
+	if (! queryok || templateresponse.compare(0, 3, "OK ") != 0 || responselines.size() != 17 || responselines[1] != "T6594285\t13\t13\tBirth date"
+		|| responselines[3] != "6594285\t101\t1\t1976\t2\t12\t3\t1") {
+		cout << "QueryServer template failed " << queryerr << "\n";
+		return 63;
+	}
+
+	string_split(paramresponse, "\n", &responselines);
+	if (responselines.size() != 14 || find(responselines.begin(), responselines.end(), "3382507\t110\thonorific\tDr") == responselines.end()) {
+		cout << "QueryServer param failed\n";
+		return 64;
+	}
+
+	string_split(pageresponse, "\n", &responselines);
+	if (responselines.size() != 6 || unknownresponse.compare(0, 4, "ERR ") != 0) {
+		cout << "QueryServer page failed\n";
+		return 65;
+	}
+
+	// Only the param requests decode, the second one from the cache
+	if (queryserver.getCacheHits() != 1 || queryserver.getCacheMisses() != 1) {
+		cout << "QueryServer cache failed\n";
+		return 66;
+	}
+
+	/**
+	 * Value index test
+	 */
+
+	ostringstream valueindexdest;
+	size_t valuetermcnt;
+
+	{
+		OutputWriter valueindexout(&valueindexdest);
+		ValueIndexWriter valueindexwriter(&valueindexout);
+		string_split(sortedexpected, "\n", &sortlines);
+
+		for (auto &line : sortlines) {
+			if (! line.empty() && ! valueindexwriter.addRow(line)) {
+				cout << "ValueIndexWriter addRow failed " << line << "\n";
+				return 67;
+			}
+		}
+
+		// Spans several dictionary blocks
+		for (int pageid = 1; pageid <= 200; ++pageid) {
+			valueindexwriter.addRow("99999999\t" + to_string(pageid) + "\tid\tV" + to_string(pageid) + "\n");
+		}
+
+		valueindexwriter.addRow("99999999\t201\tid\tV1");
+		if (valueindexwriter.addRow("3382507\t101\thonorific\tMr")) {
+			cout << "ValueIndexWriter out of order row accepted\n";
+			return 93;
+		}
+		valueindexwriter.close();
+		valuetermcnt = valueindexwriter.getTermCount();
+	}
+
+	string valueindexdata = valueindexdest.str();
+	ValueIndex valueindex;
+	vector<uint32_t> honorificdr, birthdates, honorifics, exactid, prefixid;
+
+	if (! valueindex.init(valueindexdata.data(), valueindexdata.length()) || valueindex.getBlockCount() < 4
+		|| ! valueindex.find(3382507, "honorific", "  DR ", false, &honorificdr)
+		|| ! valueindex.find(3382507, "birth_date", "{{birth date|1976|12|1", true, &birthdates)
+		|| ! valueindex.find(3382507, "honorific", "", true, &honorifics)
+		|| ! valueindex.find(99999999, "id", "v150", false, &exactid)
+		|| ! valueindex.find(99999999, "id", "v1", true, &prefixid)) {
+		cout << "ValueIndex init/find failed " << valuetermcnt << "\n";
+		return 68;
+	}
+
+	if (honorificdr != vector<uint32_t>({102, 110}) || birthdates != vector<uint32_t>({101, 110, 112}) || honorifics.size() != 11
+		|| honorifics.front() != 101 || honorifics.back() != 112) {
+		cout << "ValueIndex lookup failed\n";
+		return 69;
+	}
+
+	if (exactid != vector<uint32_t>({150}) || prefixid.size() != 112 || prefixid.front() != 1 || prefixid.back() != 201
+		|| ! valueindex.find(99999999, "id", "v1000", false, &exactid) || ! exactid.empty()) {
+		cout << "ValueIndex block lookup failed\n";
+		return 70;
+	}
+
+	/**
+	 * ParamsDiff test
+	 */
+
+	string diffnew = sortedexpected;
+	string_replace(&diffnew, "honorific\tDr\ttitle\tPerson 102", "honorific\tProf\ttitle\tPerson 102");
+	string_replace(&diffnew, "honorific\tDr\ttitle\tPerson 110b", "honorific\tMrs\ttitle\tPerson 110b");
+	string_replace(&diffnew, "3382507\t111\tbirth_date\t{{Birth date         |1976         |12         |11}}\ttitle\tPerson 111\n", "");
+	diffnew += "9999999\t5\tname\tX\n";
+
+	vector<TemplateRange> diffoldranges, diffnewranges, diffbadranges;
+	string differr;
+	if (! OffsetsScanner::readOffsets(sortedoffsets.str().data(), sortedoffsets.str().length(), sortedexpected.data(), sortedexpected.length(), &diffoldranges, &differr)
+		|| diffoldranges.size() != 2 || OffsetsScanner::readOffsets("3382507\t1\n", 10, sortedexpected.data(), sortedexpected.length(), &diffbadranges, &differr)) {
+		cout << "OffsetsScanner readOffsets failed " << differr << "\n";
+		return 76;
+	}
+
+	OffsetsScanner::scan(diffnew.data(), diffnew.length(), 0, &diffnewranges);
+
+	ostringstream diffdest;
+	ParamsDiff paramsdiff(sortedexpected.data(), sortedexpected.length(), diffnew.data(), diffnew.length());
+
+	{
+		OutputWriter diffwriter(&diffdest);
+		paramsdiff.run(diffoldranges, diffnewranges, 2, &diffwriter, &differr);
+	}
+
+	string diffexpected = "~\t3382507\t102\thonorific\tDr\tProf\n"
+		"-\t3382507\t110\thonorific\tDr\n"
+		"+\t3382507\t110\thonorific\tMrs\n"
+		"-\t3382507\t111\tbirth_date\t{{Birth date         |1976         |12         |11}}\n"
+		"-\t3382507\t111\ttitle\tPerson 111\n"
+		"+\t9999999\t5\tname\tX\n";
+
+	if (diffdest.str() != diffexpected || paramsdiff.getAdded() != 2 || paramsdiff.getRemoved() != 3 || paramsdiff.getChanged() != 1) {
+		cout << "ParamsDiff failed\n" << diffdest.str();
+		return 77;
+	}
+
+	// Templates split at page ids into chunks of about 64 bytes
+	ostringstream chunkdiffdest;
+	ParamsDiff chunkdiff(sortedexpected.data(), sortedexpected.length(), diffnew.data(), diffnew.length(), 64);
+
+	{
+		OutputWriter diffwriter(&chunkdiffdest);
+		chunkdiff.run(diffoldranges, diffnewranges, 3, &diffwriter, &differr);
+	}
+
+	if (chunkdiffdest.str() != diffexpected || chunkdiff.getAdded() != 2 || chunkdiff.getRemoved() != 3 || chunkdiff.getChanged() != 1) {
+		cout << "ParamsDiff chunks failed\n" << chunkdiffdest.str();
+		return 99;
+	}
+
+	string diffunsorted = "3382507\t102\ttitle\tA\n3382507\t101\ttitle\tB\n";
+	string diffunsorteddest;
+	long long diffunsortedcounts[3] = {0, 0, 0};
+
+	if (ParamsDiff::diffTemplate(3382507, diffunsorted.data(), diffunsorted.length(), diffunsorted.data(), diffunsorted.length(),
+		&diffunsorteddest, diffunsortedcounts)) {
+		cout << "ParamsDiff unsorted page ids not detected\n";
+		return 94;
+	}
+
 	/**
 	 * processPage() test
 	 */
@@ -440,10 +1263,14 @@ int performTests()
 | website = {{URL|http://www.grignani.it}}\
 }}";
 
-	mc.dest = new ostringstream();
+	ostringstream pagedest;
+	TemplateBitmapIndex pagebitmaps;
+	mc.dest = new OutputWriter(&pagedest);
+	mc.bitmaps = &pagebitmaps;
 	mc.processPage(0, 113, 1, pagedata, "Gianluca Grignani");
-	string output = ((ostringstream *)mc.dest)->str();
+	mc.bitmaps = 0;
 	delete mc.dest;
+	string output = pagedest.str();
 
 	string_split(output, "\t", &splits);
 
@@ -474,66 +1301,423 @@ int performTests()
 	}
 
 	/**
-	 * Misc test
+	 * TemplateFilter test
 	 */
 
-	pagedata = R"END(
-{{Infobox settlement
-|official_name =Junabad
-|native_name =جون اباد
-|settlement_type        = village
-|coordinates_region     = IR
-|subdivision_type       = [[List of countries|Country]]
-|subdivision_name = {{flag|Iran}}
-|subdivision_type1 =[[Provinces of Iran|Province]]
-|subdivision_name1 =[[Fars Province|Fars]]
-|subdivision_type2 =[[Counties of Iran|County]]
-|subdivision_name2 = [[Fasa County|Fasa]]
-|subdivision_type3 =[[Bakhsh]]
-|subdivision_name3 =[[Central District (Fasa County)|Central]]
-|subdivision_type4 =[[Rural Districts of Iran|Rural District]]
-|subdivision_name4 =[[Sahrarud Rural District|Sahrarud]]
-|leader_title           = 
-|leader_name            = 
-|established_title      =
-|established_date       = 
-|area_total_km2           = 
-|area_footnotes           = 
-|population_as_of         = 2006
-|population_total =
-|population_density_km2   =auto
-|timezone               = [[Iran Standard Time|IRST]]
-|utc_offset             = +3:30
-|timezone_DST           = [[Iran Daylight Time|IRDT]]
-|utc_offset_DST         = +4:30
-|coordinates_display      = %
-|latd=|latm=|lats=|latNS=N
-|longd=|longm=|longs=|longEW=E
-|elevation_m            = 
-|area_code              = 
-|website                = 
-|footnotes              =
-}}
-'''Junabad''' ({{lang-fa|جون اباد}}, also [[Romanize]]d as '''Jūnābād''') is a village in [[Sahrarud Rural District]], in the [[Central District (Fasa County)|Central District]] of [[Fasa County]], [[Fars Province]], [[Iran]]. At the 2006 census, its existence was noted, but its population was not reported.<ref>{{IranCensus2006|07}}</ref>  
+	MainClass filtermc;
+	filtermc.loadTemplateIds();
+	TemplateInfo *filterti = filtermc.template_info[4592538];
+	filterti->filter = make_shared<TemplateFilter>();
+	string filtererr;
+
+	if (! filterti->filter->addRule("params", {"name|genre"}, &filtererr) || ! filterti->filter->addRule("regex", {"origin", "^\\[\\[Mil"}, &filtererr)
+		|| ! filterti->filter->addRule("empty", {"First album"}, &filtererr) || filterti->filter->addRule("regex", {"name", "(unclosed"}, &filtererr)
+		|| filterti->filter->addRule("prefix", {"name"}, &filtererr) || filterti->filter->addRule("like", {"name", "x"}, &filtererr)) {
+		cout << "TemplateFilter addRule failed " << filtererr << "\n";
+		return 82;
+	}
 
-== References ==
-{{reflist}}
+	ostringstream filterdest;
+	filtermc.dest = new OutputWriter(&filterdest);
+	filtermc.processPage(0, 113, 1, pagedata, "Gianluca Grignani");
+	filterti->filter->addRule("prefix", {"name", "Luca"}, &filtererr);
+	filtermc.processPage(0, 114, 1, pagedata, "Gianluca Grignani");
+
+	// Not excludelisted
+	filtermc.template_info[576289]->filter = make_shared<TemplateFilter>();
+	filtermc.template_info[576289]->filter->addRule("params", {"author|date"}, &filtererr);
+	filtermc.template_info[576289]->filter->addRule("prefix", {"date", "14"}, &filtererr);
+	filtermc.processPage(0, 115, 1, "{{Information|author=Me|date=1493|source=X}}", "File:A");
+	filtermc.processPage(0, 116, 1, "{{Information|author=Me|date=2001|source=X}}", "File:B");
+	delete filtermc.dest;
+	filtermc.dest = 0;
+
+	if (filterdest.str() != "4592538\t113\tgenre\t[[Pop music|Pop]]\tname\tGianluca Grignani\n576289\t115\tauthor\tMe\tdate\t1493\n"
+		|| filterti->param_name_cnt["origin"] != 2 || filtermc.template_info[576289]->param_name_cnt["source"] != 2
+		|| filtermc.filteredinstances != 2 || filtermc.filteredparams != 11
+		|| filtermc.filteredbytes < 400) {
+		cout << "TemplateFilter processPage failed " << filtermc.filteredinstances << " " << filtermc.filteredparams << " "
+			<< filtermc.filteredbytes << "\n" << filterdest.str();
+		return 83;
+	}
 
-{{Fasa County}}
+	/**
+	 * ParamSketch tests
+	 */
 
-{{coord missing|Iran}}
+	// Heavy hitters among 5000 singletons, 3 values have 1000, 500, 200 occurrences
+	ParamSketch sketchall, sketchA, sketchB;
+	for (int x = 0; x < 5000; ++x) {
+		string value = "v" + to_string(x);
+		ParamSketch& half = (x & 1) ? sketchB : sketchA;
+		sketchall.add(value);
+		half.add(value);
+		const char *heavy = (x < 1000 && x % 5 < 2) ? "heavy1" : (x % 10 == 2) ? "heavy2" : (x % 25 == 3) ? "heavy3" : 0;
+		if (heavy) {
+			sketchall.add(heavy, strlen(heavy));
+			half.add(heavy, strlen(heavy));
+		}
+	}
 
-[[Category:Populated places in Fasa County]]
+	vector<ParamSketch::Counter> topcounters = sketchall.topValues();
+	long long sketchdistinct = sketchall.distinct();
+	if (topcounters.size() != ParamSketch::TOPK || topcounters[0].value != "heavy2" || topcounters[1].value != "heavy1" || topcounters[2].value != "heavy3"
+		|| topcounters[0].count < 500 || topcounters[0].count - topcounters[0].error > 500
+		|| topcounters[1].count < 400 || topcounters[1].count - topcounters[1].error > 400
+		|| topcounters[2].count < 200 || topcounters[2].count - topcounters[2].error > 200
+		|| sketchdistinct < 5003 * 0.9 || sketchdistinct > 5003 * 1.1) {
+		cout << "ParamSketch add failed " << sketchdistinct << " " << topcounters[0].value << " " << topcounters[0].count << "\n";
+		return 84;
+	}
 
-{{Fasa-geo-stub}}
-)END";
+	// Merged halves, the distinct estimate is the same as of one run
+	string sketchbytes;
+	sketchB.serialize(&sketchbytes);
+	ParamSketch sketchread;
+	bool sketchreadok = sketchread.deserialize(sketchbytes.data(), sketchbytes.length())
+		&& ! sketchread.deserialize(sketchbytes.data(), sketchbytes.length() - 1);
+	sketchread.deserialize(sketchbytes.data(), sketchbytes.length());
+	sketchA.merge(sketchread);
+	topcounters = sketchA.topValues();
+
+	ParamSketch sketchsmallA, sketchsmallB;
+	sketchsmallA.add("a", 1);
+	sketchsmallA.add("b", 1);
+	sketchsmallB.add("b", 1);
+	sketchsmallA.merge(sketchsmallB);
+
+	if (! sketchreadok || sketchA.distinct() != sketchdistinct || topcounters[0].value != "heavy2" || topcounters[0].count < 500
+		|| topcounters[0].count - topcounters[0].error > 500 || topcounters[1].value != "heavy1"
+		|| sketchsmallA.distinct() != 2 || sketchsmallA.topValues()[0].value != "b" || sketchsmallA.topValues()[0].count != 2
+		|| sketchsmallA.topValues()[0].error != 0) {
+		cout << "ParamSketch merge failed " << sketchA.distinct() << " " << sketchdistinct << "\n";
+		return 85;
+	}
 
-	mc.dest = new ostringstream();
-	mc.processPage(0, 50407944, 1, pagedata, "Junabad");
-	output = ((ostringstream *)mc.dest)->str();
-	delete mc.dest;
+	// -sketch-totals
+	MainClass sketchmc;
+	sketchmc.loadTemplateIds();
+	sketchmc.sketchtotals = true;
+	ostringstream sketchdest;
+	sketchmc.dest = new OutputWriter(&sketchdest);
+	for (int x = 0; x < 60; ++x) {
+		sketchmc.processPage(0, 200 + x, 1, "{{Information|author=A" + to_string(x) + "|source=" + (x % 3 ? "own" : "web") + "}}", "File:A");
+	}
+	delete sketchmc.dest;
+	sketchmc.dest = 0;
+	sketchmc.sketchesoutfilepath = "SketchTotalsTestSketches";
+	sketchmc.writeTotals("SketchTotalsTest");
+
+	string sketchtotals;
+	{
+		ifstream sketchfile("SketchTotalsTest", ios::in|ios::binary);
+		getline(sketchfile, sketchtotals, '\0');
+	}
+	remove("SketchTotalsTest");
+
+	string sketchrows = sketchdest.str();
+	size_t sketchpos = sketchtotals.find("\nSauthor\t60\t");
+	long long authordistinct = sketchpos == string::npos ? 0 : atoll(sketchtotals.c_str() + sketchpos + 12);
+	if (authordistinct < 57 || authordistinct > 63 || sketchtotals.find("\tA50\t2\t1\t") == string::npos || sketchtotals.find("\nSsource\t60\t2\town\t40\t0\tweb\t20\t0\n") == string::npos
+		|| sketchrows.find("576289\t249\tauthor\tA49\t") == string::npos || sketchrows.find("576289\t250\tauthor\t\tsource\town\n") == string::npos) {
+		cout << "-sketch-totals failed\n" << sketchtotals;
+		return 86;
+	}
 
-	vector<string> templates;
+	// The sketches of two shards of the pages merge into the totals of all of them
+	for (int shard = 0; shard < 2; ++shard) {
+		MainClass shardmc;
+		shardmc.loadTemplateIds();
+		shardmc.sketchtotals = true;
+		shardmc.sketchesoutfilepath = "SketchShardTest" + to_string(shard);
+		ostringstream sharddest;
+		shardmc.dest = new OutputWriter(&sharddest);
+		for (int x = shard; x < 60; x += 2) {
+			shardmc.processPage(0, 200 + x, 1, "{{Information|author=A" + to_string(x) + "|source=" + (x % 3 ? "own" : "web") + "}}", "File:A");
+		}
+		delete shardmc.dest;
+		shardmc.dest = 0;
+		shardmc.writeTotals("SketchShardTestTotals");
+		remove("SketchShardTestTotals");
+	}
+
+	retval = mergeSketches("SketchShardTest0;SketchShardTest1", "SketchMergeTest", "SketchMergeTestTotals");
+	string mergedtotals, singletotals;
+	{
+		ifstream mergedfile("SketchMergeTestTotals", ios::in|ios::binary);
+		getline(mergedfile, mergedtotals, '\0');
+	}
+
+	// A single run's sketches give its totals
+	int singleretval = mergeSketches("SketchTotalsTestSketches", "SketchMergeTest", "SketchMergeTestTotals");
+	{
+		ifstream singlefile("SketchMergeTestTotals", ios::in|ios::binary);
+		getline(singlefile, singletotals, '\0');
+	}
+
+	remove("SketchShardTest0");
+	remove("SketchShardTest1");
+	remove("SketchTotalsTestSketches");
+	remove("SketchMergeTest");
+	remove("SketchMergeTestTotals");
+
+	sketchpos = mergedtotals.find("\nSauthor\t60\t");
+	authordistinct = sketchpos == string::npos ? 0 : atoll(mergedtotals.c_str() + sketchpos + 12);
+	if (retval || singleretval || singletotals != sketchtotals || mergedtotals.find("T576289\t60\t60\tInformation\nSauthor\t60\t") != 0
+		|| authordistinct < 57 || authordistinct > 63 || mergedtotals.find("\nSsource\t60\t2\town\t40\t0\tweb\t20\t0\n") == string::npos) {
+		cout << "-merge-sketches failed\n" << mergedtotals;
+		return 100;
+	}
+
+	// -memory-limit totals spill gives the same params and totals
+	string spilltotals[2], spillrows[2];
+	size_t spillcount = 0;
+
+	for (int spill = 0; spill < 2; ++spill) {
+		MainClass spillmc;
+		spillmc.loadTemplateIds();
+		spillmc.template_info[576289]->filter = make_shared<TemplateFilter>();
+		spillmc.template_info[576289]->filter->addRule("params", {"author|source"}, &filtererr);
+		if (spill) spillmc.memorylimit = 1;
+		spillmc.spillprefix = "SpillTest";
+		ostringstream spilldest;
+		spillmc.dest = new OutputWriter(&spilldest);
+
+		for (int x = 0; x < 120; ++x) {
+			if (x % 10 == 0) spillmc.processPage(0, 300 + x, 1, pagedata, "Gianluca Grignani");
+			spillmc.processPage(0, 300 + x, 1, "{{Information|author=A" + to_string(x % 70) + "|source=" + (x % 3 ? "own" : "web")
+				+ "|date=" + to_string(x % 60) + "|x" + to_string(x) + "=1}}", "File:A");
+		}
+
+		delete spillmc.dest;
+		spillmc.dest = 0;
+		if (spill) spillcount = spillmc.spillpaths.size();
+		spillmc.writeTotals("SpillTestTotals");
+
+		ifstream spillfile("SpillTestTotals", ios::in|ios::binary);
+		getline(spillfile, spilltotals[spill], '\0');
+		remove("SpillTestTotals");
+		spillrows[spill] = spilldest.str();
+	}
+
+	ifstream spillleft("SpillTest.totals0");
+	if (spillcount < 3 || spilltotals[0].empty() || spilltotals[0] != spilltotals[1] || spillrows[0] != spillrows[1] || spillleft.is_open()
+		|| parseByteSize("12G") != 12ULL * 1024 * 1024 * 1024 || parseByteSize("64k") != 65536 || parseByteSize("1000") != 1000
+		|| parseByteSize("12X") || parseByteSize("G") || parseByteSize("-1") || parseByteSize("17179869184G")
+		|| parseByteSize("99999999999999999999")) {
+		cout << "-memory-limit totals spill failed " << spillcount << "\n" << spilltotals[0] << "\n" << spilltotals[1];
+		return 87;
+	}
+
+	// A spill that can't be read fails the totals instead of dropping its counts
+	MainClass spillgonemc;
+	spillgonemc.spillpaths.push_back("SpillTest.totalsgone");
+	if (spillgonemc.writeTotals("SpillTestTotals")) {
+		cout << "-memory-limit unreadable spill not detected\n";
+		return 95;
+	}
+	remove("SpillTestTotals");
+
+	// The -sketch-totals sketches are spilled too, the values written are the same and so are the totals of params with
+	// less than TOPK distinct values, the merged top values of the others are within their bounds
+	string sketchspilltotals[2], sketchspillrows[2];
+	size_t sketchspillcount = 0;
+	size_t sketchspillbytes = 0;
+
+	for (int spill = 0; spill < 2; ++spill) {
+		MainClass spillmc;
+		spillmc.loadTemplateIds();
+		spillmc.sketchtotals = true;
+		if (spill) spillmc.memorylimit = 1;
+		spillmc.spillprefix = "SketchSpillTest";
+		ostringstream spilldest;
+		spillmc.dest = new OutputWriter(&spilldest);
+
+		for (int x = 0; x < 120; ++x) {
+			spillmc.processPage(0, 300 + x, 1, "{{Information|author=A" + to_string(x % 70) + "|source=" + (x % 3 ? "own" : "web")
+				+ "|date=" + to_string(x % 40) + "}}", "File:A");
+		}
+
+		delete spillmc.dest;
+		spillmc.dest = 0;
+		if (spill) sketchspillcount = spillmc.sketchspillpaths.size();
+		else sketchspillbytes = spillmc.aggregatebytes;
+		spillmc.writeTotals("SketchSpillTestTotals");
+
+		ifstream spillfile("SketchSpillTestTotals", ios::in|ios::binary);
+		getline(spillfile, sketchspilltotals[spill], '\0');
+		remove("SketchSpillTestTotals");
+		sketchspillrows[spill] = spilldest.str();
+		size_t datepos = sketchspilltotals[spill].find("\nSdate\t120\t40\t");
+		if (sketchspilltotals[spill].find("T576289\t120\t120\tInformation\nSauthor\t120\t69\t") != 0 || datepos == string::npos) {
+			sketchspillcount = 0;
+		} else {
+			sketchspilltotals[spill].erase(0, datepos);
+		}
+	}
+
+	ifstream sketchspillleft("SketchSpillTest.sketches0");
+	if (sketchspillcount < 3 || sketchspillbytes < 100 * ParamSketch::TOPK || sketchspilltotals[0] != sketchspilltotals[1]
+		|| sketchspillrows[0] != sketchspillrows[1] || sketchspillleft.is_open()) {
+		cout << "-memory-limit sketches spill failed " << sketchspillcount << "\n" << sketchspilltotals[0] << "\n" << sketchspilltotals[1];
+		return 101;
+	}
+
+	/**
+	 * PageBitmap test
+	 */
+
+	set<uint32_t> bitmapsetA, bitmapsetB;
+	PageBitmap bitmapA, bitmapB;
+	uint32_t bitmaprand = 12345;
+
+	for (int x = 0; x < 30000; ++x) {
+		bitmaprand = bitmaprand * 1103515245 + 12345;
+		uint32_t pageid = (x < 20000) ? (bitmaprand >> 8) % 60000 : (bitmaprand >> 4) % 3000000; // Dense first container
+		if (x % 2) {
+			bitmapsetA.insert(pageid);
+			bitmapA.add(pageid);
+		} else {
+			bitmapsetB.insert(pageid);
+			bitmapB.add(pageid);
+		}
+	}
+
+	auto bitmapIds = [](const PageBitmap& bitmap) {
+		vector<uint32_t> ids;
+		bitmap.forEach([&](uint32_t pageid) { ids.push_back(pageid); });
+		return ids;
+	};
+
+	vector<uint32_t> expectedand, expectedor, expectedandnot;
+	set_intersection(bitmapsetA.begin(), bitmapsetA.end(), bitmapsetB.begin(), bitmapsetB.end(), back_inserter(expectedand));
+	set_union(bitmapsetA.begin(), bitmapsetA.end(), bitmapsetB.begin(), bitmapsetB.end(), back_inserter(expectedor));
+	set_difference(bitmapsetA.begin(), bitmapsetA.end(), bitmapsetB.begin(), bitmapsetB.end(), back_inserter(expectedandnot));
+
+	PageBitmap bitmapand(bitmapA), bitmapor(bitmapA), bitmapandnot(bitmapA);
+	bitmapand.andWith(bitmapB);
+	bitmapor.orWith(bitmapB);
+	bitmapandnot.andNotWith(bitmapB);
+
+	if (bitmapIds(bitmapA) != vector<uint32_t>(bitmapsetA.begin(), bitmapsetA.end()) || bitmapA.cardinality() != bitmapsetA.size()
+		|| ! bitmapA.contains(*bitmapsetA.rbegin()) || bitmapA.contains(3000001)) {
+		cout << "PageBitmap add failed\n";
+		return 71;
+	}
+
+	if (bitmapIds(bitmapand) != expectedand || bitmapIds(bitmapor) != expectedor || bitmapIds(bitmapandnot) != expectedandnot
+		|| bitmapor.cardinality() != expectedor.size()) {
+		cout << "PageBitmap set operation failed\n";
+		return 72;
+	}
+
+	string bitmapdata;
+	PageBitmap bitmapread;
+	bitmapor.serialize(&bitmapdata);
+	if (! bitmapread.deserialize(bitmapdata.data(), bitmapdata.length()) || bitmapIds(bitmapread) != expectedor
+		|| bitmapread.deserialize(bitmapdata.data(), bitmapdata.length() - 1)) {
+		cout << "PageBitmap serialize failed\n";
+		return 73;
+	}
+
+	/**
+	 * TemplateBitmapIndex test
+	 */
+
+	for (uint32_t pageid = 100; pageid < 110; ++pageid) {
+		pagebitmaps.add(1, pageid);
+		if (pageid % 2) pagebitmaps.add(2, pageid);
+		if (pageid % 3 == 0) pagebitmaps.add(3, pageid);
+	}
+	pagebitmaps.add(1, 113);
+
+	ostringstream bitmapindexdest;
+	{
+		OutputWriter bitmapindexout(&bitmapindexdest);
+		pagebitmaps.write(&bitmapindexout);
+	}
+	string bitmapindexdata = bitmapindexdest.str();
+	TemplateBitmapIndex bitmapindex;
+	PageBitmap bitmapresult1, bitmapresult2, bitmapresult3;
+	string bitmaperr;
+
+	if (! bitmapindex.init(bitmapindexdata.data(), bitmapindexdata.length()) || bitmapindex.size() != 4
+		|| ! bitmapindex.evaluate("4592538 and 1", &bitmapresult1, &bitmaperr) || bitmapIds(bitmapresult1) != vector<uint32_t>({113})
+		|| ! bitmapindex.evaluate("1 ANDNOT 2 OR 3", &bitmapresult2, &bitmaperr)
+		|| bitmapIds(bitmapresult2) != vector<uint32_t>({100, 102, 104, 105, 106, 108, 113})
+		|| ! bitmapindex.evaluate("1 ANDNOT (2 OR 3) AND 999", &bitmapresult3, &bitmaperr) || ! bitmapresult3.empty()) {
+		cout << "TemplateBitmapIndex evaluate failed " << bitmaperr << "\n";
+		return 74;
+	}
+
+	if (bitmapindex.evaluate("1 AND", &bitmapresult1, &bitmaperr) || bitmapindex.evaluate("(1 OR 2", &bitmapresult1, &bitmaperr)
+		|| bitmapindex.evaluate("1 2", &bitmapresult1, &bitmaperr) || bitmapindex.evaluate("1 XOR 2", &bitmapresult1, &bitmaperr)) {
+		cout << "TemplateBitmapIndex syntax error not detected\n";
+		return 75;
+	}
+
+	/**
+	 * Misc test
+	 */
+
+	pagedata = R"END(
+{{Infobox settlement
+|official_name =Junabad
+|native_name =جون اباد
+|settlement_type        = village
+|coordinates_region     = IR
+|subdivision_type       = [[List of countries|Country]]
+|subdivision_name = {{flag|Iran}}
+|subdivision_type1 =[[Provinces of Iran|Province]]
+|subdivision_name1 =[[Fars Province|Fars]]
+|subdivision_type2 =[[Counties of Iran|County]]
+|subdivision_name2 = [[Fasa County|Fasa]]
+|subdivision_type3 =[[Bakhsh]]
+|subdivision_name3 =[[Central District (Fasa County)|Central]]
+|subdivision_type4 =[[Rural Districts of Iran|Rural District]]
+|subdivision_name4 =[[Sahrarud Rural District|Sahrarud]]
+|leader_title           = 
+|leader_name            = 
+|established_title      =
+|established_date       = 
+|area_total_km2           = 
+|area_footnotes           = 
+|population_as_of         = 2006
+|population_total =
+|population_density_km2   =auto
+|timezone               = [[Iran Standard Time|IRST]]
+|utc_offset             = +3:30
+|timezone_DST           = [[Iran Daylight Time|IRDT]]
+|utc_offset_DST         = +4:30
+|coordinates_display      = %
+|latd=|latm=|lats=|latNS=N
+|longd=|longm=|longs=|longEW=E
+|elevation_m            = 
+|area_code              = 
+|website                = 
+|footnotes              =
+}}
+'''Junabad''' ({{lang-fa|جون اباد}}, also [[Romanize]]d as '''Jūnābād''') is a village in [[Sahrarud Rural District]], in the [[Central District (Fasa County)|Central District]] of [[Fasa County]], [[Fars Province]], [[Iran]]. At the 2006 census, its existence was noted, but its population was not reported.<ref>{{IranCensus2006|07}}</ref>  
+
+== References ==
+{{reflist}}
+
+{{Fasa County}}
+
+{{coord missing|Iran}}
+
+[[Category:Populated places in Fasa County]]
+
+{{Fasa-geo-stub}}
+)END";
+
+	pagedest.str("");
+	mc.dest = new OutputWriter(&pagedest);
+	mc.processPage(0, 50407944, 1, pagedata, "Junabad");
+	delete mc.dest;
+	output = pagedest.str();
+
+	vector<string> templates;
 	string_split(output, "\n", &templates);
 	cout << "Misc test 1 \n";
 
@@ -556,10 +1740,11 @@ int performTests()
 <ref name="TERYT">{{cite web |url=http://www.stat.gov.pl/broker/access/prefile/listPreFiles.jspa |title=Central Statistical Office (GUS) &ndash; TERYT (National Register of Territorial Land Apportionment Journal) |date=2008-06-01 |language=Polish}}</ref>
 )END";
 
-	mc.dest = new ostringstream();
+	pagedest.str("");
+	mc.dest = new OutputWriter(&pagedest);
 	mc.processPage(0, 19036667, 1, pagedata, "Ruda Różaniecka");
-	output = ((ostringstream *)mc.dest)->str();
 	delete mc.dest;
+	output = pagedest.str();
 
 	string_split(output, "\n", &templates);
 	cout << "Misc test 2 - no output\n";
@@ -602,10 +1787,11 @@ Giuliano Dati Italienische Verse Holzschnitt.jpg
 }}
 )END";
 
-	mc.dest = new ostringstream();
+	pagedest.str("");
+	mc.dest = new OutputWriter(&pagedest);
 	mc.processPage(0, 50407944, 1, pagedata, "Information");
-	output = ((ostringstream *)mc.dest)->str();
 	delete mc.dest;
+	output = pagedest.str();
 
 	string_split(output, "\n", &templates);
 	cout << "Misc test 3 \n";
@@ -621,6 +1807,64 @@ Giuliano Dati Italienische Verse Holzschnitt.jpg
 		}
 	}
 
+	/**
+	 * Excludelisted template tests - only missing required params and validation errors are written
+	 */
+
+	pagedata = "{{Birth date|1984|12|13}} {{Birth date|1984|12}} {{Birth date|84|12|13}}";
+
+	pagedest.str("");
+	mc.dest = new OutputWriter(&pagedest);
+	mc.processPage(0, 50407945, 1, pagedata, "Excludelisted");
+	delete mc.dest;
+	output = pagedest.str();
+
+	string_split(output, "\n", &templates);
+	if (templates.size() != 3 || templates[0] != "6594285\t50407945\t1\t\t2\t"
+			|| templates[1] != "6594285\t50407945\t1\t84\t2\t12\t3\t13") {
+		cout << "processPage excludelisted failed\n";
+		return 46;
+	}
+
+	/**
+	 * ValuesExport test
+	 */
+
+	string valuesexpected = "pagename\ttemplatename\tbirth_date\tname\n"
+		"Alpha\tInfobox person\t1970\tA\n"
+		"Alpha\tInfobox person\t\tA 2\n"
+		"Beta\tInfobox Person\t1980\t\n";
+
+	for (int sortbytitle = 0; sortbytitle < 2; ++sortbytitle) {
+		ValuesExport values("ValuesExportTest", sortbytitle, 64); // Sort runs of about one row
+		ostringstream valuesdest;
+
+		values.add("Beta", "Infobox Person", 1, {{"birth_date", "1980"}});
+		values.add("Alpha", "Infobox person", 1, {{"name", "A"}, {"birth_date", "1970"}});
+		values.add("Alpha", "Infobox person", 2, {{"name", "A\t2"}});
+
+		OutputWriter valueswriter(&valuesdest);
+		bool valuesok = values.finish(&valueswriter);
+		valueswriter.flush();
+
+		string expected = valuesexpected;
+		if (! sortbytitle) {
+			vector<string> expectedlines;
+			string_split(valuesexpected, "\n", &expectedlines);
+			expected = expectedlines[0] + "\n" + expectedlines[3] + "\n" + expectedlines[1] + "\n" + expectedlines[2] + "\n";
+		}
+
+		if (! valuesok || valuesdest.str() != expected || values.getRowCount() != 3 || values.getColumnCount() != 2) {
+			cout << "ValuesExport failed, sort by title " << sortbytitle << "\n" << valuesdest.str();
+			return 78;
+		}
+	}
+
+	if (access("ValuesExportTest.spill", F_OK) == 0 || access("ValuesExportTest.sort0", F_OK) == 0) {
+		cout << "ValuesExport temp files not removed\n";
+		return 79;
+	}
+
 	/**
 	 * dumpValues test
 	 */
@@ -633,10 +1877,247 @@ Giuliano Dati Italienische Verse Holzschnitt.jpg
 		return 38;
 	}
 
+	/**
+	 * dumpValuesGroups test
+	 */
+
+	{
+		ofstream groupsfile("ValueGroupsTest.tsv", ios::out|ios::binary|ios::trunc);
+		groupsfile << "# output name, template names\nperson\tInfobox person;Infobox Person\nbirth date\tBirth date\nall\tInfobox person;Infobox Person;Birth date\n";
+	}
+
+	vector<ValuesGroup> valuesgroups;
+	bool groupsok = loadValuesGroups("ValueGroupsTest.tsv", "ValueGroupsTest", &valuesgroups);
+	remove("ValueGroupsTest.tsv");
+
+	if (! groupsok || valuesgroups.size() != 3 || valuesgroups[1].outfilepath != "ValueGroupsTest_birth_date.tsv"
+		|| valuesgroups[0].templatenames.size() != 2) {
+		cout << "loadValuesGroups failed\n";
+		return 80;
+	}
+
+	// Same output file after the space to _ mapping
+	{
+		ofstream groupsfile("ValueGroupsTest.tsv", ios::out|ios::binary|ios::trunc);
+		groupsfile << "birth date\tBirth date\nbirth_date\tInfobox person\n";
+	}
+
+	vector<ValuesGroup> duplicategroups;
+	bool duplicateok = loadValuesGroups("ValueGroupsTest.tsv", "ValueGroupsTest", &duplicategroups);
+	remove("ValueGroupsTest.tsv");
+
+	if (duplicateok) {
+		cout << "loadValuesGroups duplicate output failed\n";
+		return 98;
+	}
+
+	retval = dumpValuesGroups(infilepath, valuesgroups, false);
+	vector<string> grouplines[3];
+
+	for (int x = 0; x < 3; ++x) {
+		ifstream groupoutput(valuesgroups[x].outfilepath.c_str(), ios::in|ios::binary);
+		string groupline;
+		while (getline(groupoutput, groupline)) grouplines[x].push_back(groupline);
+		remove(valuesgroups[x].outfilepath.c_str());
+	}
+
+	if (retval || grouplines[0].size() != 14 || grouplines[0][0] != "pagename\ttemplatename\tbirth_date\thonorific\ttitle"
+		|| grouplines[1].size() != 14 || grouplines[1][1].compare(0, 22, "Person 101\tBirth date\t") != 0
+		|| grouplines[2].size() != 27) {
+		cout << "dumpValuesGroups failed = " << retval << "\n";
+		return 81;
+	}
+
+	PageArena pagearena;
+	vector<MWTemplate> arenaresults;
+	MWTemplateParamParser::getTemplates(&arenaresults, origdata, &pagearena);
+	bool arenaok = arenaresults.size() == results.size() && pagearena.getBytesUsed() == 0 && pagearena.getCapacity() > 0;
+
+	for (size_t x = 0; arenaok && x < results.size(); ++x) {
+		arenaok = arenaresults[x].name == results[x].name && arenaresults[x].params == results[x].params;
+	}
+
+	PhpPreg offsetsregex("/(a)(?<digit>[0-9])?/");
+	vector<int> offsets;
+	int offsetscnt = offsetsregex.matchAllOffsets("xa1a", 4, &offsets);
+
+	if (! arenaok || offsetscnt != 2 || offsets != vector<int>({1, 3, 1, 2, 2, 3, 3, 4, 3, 4, -1, -1})
+		|| offsetsregex.getCaptureCount() != 3 || offsetsregex.getGroupNumber("digit") != 2) {
+		cout << "getTemplates with a PageArena failed " << arenaresults.size() << " " << pagearena.getBytesUsed() << " " << offsetscnt << "\n";
+		return 88;
+	}
+
+	vector<MWTemplate> nested;
+	MWTemplateParamParser::getTemplates(&nested, "{{A|b={{C|d=[[e|{{F}}]]<ref>{{G|x\x02y}}</ref>}}}}");
+
+	if (nested.size() != 4 || nested[3].name != "A" || nested[3].params["b"] != "{{C|d=[[e|{{F}}]]<ref>{{G|x\x02y}}</ref>}}"
+		|| nested[0].params["1"] != "x\x02y") {
+		cout << "getTemplates nested markers failed " << nested.size() << "\n";
+		return 89;
+	}
+
+	vector<MWTemplate> unscanned;
+	MWTemplateParamParser::getTemplates(&unscanned, origdata);
+	double pagebudget = MWTemplateParamParser::maxPageSeconds;
+	MWTemplateParamParser::maxPageSeconds = 1e-12;
+	vector<MWTemplate> scanned;
+	PageParseStats parsestats;
+	MWTemplateParamParser::getTemplates(&scanned, origdata, 0, &parsestats);
+	bool scannedok = parsestats.fallback && string(parsestats.fallback) == "time" && scanned.size() == unscanned.size();
+
+	// The scan finds the templates in closing order
+	auto nameLess = [](const MWTemplate& a, const MWTemplate& b) { return a.name < b.name; };
+	sort(scanned.begin(), scanned.end(), nameLess);
+	sort(unscanned.begin(), unscanned.end(), nameLess);
+
+	for (size_t x = 0; scannedok && x < unscanned.size(); ++x) {
+		scannedok = scanned[x].name == unscanned[x].name && scanned[x].params == unscanned[x].params;
+	}
+
+	MainClass budgetmc;
+	budgetmc.loadTemplateIds();
+	ostringstream budgetdest;
+	budgetmc.dest = new OutputWriter(&budgetdest);
+	budgetmc.processPage(0, 700, 1, origdata, "Slow page");
+	delete budgetmc.dest;
+	MWTemplateParamParser::maxPageSeconds = pagebudget;
+
+	string reportline = "700\tSlow page\t" + to_string(origdata.length()) + "\t1\t";
+	if (! scannedok || budgetmc.pathologicalcount != 1 || budgetmc.pathological.compare(0, reportline.length(), reportline) != 0
+		|| budgetmc.pathological.find("\ttime\n") == string::npos) {
+		cout << "getTemplates over the page budget failed " << scanned.size() << " " << budgetmc.pathological << "\n";
+		return 90;
+	}
+
+	// Split in segments parsed on 4 threads, the templates and their order are the same as parsing the page whole.
+	// The second page is over MAX_ITERATIONS rescans, the deep nesting is all in its first segment.
+	string splitpage = "{{A|x=<ref>{{{1}}} [[B|{{C}}]]</ref>}}\nText {{D|y={{E}}}}\n"
+		"{| class=wikitable\n|-\n| {{F|1}}\n|}\n[[G|{{H|z=<b>{{I}}</b>}}]]\n<ref>{{J|{{{k}}}}}</ref>\n";
+	string deeppage;
+	for (int x = 0; x < 600; ++x) deeppage += "{{L|<b>";
+	for (int x = 0; x < 600; ++x) deeppage += "</b>}}";
+	deeppage += "\n" + splitpage + splitpage + splitpage;
+	size_t parallelsize = MWTemplateParamParser::parallelPageSize;
+	int pagethreads = MWTemplateParamParser::pageThreads;
+	bool splitok = true;
+
+	for (string page : {splitpage + splitpage + splitpage + splitpage, deeppage}) {
+		vector<MWTemplate> whole, split;
+		PageParseStats wholestats, splitstats;
+		MWTemplateParamParser::parallelPageSize = 0;
+		MWTemplateParamParser::getTemplates(&whole, page, 0, &wholestats);
+		MWTemplateParamParser::parallelPageSize = page.length() / 4;
+		MWTemplateParamParser::pageThreads = 4;
+		MWTemplateParamParser::getTemplates(&split, page, 0, &splitstats);
+
+		splitok = splitok && split.size() == whole.size() && ! whole.empty() && splitstats.iterations == wholestats.iterations
+			&& (splitstats.fallback != 0) == (wholestats.fallback != 0);
+		for (size_t x = 0; splitok && x < whole.size(); ++x) {
+			splitok = split[x].name == whole[x].name && split[x].params == whole[x].params;
+		}
+	}
+
+	MWTemplateParamParser::parallelPageSize = parallelsize;
+	MWTemplateParamParser::pageThreads = pagethreads;
+
+	if (! splitok) {
+		cout << "getTemplates split page failed\n";
+		return 91;
+	}
+
+	// Cached invocations parse the same as uncached ones
+	size_t cachecapacity = TemplateCache::capacity;
+	TemplateCache::capacity = 0;
+	vector<MWTemplate> uncached;
+	MWTemplateParamParser::getTemplates(&uncached, origdata);
+	TemplateCache::capacity = cachecapacity ? cachecapacity : 1024;
+	vector<MWTemplate> cached;
+	MWTemplateParamParser::getTemplates(&cached, origdata);
+	MWTemplateParamParser::getTemplates(&cached, origdata);
+
+	bool cacheok = cached.size() == uncached.size() * 2 && TemplateCache::find("{{sort|ABC}}", 12, string_hash("{{sort|ABC}}", 12));
+	for (size_t x = 0; cacheok && x < cached.size(); ++x) {
+		const MWTemplate& expected = uncached[x % uncached.size()];
+		cacheok = cached[x].name == expected.name && cached[x].params == expected.params;
+	}
+	TemplateCache::capacity = cachecapacity;
+
+	if (! cacheok) {
+		cout << "getTemplates template cache failed " << cached.size() << " " << uncached.size() << "\n";
+		return 92;
+	}
+
 	cout << "All tests passed\n";
 	return 0;
 }
 
+/**
+ * Time the parser regexes and getTemplates against the test dump.
+ * Build with and without -DPHPPREG_PCRE2 to compare the regex backends.
+ */
+int performBenchmarks()
+{
+	cout << "Performing benchmarks using " << PhpPreg::getBackend() << "\n";
+
+	string infilepath = "MWDumpTest.xml";
+	ifstream source(infilepath.c_str(), ios::in|ios::binary);
+	if (source.fail()) {
+	    cerr << "new ifstream failed for " << infilepath << "\n";
+	    return 1;
+	}
+
+	string subject((istreambuf_iterator<char>(source)), istreambuf_iterator<char>());
+	const int iterations = 2000;
+	vector<shared_ptr<MatchVector>> matches;
+
+	map<string, PhpPreg *> benchregexs = {
+		{"comment", &MWTemplateParamParser::COMMENT_REGEX},
+		{"nowiki", &MWTemplateParamParser::NOWIKI_REGEX},
+		{"br", &MWTemplateParamParser::BR_REGEX}
+	};
+
+	for (auto &regexname : MWTemplateParamParser::regexs_ordered) {
+		benchregexs[regexname] = &MWTemplateParamParser::regexs[regexname];
+	}
+
+	for (auto &regex_pair : benchregexs) {
+		int matchcnt = 0;
+		auto start = chrono::steady_clock::now();
+
+		for (int i = 0; i < iterations; ++i) matchcnt += regex_pair.second->matchAll(subject, &matches);
+
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		cout << regex_pair.first << "\t" << elapsed / iterations / 1000.0 << " us/scan\t" << matchcnt / iterations << " matches\n";
+	}
+
+	vector<MWTemplate> results;
+	auto start = chrono::steady_clock::now();
+
+	for (int i = 0; i < iterations; ++i) {
+		results.clear();
+		MWTemplateParamParser::getTemplates(&results, subject);
+	}
+
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	cout << "getTemplates\t" << elapsed / iterations / 1000.0 << " us/call\t" << results.size() << " templates\n";
+
+	PageArena arena;
+	results.clear();
+	MWTemplateParamParser::getTemplates(&results, subject, &arena);
+	results.clear();
+#ifdef MWDTP_COUNT_ALLOCS
+	long long allocsbefore = alloccount;
+#endif
+	MWTemplateParamParser::getTemplates(&results, subject, &arena);
+	cout << "getTemplates\t" << arena.getCapacity() << " arena bytes";
+#ifdef MWDTP_COUNT_ALLOCS
+	cout << "\t" << alloccount - allocsbefore << " allocations/call";
+#endif
+	cout << "\n";
+
+	return 0;
+}
+
 MWDumpHandler *mwdh;
 
 void XMLCALL startElement(void *userData, const char *el, const char **attr)
@@ -686,16 +2167,15 @@ int MainClass::parseTemplates(const string& infilepath, const string& outfilepat
     	}
     }
 
-    if (outfilepath == "-") {
-    	dest = &cout;
-    } else {
-    	dest = new ofstream(outfilepath.c_str(), ios::out|ios::binary|ios::trunc);
-    	if (dest->fail()) {
-    	    cerr << "new ofstream failed for " << outfilepath << "\n";
-    	    return 4;
-    	}
+    dest = OutputWriter::open(outfilepath);
+    if (! dest) {
+    	cerr << "open failed for " << outfilepath << "\n";
+    	return 4;
     }
 
+    if (compressoutput) bgzf = new BgzfWriter(dest);
+    if (binaryoutput) binwriter = new ParamsBinaryWriter(dest);
+
     // Determine the wiki project
     string::size_type projectEnd = totalsoutfilepath.find("TemplateTotals");
     if (projectEnd == string::npos) {
@@ -707,6 +2187,25 @@ int MainClass::parseTemplates(const string& infilepath, const string& outfilepat
     loadExclusions(wikiProject);
     loadNamespaces(wikiProject);
 
+    if (! loadFilters(wikiProject)) return 12;
+
+    string offsetsoutfilepath;
+    spillprefix = (outfilepath == "-") ? wikiProject + "TemplateParams" : outfilepath;
+
+    if (sortoutput) {
+    	sorter = new ExternalSort(spillprefix, sortmemory, ExternalSort::paramsLess);
+    	offsetsoutfilepath = siblingPath(outfilepath, "TemplateOffsets");
+    }
+
+    string pathologicaloutfilepath = siblingPath(outfilepath, "TemplatePathological");
+    if (sketchtotals) sketchesoutfilepath = siblingPath(outfilepath, "TemplateSketches");
+
+    string bitmapsoutfilepath;
+    if (writebitmaps) {
+    	bitmaps = new TemplateBitmapIndex();
+    	bitmapsoutfilepath = siblingPath(outfilepath, "TemplateBitmaps");
+    }
+
 	int bytes_read;
 	char *buff;
 
@@ -737,9 +2236,105 @@ int MainClass::parseTemplates(const string& infilepath, const string& outfilepat
     XML_ParserFree(p);
 
     if (infilepath != "-") delete source;
-    if (outfilepath != "-") delete dest;
 
-    writeTotals(totalsoutfilepath);
+    if (sorter && binwriter) {
+    	bool sortok = sorter->finish([&](const string& line) { binwriter->addRow(line); });
+    	delete sorter;
+    	sorter = 0;
+
+    	if (! sortok) {
+    	    cerr << "sort run merge failed\n";
+    	    return 9;
+    	}
+    }
+
+    if (sorter) {
+    	OutputWriter *offsets = OutputWriter::open(offsetsoutfilepath);
+    	if (! offsets) {
+    	    cerr << "open failed for " << offsetsoutfilepath << "\n";
+    	    return 8;
+    	}
+
+    	if (verbose) cerr << "merging " << sorter->getRunCount() << " sort runs, offsets to " << offsetsoutfilepath << "\n";
+
+    	int retval = writeSortedParams(*sorter, dest, offsets, bgzf);
+    	delete offsets;
+    	delete sorter;
+    	sorter = 0;
+    	if (retval) return retval;
+    }
+
+    if (binwriter) {
+    	bool binaryok = binwriter->close();
+    	delete binwriter;
+    	binwriter = 0;
+
+    	if (! binaryok) {
+    		cerr << "write failed for " << outfilepath << "\n";
+    		return 10;
+    	}
+    }
+
+    if (bgzf) {
+    	bool compressok = bgzf->close();
+    	delete bgzf;
+    	bgzf = 0;
+
+    	if (! compressok) {
+    		cerr << "compression failed for " << outfilepath << "\n";
+    		return 10;
+    	}
+    }
+
+    if (! dest->flush()) {
+    	cerr << "write failed for " << outfilepath << "\n";
+    	return 10;
+    }
+
+    delete dest;
+    dest = 0;
+
+    if (bitmaps) {
+    	bool bitmapsok = bitmaps->write(bitmapsoutfilepath);
+    	delete bitmaps;
+    	bitmaps = 0;
+
+    	if (! bitmapsok) {
+    		cerr << "write failed for " << bitmapsoutfilepath << "\n";
+    		return 11;
+    	}
+    }
+
+    if (pathologicalcount) {
+    	OutputWriter *pathologicalfile = OutputWriter::open(pathologicaloutfilepath);
+    	if (! pathologicalfile) {
+    		cerr << "open failed for " << pathologicaloutfilepath << "\n";
+    		return 14;
+    	}
+
+    	pathologicalfile->write("page_id\ttitle\tbytes\titerations\tseconds\tfallback\n");
+    	pathologicalfile->write(pathological);
+    	bool pathologicalok = pathologicalfile->flush();
+    	delete pathologicalfile;
+    	if (verbose) cerr << pathologicalcount << " pages over the parse budget, see " << pathologicaloutfilepath << "\n";
+
+    	if (! pathologicalok) {
+    		cerr << "write failed for " << pathologicaloutfilepath << "\n";
+    		return 14;
+    	}
+    }
+
+    if (verbose && ! spillpaths.empty()) cerr << "totals spilled " << spillpaths.size() << " times to " << spillprefix << ".totalsN\n";
+
+    if (! writeTotals(totalsoutfilepath)) return 15;
+
+    if (verbose && (filteredinstances || filteredparams)) {
+    	cerr << "filters: " << filteredinstances << " instances, " << filteredparams << " params not written, "
+    		<< filteredbytes << " bytes saved\n";
+    }
+
+    if (verbose) PhpPregRegistry::writeStats(cerr);
+    if (verbose) TemplateCache::writeStats(cerr);
 
 	return 0;
 }
@@ -754,9 +2349,20 @@ void MainClass::processPage(int ns, unsigned int page_id, unsigned int revid, co
 	++pagecnt;
 	if (pagecnt % 100000 == 0 && verbose) cerr << pagecnt << "\n";
 
+	// Spill if it frees at least half of the totals counts. The bitmaps and the template cache count against the limit
+	// but are not spilled, so a spill also has to free a sixteenth of the limit
+	size_t fixedbytes = (bitmaps ? bitmaps->getMemorySize() : 0) + TemplateCache::getMemorySize();
+	if (memorylimit && aggregatebytes + fixedbytes > memorylimit / 2 && aggregatebytes > retainedbytes * 2
+		&& aggregatebytes - retainedbytes > memorylimit / 16 && ! spillTotals()) {
+		cerr << "totals spill write failed\n";
+		exit(13);
+	}
+
 	// Parse the templates
 	vector<MWTemplate> templates;
-	MWTemplateParamParser::getTemplates(&templates, page_data);
+	PageParseStats parsestats;
+	MWTemplateParamParser::getTemplates(&templates, page_data, 0, &parsestats);
+	if (parsestats.fallback) reportPathological(page_id, page_title, page_data.length(), parsestats);
 	int tmplid;
 	map<int, int> pagetemplates;
 	bool excludelisted;
@@ -780,102 +2386,463 @@ void MainClass::processPage(int ns, unsigned int page_id, unsigned int revid, co
 
 		++pagetemplates[tmplid];
 
-		if (pagetemplates[tmplid] == 1) ++template_info[tmplid]->pagecount;
-		++template_info[tmplid]->instancecount;
+		TemplateInfo *ti = template_info[tmplid];
+		if (pagetemplates[tmplid] == 1) {
+			++ti->pagecount;
+			if (bitmaps) bitmaps->add(tmplid, page_id);
+		}
+		++ti->instancecount;
 
 		excludelisted = (excludelist.find(tmplid) != excludelist.end());
-		bool writeexcludelisted = false;
 
-		// Determine if excludelisted template needs to be written out: unknown/deprecated/required param
 		if (excludelisted) {
-			// unknown
-			for (auto &pair : templ_params) {
-				string key = pair.first;
-				if (template_info[tmplid]->param_valid.find(key) == template_info[tmplid]->param_valid.end()) {
-					writeexcludelisted = true;
-					break;
-				}
-			}
-
-			// deprecated/required
-			if (! writeexcludelisted) {
-				for (auto &pair : template_info[tmplid]->param_valid) {
-					string key = pair.first;
-					char value = pair.second;
+			processExcluded(ti, tmplid, page_id, templ_params);
+			continue;
+		}
 
-					if (value == 'D' && templ_params.find(key) != templ_params.end()) {
-						writeexcludelisted = true;
-						break;
-					}
+		bool writevaliderror = validateParams(ti, templ_params);
 
-					// Don't check suggested because generates too many, ie. Cite book
-					if (value == 'R' && templ_params.find(key) == templ_params.end()) {
-						writeexcludelisted = true;
-						break;
-					}
-				}
-			}
-		}
+		TemplateFilter *filter = ti->filter.get();
+		bool writeinstance = ! filter || filter->matches(templ_params);
 
-		// Value validation
-		bool writevaliderror = false;
+		row.clear();
+		string_append_uint(&row, tmplid);
+		row += '\t';
+		string_append_uint(&row, page_id);
 
 		for (auto &pair : templ_params) {
-			string key = pair.first;
-			string value = pair.second;
-			if (template_info[tmplid]->param_validation.find(key) == template_info[tmplid]->param_validation.end()) continue;
-			if (value.length() == 0) continue;
-			char validation_type = template_info[tmplid]->param_validation[key];
-
-			switch (validation_type) {
-				case 'Y':
-					transform(value.begin(), value.end(), value.begin(), ::tolower);
-					if (yesno.find(value) == yesno.end()) writevaliderror = true;
-					break;
-
-				case 'R':
-					if (! template_info[tmplid]->param_validation_regex[key]->match(value)) writevaliderror = true;
-					break;
-
-				case 'V':
-					if (template_info[tmplid]->param_validation_values[key]->find(value) == template_info[tmplid]->param_validation_values[key]->end()) writevaliderror = true;
-					break;
+			if (! writeinstance || (filter && ! filter->keepParam(pair.first))) {
+				countFiltered(ti, pair.first, pair.second, false, writevaliderror);
+				if (writeinstance) ++filteredparams;
+				continue;
 			}
 
-			if (writevaliderror) break;
-		}
+			row += '\t';
+			size_t keypos = row.length();
+			string_append_field(&row, pair.first); // Don't want tabs/newlines in csv file
+			keybuf.assign(row, keypos, string::npos);
+			row += '\t';
 
-		if (writevaliderror) {
-			if (template_info[tmplid]->validationerrcount > 10000) writevaliderror = false;
-			else ++template_info[tmplid]->validationerrcount;
+			// Calc unique values
+			countParam(ti, keybuf);
+
+			if (sketchtotals) {
+				ParamSketch& sketch = paramSketch(ti, keybuf);
+				bool writevalue = ! sketchFull(ti, keybuf, sketch) || writevaliderror;
+				size_t valuepos = row.length();
+				string_append_field(&row, pair.second);
+				countSketchValue(ti, keybuf, sketch, row.data() + valuepos, row.length() - valuepos);
+				if (! writevalue) row.erase(valuepos);
+				continue;
+			}
+
+			map<string, int>& value_cnt = paramValues(ti, keybuf);
+			bool valuesfull = valuesFull(ti, keybuf, value_cnt);
+
+			if (valuesfull && ! writevaliderror) continue; // Don't write the value out, need key for templates having 'key' searches
+
+			size_t valuepos = row.length();
+			string_append_field(&row, pair.second);
+
+			if (! valuesfull) {
+				valuebuf.assign(row, valuepos, string::npos);
+				countValue(ti, keybuf, value_cnt, valuebuf);
+			}
 		}
 
-		if (! excludelisted || writeexcludelisted || writevaliderror) *dest << tmplid << "\t" << page_id;
+		if (! writeinstance) {
+			++filteredinstances;
+			filteredbytes += row.length() + 1;
+			continue;
+		}
 
-		for (auto &pair : templ_params) {
-			string key = pair.first;
-			string& value = pair.second;
-			for (auto &achar : key) if (achar == '\n' || achar == '\t') achar = ' '; // Don't want tabs/newlines in csv file
-			for (auto &achar : value) if (achar == '\n' || achar == '\t') achar = ' ';
-			if (key.length() > 255) key.erase(255);
-			if (value.length() > 255) value.erase(255);
+		row += '\n';
+		writeRow();
+	}
+}
 
-			// Calc unique values
-			++template_info[tmplid]->param_name_cnt[key];
+/**
+ * Path of an output file next to the params file, ie. enwikiTemplateParams.sorted -> enwikiTemplateOffsets.
+ * Without TemplateParams in the params file name, the file is the wiki project name + suffix.
+ */
+string MainClass::siblingPath(const string& outfilepath, const char *suffix)
+{
+	string::size_type paramsPos = outfilepath.find("TemplateParams");
+	if (paramsPos == string::npos) return wikiProject + suffix;
+	return outfilepath.substr(0, paramsPos) + suffix; // No .sorted/.gz suffix
+}
 
-			if (template_info[tmplid]->param_value_cnt[key].size() == 50 && ! writevaliderror) {
-				if (! excludelisted || writeexcludelisted) *dest << "\t" << key << "\t"; // Don't write the value out, need key for templates having 'key' searches
-			} else {
-				if (template_info[tmplid]->param_value_cnt[key].size() < 50) ++template_info[tmplid]->param_value_cnt[key][value];
-				if (! excludelisted || writevaliderror) *dest << "\t" << key << "\t" << value;
-				else if (writeexcludelisted) *dest << "\t" << key << "\t";
+/**
+ * Add a page over the parse budget to the pathological pages report.
+ */
+void MainClass::reportPathological(unsigned int page_id, const string& page_title, size_t page_size, const PageParseStats& stats)
+{
+	++pathologicalcount;
+	string_append_uint(&pathological, page_id);
+	pathological += '\t';
+	pathological += page_title;
+	pathological += '\t';
+	string_append_uint(&pathological, page_size);
+	pathological += '\t';
+	string_append_uint(&pathological, stats.iterations);
+	pathological += '\t';
+	pathological += to_string(stats.seconds);
+	pathological += '\t';
+	pathological += stats.fallback;
+	pathological += '\n';
+
+	if (verbose) cerr << "page " << page_id << " " << page_title << " over the parse budget (" << stats.fallback << ")\n";
+}
+
+void MainClass::writeRow()
+{
+	if (binwriter && ! sorter) binwriter->addRow(row);
+	else if (bgzf && ! sorter) bgzf->write(row);
+	else if (! sorter) dest->write(row);
+	else if (! sorter->add(row)) {
+		cerr << "sort run write failed\n";
+		exit(9);
+	}
+}
+
+/**
+ * Value validation.
+ * @return true = a value failed validation and the validation error limit has not been reached
+ */
+bool MainClass::validateParams(TemplateInfo *ti, const map<string, string>& templ_params)
+{
+	if (! ti->has_validation || ti->validationerrcount > 10000) return false;
+
+	for (auto &pair : templ_params) {
+		if (pair.second.length() == 0) continue;
+		auto param_it = ti->param_ids.find(pair.first);
+		if (param_it == ti->param_ids.end()) continue;
+		int ruleid = ti->param_rules[param_it->second];
+		if (ruleid < 0) continue;
+
+		if (! validator.validate(ruleid, pair.second)) {
+			++ti->validationerrcount;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Excludelisted templates are only written out for an unknown/deprecated/required param or a validation error.
+ * The decision is made from a bitset of the declared params present, and value bookkeeping is only
+ * done for instances that are written out.
+ */
+void MainClass::processExcluded(TemplateInfo *ti, int tmplid, unsigned int page_id, map<string, string>& templ_params)
+{
+	bool writeexcludelisted = false;
+	param_bits.assign(ti->deprecated_mask.size(), 0);
+
+	for (auto &pair : templ_params) {
+		auto param_it = ti->param_ids.find(pair.first);
+
+		if (param_it == ti->param_ids.end()) {
+			writeexcludelisted = true; // unknown
+			keybuf.clear();
+			string_append_field(&keybuf, pair.first);
+			countParam(ti, keybuf);
+		} else {
+			int paramid = param_it->second;
+			param_bits[paramid >> 6] |= 1ULL << (paramid & 63);
+			++ti->param_id_cnt[paramid];
+		}
+	}
+
+	// deprecated/required, don't check suggested because generates too many, ie. Cite book
+	for (size_t i = 0; i < param_bits.size() && ! writeexcludelisted; ++i) {
+		if ((param_bits[i] & ti->deprecated_mask[i]) || (ti->required_mask[i] & ~param_bits[i])) writeexcludelisted = true;
+	}
+
+	bool writevaliderror = validateParams(ti, templ_params);
+
+	if (! writeexcludelisted && ! writevaliderror) return;
+
+	TemplateFilter *filter = ti->filter.get();
+	bool writeinstance = ! filter || filter->matches(templ_params);
+
+	row.clear();
+	string_append_uint(&row, tmplid);
+	row += '\t';
+	string_append_uint(&row, page_id);
+
+	for (auto &pair : templ_params) {
+		if (! writeinstance || (filter && ! filter->keepParam(pair.first))) {
+			countFiltered(ti, pair.first, pair.second, true, writevaliderror);
+			if (writeinstance) ++filteredparams;
+			continue;
+		}
+
+		row += '\t';
+		size_t keypos = row.length();
+		string_append_field(&row, pair.first);
+		keybuf.assign(row, keypos, string::npos);
+		row += '\t';
+
+		if (sketchtotals) {
+			valuebuf.clear();
+			string_append_field(&valuebuf, pair.second);
+			countSketchValue(ti, keybuf, paramSketch(ti, keybuf), valuebuf.data(), valuebuf.length());
+			if (writevaliderror) row += valuebuf;
+			continue;
+		}
+
+		map<string, int>& value_cnt = paramValues(ti, keybuf);
+		bool valuesfull = valuesFull(ti, keybuf, value_cnt);
+
+		if (valuesfull && ! writevaliderror) continue; // Don't write the value out, need key for templates having 'key' searches
+
+		if (writevaliderror) {
+			size_t valuepos = row.length();
+			string_append_field(&row, pair.second);
+			if (! valuesfull) valuebuf.assign(row, valuepos, string::npos);
+		} else if (! valuesfull) {
+			valuebuf.clear();
+			string_append_field(&valuebuf, pair.second);
+		}
+
+		if (! valuesfull) countValue(ti, keybuf, value_cnt, valuebuf);
+	}
+
+	if (! writeinstance) {
+		++filteredinstances;
+		filteredbytes += row.length() + 1;
+		return;
+	}
+
+	row += '\n';
+	writeRow();
+}
+
+/**
+ * Totals of a param not written because of a TemplateFilter, and the bytes it would have taken.
+ *
+ * @param excludelisted true = excludelisted template, the name was counted by param id and the value is only written on validation errors
+ * @param writevaliderror true = a value failed validation, values are written past the distinct values limit
+ */
+void MainClass::countFiltered(TemplateInfo *ti, const string& name, const string& value, bool excludelisted, bool writevaliderror)
+{
+	keybuf.clear();
+	filteredbytes += 2 + string_append_field(&keybuf, name);
+	if (! excludelisted) countParam(ti, keybuf);
+
+	if (sketchtotals) {
+		ParamSketch& sketch = paramSketch(ti, keybuf);
+		valuebuf.clear();
+		size_t valuelength = string_append_field(&valuebuf, value);
+		if (writevaliderror || (! excludelisted && ! sketchFull(ti, keybuf, sketch))) filteredbytes += valuelength;
+		countSketchValue(ti, keybuf, sketch, valuebuf.data(), valuebuf.length());
+		return;
+	}
+
+	map<string, int>& value_cnt = paramValues(ti, keybuf);
+
+	if (! valuesFull(ti, keybuf, value_cnt)) {
+		valuebuf.clear();
+		size_t valuelength = string_append_field(&valuebuf, value);
+		if (! excludelisted || writevaliderror) filteredbytes += valuelength;
+		countValue(ti, keybuf, value_cnt, valuebuf);
+	} else if (writevaliderror) {
+		filteredbytes += min(value.length(), (size_t)255);
+	}
+}
+
+static const size_t MAP_ENTRY_BYTES = 80; // Approximate std::map node and std::string overhead
+
+void MainClass::countParam(TemplateInfo *ti, const string& key)
+{
+	size_t paramcnt = ti->param_name_cnt.size();
+	++ti->param_name_cnt[key];
+	if (ti->param_name_cnt.size() != paramcnt) aggregatebytes += MAP_ENTRY_BYTES + key.length();
+}
+
+map<string, int>& MainClass::paramValues(TemplateInfo *ti, const string& key)
+{
+	size_t paramcnt = ti->param_value_cnt.size();
+	map<string, int>& value_cnt = ti->param_value_cnt[key];
+	if (ti->param_value_cnt.size() != paramcnt) aggregatebytes += MAP_ENTRY_BYTES + key.length() + sizeof(value_cnt);
+	return value_cnt;
+}
+
+/**
+ * @return true = 50 distinct values of the param have been counted, no more are counted
+ */
+bool MainClass::valuesFull(TemplateInfo *ti, const string& key, const map<string, int>& value_cnt)
+{
+	if (! ti->valuesspilled) return value_cnt.size() >= 50;
+
+	auto seen_it = ti->param_value_seen.find(key);
+	return seen_it != ti->param_value_seen.end() && seen_it->second.size() >= 50;
+}
+
+void MainClass::countValue(TemplateInfo *ti, const string& key, map<string, int>& value_cnt, const string& value)
+{
+	size_t valuecnt = value_cnt.size();
+	++value_cnt[value];
+	if (value_cnt.size() == valuecnt) return;
+
+	aggregatebytes += MAP_ENTRY_BYTES + value.length();
+	if (ti->valuesspilled) countSeen(ti, key, string_hash(value));
+}
+
+ParamSketch& MainClass::paramSketch(TemplateInfo *ti, const string& key)
+{
+	size_t paramcnt = ti->param_sketches.size();
+	ParamSketch& sketch = ti->param_sketches[key];
+	if (ti->param_sketches.size() != paramcnt) aggregatebytes += MAP_ENTRY_BYTES + key.length() + sketch.getMemorySize();
+	return sketch;
+}
+
+/**
+ * @return true = TOPK distinct values of the param have been seen, the values are not written out
+ */
+bool MainClass::sketchFull(TemplateInfo *ti, const string& key, const ParamSketch& sketch)
+{
+	if (sketch.full() || ! ti->valuesspilled) return sketch.full();
+
+	auto seen_it = ti->param_value_seen.find(key);
+	return seen_it != ti->param_value_seen.end() && seen_it->second.size() >= ParamSketch::TOPK;
+}
+
+void MainClass::countSketchValue(TemplateInfo *ti, const string& key, ParamSketch& sketch, const char *value, size_t length)
+{
+	size_t sketchbytes = sketch.getMemorySize();
+	size_t valuecnt = sketch.size();
+	sketch.add(value, length);
+	aggregatebytes = aggregatebytes + sketch.getMemorySize() - sketchbytes;
+
+	if (ti->valuesspilled && sketch.size() != valuecnt) countSeen(ti, key, string_hash(value, length));
+}
+
+/**
+ * Keep the hash of a distinct value counted after a spill, a value counted before a spill is not a new distinct value.
+ */
+void MainClass::countSeen(TemplateInfo *ti, const string& key, uint64_t hashvalue)
+{
+	vector<uint64_t>& seen = ti->param_value_seen[key];
+	if (find(seen.begin(), seen.end(), hashvalue) != seen.end()) return;
+
+	size_t seenbytes = sizeof(uint64_t) + (seen.empty() ? MAP_ENTRY_BYTES + key.length() : 0);
+	seen.push_back(hashvalue);
+	aggregatebytes += seenbytes;
+	retainedbytes += seenbytes;
+}
+
+/**
+ * Write the param and value counts to a spill file, sorted by template id, and free them. writeTotals() merges the spill files.
+ * The distinct values counted so far are kept by hash, so the 50 distinct values limit is applied as without a spill.
+ *
+ * Lines are template id, P, count, param name or template id, V, count, param name, value.
+ * With -sketch-totals the sketches are spilled to ...sketchesN in the TemplateSketches format, with 0 counts.
+ *
+ * @return false = write failed
+ */
+bool MainClass::spillTotals()
+{
+	string spillpath = spillprefix + ".totals" + to_string(spillpaths.size());
+	OutputWriter *spill = OutputWriter::open(spillpath);
+	if (! spill) return false;
+	spillpaths.push_back(spillpath);
+
+	OutputWriter *sketchspill = 0;
+	if (sketchtotals) {
+		string sketchspillpath = spillprefix + ".sketches" + to_string(sketchspillpaths.size());
+		sketchspill = OutputWriter::open(sketchspillpath);
+		if (! sketchspill) {
+			delete spill;
+			return false;
+		}
+		sketchspillpaths.push_back(sketchspillpath);
+		TemplateSketches::writeHeader(sketchspill);
+	}
+
+	for (auto &info_pair : template_info) {
+		TemplateInfo *ti = info_pair.second;
+		if (ti->param_name_cnt.empty() && ti->param_value_cnt.empty() && ti->param_sketches.empty()) continue;
+
+		for (auto &param_pair : ti->param_name_cnt) {
+			spill->writeInt(info_pair.first);
+			spill->write("\tP\t", 3);
+			spill->writeInt(param_pair.second);
+			spill->put('\t');
+			spill->write(param_pair.first);
+			spill->put('\n');
+		}
+
+		for (auto &values_pair : ti->param_value_cnt) {
+			vector<uint64_t> *seen = 0;
+			if (! ti->valuesspilled && ! values_pair.second.empty()) {
+				seen = &ti->param_value_seen[values_pair.first];
+				retainedbytes += MAP_ENTRY_BYTES + values_pair.first.length() + values_pair.second.size() * sizeof(uint64_t);
+			}
+
+			for (auto &value_pair : values_pair.second) {
+				spill->writeInt(info_pair.first);
+				spill->write("\tV\t", 3);
+				spill->writeInt(value_pair.second);
+				spill->put('\t');
+				spill->write(values_pair.first);
+				spill->put('\t');
+				spill->write(value_pair.first);
+				spill->put('\n');
+
+				if (seen) seen->push_back(string_hash(value_pair.first));
+			}
+		}
+
+		if (sketchspill && ! ti->param_sketches.empty()) {
+			TemplateSketches::writeTemplate(sketchspill, info_pair.first, ti->name, 0, 0, ti->param_sketches.size());
+
+			for (auto &sketch_pair : ti->param_sketches) {
+				TemplateSketches::writeParam(sketchspill, sketch_pair.first, 0, sketch_pair.second);
+				if (ti->valuesspilled) continue;
+
+				// A full sketch keeps TOPK hashes, so it stays full
+				vector<uint64_t>& seen = ti->param_value_seen[sketch_pair.first];
+				for (auto &counter : sketch_pair.second.topValues()) seen.push_back(string_hash(counter.value));
+				retainedbytes += MAP_ENTRY_BYTES + sketch_pair.first.length() + seen.size() * sizeof(uint64_t);
 			}
 		}
 
-		if (! excludelisted || writeexcludelisted || writevaliderror) *dest << "\n";
+		ti->valuesspilled = true;
+		ti->param_name_cnt.clear();
+		ti->param_value_cnt.clear();
+		ti->param_sketches.clear();
+	}
+
+	aggregatebytes = retainedbytes;
+
+	bool spillok = spill->flush();
+	delete spill;
+
+	if (sketchspill) {
+		spillok = sketchspill->flush() && spillok;
+		delete sketchspill;
 	}
+
+	return spillok;
 }
 
+/**
+ * A MainClass::spillTotals() file, read in template id order.
+ */
+struct TotalsSpill {
+	ifstream source;
+	string line;
+	int tmplid = INT_MAX; // of line, INT_MAX = end of file
+
+	void next()
+	{
+		if (getline(source, line)) tmplid = atoi(line.c_str());
+		else tmplid = INT_MAX;
+	}
+};
+
 void MainClass::loadTemplateIds()
 {
 	string infilepath = "TemplateIds.tsv";
@@ -909,30 +2876,110 @@ void MainClass::loadTemplateIds()
 					vector<string> aliases;
 					string_split(pieces[i], "|", &aliases);
 
-					template_info[id]->param_valid[aliases[0]] = pieces[i + 1][0];
+					TemplateInfo *ti = template_info[id];
+					ti->param_valid[aliases[0]] = pieces[i + 1][0];
 					if (aliases.size() > 1) {
 						for (unsigned int j = 1; j < aliases.size(); ++j) {
-							template_info[id]->param_aliases[aliases[j]] = aliases[0];
+							ti->param_aliases[aliases[j]] = aliases[0];
 						}
 					}
 
+					int paramid;
+					auto param_it = ti->param_ids.find(aliases[0]);
+					if (param_it == ti->param_ids.end()) {
+						paramid = ti->param_rules.size();
+						ti->param_ids[aliases[0]] = paramid;
+						ti->param_names.push_back(aliases[0]);
+						ti->param_rules.push_back(-1);
+					} else {
+						paramid = param_it->second;
+					}
+
 					char validation = pieces[i + 2][0];
-					template_info[id]->param_validation[aliases[0]] = validation;
 
-					if (validation == 'R') {
-						string regex = "!^" + pieces[i + 3] + "$!u";
-						template_info[id]->param_validation_regex[aliases[0]] = new PhpPreg(regex);
-						++i;
-					} else if (validation == 'V') {
-						vector<string> values;
-						string_split(pieces[i + 3], "|", &values);
-						template_info[id]->param_validation_values[aliases[0]] = new set<string>(values.begin(), values.end());
+					if (validation == 'R' || validation == 'V') {
+						ti->param_rules[paramid] = validator.addRule(validation, pieces[i + 3]);
 						++i;
+					} else {
+						ti->param_rules[paramid] = validator.addRule(validation, "");
 					}
 				}
 			}
 		}
 	}
+
+	// Param bitset masks
+	for (auto &info_pair : template_info) {
+		TemplateInfo *ti = info_pair.second;
+		size_t words = (ti->param_names.size() + 63) / 64;
+		ti->deprecated_mask.assign(words, 0);
+		ti->required_mask.assign(words, 0);
+		ti->param_id_cnt.assign(ti->param_names.size(), 0);
+
+		for (auto &pair : ti->param_valid) {
+			int paramid = ti->param_ids[pair.first];
+			if (pair.second == 'D') ti->deprecated_mask[paramid >> 6] |= 1ULL << (paramid & 63);
+			else if (pair.second == 'R') ti->required_mask[paramid >> 6] |= 1ULL << (paramid & 63);
+		}
+
+		for (int ruleid : ti->param_rules) {
+			if (ruleid >= 0) ti->has_validation = true;
+		}
+	}
+}
+
+/**
+ * Load the TemplateFilters.tsv rules of a project. The file is optional.
+ * Sections start with a project line, followed by template id, rule, rule arguments lines, see TemplateFilter.
+ *
+ * @return false = invalid rule
+ */
+bool MainClass::loadFilters(const string& wikiProject)
+{
+	string infilepath = "TemplateFilters.tsv";
+	ifstream source(infilepath.c_str(), ios::in|ios::binary);
+	if (source.fail()) return true;
+
+	string line;
+	vector<string> pieces;
+	bool projectFound = false;
+
+	while (getline(source, line)) {
+		if (line.empty() || line[0] == '#') continue;
+
+		string_split(line, "\t", &pieces);
+
+		if (! isdigit(pieces[0][0])) {
+			projectFound = (pieces[0] == wikiProject);
+			continue;
+		}
+
+		if (! projectFound) continue;
+
+		int id = stoi(pieces[0]);
+		auto info_it = template_info.find(id);
+		if (info_it == template_info.end()) {
+			cerr << infilepath << ": template id not in TemplateIds.tsv " << id << "\n";
+			continue;
+		}
+
+		TemplateInfo *ti = info_it->second;
+		if (! ti->filter) ti->filter = make_shared<TemplateFilter>();
+
+		string errmsg;
+		if (pieces.size() < 2 || pieces[1].empty()) {
+			cerr << infilepath << ": rule name expected in " << line << "\n";
+			return false;
+		}
+
+		vector<string> args(pieces.begin() + 2, pieces.end());
+		if (! ti->filter->addRule(pieces[1], args, &errmsg)) {
+			cerr << infilepath << ": " << errmsg << " in " << line << "\n";
+			return false;
+		}
+	}
+
+	return true;
 }
 
 /**
@@ -1007,70 +3054,317 @@ void loadNamespaces(const string& wikiProject)
 	}
 }
 
-void MainClass::writeTotals(const string& totalsoutfilepath)
+/**
+ * Write the totals, and with -sketch-totals the sketches to sketchesoutfilepath.
+ *
+ * @return false = open or write failed, or a spill file could not be read
+ */
+bool MainClass::writeTotals(const string& totalsoutfilepath)
 {
-    ostream *dest;
+    OutputWriter *dest;
     if (totalsoutfilepath == "-") {
-    	dest = &cerr;
+    	cerr.flush();
+    	dest = new OutputWriter(STDERR_FILENO, false);
     } else {
-    	dest = new ofstream(totalsoutfilepath.c_str(), ios::out|ios::binary|ios::trunc);
-    	if (dest->fail()) {
-    	    cerr << "new ofstream failed for " << totalsoutfilepath << "\n";
+    	dest = OutputWriter::open(totalsoutfilepath);
+    	if (! dest) {
+    	    cerr << "open failed for " << totalsoutfilepath << "\n";
+    	    return false;
+    	}
+    }
+
+    // The totals would be missing the counts of an unreadable spill
+    vector<unique_ptr<TotalsSpill>> spills;
+    for (auto &spillpath : spillpaths) {
+    	spills.emplace_back(new TotalsSpill());
+    	spills.back()->source.open(spillpath.c_str(), ios::in|ios::binary);
+    	if (spills.back()->source.fail()) {
+    		cerr << "new ifstream failed for " << spillpath << "\n";
+    		delete dest;
+    		return false;
+    	}
+    	spills.back()->next();
+    }
+    vector<unique_ptr<TemplateSketches>> sketchspills;
+    for (auto &sketchspillpath : sketchspillpaths) {
+    	sketchspills.emplace_back(new TemplateSketches());
+    	if (! sketchspills.back()->open(sketchspillpath)) {
+    		cerr << "open failed or not a sketches file " << sketchspillpath << "\n";
+    		delete dest;
+    		return false;
     	}
     }
+    vector<string> pieces;
+    bool spillsok = true;
+
+    OutputWriter *sketchdest = 0;
+    if (sketchtotals && ! sketchesoutfilepath.empty()) {
+    	sketchdest = OutputWriter::open(sketchesoutfilepath);
+    	if (! sketchdest) {
+    		cerr << "open failed for " << sketchesoutfilepath << "\n";
+    		delete dest;
+    		return false;
+    	}
+
+    	TemplateSketches::writeHeader(sketchdest);
+    }
 
     for (auto &info_pair : template_info) {
     	TemplateInfo* ti = info_pair.second;
+
+    	// Merge the spilled counts
+    	for (auto &spill : spills) {
+    		for (; spill->tmplid == info_pair.first; spill->next()) {
+    			string_split(spill->line, "\t", &pieces, 5);
+    			if (pieces.size() == 4 && pieces[1] == "P") ti->param_name_cnt[pieces[3]] += stoi(pieces[2]);
+    			else if (pieces.size() == 5 && pieces[1] == "V") ti->param_value_cnt[pieces[3]][pieces[4]] += stoi(pieces[2]);
+    		}
+    	}
+
+    	for (size_t i = 0; i < sketchspills.size(); ++i) {
+    		TemplateSketches& sketchspill = *sketchspills[i];
+    		if (sketchspill.done() || sketchspill.tmplid != (uint32_t)info_pair.first) continue;
+
+    		for (auto &param : sketchspill.params) ti->param_sketches[param.name].merge(param.sketch);
+
+    		if (! sketchspill.next()) {
+    			cerr << "corrupt sketches file " << sketchspillpaths[i] << "\n";
+    			spillsok = false;
+    		}
+    	}
+
     	if (ti->pagecount == 0) continue;
 
-    	*dest << "T" << info_pair.first << "\t" << ti->pagecount << "\t" << ti->instancecount << "\t" << ti->name << "\n";
+    	// Fold in the excludelisted template counts kept by param id
+    	for (size_t paramid = 0; paramid < ti->param_id_cnt.size(); ++paramid) {
+    		if (ti->param_id_cnt[paramid] == 0) continue;
+    		string key = ti->param_names[paramid];
+    		if (key.length() > 255) key.erase(255);
+    		ti->param_name_cnt[key] += ti->param_id_cnt[paramid];
+    	}
+
+    	dest->put('T');
+    	dest->writeInt(info_pair.first);
+    	dest->put('\t');
+    	dest->writeInt(ti->pagecount);
+    	dest->put('\t');
+    	dest->writeInt(ti->instancecount);
+    	dest->put('\t');
+    	dest->write(ti->name);
+    	dest->put('\n');
+
+    	if (sketchdest) {
+    		TemplateSketches::writeTemplate(sketchdest, info_pair.first, ti->name, ti->pagecount, ti->instancecount, ti->param_name_cnt.size());
+    	}
 
     	for (auto &param_pair : ti->param_name_cnt) {
     		const string& param_name = param_pair.first;
 
-    		*dest << "P" << param_name << "\t" << param_pair.second;
+    		if (sketchtotals) {
+    			writeSketch(dest, param_name, param_pair.second, ti->param_sketches[param_name]);
+    			if (sketchdest) TemplateSketches::writeParam(sketchdest, param_name, param_pair.second, ti->param_sketches[param_name]);
+    			continue;
+    		}
+
+    		dest->put('P');
+    		dest->write(param_name);
+    		dest->put('\t');
+    		dest->writeInt(param_pair.second);
 
 			for (auto &value_pair : ti->param_value_cnt[param_name]) {
-				*dest << "\t" << value_pair.first << "\t" << value_pair.second;
+				dest->put('\t');
+				dest->write(value_pair.first);
+				dest->put('\t');
+				dest->writeInt(value_pair.second);
 			}
 
-        	*dest << "\n";
+			dest->put('\n');
+    	}
+    }
+
+    bool writeok = dest->flush();
+    if (! writeok) cerr << "write failed for " << totalsoutfilepath << "\n";
+    delete dest;
+
+    if (sketchdest) {
+    	bool sketchesok = sketchdest->flush();
+    	delete sketchdest;
+
+    	if (! sketchesok) {
+    		cerr << "write failed for " << sketchesoutfilepath << "\n";
+    		writeok = false;
     	}
     }
 
-    if (totalsoutfilepath != "-") delete dest;
+    spills.clear();
+    for (auto &spillpath : spillpaths) remove(spillpath.c_str());
+    spillpaths.clear();
+    sketchspills.clear();
+    for (auto &sketchspillpath : sketchspillpaths) remove(sketchspillpath.c_str());
+    sketchspillpaths.clear();
+
+    return writeok && spillsok;
 }
 
-int calcOffsets(string infilepath, string outfilepath)
+/**
+ * -sketch-totals param line: S, param name, count, estimated distinct value count,
+ * followed by value, count, count overestimate bound for the top values by descending count.
+ */
+void writeSketch(OutputWriter *dest, const string& param_name, long long paramcount, const ParamSketch& sketch)
 {
-	bool excludelisted;
-    istream *source;
+	dest->put('S');
+	dest->write(param_name);
+	dest->put('\t');
+	dest->writeInt(paramcount);
+	dest->put('\t');
+	dest->writeInt(sketch.distinct());
+
+	for (auto &counter : sketch.topValues()) {
+		dest->put('\t');
+		dest->write(counter.value);
+		dest->put('\t');
+		dest->writeInt(counter.count);
+		dest->put('\t');
+		dest->writeInt(counter.error);
+	}
+
+	dest->put('\n');
+}
+
+/**
+ * Write a template start offset, negative for excludelisted templates, row count and byte length.
+ * For BGZF params the offset is the compressed block offset, followed by the offset in the uncompressed block.
+ */
+void writeOffset(OutputWriter *dest, const TemplateRange& range, long long offset, long long inblockoffset)
+{
+	bool excludelisted = (excludelist.find(range.tmplid) != excludelist.end());
+
+	dest->writeUInt(range.tmplid);
+	dest->put('\t');
+	if (excludelisted) dest->put('-');
+	dest->writeInt(offset);
+
+	if (inblockoffset >= 0) {
+		dest->put('\t');
+		dest->writeInt(inblockoffset);
+	}
+
+	dest->put('\t');
+	dest->writeInt(range.rows);
+	dest->put('\t');
+	dest->writeInt(range.length);
+	dest->put('\n');
+}
+
+/**
+ * Write the merged sort runs and the template start offsets.
+ */
+int writeSortedParams(ExternalSort& sorter, OutputWriter *dest, OutputWriter *offsets, BgzfWriter *bgzf)
+{
+	long long offset = 0;
+	vector<TemplateRange> ranges;
+	vector<pair<size_t, size_t>> blockoffsets; // block index, offset in block
+
+	bool ok = sorter.finish([&](const string& line) {
+		unsigned long tmplid = strtoul(line.c_str(), NULL, 10);
+
+		if (ranges.empty() || tmplid != ranges.back().tmplid) {
+			TemplateRange range;
+			range.tmplid = tmplid;
+			range.offset = offset;
+			range.rows = 0;
+			range.length = 0;
+			ranges.push_back(range);
+			if (bgzf) blockoffsets.push_back(make_pair(bgzf->getBlockIndex(), bgzf->getInBlockOffset()));
+		}
+
+		++ranges.back().rows;
+		ranges.back().length += line.length();
+
+		if (bgzf) bgzf->write(line);
+		else dest->write(line);
+		offset += line.length();
+	});
+
+	if (! ok) {
+		cerr << "sort run merge failed\n";
+		return 9;
+	}
+
+	if (bgzf) {
+		// Block offsets are known once the blocks are compressed
+		if (! bgzf->close()) {
+			cerr << "compression failed\n";
+			return 10;
+		}
+
+		for (size_t i = 0; i < ranges.size(); ++i) {
+			writeOffset(offsets, ranges[i], bgzf->getBlockOffset(blockoffsets[i].first), blockoffsets[i].second);
+		}
+	} else {
+		for (auto &range : ranges) writeOffset(offsets, range, range.offset);
+	}
+
+	return 0;
+}
+
+/**
+ * Template start offsets of a sorted params file. A file is scanned mmap'd in parallel chunks, stdin sequentially.
+ * With pageindex the page id index is written too.
+ */
+int calcOffsets(string infilepath, string outfilepath, bool pageindex)
+{
+	vector<TemplateRange> ranges;
+	vector<PageIndexEntry> pagesbuf;
+	vector<PageIndexEntry> *pages = pageindex ? &pagesbuf : 0;
+
     if (infilepath == "-") {
-    	source = &cin;
+    	const size_t buffsize = 16 * 1024 * 1024;
+    	unique_ptr<char[]> buff(new char[buffsize]);
+    	size_t carry = 0;
+    	long long baseoffset = 0;
+
+    	for (;;) {
+    		size_t bytes_read = fread(buff.get() + carry, 1, buffsize - carry, stdin);
+    		size_t available = carry + bytes_read;
+    		if (available == 0) break;
+
+    		// Scan the whole lines, the partial last line is carried over unless at eof
+    		size_t scanlength = available;
+    		if (bytes_read > 0) {
+    			const char *lastnl = (const char *)memrchr(buff.get(), '\n', available);
+    			scanlength = lastnl ? lastnl + 1 - buff.get() : 0;
+    			if (scanlength == 0 && available == buffsize) scanlength = available; // Line longer than the buffer
+    		}
+
+    		OffsetsScanner::scan(buff.get(), scanlength, baseoffset, &ranges, pages);
+    		baseoffset += scanlength;
+    		carry = available - scanlength;
+    		memmove(buff.get(), buff.get() + scanlength, carry);
+
+    		if (bytes_read == 0) break;
+    	}
     } else {
-    	source = new ifstream(infilepath.c_str(), ios::in|ios::binary);
-    	if (source->fail()) {
-    	    cerr << "new ifstream failed for " << infilepath << "\n";
+    	MappedFile source;
+    	if (! source.open(infilepath, MADV_WILLNEED)) {
+    	    cerr << "open failed for " << infilepath << "\n";
     	    return 1;
     	}
+
+    	if (source.size() > 0) OffsetsScanner::scanParallel(source.data(), source.size(), 0, &ranges, pages);
     }
 
-    ostream *dest;
-    if (outfilepath == "-") {
-    	dest = &cout;
-    } else {
-    	dest = new ofstream(outfilepath.c_str(), ios::out|ios::binary|ios::trunc);
-    	if (dest->fail()) {
-    	    cerr << "new ofstream failed for " << outfilepath << "\n";
-    	    return 2;
-    	}
+    OutputWriter *dest = OutputWriter::open(outfilepath);
+    if (! dest) {
+    	cerr << "open failed for " << outfilepath << "\n";
+    	return 2;
     }
 
     // Determine the wiki project
     string wikiProject;
 
-    unsigned int projectEnd = infilepath.find("TemplateParams");
-    if (projectEnd == std::string::npos) {
+    string::size_type projectEnd = infilepath.find("TemplateParams");
+    if (projectEnd == string::npos) {
     	wikiProject = "enwiki";
     } else {
     	wikiProject = infilepath.substr(0, projectEnd);
@@ -1078,44 +3372,476 @@ int calcOffsets(string infilepath, string outfilepath)
 
     loadExclusions(wikiProject);
 
-    string prevTemplID;
-	string line;
-	vector<string> pieces;
+    for (auto &range : ranges) writeOffset(dest, range, range.offset);
 
-	while (source->good()) {
-		long long offset = source->tellg();
+    bool writeok = dest->flush();
+    delete dest;
 
-		getline(*source, line);
+    if (! writeok) {
+    	cerr << "write failed for " << outfilepath << "\n";
+    	return 3;
+    }
 
-		if (line.length()) {
-			string_split(line, "\t", &pieces);
-			string templID(pieces[0]);
+    if (pageindex) {
+    	string indexfilepath;
+    	string::size_type offsetsPos = outfilepath.find("TemplateOffsets");
+    	if (outfilepath == "-") indexfilepath = wikiProject + "TemplatePageIndex";
+    	else if (offsetsPos == string::npos) indexfilepath = outfilepath + ".pageindex";
+    	else indexfilepath = string(outfilepath).replace(offsetsPos, 15, "TemplatePageIndex");
 
-			if (templID != prevTemplID) {
-				int tmplid = atoi(templID.c_str());
-				excludelisted = (excludelist.find(tmplid) != excludelist.end());
-				string blsign;
-				if (excludelisted) blsign = "-";
+    	if (! PageIndex::write(indexfilepath, pages)) {
+    		cerr << "write failed for " << indexfilepath << "\n";
+    		return 4;
+    	}
+    }
 
-				*dest << templID << "\t" << blsign << offset << "\n";
-			}
+	return 0;
+}
+
+/**
+ * Write the rows of a page using the page id index.
+ */
+int lookupPage(string paramsfilepath, string indexfilepath, string pageid, bool verbose)
+{
+	auto starttime = chrono::steady_clock::now();
+
+	PageIndex index;
+	if (! index.open(indexfilepath)) {
+		cerr << "open failed or not a page index " << indexfilepath << "\n";
+		return 1;
+	}
+
+	MappedFile params;
+	if (! params.open(paramsfilepath)) {
+		cerr << "open failed for " << paramsfilepath << "\n";
+		return 2;
+	}
+
+	const char *data = params.data();
+	size_t size = params.size();
+
+	OutputWriter dest(STDOUT_FILENO, false);
+	const PageIndexEntry *end;
+	const PageIndexEntry *entry = index.find(strtoul(pageid.c_str(), NULL, 10), &end);
+	int rowcnt = 0;
+
+	for (; entry < end; ++entry) {
+		// The rows of the page's instances of the template follow each other
+		string rowprefix = to_string(entry->tmplid) + "\t" + to_string(entry->pageid);
+		size_t offset = entry->offset;
+
+		while (offset < size) {
+			const char *eol = (const char *)memchr(data + offset, '\n', size - offset);
+			size_t next = eol ? eol + 1 - data : size;
+			size_t prefixend = offset + rowprefix.length();
+
+			if (prefixend > next || memcmp(data + offset, rowprefix.data(), rowprefix.length()) != 0
+				|| (prefixend < next && data[prefixend] != '\t' && data[prefixend] != '\n')) break;
+
+			dest.write(data + offset, next - offset);
+			++rowcnt;
+			offset = next;
+		}
+	}
+
+	dest.flush();
+
+	if (verbose) {
+		auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - starttime).count();
+		cerr << rowcnt << " rows in " << elapsed << " us\n";
+	}
+
+	return 0;
+}
+
+/**
+ * Serve queries for a sorted params file. The offsets and page index file names are derived from the params file name.
+ */
+int serveQueries(string paramsfilepath, string totalsfilepath, string socketpath, bool verbose)
+{
+	string::size_type projectEnd = paramsfilepath.find("TemplateParams");
+	if (projectEnd == string::npos) {
+		cerr << "params file name must contain TemplateParams " << paramsfilepath << "\n";
+		return 1;
+	}
+
+	string project = paramsfilepath.substr(0, projectEnd);
+	string offsetsfilepath = project + "TemplateOffsets";
+	string indexfilepath = project + "TemplatePageIndex";
+	if (access(indexfilepath.c_str(), R_OK) != 0) indexfilepath.clear();
+
+	QueryServer server;
+	server.verbose = verbose;
+	string errmsg;
+
+	if (! server.open(paramsfilepath, offsetsfilepath, totalsfilepath, indexfilepath, &errmsg)) {
+		cerr << errmsg << "\n";
+		return 2;
+	}
+
+	return server.serve(socketpath);
+}
+
+/**
+ * Write a binary params file as params tsv.
+ */
+int readBinaryParams(string infilepath, string outfilepath)
+{
+	ParamsBinaryReader reader;
+	if (! reader.open(infilepath)) {
+		cerr << "open failed or not a binary params file " << infilepath << "\n";
+		return 1;
+	}
+
+	OutputWriter *dest = OutputWriter::open(outfilepath);
+	if (! dest) {
+		cerr << "open failed for " << outfilepath << "\n";
+		return 2;
+	}
+
+	bool readok = reader.readAll([&](const string& line) { dest->write(line); });
+	bool writeok = dest->flush();
+	delete dest;
+
+	if (! readok) {
+		cerr << "corrupt binary params file " << infilepath << "\n";
+		return 3;
+	}
+
+	if (! writeok) {
+		cerr << "write failed for " << outfilepath << "\n";
+		return 4;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the value index of a sorted params file.
+ */
+int buildValueIndex(string paramsfilepath, string indexfilepath, bool verbose)
+{
+	auto starttime = chrono::steady_clock::now();
+
+	MappedFile params;
+	if (! params.open(paramsfilepath)) {
+		cerr << "open failed for " << paramsfilepath << "\n";
+		return 1;
+	}
+
+	OutputWriter *dest = OutputWriter::open(indexfilepath);
+	if (! dest) {
+		cerr << "open failed for " << indexfilepath << "\n";
+		return 2;
+	}
+
+	ValueIndexWriter writer(dest);
+	const char *data = params.data();
+	size_t size = params.size();
+	size_t offset = 0;
+	bool rowsok = true;
 
-			prevTemplID = templID;
+	while (offset < size) {
+		const char *eol = (const char *)memchr(data + offset, '\n', size - offset);
+		size_t next = eol ? eol + 1 - data : size;
+
+		if (! writer.addRow(data + offset, next - offset)) {
+			rowsok = false;
+			break;
 		}
+
+		offset = next;
+	}
+
+	bool writeok = writer.close();
+	delete dest;
+
+	if (! rowsok) {
+		cerr << "params file not sorted or malformed at offset " << offset << " " << paramsfilepath << "\n";
+		return 3;
+	}
+
+	if (! writeok) {
+		cerr << "write failed for " << indexfilepath << "\n";
+		return 4;
+	}
+
+	if (verbose) {
+		auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - starttime).count();
+		cerr << writer.getTermCount() << " terms in " << elapsed << " ms\n";
+	}
+
+	return 0;
+}
+
+/**
+ * Write the page ids of a value query: param=value, param^=prefix, or param for any value.
+ */
+int queryValues(string indexfilepath, string tmplid, string query, bool verbose)
+{
+	auto starttime = chrono::steady_clock::now();
+
+	ValueIndex index;
+	if (! index.open(indexfilepath)) {
+		cerr << "open failed or not a value index " << indexfilepath << "\n";
+		return 1;
+	}
+
+	string paramname = query;
+	string value;
+	bool prefix = true;
+	string::size_type eqPos = query.find('=');
+
+	if (eqPos != string::npos) {
+		prefix = eqPos > 0 && query[eqPos - 1] == '^';
+		paramname = query.substr(0, prefix ? eqPos - 1 : eqPos);
+		value = query.substr(eqPos + 1);
+	}
+
+	vector<uint32_t> pageids;
+	if (! index.find(strtoul(tmplid.c_str(), NULL, 10), paramname, value, prefix, &pageids)) {
+		cerr << "corrupt value index " << indexfilepath << "\n";
+		return 2;
+	}
+
+	OutputWriter dest(STDOUT_FILENO, false);
+	for (uint32_t pageid : pageids) {
+		dest.writeUInt(pageid);
+		dest.put('\n');
+	}
+	dest.flush();
+
+	if (verbose) {
+		auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - starttime).count();
+		cerr << pageids.size() << " pages in " << elapsed << " us\n";
+	}
+
+	return 0;
+}
+
+/**
+ * Write the page ids of a template id set expression.
+ */
+int queryBitmaps(string indexfilepath, string expression, bool verbose)
+{
+	auto starttime = chrono::steady_clock::now();
+
+	TemplateBitmapIndex index;
+	if (! index.open(indexfilepath)) {
+		cerr << "open failed or not a template bitmaps file " << indexfilepath << "\n";
+		return 1;
+	}
+
+	PageBitmap result;
+	string errmsg;
+	if (! index.evaluate(expression, &result, &errmsg)) {
+		cerr << errmsg << "\n";
+		return 2;
+	}
+
+	OutputWriter dest(STDOUT_FILENO, false);
+	result.forEach([&](uint32_t pageid) {
+		dest.writeUInt(pageid);
+		dest.put('\n');
+	});
+	dest.flush();
+
+	if (verbose) {
+		auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - starttime).count();
+		cerr << result.cardinality() << " pages in " << elapsed << " us\n";
+	}
+
+	return 0;
+}
+
+/**
+ * Template ranges of a sorted params file, from its offsets file ...TemplateOffsets if there is one, else scanned.
+ */
+bool loadTemplateRanges(const string& paramsfilepath, const MappedFile& params, vector<TemplateRange> *ranges, bool verbose)
+{
+	string::size_type projectEnd = paramsfilepath.find("TemplateParams");
+	string offsetsfilepath = (projectEnd == string::npos) ? "" : paramsfilepath.substr(0, projectEnd) + "TemplateOffsets";
+	MappedFile offsets;
+
+	if (offsetsfilepath.empty() || access(offsetsfilepath.c_str(), R_OK) != 0) {
+		if (verbose) cerr << "no offsets file, scanning " << paramsfilepath << "\n";
+		OffsetsScanner::scanParallel(params.data(), params.size(), 0, ranges);
+		return true;
+	}
+
+	string errmsg;
+	if (! offsets.open(offsetsfilepath)) errmsg = "open failed for " + offsetsfilepath;
+	else if (OffsetsScanner::readOffsets(offsets.data(), offsets.size(), params.data(), params.size(), ranges, &errmsg)) return true;
+
+	cerr << errmsg << "\n";
+	return false;
+}
+
+/**
+ * Write the param value differences of two sorted params files.
+ */
+int diffParams(string oldfilepath, string newfilepath, string outfilepath, bool verbose)
+{
+	auto starttime = chrono::steady_clock::now();
+
+	MappedFile oldparams, newparams;
+	if (! oldparams.open(oldfilepath)) {
+		cerr << "open failed for " << oldfilepath << "\n";
+		return 1;
 	}
 
-    if (outfilepath != "-") delete dest;
+	if (! newparams.open(newfilepath)) {
+		cerr << "open failed for " << newfilepath << "\n";
+		return 1;
+	}
+
+	vector<TemplateRange> oldranges, newranges;
+	if (! loadTemplateRanges(oldfilepath, oldparams, &oldranges, verbose)
+		|| ! loadTemplateRanges(newfilepath, newparams, &newranges, verbose)) return 2;
+
+	auto rangeLess = [](const TemplateRange& a, const TemplateRange& b) { return a.tmplid < b.tmplid; };
+	if (! is_sorted(oldranges.begin(), oldranges.end(), rangeLess) || ! is_sorted(newranges.begin(), newranges.end(), rangeLess)) {
+		cerr << "params files not sorted by template id\n";
+		return 3;
+	}
+
+	OutputWriter *dest = OutputWriter::open(outfilepath);
+	if (! dest) {
+		cerr << "open failed for " << outfilepath << "\n";
+		return 4;
+	}
+
+	ParamsDiff diff(oldparams.data(), oldparams.size(), newparams.data(), newparams.size());
+	string errmsg;
+	bool diffok = diff.run(oldranges, newranges, 0, dest, &errmsg);
+	delete dest;
+
+	if (! diffok) {
+		cerr << errmsg << " for " << outfilepath << "\n";
+		return 5;
+	}
+
+	if (verbose) {
+		auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - starttime).count();
+		cerr << diff.getAdded() << " added, " << diff.getRemoved() << " removed, " << diff.getChanged() << " changed in " << elapsed << " ms\n";
+	}
 
 	return 0;
 }
 
+/**
+ * Merge the ...TemplateSketches of -sketch-totals runs over disjoint pages, ie. dump shards, into the sketches and the
+ * totals of all the pages. A template at a time, the files are in template id order.
+ */
+int mergeSketches(string sketchesfilepaths, string sketchesoutfilepath, string totalsoutfilepath)
+{
+	vector<string> inputpaths;
+	string_split(sketchesfilepaths, ";", &inputpaths);
+
+	vector<unique_ptr<TemplateSketches>> inputs;
+	for (auto &inputpath : inputpaths) {
+		inputs.emplace_back(new TemplateSketches());
+		if (! inputs.back()->open(inputpath)) {
+			cerr << "open failed or not a sketches file " << inputpath << "\n";
+			return 1;
+		}
+	}
+
+	OutputWriter *sketchdest = OutputWriter::open(sketchesoutfilepath);
+	if (! sketchdest) {
+		cerr << "open failed for " << sketchesoutfilepath << "\n";
+		return 2;
+	}
+
+	OutputWriter *dest = OutputWriter::open(totalsoutfilepath);
+	if (! dest) {
+		cerr << "open failed for " << totalsoutfilepath << "\n";
+		delete sketchdest;
+		return 2;
+	}
+
+	TemplateSketches::writeHeader(sketchdest);
+	map<string, pair<long long, ParamSketch>> params; // count, sketch by param name
+	int retval = 0;
+
+	for (;;) {
+		uint32_t tmplid = UINT32_MAX;
+		bool found = false;
+		for (auto &input : inputs) {
+			if (! input->done() && input->tmplid <= tmplid) {
+				tmplid = input->tmplid;
+				found = true;
+			}
+		}
+		if (! found) break;
+
+		string name;
+		long long pagecount = 0;
+		long long instancecount = 0;
+		params.clear();
+
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			TemplateSketches& input = *inputs[i];
+			if (input.done() || input.tmplid != tmplid) continue;
+
+			name = input.name;
+			pagecount += input.pagecount;
+			instancecount += input.instancecount;
+
+			for (auto &param : input.params) {
+				pair<long long, ParamSketch>& merged = params[param.name];
+				merged.first += param.count;
+				merged.second.merge(param.sketch);
+			}
+
+			if (! input.next()) {
+				cerr << "corrupt sketches file " << inputpaths[i] << "\n";
+				retval = 3;
+			}
+		}
+
+		if (retval) break;
+
+		dest->put('T');
+		dest->writeInt(tmplid);
+		dest->put('\t');
+		dest->writeInt(pagecount);
+		dest->put('\t');
+		dest->writeInt(instancecount);
+		dest->put('\t');
+		dest->write(name);
+		dest->put('\n');
+
+		TemplateSketches::writeTemplate(sketchdest, tmplid, name, pagecount, instancecount, params.size());
+
+		for (auto &param_pair : params) {
+			writeSketch(dest, param_pair.first, param_pair.second.first, param_pair.second.second);
+			TemplateSketches::writeParam(sketchdest, param_pair.first, param_pair.second.first, param_pair.second.second);
+		}
+	}
+
+	if (! dest->flush()) {
+		cerr << "write failed for " << totalsoutfilepath << "\n";
+		retval = 4;
+	}
+
+	if (! sketchdest->flush()) {
+		cerr << "write failed for " << sketchesoutfilepath << "\n";
+		retval = 4;
+	}
+
+	delete dest;
+	delete sketchdest;
+
+	return retval;
+}
+
 class ValuesHandler : public IPageHandler
 {
 public:
 	bool verbose;
-	set<string> templatenames;
 	void processPage(int mwnamespace, unsigned int page_id, unsigned int revision_id, const std::string& page_data, const std::string& page_title);
-	map<string, map<string, map<string, string>>> param_values; // pagename, template name, parameter name, parameter value
+	unordered_map<string, vector<ValuesExport *>> template_groups; // template name, the groups containing it
 };
 
 void ValuesHandler::processPage(int ns, unsigned int page_id, unsigned int revid, const std::string& page_data, const std::string& page_title)
@@ -1128,11 +3854,18 @@ void ValuesHandler::processPage(int ns, unsigned int page_id, unsigned int revid
 
 	// Parse the templates
 	vector<MWTemplate> templates;
-	MWTemplateParamParser::getTemplates(&templates, page_data);
+	PageParseStats parsestats;
+	MWTemplateParamParser::getTemplates(&templates, page_data, 0, &parsestats);
 	map<string, int> pagetemplates;
 
+	if (parsestats.fallback && verbose) {
+		cerr << "page " << page_id << " " << page_title << " over the parse budget (" << parsestats.fallback << "), "
+			<< parsestats.iterations << " iterations " << parsestats.seconds << " seconds\n";
+	}
+
 	for (auto &templ : templates) {
-		if (templatenames.find(templ.name) == templatenames.end()) continue;
+		auto groups_it = template_groups.find(templ.name);
+		if (groups_it == template_groups.end()) continue;
 
 		// Fancy code to erase map elements while iterating the map
 		for (map<string,string>::iterator it=templ.params.begin(), it_next=it, it_end=templ.params.end();
@@ -1145,26 +3878,119 @@ void ValuesHandler::processPage(int ns, unsigned int page_id, unsigned int revid
 
 		if (templ.params.empty()) continue;
 
-		++pagetemplates[templ.name];
-		string temptmplname = templ.name;
+		int occurrence = ++pagetemplates[templ.name];
 
-		if (pagetemplates[templ.name] > 1) temptmplname += "{" + to_string(pagetemplates[templ.name]) + "}";
+		for (auto values : groups_it->second) {
+			if (! values->add(page_title, templ.name, occurrence, templ.params)) {
+				cerr << "values spill write failed\n";
+				exit(8);
+			}
+		}
+	}
 
-		for (auto &pair : templ.params) {
-			string key = pair.first;
-			string& value = pair.second;
-			for (auto &achar : key) if (achar == '\n' || achar == '\t') achar = ' '; // Don't want tabs/newlines in csv file
-			for (auto &achar : value) if (achar == '\n' || achar == '\t') achar = ' ';
-			if (key.length() > 255) key.erase(255);
-			if (value.length() > 255) value.erase(255);
+}
 
-			param_values[page_title][temptmplname][key] = value;
+/**
+ * Output file path of a template group, from the output path prefix and the group name.
+ */
+string valuesOutfilePath(const string& outfilepath, string groupname)
+{
+	if (outfilepath == "-") return outfilepath;
+
+	string_replace(&groupname, " ", "_");
+	return outfilepath + "_" + groupname + ".tsv";
+}
+
+/**
+ * @param size Bytes with an optional K, M or G suffix
+ * @return 0 = invalid or too large
+ */
+size_t parseByteSize(const string& size)
+{
+	if (! isdigit(size[0])) return 0;
+
+	char *end;
+	errno = 0;
+	unsigned long long bytes = strtoull(size.c_str(), &end, 10);
+	if (errno == ERANGE) return 0;
+
+	unsigned long long multiplier = 1;
+
+	switch (toupper(*end)) {
+	case 'G': multiplier *= 1024;
+		[[fallthrough]];
+	case 'M': multiplier *= 1024;
+		[[fallthrough]];
+	case 'K': multiplier *= 1024;
+		++end;
+		break;
+	}
+
+	if (*end || bytes > SIZE_MAX / multiplier) return 0;
+	return bytes * multiplier;
+}
+
+/**
+ * Load a template groups file: a line per group, output name tab template names separated by ;
+ *
+ * @return false = open failed, malformed line or two groups with the same output file
+ */
+bool loadValuesGroups(const string& groupsfilepath, const string& outfilepath, vector<ValuesGroup> *groups)
+{
+	ifstream source(groupsfilepath.c_str(), ios::in|ios::binary);
+	if (source.fail()) {
+		cerr << "new ifstream failed for " << groupsfilepath << "\n";
+		return false;
+	}
+
+	string line;
+	vector<string> pieces;
+	set<string> outfilepaths;
+
+	while (getline(source, line)) {
+		if (line.empty() || line[0] == '#') continue;
+
+		string_split(line, "\t", &pieces);
+		if (pieces.size() != 2 || pieces[0].empty() || pieces[1].empty()) {
+			cerr << "output name and template names expected in " << groupsfilepath << ": " << line << "\n";
+			return false;
+		}
+
+		ValuesGroup group;
+		group.outfilepath = valuesOutfilePath(outfilepath, pieces[0]);
+
+		// ie. "birth date" and "birth_date", or several groups to stdout
+		if (! outfilepaths.insert(group.outfilepath).second) {
+			cerr << "duplicate output file " << group.outfilepath << " in " << groupsfilepath << ": " << line << "\n";
+			return false;
 		}
+		string_split(pieces[1], ";", &group.templatenames);
+		groups->push_back(group);
 	}
 
+	return true;
+}
+
+/**
+ * Write the parameter values of a template group, a row per template instance.
+ *
+ * @param sortbytitle true = rows sorted by page name, false = dump order
+ */
+int dumpValues(string infilepath, string outfilepath, string templatenames, bool verbose, bool sortbytitle)
+{
+	vector<ValuesGroup> groups(1);
+	string_split(templatenames, ";", &groups[0].templatenames);
+	groups[0].outfilepath = valuesOutfilePath(outfilepath, groups[0].templatenames[0]);
+
+	return dumpValuesGroups(infilepath, groups, verbose, sortbytitle);
 }
 
-int dumpValues(string infilepath, string outfilepath, string templatenames, bool verbose)
+/**
+ * Write the parameter values of template groups in one dump pass, a file per group.
+ *
+ * @param sortbytitle true = rows sorted by page name, false = dump order
+ */
+int dumpValuesGroups(string infilepath, const vector<ValuesGroup>& groups, bool verbose, bool sortbytitle)
 {
 	// Check for single byte xml characters for utf8 internal data
 	const XML_Feature *fl = XML_GetFeatureList();
@@ -1182,14 +4008,35 @@ int dumpValues(string infilepath, string outfilepath, string templatenames, bool
 	XML_SetElementHandler(p, startElement, endElement);
 	XML_SetCharacterDataHandler(p, characters);
 
-	vector<string> temptemplates;
-	string_split(templatenames, ";", &temptemplates);
-	string maintemplate = temptemplates[0];
-	set<string> templates(temptemplates.begin(), temptemplates.end());
-
 	ValuesHandler vh;
 	vh.verbose = verbose;
-	vh.templatenames = templates;
+
+	// Open the outputs before the dump pass, so a bad path fails without parsing the dump
+	vector<unique_ptr<OutputWriter>> groupdests;
+
+	for (auto &group : groups) {
+		groupdests.emplace_back(OutputWriter::open(group.outfilepath));
+		if (! groupdests.back()) {
+			cerr << "open failed for " << group.outfilepath << "\n";
+			XML_ParserFree(p);
+			return 4;
+		}
+	}
+
+	// The groups share the sort memory
+	size_t sortmemory = max((size_t)16 * 1024 * 1024, (size_t)1024 * 1024 * 1024 / max(groups.size(), (size_t)1));
+	vector<unique_ptr<ValuesExport>> groupvalues;
+
+	for (auto &group : groups) {
+		string tempprefix = (group.outfilepath == "-") ? "TemplateValues" : group.outfilepath;
+		groupvalues.emplace_back(new ValuesExport(tempprefix, sortbytitle, sortmemory));
+
+		for (auto &templatename : group.templatenames) {
+			vector<ValuesExport *>& templategroups = vh.template_groups[templatename];
+			if (templategroups.empty() || templategroups.back() != groupvalues.back().get()) templategroups.push_back(groupvalues.back().get());
+		}
+	}
+
     MWDumpHandler defaultHandler(vh);
     mwdh = &defaultHandler;
 
@@ -1233,65 +4080,31 @@ int dumpValues(string infilepath, string outfilepath, string templatenames, bool
 
     XML_ParserFree(p);
 
-    ostream *dest;
-    if (outfilepath == "-") {
-    	dest = &cout;
-    } else {
-    	string outfilename = maintemplate;
-    	string_replace(&outfilename, " ", "_");
+    if (infilepath != "-") delete source;
 
-    	dest = new ofstream(outfilepath + "_" + outfilename + ".tsv", ios::out|ios::binary|ios::trunc);
-    	if (dest->fail()) {
-    	    cerr << "new ofstream failed for " << outfilepath << "\n";
-    	    return 4;
+    for (size_t i = 0; i < groups.size(); ++i) {
+    	const string& valuesoutfilepath = groups[i].outfilepath;
+    	ValuesExport& values = *groupvalues[i];
+
+    	if (! values.finish(groupdests[i].get())) {
+    		cerr << "values spill read failed\n";
+    		return 9;
     	}
-    }
 
-	// Determine the parameter names used
-	set<string> paramnames;
-	for (auto &pair : vh.param_values) {
-		for (auto &pair2 : pair.second) {
-			for (auto &pair3 : pair2.second) {
-				paramnames.insert(pair3.first);
-			}
-		}
-	}
+    	bool writeok = groupdests[i]->flush();
+    	groupdests[i].reset();
 
-    // write the header
-    *dest << "pagename" << "\t" << "templatename";
+    	if (! writeok) {
+    		cerr << "write failed for " << valuesoutfilepath << "\n";
+    		return 8;
+    	}
 
-    for (auto &paramname : paramnames) {
-    	*dest << "\t" << paramname;
+    	if (verbose) cerr << valuesoutfilepath << ": " << values.getRowCount() << " rows, " << values.getColumnCount() << " parameters\n";
+    	groupvalues[i].reset(); // Remove the spill files
     }
 
-    *dest << "\n";
-
-	for (auto &pair : vh.param_values) {
-		string pagename = pair.first;
-
-		for (auto &pair2 : pair.second) {
-			string temptmplname = pair2.first;
-			// strip occurrence number
-			PhpPreg phpPreg("!^([^{]+)(?:\\{\\d+\\})?$!");
-			MatchVector mv;
-			phpPreg.match(temptmplname, &mv);
-			temptmplname = mv[1]->text;
-
-			*dest << pagename << "\t" << temptmplname;
-
-			for (auto &paramname : paramnames) {
-				string paramvalue;
-				if (pair2.second.find(paramname) == pair2.second.end()) paramvalue = "";
-				else paramvalue = pair2.second[paramname];
-				*dest << "\t" << paramvalue;
-			}
-
-			*dest << "\n";
-		}
-	}
-
-    if (infilepath != "-") delete source;
-    if (outfilepath != "-") delete dest;
+    if (verbose) PhpPregRegistry::writeStats(cerr);
+    if (verbose) TemplateCache::writeStats(cerr);
 
 	return 0;
 }
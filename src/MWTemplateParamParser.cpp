@@ -17,8 +17,14 @@
 #include <algorithm>
 #include "MWTemplateParamParser.h"
 #include "string_util.h"
+#include "TemplateCache.h"
 #include <cctype>
-#include <sstream>
+#include <cstring>
+#include <ctime>
+#include <climits>
+#include <iterator>
+#include <thread>
+#include <functional>
 
 using namespace std;
 
@@ -43,160 +49,190 @@ vector<string> MWTemplateParamParser::regexs_ordered = {
 };
 
 const int MWTemplateParamParser::MAX_ITERATIONS = 1000;
+double MWTemplateParamParser::maxPageSeconds = 10;
+size_t MWTemplateParamParser::parallelPageSize = 1024 * 1024;
+int MWTemplateParamParser::pageThreads = 0;
 PhpPreg MWTemplateParamParser::COMMENT_REGEX("/<!--.*?-->/us");
-PhpPreg MWTemplateParamParser::MARKER_REGEX("!\\x02\\d+\\x03!");
 PhpPreg MWTemplateParamParser::NOWIKI_REGEX("!<\\s*nowiki\\s*>.*?<\\s*/nowiki\\s*>!usi");
 PhpPreg MWTemplateParamParser::BR_REGEX("!<\\s*br\\s*/?\\s*>!usi");
 
+/**
+ * Trim whitespace from both ends of an arena string.
+ */
+static void trimArenaString(ArenaString *subject)
+{
+	static const char *whitespace = " \r\n\t";
+	ArenaString::size_type pos = subject->find_last_not_of(whitespace);
+	if (pos == ArenaString::npos) {
+		subject->clear();
+		return;
+	}
+	++pos;
+	if (pos < subject->length()) subject->erase(pos);
+
+	pos = subject->find_first_not_of(whitespace);
+	if (pos > 0) subject->erase(0, pos);
+}
+
 /**
  * Get template names and parameters in a string.
  * Numbered params are relative to 1
  *
  * @param results
  * @param page_data
+ * @param arena
  */
-void MWTemplateParamParser::getTemplates(vector<MWTemplate> *results, const string& origdata)
-{
-		int itercnt = 0;
-		bool match_found = true;
-		map<string, string> markers;
-		vector<string> templates;
-		vector<shared_ptr<MatchVector>> marker_matches;
-		MatchVector match;
-		string tmpl_name;
-		map<string, string> tmpl_params;
-		int numbered_param;
-		vector<string> params;
-		vector<string> name_value;
-		string param_name;
-		string param_value;
-
-		string data = origdata;
-		COMMENT_REGEX.replace(&data, ""); // Strip comments
-		NOWIKI_REGEX.replace(&data, ""); // Strip nowiki
-		BR_REGEX.replace(&data, " "); // Replace BR
-
-		while (match_found) {
-			if (++itercnt > MAX_ITERATIONS) {
-				return;
-			}
+void MWTemplateParamParser::getTemplates(vector<MWTemplate> *results, const string& origdata, PageArena *arena, PageParseStats *stats)
+{
+	static thread_local PageArena threadarena;
+	if (! arena) arena = &threadarena;
 
-			match_found = _getTemplates(&data, &markers, &templates, 0, data.length());
-		}
+	parseTemplates(results, origdata, arena, stats);
+	arena->reset();
+}
 
-		// Parse the template names and parameters
-		for (auto templ : templates) {
-			PhpPreg& template_regex = regexs["template"];
-			template_regex.match(templ, &match);
-			tmpl_name = match["name"]->text;
+MWTemplateParamParser::ThreadRegexs::ThreadRegexs() : comment(COMMENT_REGEX), nowiki(NOWIKI_REGEX), br(BR_REGEX)
+{
+	ordered.reserve(regexs_ordered.size());
 
-			// Replace any markers in the name
-			MARKER_REGEX.matchAll(tmpl_name, &marker_matches);
-			for (auto &marker_match : marker_matches) {
-				string_replace(&tmpl_name, marker_match->at(0)->text, markers[marker_match->at(0)->text]);
-			}
+	for (auto &regexname : regexs_ordered) {
+		if (regexname == "template") templateRegex = ordered.size();
+		ordered.emplace_back(regexs.at(regexname));
+		contentGroups.push_back(ordered.back().getGroupNumber("content"));
+	}
+}
 
-			string_replace(&tmpl_name, "_", " ");
-			string_trim(&tmpl_name);
-			tmpl_name[0] = toupper(tmpl_name[0]);
-			if (tmpl_name.find("Template:") == 0) {
-				tmpl_name.erase(0, 9);
-				string_trim(&tmpl_name);
-				tmpl_name[0] = toupper(tmpl_name[0]);
-			}
+MWTemplateParamParser::ThreadRegexs& MWTemplateParamParser::getThreadRegexs()
+{
+	static thread_local ThreadRegexs threadregexs;
+	return threadregexs;
+}
 
-			tmpl_params.clear();
-			if (match.isSet("params")) {
-				numbered_param = 1;
-				string_split(match["params"]->text, "|", &params);
-
-				for (auto param : params) {
-					if (param.find('=') != string::npos) {
-						string_split(param, "=", &name_value, 2);
-						param_name = name_value[0];
-						param_value = name_value[1];
-
-						if (param_name.length() && param_name.back() == '\n') { // = must be on same line as param name
-							param_name = to_string(numbered_param);
-							param_value = param;
-							++numbered_param;
-
-						} else {
-							// Replace any markers in the name
-							MARKER_REGEX.matchAll(param_name, &marker_matches);
-							for (auto &marker_match : marker_matches) {
-								string_replace(&param_name, marker_match->at(0)->text, markers[marker_match->at(0)->text]);
-							}
-						}
-					} else {
-						param_name = to_string(numbered_param);
-						param_value = param;
-						++numbered_param;
-					}
+MWTemplateParamParser::PageParse::PageParse(PageArena *arena)
+	: arena(arena), regexs(getThreadRegexs()), markers(arena), templates(arena), iterations(arena),
+	matches(ArenaAllocator<ArenaVector<int>>(arena))
+{
+}
 
-					// Replace any markers in the content
-					MARKER_REGEX.matchAll(param_value, &marker_matches);
-					for (auto &marker_match : marker_matches) {
-						string_replace(&param_value, marker_match->at(0)->text, markers[marker_match->at(0)->text]);
-					}
+/**
+ * All the temporaries are in the arena, only the results are on the heap.
+ * When the page exceeds MAX_ITERATIONS or maxPageSeconds the templates not found yet are extracted by scanBraces.
+ */
+void MWTemplateParamParser::parseTemplates(vector<MWTemplate> *results, const string& origdata, PageArena *arena, PageParseStats *stats)
+{
+	double starttime = threadSeconds();
+	ThreadRegexs& threadregexs = getThreadRegexs();
 
-					string_trim(&param_name);
-					string_trim(&param_value);
-					if (param_name.length()) tmpl_params[param_name] = param_value;
-				}
-			}
+	ArenaString data(origdata.data(), origdata.length(), arena);
+	replaceMatches(threadregexs.comment, &data, "", arena); // Strip comments
+	replaceMatches(threadregexs.nowiki, &data, "", arena); // Strip nowiki
+	replaceMatches(threadregexs.br, &data, " ", arena); // Replace BR
 
-			results->emplace_back(tmpl_name, tmpl_params);
-		}
+	if (parallelPageSize && data.length() >= parallelPageSize && parseSegments(results, data, arena, stats)) {
+		if (stats) stats->seconds += threadSeconds() - starttime;
+		return;
+	}
+
+	// A failed split is not charged to the page, so the page parses like it was never split
+	PageParse parse(arena);
+	if (maxPageSeconds > 0) parse.budget.deadline = threadSeconds() + maxPageSeconds;
+
+	if (! rescan(&data, &parse)) scanBraces(data, &parse);
+
+	addTemplates(results, parse, 0, parse.templates.size());
+
+	if (stats) {
+		stats->iterations = min((int)parse.iterations.size() + 1, MAX_ITERATIONS);
+		stats->seconds = threadSeconds() - starttime;
+		stats->fallback = parse.budget.exceeded;
+	}
+}
+
+/**
+ * Replace the page constructs with markers, innermost first, until no regex matches.
+ *
+ * @return false = over budget, data is consistent but not done
+ */
+bool MWTemplateParamParser::rescan(ArenaString *data, PageParse *parse, size_t maxiterations)
+{
+	for (;;) {
+		if (parse->iterations.size() >= maxiterations) parse->budget.exceeded = "iterations";
+
+		Iteration iteration;
+		bool match_found = ! parse->budget.exceeded && _getTemplates(data, parse, 0, data->length(), 0, &iteration);
+
+		if (parse->budget.exceeded) return false;
+		if (! match_found) return true;
+
+		iteration.templatesEnd = parse->templates.size();
+		iteration.markersEnd = parse->markers.size();
+		parse->iterations.push_back(iteration);
+	}
 }
 
-bool MWTemplateParamParser::_getTemplates(string *data, map<string, string> *markers, vector<string> *templates, int start, int length)
+/**
+ * Replace the innermost matches of the first regex that matches with markers.
+ *
+ * @param depth Nesting depth, the match offsets are in parse->matches[depth]
+ * @param iteration Top level call only, gets the regex that matched
+ * @return true = data changed or the budget is exhausted, rescan
+ */
+bool MWTemplateParamParser::_getTemplates(ArenaString *data, PageParse *parse, int start, int length, size_t depth, Iteration *iteration)
 {
 	int match_cnt;
 	int offset_adjust;
-	vector<shared_ptr<MatchVector>> matches;
-	string marker_id;
+	if (parse->matches.size() == depth) parse->matches.emplace_back(parse->arena);
+	ArenaVector<int>& matches = parse->matches[depth];
+	char marker_id[MARKER_LENGTH];
 	int content_len;
 	int offset;
-	vector<shared_ptr<MatchVector>> marker_matches;
 	bool match_found;
-	string substrdata;
-
-	substrdata = data->substr(start, length);
-
-	for (auto &regexname : regexs_ordered) {
-		PhpPreg& type_regex = regexs[regexname];
-		match_cnt = type_regex.matchAll(substrdata, &matches);
+	ThreadRegexs& threadregexs = parse->regexs;
+
+	for (size_t regexnum = 0; regexnum < threadregexs.ordered.size(); ++regexnum) {
+		PhpPreg& type_regex = threadregexs.ordered[regexnum];
+		matches.clear();
+		if (parse->budget.exhausted()) return true; // Unwind without changing data
+		match_cnt = type_regex.matchAllOffsets(data->data() + start, length, &matches, &ParseBudget::exhausted, &parse->budget);
+		if (parse->budget.exceeded) return true; // Stopped between matches
 		offset_adjust = 0;
 
+		if (! match_cnt && type_regex.isError()) {
+			// ie. the match or jit stack limit, backtracking out of hand
+			parse->budget.exceeded = "match error";
+			return true;
+		}
+
 		if (match_cnt) {
+			int capcount = type_regex.getCaptureCount();
+			int contentgroup = threadregexs.contentGroups[regexnum];
+			if (iteration) iteration->regex = regexnum;
+
+			for (int m = 0; m < match_cnt; ++m) {
+				const int *match = &matches[m * capcount * 2];
 
-			for (auto match : matches) {
 				// See if there are any containers inside
-				match_found = _getTemplates(data, markers, templates, start + match->at("content")->textOffset - offset_adjust,
-					match->at("content")->text.length());
-                if (match_found) return true; // Restart because data changed
+				match_found = _getTemplates(data, parse, start + match[contentgroup * 2] - offset_adjust,
+					match[contentgroup * 2 + 1] - match[contentgroup * 2], depth + 1, 0);
+				if (match_found) {
+					if (iteration) iteration->descended = true;
+					return true; // Restart because data changed
+				}
 
 				// Replace the match with a marker
-				ostringstream oss;
-				oss << "\x02" << markers->size() << "\x03";
-				marker_id = oss.str();
-				string content = match->at(0)->text;
-				content_len = content.length();
-				offset = start + match->at(0)->textOffset - offset_adjust;
-				offset_adjust += content_len - marker_id.length();
-
-				data->replace(offset, content_len, marker_id);
-
-				if (regexname == "template") templates->push_back(content);
-
-				// Replace any markers in the content
-				MARKER_REGEX.matchAll(content, &marker_matches);
-				for (auto &marker_match : marker_matches) {
-					string_replace(&content, marker_match->at(0)->text, (*markers)[marker_match->at(0)->text]);
-				}
+				formatMarker(parse->markers.size(), marker_id);
+				content_len = match[1] - match[0];
+				offset = start + match[0] - offset_adjust;
+				offset_adjust += content_len - MARKER_LENGTH;
 
-				(*markers)[marker_id] = content;
+				if (regexnum == threadregexs.templateRegex) parse->templates.emplace_back(data->data() + offset, content_len, parse->arena);
+
+				// Replace any markers in the content, so nested markers are only ever expanded once
+				ArenaString expanded(parse->arena);
+				expandMarkers(data->data() + offset, content_len, parse->markers, &expanded);
+				data->replace(offset, content_len, marker_id, MARKER_LENGTH);
+
+				parse->markers.push_back(move(expanded));
 			}
 
 			return true; // Restart because data changed
@@ -206,5 +242,611 @@ bool MWTemplateParamParser::_getTemplates(string *data, map<string, string> *mar
     return false;
 }
 
+/**
+ * Parse the names and parameters of templates [first, last). Invocations without markers are looked up in TemplateCache first.
+ */
+void MWTemplateParamParser::addTemplates(vector<MWTemplate> *results, const PageParse& parse, size_t first, size_t last)
+{
+	PageArena *arena = parse.arena;
+	ArenaVector<int> match(arena);
+	ArenaString tmpl_name(arena);
+	ArenaString param_name(arena);
+	ArenaString param_value(arena);
+	char digits[20];
+
+	PhpPreg& template_regex = parse.regexs.ordered[parse.regexs.templateRegex];
+	int namegroup = template_regex.getGroupNumber("name");
+	int paramsgroup = template_regex.getGroupNumber("params");
+
+	for (size_t t = first; t < last; ++t) {
+		const ArenaString& templ = parse.templates[t];
+
+		// Invocations with markers are not cached, their text depends on the page
+		bool cacheable = ! memchr(templ.data(), '\x02', templ.length());
+		uint64_t hashvalue = 0;
+
+		if (cacheable) {
+			hashvalue = string_hash(templ.data(), templ.length());
+			shared_ptr<const MWTemplate> cached = TemplateCache::find(templ.data(), templ.length(), hashvalue);
+
+			if (cached) {
+				results->push_back(*cached);
+				continue;
+			}
+		}
+
+		match.clear();
+		if (! template_regex.matchAllOffsets(templ.data(), templ.length(), &match)) continue;
+
+		// Replace any markers in the name
+		expandMarkers(templ.data() + match[namegroup * 2], match[namegroup * 2 + 1] - match[namegroup * 2], parse.markers, &tmpl_name);
+
+		replace(tmpl_name.begin(), tmpl_name.end(), '_', ' ');
+		trimArenaString(&tmpl_name);
+		tmpl_name[0] = toupper(tmpl_name[0]);
+		if (tmpl_name.compare(0, 9, "Template:") == 0) {
+			tmpl_name.erase(0, 9);
+			trimArenaString(&tmpl_name);
+			tmpl_name[0] = toupper(tmpl_name[0]);
+		}
+
+		results->emplace_back(string(tmpl_name.data(), tmpl_name.length()), map<string, string>());
+		map<string, string>& tmpl_params = results->back().params;
+
+		if (match[paramsgroup * 2] >= 0) {
+			int numbered_param = 1;
+			const char *params = templ.data() + match[paramsgroup * 2];
+			const char *paramsend = templ.data() + match[paramsgroup * 2 + 1];
+
+			for (const char *param = params; ; ) {
+				const char *paramend = static_cast<const char *>(memchr(param, '|', paramsend - param));
+				if (! paramend) paramend = paramsend;
+				const char *equals = static_cast<const char *>(memchr(param, '=', paramend - param));
+
+				// = must be on same line as param name
+				if (equals && ! (equals > param && equals[-1] == '\n')) {
+					// Replace any markers in the name and content
+					expandMarkers(param, equals - param, parse.markers, &param_name);
+					expandMarkers(equals + 1, paramend - equals - 1, parse.markers, &param_value);
+				} else {
+					param_name.assign(digits, uint_to_chars(digits, numbered_param));
+					expandMarkers(param, paramend - param, parse.markers, &param_value);
+					++numbered_param;
+				}
+
+				trimArenaString(&param_name);
+				trimArenaString(&param_value);
+				if (param_name.length()) {
+					tmpl_params[string(param_name.data(), param_name.length())].assign(param_value.data(), param_value.length());
+				}
+
+				if (paramend == paramsend) break;
+				param = paramend + 1;
+			}
+		}
+
+		if (cacheable) TemplateCache::insert(templ.data(), templ.length(), hashvalue, results->back());
+	}
+}
+
+/**
+ * Run work(i) for segments 1 to count - 1 on their own threads, and for segment 0 on the calling thread.
+ */
+static void runSegments(size_t count, const function<void(size_t)>& work)
+{
+	vector<thread> workers;
+	for (size_t i = 1; i < count; ++i) workers.emplace_back(work, i);
+	work(0);
+	for (auto &worker : workers) worker.join();
+}
+
+/**
+ * Parse a large page as segments in parallel. The segment rescans are replayed in the order the page rescans would
+ * have done them, so the results are the same as parsing the page whole, including the scanBraces fallback after
+ * MAX_ITERATIONS rescans.
+ *
+ * @return false = not split, over the time budget or the segments did not parse like the whole page, parse it whole
+ */
+bool MWTemplateParamParser::parseSegments(vector<MWTemplate> *results, const ArenaString& data, PageArena *arena, PageParseStats *stats)
+{
+	int threads = pageThreads;
+	if (threads <= 0) threads = thread::hardware_concurrency();
+	if (threads <= 1) return false;
+
+	vector<size_t> starts;
+	findSegments(data.data(), data.length(), min((size_t)threads, data.length() / max(parallelPageSize / 4, (size_t)1)), &starts);
+	size_t count = starts.size() - 1;
+	if (count < 2) return false;
+
+	vector<SegmentResult> segments(count);
+	runSegments(count, [&](size_t i) {
+		PageArena segmentarena;
+		parseSegment(data.data() + starts[i], starts[i + 1] - starts[i], &segmentarena, &segments[i]);
+	});
+
+	double seconds = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (segments[i].exceeded) return false;
+		if (i) seconds += segments[i].seconds; // The calling thread's time is added by parseTemplates
+	}
+
+	// Nothing may match across the segment edges. A truncated segment still has matches, the page is over
+	// MAX_ITERATIONS rescans and finished by scanBraces below
+	bool truncated = false;
+	for (auto &segment : segments) truncated = truncated || segment.truncated;
+
+	if (! truncated) {
+		ArenaString joined(arena);
+		for (auto &segment : segments) joined.append(segment.data.data(), segment.data.length());
+
+		ArenaVector<int> matches(arena);
+		for (auto &regex : getThreadRegexs().ordered) {
+			if (regex.matchAllOffsets(joined.data(), joined.length(), &matches) || regex.isError()) return false;
+		}
+	}
+
+	// A page rescan runs the first regex that matches anywhere on every segment that it matches in,
+	// up to the first segment where it stops at nested content
+	vector<pair<size_t, size_t>> replay; // segment, iteration
+	vector<size_t> applied(count, 0); // Iterations replayed by segment
+	int rescans = 0;
+	bool limited = false;
+
+	for (;;) {
+		if (rescans == MAX_ITERATIONS) {
+			limited = true;
+			break;
+		}
+
+		int regex = INT_MAX;
+		for (size_t i = 0; i < count; ++i) {
+			if (applied[i] < segments[i].iterations.size()) regex = min(regex, segments[i].iterations[applied[i]].regex);
+		}
+		if (regex == INT_MAX) break;
+		++rescans;
+
+		for (size_t i = 0; i < count; ++i) {
+			if (applied[i] >= segments[i].iterations.size() || segments[i].iterations[applied[i]].regex != regex) continue;
+
+			replay.emplace_back(i, applied[i]);
+			if (segments[i].iterations[applied[i]++].descended) break;
+		}
+	}
+
+	if (! limited) {
+		for (auto &step : replay) {
+			vector<MWTemplate>& segmentresults = segments[step.first].results;
+			const vector<Iteration>& iterations = segments[step.first].iterations;
+			size_t first = step.second ? iterations[step.second - 1].resultsEnd : 0;
+			move(segmentresults.begin() + first, segmentresults.begin() + iterations[step.second].resultsEnd, back_inserter(*results));
+		}
+
+		if (stats) {
+			stats->iterations = rescans + 1;
+			stats->seconds = seconds;
+			stats->fallback = 0;
+		}
+
+		return true;
+	}
+
+	// Put the page back together as it was after the last allowed rescan, with the marker ids of each
+	// segment moved past the previous segments' ones, and finish it like parseTemplates does
+	vector<size_t> markerbase(count, 0);
+	for (size_t i = 1; i < count; ++i) {
+		markerbase[i] = markerbase[i - 1] + (applied[i - 1] ? segments[i - 1].iterations[applied[i - 1] - 1].markersEnd : 0);
+	}
+
+	vector<SegmentState> states(count);
+	runSegments(count, [&](size_t i) {
+		PageArena segmentarena;
+		rebuildSegment(data.data() + starts[i], starts[i + 1] - starts[i], applied[i], markerbase[i], &segmentarena, &states[i]);
+	});
+
+	PageParse parse(arena);
+	ArenaString pagedata(arena);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (! states[i].complete) return false;
+		if (i) seconds += states[i].seconds;
+		pagedata.append(states[i].data.data(), states[i].data.length());
+		for (auto &marker : states[i].markers) parse.markers.emplace_back(marker.data(), marker.length(), arena);
+	}
+
+	for (auto &step : replay) {
+		const vector<Iteration>& iterations = segments[step.first].iterations;
+		size_t first = step.second ? iterations[step.second - 1].templatesEnd : 0;
+
+		for (size_t t = first; t < iterations[step.second].templatesEnd; ++t) {
+			const string& templ = states[step.first].templates[t];
+			parse.templates.emplace_back(templ.data(), templ.length(), arena);
+		}
+	}
+
+	scanBraces(pagedata, &parse);
+	addTemplates(results, parse, 0, parse.templates.size());
+
+	if (stats) {
+		stats->iterations = MAX_ITERATIONS;
+		stats->seconds = seconds;
+		stats->fallback = "iterations";
+	}
+
+	return true;
+}
+
+/**
+ * Segment worker, rescans the segment and parses its templates a rescan at a time.
+ */
+void MWTemplateParamParser::parseSegment(const char *text, size_t length, PageArena *arena, SegmentResult *result)
+{
+	double starttime = threadSeconds();
+	PageParse parse(arena);
+	if (maxPageSeconds > 0) parse.budget.deadline = starttime + maxPageSeconds;
+
+	// A page rescan replays at most one rescan of each segment, so a segment stopped at MAX_ITERATIONS is enough
+	// for the page to reach MAX_ITERATIONS in parseSegments
+	ArenaString data(text, length, arena);
+	bool complete = rescan(&data, &parse, MAX_ITERATIONS);
+	result->truncated = ! complete && strcmp(parse.budget.exceeded, "iterations") == 0;
+
+	if (complete || result->truncated) {
+		size_t first = 0;
+
+		for (auto &iteration : parse.iterations) {
+			addTemplates(&result->results, parse, first, iteration.templatesEnd);
+			first = iteration.templatesEnd;
+			iteration.resultsEnd = result->results.size();
+		}
+
+		result->iterations.assign(parse.iterations.begin(), parse.iterations.end());
+		result->data.assign(data.data(), data.length());
+	}
+
+	if (! result->truncated) result->exceeded = parse.budget.exceeded;
+	result->seconds = threadSeconds() - starttime;
+}
+
+/**
+ * Segment worker, redoes the first iterations rescans of the segment. The text, templates and markers are copied
+ * out with markerbase added to the marker ids.
+ */
+void MWTemplateParamParser::rebuildSegment(const char *text, size_t length, size_t iterations, size_t markerbase, PageArena *arena,
+	SegmentState *state)
+{
+	double starttime = threadSeconds();
+	PageParse parse(arena);
+	if (maxPageSeconds > 0) parse.budget.deadline = starttime + maxPageSeconds;
+
+	ArenaString data(text, length, arena);
+	rescan(&data, &parse, iterations);
+	state->complete = parse.iterations.size() == iterations && (! parse.budget.exceeded || strcmp(parse.budget.exceeded, "iterations") == 0);
+
+	if (state->complete) {
+		shiftMarkers(data.data(), data.length(), markerbase, &state->data);
+		state->templates.resize(parse.templates.size());
+		for (size_t t = 0; t < parse.templates.size(); ++t) {
+			shiftMarkers(parse.templates[t].data(), parse.templates[t].length(), markerbase, &state->templates[t]);
+		}
+		for (auto &marker : parse.markers) state->markers.emplace_back(marker.data(), marker.length());
+	}
+
+	state->seconds = threadSeconds() - starttime;
+}
+
+/**
+ * Copy text to dest with shift added to the marker ids.
+ */
+void MWTemplateParamParser::shiftMarkers(const char *text, size_t length, size_t shift, string *dest)
+{
+	dest->assign(text, length);
+	if (! shift) return;
+
+	char *ptr = &(*dest)[0];
+	char *end = ptr + length;
+	size_t id;
+
+	while ((ptr = static_cast<char *>(memchr(ptr, '\x02', end - ptr))) != NULL) {
+		if (end - ptr >= MARKER_LENGTH && parseMarker(ptr, &id)) {
+			formatMarker(id + shift, ptr);
+			ptr += MARKER_LENGTH;
+		} else {
+			++ptr;
+		}
+	}
+}
+
+/**
+ * Length of the html tag at tag, 0 = not a tag. Tags longer than MAX_TAG_LENGTH are not recognized so the scan stays linear.
+ */
+static size_t scanTag(const char *tag, size_t avail, bool *closing, const char **name, size_t *namelen)
+{
+	static const size_t MAX_TAG_LENGTH = 512;
+	const char *end = tag + min(avail, MAX_TAG_LENGTH);
+	const char *p = tag + 1;
+
+	while (p < end && isspace((unsigned char)*p)) ++p;
+	*closing = p < end && *p == '/';
+	if (*closing) ++p;
+	while (p < end && isspace((unsigned char)*p)) ++p;
+
+	*name = p;
+	while (p < end && (isalnum((unsigned char)*p) || *p == '_')) ++p;
+	*namelen = p - *name;
+	if (! *namelen) return 0;
+
+	const char *gt = static_cast<const char *>(memchr(p, '>', end - p));
+	return gt ? gt + 1 - tag : 0;
+}
+
+/**
+ * Split points for parseSegments, at most count segments. Segments start at line starts outside any template,
+ * passed param, table, link or html element, so no regex match spans two segments. Fewer segments if there are
+ * not enough such lines, ie. after an unclosed html element.
+ */
+void MWTemplateParamParser::findSegments(const char *text, size_t length, size_t count, vector<size_t> *starts)
+{
+	starts->assign(1, 0);
+	int braces = 0;
+	int links = 0;
+	vector<pair<const char *, size_t>> opentags; // html elements not closed yet
+	bool closingtag;
+	const char *tagname;
+	size_t tagnamelen;
+	size_t target = length / max(count, (size_t)1);
+
+	for (size_t i = 0; i < length && starts->size() < count; ++i) {
+		char c = text[i];
+
+		if (c == '{') {
+			++braces;
+		} else if (c == '}') {
+			if (braces) --braces;
+		} else if (c == '[' && i + 1 < length && text[i + 1] == '[') {
+			++links;
+			++i;
+		} else if (c == ']' && i + 1 < length && text[i + 1] == ']') {
+			if (links) --links;
+			++i;
+		} else if (c == '<') {
+			size_t taglen = scanTag(text + i, length - i, &closingtag, &tagname, &tagnamelen);
+			if (! taglen) continue;
+
+			if (closingtag) {
+				for (auto it = opentags.rbegin(); it != opentags.rend(); ++it) {
+					if (it->second == tagnamelen && memcmp(it->first, tagname, tagnamelen) == 0) {
+						opentags.erase(next(it).base());
+						break;
+					}
+				}
+			} else if (text[i + taglen - 2] != '/') {
+				opentags.emplace_back(tagname, tagnamelen);
+			}
+
+			i += taglen - 1;
+		} else if (c == '\n' && i + 1 >= target && ! braces && ! links && opentags.empty() && i + 1 < length) {
+			starts->push_back(i + 1);
+			target = length / count * starts->size();
+		}
+	}
+
+	starts->push_back(length);
+}
+
+/**
+ * Budget fallback, one linear pass over data. Passed params, templates, tables, links and html elements are replaced
+ * by markers innermost first like the regexes do. Openers without a matching closer are left as text.
+ */
+void MWTemplateParamParser::scanBraces(const ArenaString& data, PageParse *parse)
+{
+	PageArena *arena = parse->arena;
+	MarkerTable *markers = &parse->markers;
+	ArenaVector<ArenaString> *templates = &parse->templates;
+	enum { PASSED_PARAM, TEMPLATE, TABLE, LINK, HTML, FRAME_TYPES };
+	struct Frame {
+		int type;
+		size_t start; // in out
+		const char *name; // HTML tag name
+		size_t namelen;
+	};
+
+	ArenaVector<Frame> frames(arena);
+	int opened[FRAME_TYPES] = {0};
+	ArenaString out(arena);
+	char marker_id[MARKER_LENGTH];
+	const char *text = data.data();
+	size_t length = data.length();
+	bool closingtag;
+	const char *tagname = 0;
+	size_t tagnamelen = 0;
+	out.reserve(length);
+
+	for (size_t i = 0; i < length; ) {
+		char c = text[i];
+		char next = i + 1 < length ? text[i + 1] : 0;
+		bool third = i + 2 < length && text[i + 2] == c;
+		int opens = -1;
+		int closes = -1;
+		bool stub = false;
+		size_t width = 2;
+
+		if (c == '{' && next == '{') {
+			opens = third ? PASSED_PARAM : TEMPLATE;
+			if (third) width = 3;
+		} else if (c == '{' && next == '|') {
+			opens = TABLE;
+		} else if (c == '[' && next == '[') {
+			opens = LINK;
+		} else if (c == '<' && (width = scanTag(text + i, length - i, &closingtag, &tagname, &tagnamelen))) {
+			if (closingtag) {
+				if (! frames.empty() && frames.back().type == HTML && frames.back().namelen == tagnamelen
+					&& memcmp(frames.back().name, tagname, tagnamelen) == 0) closes = HTML;
+			} else if (text[i + width - 2] == '/') {
+				stub = true;
+				closes = HTML;
+			} else {
+				opens = HTML;
+			}
+		} else if (! frames.empty()) {
+			int wanted = -1;
+			if (c == '}' && next == '}') wanted = third && frames.back().type == PASSED_PARAM ? PASSED_PARAM : TEMPLATE;
+			else if (c == '|' && next == '}') wanted = TABLE;
+			else if (c == ']' && next == ']') wanted = LINK;
+
+			if (wanted >= 0 && opened[wanted]) {
+				// Unclosed elements inside are text
+				while (frames.back().type == HTML) {
+					--opened[HTML];
+					frames.pop_back();
+				}
+				if (frames.back().type == wanted) closes = wanted;
+				if (closes == PASSED_PARAM) width = 3;
+			}
+		}
+
+		if (opens >= 0) {
+			frames.push_back({opens, out.length(), tagname, tagnamelen});
+			++opened[opens];
+			out.append(text + i, width);
+		} else if (closes >= 0) {
+			size_t start = out.length();
+			if (! stub) {
+				start = frames.back().start;
+				--opened[closes];
+				frames.pop_back();
+			}
+			out.append(text + i, width);
+
+			ArenaString content(out.data() + start, out.length() - start, arena);
+			if (closes == TEMPLATE) templates->push_back(content);
+
+			ArenaString expanded(arena);
+			expandMarkers(content.data(), content.length(), *markers, &expanded);
+			formatMarker(markers->size(), marker_id);
+			markers->push_back(move(expanded));
+
+			out.resize(start);
+			out.append(marker_id, MARKER_LENGTH);
+		} else {
+			out.push_back(c);
+			width = 1;
+		}
+
+		i += width;
+	}
+}
+
+/**
+ * @return true = over budget, exceeded is set
+ */
+bool MWTemplateParamParser::ParseBudget::exhausted()
+{
+	if (exceeded) return true;
+	if (deadline > 0 && threadSeconds() > deadline) exceeded = "time";
+	return exceeded != 0;
+}
+
+/**
+ * @return Cpu time of the calling thread
+ */
+double MWTemplateParamParser::threadSeconds()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * PhpPreg::replace on an arena string.
+ */
+void MWTemplateParamParser::replaceMatches(PhpPreg& regex, ArenaString *data, const char *replacement, PageArena *arena)
+{
+	ArenaVector<int> matches(arena);
+	int match_cnt = regex.matchAllOffsets(data->data(), data->length(), &matches);
+	if (! match_cnt) return;
+
+	int capcount = regex.getCaptureCount();
+	ArenaString replaced(arena);
+	replaced.reserve(data->length());
+	int lastPos = 0;
+
+	for (int m = 0; m < match_cnt; ++m) {
+		const int *match = &matches[m * capcount * 2];
+		replaced.append(*data, lastPos, match[0] - lastPos);
+		replaced += replacement;
+		lastPos = match[1];
+	}
+
+	replaced.append(*data, lastPos, ArenaString::npos);
+	data->swap(replaced);
+}
+
+/**
+ * Write the MARKER_LENGTH bytes of the marker for id to dest.
+ */
+void MWTemplateParamParser::formatMarker(size_t id, char *dest)
+{
+	static const char *hexdigits = "0123456789abcdef";
+	dest[0] = '\x02';
+	for (int i = MARKER_DIGITS; i > 0; --i) {
+		dest[i] = hexdigits[id & 0xf];
+		id >>= 4;
+	}
+	dest[MARKER_LENGTH - 1] = '\x03';
+}
+
+/**
+ * @param marker Text starting with \x02, at least MARKER_LENGTH bytes
+ * @param id Marker id
+ * @return false = not a marker
+ */
+bool MWTemplateParamParser::parseMarker(const char *marker, size_t *id)
+{
+	if (marker[MARKER_LENGTH - 1] != '\x03') return false;
+	*id = 0;
+
+	for (int i = 1; i <= MARKER_DIGITS; ++i) {
+		char c = marker[i];
+		if (c >= '0' && c <= '9') *id = (*id << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f') *id = (*id << 4) | (c - 'a' + 10);
+		else return false;
+	}
+
+	return true;
+}
+
+/**
+ * Copy text to dest with the markers replaced by their content, in one pass.
+ * Marker content is stored expanded, so it is spliced in as is.
+ */
+void MWTemplateParamParser::expandMarkers(const char *text, size_t length, const MarkerTable& markers, ArenaString *dest)
+{
+	const char *end = text + length;
+	const char *marker = static_cast<const char *>(memchr(text, '\x02', length));
+	if (! marker) {
+		dest->assign(text, length);
+		return;
+	}
+
+	dest->clear();
+	dest->reserve(length);
+	size_t id;
+
+	while (marker) {
+		dest->append(text, marker - text);
+
+		if (end - marker >= MARKER_LENGTH && parseMarker(marker, &id) && id < markers.size()) {
+			dest->append(markers[id]);
+			text = marker + MARKER_LENGTH;
+		} else {
+			dest->push_back(*marker);
+			text = marker + 1;
+		}
+
+		marker = static_cast<const char *>(memchr(text, '\x02', end - text));
+	}
+
+	dest->append(text, end - text);
+}
 
 } /* namespace phppreg */
@@ -20,28 +20,154 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include "MWTemplate.h"
 #include "PhpPreg.h"
+#include "PageArena.h"
 
 namespace phppreg {
 
+/**
+ * Work spent by getTemplates on one page.
+ */
+struct PageParseStats
+{
+	int iterations = 0; // Rescans of the page
+	double seconds = 0; // Thread cpu time
+	const char *fallback = 0; // Budget exceeded ("iterations", "time", "match error"), the rest was extracted by scanBraces
+};
+
 class MWTemplateParamParser
 {
 public:
 	MWTemplateParamParser() {}
-	static void getTemplates(std::vector<MWTemplate> *templates, const std::string& origdata);
+
+	/**
+	 * @param arena Arena for the parse temporaries, reset before returning. 0 = the calling thread's arena
+	 * @param stats Work spent on the page, 0 = not wanted
+	 */
+	static void getTemplates(std::vector<MWTemplate> *templates, const std::string& origdata, PageArena *arena = 0, PageParseStats *stats = 0);
 	virtual ~MWTemplateParamParser() {}
 
 	static std::map<std::string, PhpPreg> regexs;
 	static std::vector<std::string> regexs_ordered;
 	const static int MAX_ITERATIONS;
+	static double maxPageSeconds; // Thread cpu time budget per page, 0 = no limit
+	static size_t parallelPageSize; // Pages this size or larger are split into segments parsed in parallel, 0 = never
+	static int pageThreads; // Threads for a split page, <= 0 = hardware concurrency
 	static PhpPreg COMMENT_REGEX;
-	static PhpPreg MARKER_REGEX;
 	static PhpPreg NOWIKI_REGEX;
 	static PhpPreg BR_REGEX;
 
 protected:
-	static bool _getTemplates(std::string *data, std::map<std::string, std::string> *markers, std::vector<std::string> *templates, int start, int length);
+	/**
+	 * Marker content indexed by marker id, already expanded
+	 */
+	typedef ArenaVector<ArenaString> MarkerTable;
+
+	/**
+	 * Markers are \x02, MARKER_DIGITS hex digits of the id, \x03
+	 */
+	static const int MARKER_DIGITS = 8;
+	static const int MARKER_LENGTH = MARKER_DIGITS + 2;
+
+	/**
+	 * Per page work budget, checked before each regex scan and between its matches
+	 */
+	struct ParseBudget
+	{
+		double deadline = 0; // Thread cpu time, 0 = no limit
+		const char *exceeded = 0;
+
+		bool exhausted();
+		static bool exhausted(void *budget) { return ((ParseBudget *)budget)->exhausted(); } // PhpPreg::StopFunc
+	};
+
+	/**
+	 * Per thread copies of the regexs. The copies share the compiled patterns and use the thread's match resources,
+	 * only the error state is their own.
+	 */
+	struct ThreadRegexs
+	{
+		std::vector<PhpPreg> ordered; // regexs_ordered
+		std::vector<int> contentGroups;
+		size_t templateRegex = 0; // in ordered
+		PhpPreg comment;
+		PhpPreg nowiki;
+		PhpPreg br;
+
+		ThreadRegexs();
+	};
+
+	/**
+	 * One rescan of a page or segment that changed it
+	 */
+	struct Iteration
+	{
+		int regex = -1; // in regexs_ordered, the first one that matched
+		bool descended = false; // Stopped at a match with nested content
+		size_t templatesEnd = 0; // templates size after the rescan
+		size_t markersEnd = 0; // markers size after the rescan
+		size_t resultsEnd = 0; // Segment results size after the rescan
+	};
+
+	/**
+	 * Rescan loop state of a page or segment
+	 */
+	struct PageParse
+	{
+		PageArena *arena;
+		ThreadRegexs& regexs;
+		MarkerTable markers;
+		ArenaVector<ArenaString> templates;
+		ArenaVector<Iteration> iterations;
+		std::deque<ArenaVector<int>, ArenaAllocator<ArenaVector<int>>> matches; // by _getTemplates depth, reused by every rescan
+		ParseBudget budget;
+
+		PageParse(PageArena *arena);
+	};
+
+	/**
+	 * Worker output for a segment of a split page
+	 */
+	struct SegmentResult
+	{
+		std::vector<MWTemplate> results;
+		std::vector<Iteration> iterations;
+		std::string data; // Segment text after the rescans
+		double seconds = 0;
+		const char *exceeded = 0; // Over the time budget or a match error
+		bool truncated = false; // Stopped at MAX_ITERATIONS rescans
+	};
+
+	/**
+	 * A segment of a split page after some rescans, with the marker ids moved for the whole page
+	 */
+	struct SegmentState
+	{
+		std::string data;
+		std::vector<std::string> templates;
+		std::vector<std::string> markers;
+		double seconds = 0;
+		bool complete = false; // false = over budget
+	};
+
+	static ThreadRegexs& getThreadRegexs();
+	static void parseTemplates(std::vector<MWTemplate> *templates, const std::string& origdata, PageArena *arena, PageParseStats *stats);
+	static bool rescan(ArenaString *data, PageParse *parse, size_t maxiterations = MAX_ITERATIONS);
+	static bool _getTemplates(ArenaString *data, PageParse *parse, int start, int length, size_t depth, Iteration *iteration);
+	static void addTemplates(std::vector<MWTemplate> *results, const PageParse& parse, size_t first, size_t last);
+	static bool parseSegments(std::vector<MWTemplate> *results, const ArenaString& data, PageArena *arena, PageParseStats *stats);
+	static void parseSegment(const char *text, size_t length, PageArena *arena, SegmentResult *result);
+	static void rebuildSegment(const char *text, size_t length, size_t iterations, size_t markerbase, PageArena *arena, SegmentState *state);
+	static void shiftMarkers(const char *text, size_t length, size_t shift, std::string *dest);
+	static void findSegments(const char *text, size_t length, size_t count, std::vector<size_t> *starts);
+	static void scanBraces(const ArenaString& data, PageParse *parse);
+	static double threadSeconds();
+	static void replaceMatches(PhpPreg& regex, ArenaString *data, const char *replacement, PageArena *arena);
+	static void formatMarker(size_t id, char *dest);
+	static bool parseMarker(const char *marker, size_t *id);
+	static void expandMarkers(const char *text, size_t length, const MarkerTable& markers, ArenaString *dest);
 };
 
 } /* namespace phppreg */
@@ -0,0 +1,61 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace phppreg {
+
+bool MappedFile::open(const string& path, int advice)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	if (st.st_size > 0) {
+		void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			::close(fd);
+			return false;
+		}
+
+		if (advice) madvise(mapped, st.st_size, advice);
+
+		addr = (const char *)mapped;
+		length = st.st_size;
+	}
+
+	::close(fd);
+
+	return true;
+}
+
+MappedFile::~MappedFile()
+{
+	if (addr) munmap((void *)addr, length);
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,57 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <string>
+
+namespace phppreg {
+
+/**
+ * Read only mmap of a whole file.
+ */
+class MappedFile
+{
+public:
+	MappedFile() {}
+
+	/**
+	 * Map a file. An empty file maps to 0 length data.
+	 *
+	 * @param path File path
+	 * @param advice madvise advice for the mapping, ie. MADV_SEQUENTIAL, 0 = MADV_NORMAL
+	 * @return false = open or mmap failed
+	 */
+	bool open(const std::string& path, int advice = 0);
+
+	const char *data() const { return addr; }
+	size_t size() const { return length; }
+
+	virtual ~MappedFile();
+
+protected:
+	const char *addr = 0;
+	size_t length = 0;
+
+private:
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator= (const MappedFile& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* MAPPEDFILE_H_ */
@@ -0,0 +1,196 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "OffsetsScanner.h"
+#include "string_util.h"
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+
+using namespace std;
+
+namespace phppreg {
+
+void OffsetsScanner::scan(const char *data, size_t length, long long baseoffset, vector<TemplateRange> *ranges,
+	vector<PageIndexEntry> *pages)
+{
+	const char *ptr = data;
+	const char *end = data + length;
+	TemplateRange *current = ranges->empty() ? 0 : &ranges->back();
+
+	while (ptr < end) {
+		// memchr is the vectorized newline search
+		const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+		const char *next = eol ? eol + 1 : end;
+
+		if (*ptr != '\n') {
+			unsigned long tmplid = 0;
+			const char *digit = ptr;
+			for (; digit < next && *digit >= '0' && *digit <= '9'; ++digit) {
+				tmplid = tmplid * 10 + (*digit - '0');
+			}
+
+			if (pages) {
+				uint32_t pageid = 0;
+				if (digit < next && *digit == '\t') {
+					for (++digit; digit < next && *digit >= '0' && *digit <= '9'; ++digit) {
+						pageid = pageid * 10 + (*digit - '0');
+					}
+				}
+
+				if (pages->empty() || pages->back().pageid != pageid || pages->back().tmplid != tmplid) {
+					PageIndexEntry entry;
+					entry.pageid = pageid;
+					entry.tmplid = tmplid;
+					entry.offset = baseoffset + (ptr - data);
+					pages->push_back(entry);
+				}
+			}
+
+			if (! current || tmplid != current->tmplid) {
+				TemplateRange range;
+				range.tmplid = tmplid;
+				range.offset = baseoffset + (ptr - data);
+				range.rows = 0;
+				range.length = 0;
+				ranges->push_back(range);
+				current = &ranges->back();
+			}
+
+			++current->rows;
+		}
+
+		if (current) current->length = baseoffset + (next - data) - current->offset;
+		ptr = next;
+	}
+}
+
+void OffsetsScanner::append(vector<TemplateRange> *ranges, const vector<TemplateRange>& more)
+{
+	if (more.empty()) return;
+
+	auto it = more.begin();
+
+	if (! ranges->empty() && ranges->back().tmplid == it->tmplid) {
+		ranges->back().rows += it->rows;
+		ranges->back().length = it->offset + it->length - ranges->back().offset;
+		++it;
+	}
+
+	ranges->insert(ranges->end(), it, more.end());
+}
+
+void OffsetsScanner::append(vector<PageIndexEntry> *pages, const vector<PageIndexEntry>& more)
+{
+	if (more.empty()) return;
+
+	auto it = more.begin();
+	if (! pages->empty() && pages->back().pageid == it->pageid && pages->back().tmplid == it->tmplid) ++it;
+
+	pages->insert(pages->end(), it, more.end());
+}
+
+void OffsetsScanner::scanParallel(const char *data, size_t length, int threads, vector<TemplateRange> *ranges,
+	vector<PageIndexEntry> *pages)
+{
+	if (threads <= 0) threads = thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+
+	size_t chunkcnt = min((size_t)threads, length / MIN_CHUNK_SIZE + 1);
+
+	// Chunk edges are moved to the next line start
+	vector<size_t> starts(1, 0);
+	for (size_t i = 1; i < chunkcnt; ++i) {
+		size_t start = max(length / chunkcnt * i, starts.back());
+		const char *eol = (const char *)memchr(data + start, '\n', length - start);
+		start = eol ? eol + 1 - data : length;
+		starts.push_back(start);
+	}
+	starts.push_back(length);
+
+	vector<vector<TemplateRange>> chunkranges(chunkcnt);
+	vector<vector<PageIndexEntry>> chunkpages(chunkcnt);
+	vector<thread> workers;
+
+	for (size_t i = 1; i < chunkcnt; ++i) {
+		workers.emplace_back([&, i]() {
+			scan(data + starts[i], starts[i + 1] - starts[i], starts[i], &chunkranges[i], pages ? &chunkpages[i] : 0);
+		});
+	}
+
+	scan(data, starts[1], 0, &chunkranges[0], pages ? &chunkpages[0] : 0);
+
+	for (auto &worker : workers) worker.join();
+
+	for (auto &chunk : chunkranges) append(ranges, chunk);
+
+	if (pages) {
+		for (auto &chunk : chunkpages) append(pages, chunk);
+	}
+}
+
+bool OffsetsScanner::readOffsets(const char *data, size_t length, const char *params, size_t paramslength,
+	vector<TemplateRange> *ranges, string *errmsg)
+{
+	const char *ptr = data;
+	const char *end = data + length;
+	size_t first = ranges->size();
+	vector<string> pieces;
+	string line;
+
+	while (ptr < end) {
+		const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+		if (! eol) eol = end;
+		line.assign(ptr, eol - ptr);
+		ptr = eol + 1;
+		if (line.empty()) continue;
+
+		string_split(line, "\t", &pieces);
+		if (pieces.size() != 2 && pieces.size() != 4) {
+			*errmsg = "unsupported offsets line (BGZF offsets?): " + line;
+			return false;
+		}
+
+		TemplateRange range;
+		range.tmplid = strtoul(pieces[0].c_str(), NULL, 10);
+		range.offset = llabs(atoll(pieces[1].c_str()));
+		range.rows = (pieces.size() == 4) ? atoll(pieces[2].c_str()) : -1;
+		range.length = (pieces.size() == 4) ? atoll(pieces[3].c_str()) : -1;
+
+		// The range must start at a row of the template
+		string rowprefix = pieces[0] + "\t";
+		if (range.offset + max(range.length, 0LL) > (long long)paramslength
+			|| (range.offset > 0 && params[range.offset - 1] != '\n')
+			|| paramslength - range.offset < rowprefix.length()
+			|| memcmp(params + range.offset, rowprefix.data(), rowprefix.length()) != 0) {
+			*errmsg = "offsets don't match the params file: " + line;
+			return false;
+		}
+
+		ranges->push_back(range);
+	}
+
+	for (size_t i = first; i < ranges->size(); ++i) {
+		TemplateRange& range = (*ranges)[i];
+		if (range.length >= 0) continue;
+		long long next = (i + 1 < ranges->size()) ? (*ranges)[i + 1].offset : paramslength;
+		range.length = next - range.offset;
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
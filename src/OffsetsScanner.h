@@ -0,0 +1,96 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef OFFSETSSCANNER_H_
+#define OFFSETSSCANNER_H_
+
+#include <string>
+#include <vector>
+#include "PageIndex.h"
+
+namespace phppreg {
+
+/**
+ * Rows of one template in a sorted params file.
+ */
+struct TemplateRange {
+	unsigned long tmplid;
+	long long offset;
+	long long rows;
+	long long length; // bytes, including any empty lines up to the next template
+};
+
+/**
+ * Finds the template ranges of a sorted params file. Only the leading template id of a row is parsed.
+ */
+class OffsetsScanner
+{
+public:
+	/**
+	 * Scan whole lines.
+	 *
+	 * @param data Rows, starting at a line start
+	 * @param length Length
+	 * @param baseoffset File offset of data
+	 * @param ranges Ranges are appended, the first range is merged with the last range if the template is the same
+	 * @param pages Page index entries are appended if not 0, one per run of rows with the same template and page id
+	 */
+	static void scan(const char *data, size_t length, long long baseoffset, std::vector<TemplateRange> *ranges,
+		std::vector<PageIndexEntry> *pages = 0);
+
+	/**
+	 * Scan in parallel chunks split at line starts. The ranges of a template spanning chunks are merged.
+	 *
+	 * @param data Rows
+	 * @param length Length
+	 * @param threads Threads, 0 = hardware concurrency
+	 * @param ranges Ranges are appended
+	 * @param pages Page index entries are appended if not 0
+	 */
+	static void scanParallel(const char *data, size_t length, int threads, std::vector<TemplateRange> *ranges,
+		std::vector<PageIndexEntry> *pages = 0);
+
+	/**
+	 * Append ranges, merging the edge ranges if the template is the same.
+	 */
+	static void append(std::vector<TemplateRange> *ranges, const std::vector<TemplateRange>& more);
+
+	/**
+	 * Append page index entries, dropping the first if it continues the last run.
+	 */
+	static void append(std::vector<PageIndexEntry> *pages, const std::vector<PageIndexEntry>& more);
+
+	/**
+	 * Read an offsets file: template id, [-]offset, row count, byte length, or just template id, [-]offset.
+	 * Two column ranges end at the next template, their row count is -1.
+	 *
+	 * @param data Offsets file
+	 * @param length Length
+	 * @param params Sorted params file the offsets are checked against
+	 * @param paramslength Params file length
+	 * @param ranges Ranges are appended, excludelisted templates have positive offsets
+	 * @param errmsg Error message
+	 * @return false = malformed offsets, BGZF offsets, or offsets not matching the params file
+	 */
+	static bool readOffsets(const char *data, size_t length, const char *params, size_t paramslength,
+		std::vector<TemplateRange> *ranges, std::string *errmsg);
+
+	static const size_t MIN_CHUNK_SIZE = 16 * 1024 * 1024;
+};
+
+} /* namespace phppreg */
+
+#endif /* OFFSETSSCANNER_H_ */
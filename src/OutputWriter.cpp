@@ -0,0 +1,111 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "OutputWriter.h"
+#include <iostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace phppreg {
+
+OutputWriter::OutputWriter(int fd, bool closefd, size_t buffersize)
+	: fd(fd), closefd(closefd)
+{
+	buffer = new char[buffersize];
+	bufptr = buffer;
+	bufend = buffer + buffersize;
+}
+
+OutputWriter::OutputWriter(ostream *stream, size_t buffersize)
+	: stream(stream)
+{
+	buffer = new char[buffersize];
+	bufptr = buffer;
+	bufend = buffer + buffersize;
+}
+
+OutputWriter *OutputWriter::open(const string& path)
+{
+	if (path == "-") {
+		cout.flush();
+		return new OutputWriter(STDOUT_FILENO, false);
+	}
+
+	int fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0) return 0;
+
+	return new OutputWriter(fd, true);
+}
+
+void OutputWriter::writeSlow(const char *data, size_t length)
+{
+	flush();
+
+	// Large writes bypass the buffer
+	if (length >= (size_t)(bufend - buffer)) {
+		if (! writeAll(data, length)) failed = true;
+		flushed += length;
+		return;
+	}
+
+	memcpy(bufptr, data, length);
+	bufptr += length;
+}
+
+bool OutputWriter::flush()
+{
+	size_t length = bufptr - buffer;
+	if (length == 0) return ! failed;
+
+	if (! writeAll(buffer, length)) failed = true;
+	flushed += length;
+	bufptr = buffer;
+
+	return ! failed;
+}
+
+bool OutputWriter::writeAll(const char *data, size_t length)
+{
+	if (stream) {
+		stream->write(data, length);
+		return ! stream->fail();
+	}
+
+	while (length) {
+		ssize_t written = ::write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		data += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+OutputWriter::~OutputWriter()
+{
+	flush();
+	if (closefd) ::close(fd);
+	delete[] buffer;
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,133 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef OUTPUTWRITER_H_
+#define OUTPUTWRITER_H_
+
+#include <string>
+#include <ostream>
+#include <cstring>
+#include "string_util.h"
+
+namespace phppreg {
+
+/**
+ * Buffered output file writer. Output is collected in a large owned buffer and written with
+ * write(2), or to an ostream (used by the tests).
+ */
+class OutputWriter
+{
+public:
+	static const size_t DEFAULT_BUFFER_SIZE = 4 * 1024 * 1024;
+
+	/**
+	 * constructor
+	 *
+	 * @param fd File descriptor to write to
+	 * @param closefd Close the descriptor in the destructor
+	 * @param buffersize Output buffer size
+	 */
+	OutputWriter(int fd, bool closefd, size_t buffersize = DEFAULT_BUFFER_SIZE);
+
+	/**
+	 * constructor
+	 *
+	 * @param stream Stream to write to
+	 * @param buffersize Output buffer size
+	 */
+	OutputWriter(std::ostream *stream, size_t buffersize = DEFAULT_BUFFER_SIZE);
+
+	/**
+	 * Open an output file, "-" = stdout.
+	 *
+	 * @param path File path
+	 * @return writer, 0 = open failed
+	 */
+	static OutputWriter *open(const std::string& path);
+
+	void write(const char *data, size_t length)
+	{
+		if (length > (size_t)(bufend - bufptr)) {
+			writeSlow(data, length);
+			return;
+		}
+
+		memcpy(bufptr, data, length);
+		bufptr += length;
+	}
+
+	void write(const std::string& data) { write(data.data(), data.length()); }
+
+	void put(char c)
+	{
+		if (bufptr == bufend) flush();
+		*bufptr++ = c;
+	}
+
+	void writeUInt(unsigned long long value)
+	{
+		if (bufend - bufptr < 20) flush();
+		bufptr += uint_to_chars(bufptr, value);
+	}
+
+	void writeInt(long long value)
+	{
+		if (value < 0) {
+			put('-');
+			writeUInt(0ULL - (unsigned long long)value);
+		} else {
+			writeUInt(value);
+		}
+	}
+
+	/**
+	 * Write out the buffer.
+	 *
+	 * @return false = write failed
+	 */
+	bool flush();
+
+	bool fail() const { return failed; }
+
+	/**
+	 * @return Total bytes written, including the buffered bytes
+	 */
+	long long tellp() const { return flushed + (bufptr - buffer); }
+
+	virtual ~OutputWriter();
+
+protected:
+	int fd = -1;
+	bool closefd = false;
+	std::ostream *stream = 0;
+	char *buffer;
+	char *bufptr;
+	char *bufend;
+	long long flushed = 0;
+	bool failed = false;
+
+	void writeSlow(const char *data, size_t length);
+	bool writeAll(const char *data, size_t length);
+
+private:
+	OutputWriter() = delete;
+	OutputWriter(const OutputWriter& other) = delete;
+	OutputWriter& operator= (const OutputWriter& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* OUTPUTWRITER_H_ */
@@ -0,0 +1,69 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "PageArena.h"
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace phppreg {
+
+const size_t PageArena::CHUNK_SIZE;
+const size_t PageArena::RETAIN_SIZE;
+
+void *PageArena::allocateSlow(size_t size, size_t alignment)
+{
+	// Next kept chunk that fits, else a new one
+	while (++current < chunks.size()) {
+		if (size + alignment <= chunks[current].size) break;
+	}
+
+	if (current >= chunks.size()) {
+		Chunk chunk;
+		chunk.size = max(CHUNK_SIZE, size + alignment);
+		chunk.data = static_cast<char *>(malloc(chunk.size));
+		if (! chunk.data) throw bad_alloc();
+		chunks.push_back(chunk);
+		capacity += chunk.size;
+		current = chunks.size() - 1;
+	}
+
+	offset = 0;
+	return allocate(size, alignment);
+}
+
+void PageArena::reset()
+{
+	if (capacity > RETAIN_SIZE) {
+		while (chunks.size() > 1 && capacity > RETAIN_SIZE) {
+			capacity -= chunks.back().size;
+			free(chunks.back().data);
+			chunks.pop_back();
+		}
+	}
+
+	current = 0;
+	offset = 0;
+	bytesused = 0;
+}
+
+PageArena::~PageArena()
+{
+	for (auto &chunk : chunks) free(chunk.data);
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,114 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PAGEARENA_H_
+#define PAGEARENA_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace phppreg {
+
+/**
+ * Monotonic allocator for the temporaries of parsing one page. Allocations are carved out of chunks
+ * and never freed one by one, reset() makes all the memory reusable in O(1) for the next page.
+ * Not thread safe, use one arena per thread.
+ */
+class PageArena
+{
+public:
+	static const size_t CHUNK_SIZE = 256 * 1024;
+	static const size_t RETAIN_SIZE = 64 * 1024 * 1024; // Chunks above this are freed by reset()
+
+	PageArena() {}
+
+	void *allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+	{
+		size_t pos = (offset + alignment - 1) & ~(alignment - 1);
+		if (current < chunks.size() && pos + size <= chunks[current].size) {
+			offset = pos + size;
+			bytesused += size;
+			return chunks[current].data + pos;
+		}
+		return allocateSlow(size, alignment);
+	}
+
+	/**
+	 * Free all allocations. The chunks are kept for reuse, up to RETAIN_SIZE bytes.
+	 */
+	void reset();
+
+	/**
+	 * @return Bytes allocated since the last reset
+	 */
+	size_t getBytesUsed() const { return bytesused; }
+
+	/**
+	 * @return Bytes of chunk memory held
+	 */
+	size_t getCapacity() const { return capacity; }
+
+	virtual ~PageArena();
+
+protected:
+	struct Chunk {
+		char *data;
+		size_t size;
+	};
+
+	std::vector<Chunk> chunks;
+	size_t current = 0; // Chunk being carved
+	size_t offset = 0; // in the current chunk
+	size_t bytesused = 0;
+	size_t capacity = 0;
+
+	void *allocateSlow(size_t size, size_t alignment);
+
+private:
+	PageArena(const PageArena& other) = delete;
+	PageArena& operator= (const PageArena& other) = delete;
+};
+
+/**
+ * std allocator on a PageArena, deallocate is a no-op.
+ */
+template <class T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	ArenaAllocator(PageArena *arena) : arena(arena) {}
+	template <class U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T *, size_t) {}
+
+	template <class U> bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <class U> bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+	PageArena *arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} /* namespace phppreg */
+
+#endif /* PAGEARENA_H_ */
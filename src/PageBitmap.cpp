@@ -0,0 +1,328 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "PageBitmap.h"
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+enum { OP_AND, OP_OR, OP_ANDNOT };
+
+PageBitmap::Container *PageBitmap::getContainer(uint16_t key)
+{
+	if (! containers.empty() && containers.back().key == key) return &containers.back();
+
+	auto it = lower_bound(containers.begin(), containers.end(), key, [](const Container& container, uint16_t key) {
+		return container.key < key;
+	});
+	if (it != containers.end() && it->key == key) return &*it;
+
+	Container container;
+	container.key = key;
+	container.count = 0;
+	return &*containers.insert(it, container);
+}
+
+void PageBitmap::toBitmap(Container *container)
+{
+	container->bits.assign(BITMAP_WORDS, 0);
+	for (uint16_t low : container->array) container->bits[low >> 6] |= 1ULL << (low & 63);
+	vector<uint16_t>().swap(container->array);
+}
+
+void PageBitmap::shrink(Container *container)
+{
+	if (container->bits.empty() || container->count > ARRAY_MAX) return;
+
+	container->array.clear();
+	container->array.reserve(container->count);
+
+	for (size_t word = 0; word < BITMAP_WORDS; ++word) {
+		uint64_t bits = container->bits[word];
+		while (bits) {
+			container->array.push_back((uint16_t)(word * 64 + __builtin_ctzll(bits)));
+			bits &= bits - 1;
+		}
+	}
+
+	vector<uint64_t>().swap(container->bits);
+}
+
+void PageBitmap::countBytes()
+{
+	heapbytes = containers.capacity() * sizeof(Container);
+	for (auto &container : containers) heapbytes += containerBytes(container);
+}
+
+void PageBitmap::add(uint32_t pageid)
+{
+	size_t containerscapacity = containers.capacity();
+	Container *container = getContainer(pageid >> 16);
+	heapbytes += (containers.capacity() - containerscapacity) * sizeof(Container);
+	uint16_t low = pageid & 0xffff;
+
+	if (! container->bits.empty()) {
+		uint64_t& word = container->bits[low >> 6];
+		uint64_t bit = 1ULL << (low & 63);
+		if (! (word & bit)) {
+			word |= bit;
+			++container->count;
+		}
+		return;
+	}
+
+	vector<uint16_t>& array = container->array;
+	size_t arraybytes = containerBytes(*container);
+	if (array.empty() || array.back() < low) {
+		array.push_back(low);
+	} else {
+		auto it = lower_bound(array.begin(), array.end(), low);
+		if (*it == low) return;
+		array.insert(it, low);
+	}
+
+	if (++container->count > ARRAY_MAX) toBitmap(container);
+	heapbytes = heapbytes + containerBytes(*container) - arraybytes;
+}
+
+bool PageBitmap::contains(uint32_t pageid) const
+{
+	uint16_t key = pageid >> 16;
+	uint16_t low = pageid & 0xffff;
+
+	auto it = lower_bound(containers.begin(), containers.end(), key, [](const Container& container, uint16_t key) {
+		return container.key < key;
+	});
+	if (it == containers.end() || it->key != key) return false;
+
+	if (! it->bits.empty()) return (it->bits[low >> 6] >> (low & 63)) & 1;
+	return binary_search(it->array.begin(), it->array.end(), low);
+}
+
+size_t PageBitmap::cardinality() const
+{
+	size_t count = 0;
+	for (auto &container : containers) count += container.count;
+	return count;
+}
+
+void PageBitmap::forEach(const PageFunc& func) const
+{
+	for (auto &container : containers) {
+		uint32_t high = (uint32_t)container.key << 16;
+
+		if (container.bits.empty()) {
+			for (uint16_t low : container.array) func(high | low);
+			continue;
+		}
+
+		for (size_t word = 0; word < BITMAP_WORDS; ++word) {
+			uint64_t bits = container.bits[word];
+			while (bits) {
+				func(high | (uint32_t)(word * 64 + __builtin_ctzll(bits)));
+				bits &= bits - 1;
+			}
+		}
+	}
+}
+
+/**
+ * Combine two containers with the same key. Two arrays are merged as arrays, otherwise as bitmaps.
+ */
+void PageBitmap::combine(Container *dest, const Container& other, int op)
+{
+	if (dest->bits.empty() && other.bits.empty()) {
+		vector<uint16_t> result;
+
+		if (op == OP_AND) {
+			set_intersection(dest->array.begin(), dest->array.end(), other.array.begin(), other.array.end(), back_inserter(result));
+		} else if (op == OP_OR) {
+			set_union(dest->array.begin(), dest->array.end(), other.array.begin(), other.array.end(), back_inserter(result));
+		} else {
+			set_difference(dest->array.begin(), dest->array.end(), other.array.begin(), other.array.end(), back_inserter(result));
+		}
+
+		dest->array.swap(result);
+		dest->count = dest->array.size();
+		if (dest->count > ARRAY_MAX) toBitmap(dest);
+		return;
+	}
+
+	if (op == OP_AND && dest->bits.empty()) {
+		// Filter the array by the other's bitmap
+		size_t count = 0;
+		for (uint16_t low : dest->array) {
+			if ((other.bits[low >> 6] >> (low & 63)) & 1) dest->array[count++] = low;
+		}
+		dest->array.resize(count);
+		dest->count = count;
+		return;
+	}
+
+	if (dest->bits.empty()) toBitmap(dest);
+
+	const uint64_t *otherbits;
+	vector<uint64_t> otherconverted;
+
+	if (other.bits.empty()) {
+		otherconverted.assign(BITMAP_WORDS, 0);
+		for (uint16_t low : other.array) otherconverted[low >> 6] |= 1ULL << (low & 63);
+		otherbits = otherconverted.data();
+	} else {
+		otherbits = other.bits.data();
+	}
+
+	uint32_t count = 0;
+	for (size_t word = 0; word < BITMAP_WORDS; ++word) {
+		uint64_t& bits = dest->bits[word];
+		if (op == OP_AND) bits &= otherbits[word];
+		else if (op == OP_OR) bits |= otherbits[word];
+		else bits &= ~otherbits[word];
+		count += __builtin_popcountll(bits);
+	}
+
+	dest->count = count;
+	shrink(dest);
+}
+
+void PageBitmap::andWith(const PageBitmap& other)
+{
+	vector<Container> result;
+	auto other_it = other.containers.begin();
+
+	for (auto &container : containers) {
+		while (other_it != other.containers.end() && other_it->key < container.key) ++other_it;
+		if (other_it == other.containers.end()) break;
+		if (other_it->key != container.key) continue;
+
+		combine(&container, *other_it, OP_AND);
+		if (container.count) result.push_back(move(container));
+	}
+
+	containers.swap(result);	countBytes();
+}
+
+void PageBitmap::orWith(const PageBitmap& other)
+{
+	vector<Container> result;
+	result.reserve(containers.size() + other.containers.size());
+	auto it = containers.begin();
+
+	for (auto &othercontainer : other.containers) {
+		while (it != containers.end() && it->key < othercontainer.key) result.push_back(move(*it++));
+
+		if (it != containers.end() && it->key == othercontainer.key) {
+			combine(&*it, othercontainer, OP_OR);
+			result.push_back(move(*it++));
+		} else {
+			result.push_back(othercontainer);
+		}
+	}
+
+	while (it != containers.end()) result.push_back(move(*it++));
+	containers.swap(result);	countBytes();
+}
+
+void PageBitmap::andNotWith(const PageBitmap& other)
+{
+	vector<Container> result;
+	auto other_it = other.containers.begin();
+
+	for (auto &container : containers) {
+		while (other_it != other.containers.end() && other_it->key < container.key) ++other_it;
+
+		if (other_it != other.containers.end() && other_it->key == container.key) {
+			combine(&container, *other_it, OP_ANDNOT);
+			if (! container.count) continue;
+		}
+
+		result.push_back(move(container));
+	}
+
+	containers.swap(result);	countBytes();
+}
+
+static inline void putLE(string *dest, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i) *dest += (char)(value >> (8 * i));
+}
+
+static inline uint64_t getLE(const char *src, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; --i) value = (value << 8) | (unsigned char)src[i];
+	return value;
+}
+
+void PageBitmap::serialize(string *dest) const
+{
+	putLE(dest, containers.size(), 4);
+
+	for (auto &container : containers) {
+		putLE(dest, container.key, 2);
+		putLE(dest, container.count - 1, 2);
+
+		if (container.bits.empty()) {
+			for (uint16_t low : container.array) putLE(dest, low, 2);
+		} else {
+			for (uint64_t word : container.bits) putLE(dest, word, 8);
+		}
+	}
+}
+
+bool PageBitmap::deserialize(const char *data, size_t length)
+{
+	containers.clear();
+	heapbytes = 0;
+	if (length < 4) return false;
+
+	size_t containercnt = getLE(data, 4);
+	size_t pos = 4;
+
+	for (size_t i = 0; i < containercnt; ++i) {
+		if (length - pos < 4) return false;
+
+		Container container;
+		container.key = getLE(data + pos, 2);
+		container.count = getLE(data + pos + 2, 2) + 1;
+		pos += 4;
+
+		if (! containers.empty() && containers.back().key >= container.key) return false;
+
+		if (container.count <= ARRAY_MAX) {
+			if (length - pos < container.count * 2) return false;
+			container.array.resize(container.count);
+			for (size_t j = 0; j < container.count; ++j) container.array[j] = getLE(data + pos + j * 2, 2);
+			pos += container.count * 2;
+		} else {
+			if (length - pos < BITMAP_WORDS * 8) return false;
+			container.bits.resize(BITMAP_WORDS);
+			for (size_t j = 0; j < BITMAP_WORDS; ++j) container.bits[j] = getLE(data + pos + j * 8, 8);
+			pos += BITMAP_WORDS * 8;
+		}
+
+		containers.push_back(move(container));
+	}
+
+	countBytes();
+	return pos == length;
+}
+
+} /* namespace phppreg */
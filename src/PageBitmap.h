@@ -0,0 +1,113 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PAGEBITMAP_H_
+#define PAGEBITMAP_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+namespace phppreg {
+
+/**
+ * Compressed set of page ids, roaring bitmap style: the ids are split by their high 16 bits into containers,
+ * a container is a sorted array of the low 16 bits up to 4096 ids, a 65536 bit bitmap above.
+ *
+ * Serialized (little endian): uint32 container count, per container: uint16 key, uint16 id count - 1,
+ * followed by the low 16 bits of the ids (array container) or 1024 uint64 words (bitmap container).
+ */
+class PageBitmap
+{
+public:
+	static const size_t ARRAY_MAX = 4096;
+	static const size_t BITMAP_WORDS = 1024;
+
+	typedef std::function<void(uint32_t pageid)> PageFunc;
+
+	PageBitmap() {}
+
+	/**
+	 * Add a page id. Adding in ascending order is the fast path.
+	 */
+	void add(uint32_t pageid);
+
+	bool contains(uint32_t pageid) const;
+
+	/**
+	 * @return Number of page ids
+	 */
+	size_t cardinality() const;
+
+	bool empty() const { return containers.empty(); }
+
+	/**
+	 * @return Approximate bytes used by the bitmap
+	 */
+	size_t getMemorySize() const { return sizeof(PageBitmap) + heapbytes; }
+
+	/**
+	 * Call func for each page id, ascending.
+	 */
+	void forEach(const PageFunc& func) const;
+
+	/**
+	 * Set operations, the result replaces this bitmap.
+	 */
+	void andWith(const PageBitmap& other);
+	void orWith(const PageBitmap& other);
+	void andNotWith(const PageBitmap& other);
+
+	/**
+	 * Append the serialized bitmap.
+	 */
+	void serialize(std::string *dest) const;
+
+	/**
+	 * Read a serialized bitmap.
+	 *
+	 * @return false = malformed
+	 */
+	bool deserialize(const char *data, size_t length);
+
+	virtual ~PageBitmap() {}
+
+protected:
+	struct Container {
+		uint16_t key;
+		uint32_t count;
+		std::vector<uint16_t> array; // Sorted low bits, if bits is empty
+		std::vector<uint64_t> bits;
+	};
+
+	std::vector<Container> containers; // Sorted by key
+	size_t heapbytes = 0; // containers, array and bits capacity, kept by add() and recounted by countBytes()
+
+	Container *getContainer(uint16_t key);
+	void countBytes();
+	static size_t containerBytes(const Container& container)
+	{
+		return container.array.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+	}
+	static void toBitmap(Container *container);
+	static void shrink(Container *container);
+	static void combine(Container *dest, const Container& other, int op);
+};
+
+} /* namespace phppreg */
+
+#endif /* PAGEBITMAP_H_ */
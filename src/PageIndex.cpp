@@ -0,0 +1,85 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "PageIndex.h"
+#include "OutputWriter.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+const char PageIndex::MAGIC[] = "MWPGIDX1";
+
+static const size_t HEADER_SIZE = 16;
+
+bool PageIndex::write(const string& path, vector<PageIndexEntry> *entries)
+{
+	sort(entries->begin(), entries->end(), [](const PageIndexEntry& a, const PageIndexEntry& b) {
+		if (a.pageid != b.pageid) return a.pageid < b.pageid;
+		return a.offset < b.offset;
+	});
+
+	OutputWriter *dest = OutputWriter::open(path);
+	if (! dest) return false;
+
+	uint64_t count = entries->size();
+	dest->write(MAGIC, 8);
+	dest->write((const char *)&count, sizeof(count));
+	if (count) dest->write((const char *)entries->data(), count * sizeof(PageIndexEntry));
+
+	bool ok = dest->flush();
+	delete dest;
+
+	return ok;
+}
+
+bool PageIndex::open(const string& path)
+{
+	if (! file.open(path)) return false;
+
+	return init(file.data(), file.size());
+}
+
+bool PageIndex::init(const char *data, size_t length)
+{
+	if (length < HEADER_SIZE || memcmp(data, MAGIC, 8) != 0) return false;
+
+	uint64_t entrycnt;
+	memcpy(&entrycnt, data + 8, sizeof(entrycnt));
+	if (entrycnt > (length - HEADER_SIZE) / sizeof(PageIndexEntry)) return false;
+
+	entries = (const PageIndexEntry *)(data + HEADER_SIZE);
+	count = entrycnt;
+
+	return true;
+}
+
+const PageIndexEntry *PageIndex::find(uint32_t pageid, const PageIndexEntry **end) const
+{
+	auto less = [](const PageIndexEntry& entry, uint32_t id) { return entry.pageid < id; };
+	const PageIndexEntry *first = lower_bound(entries, entries + count, pageid, less);
+
+	const PageIndexEntry *last = first;
+	while (last < entries + count && last->pageid == pageid) ++last;
+
+	*end = last;
+
+	return first;
+}
+
+} /* namespace phppreg */
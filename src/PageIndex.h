@@ -0,0 +1,95 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PAGEINDEX_H_
+#define PAGEINDEX_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "MappedFile.h"
+
+namespace phppreg {
+
+/**
+ * First row of a page's instances of a template in a sorted params file.
+ */
+struct PageIndexEntry {
+	uint32_t pageid;
+	uint32_t tmplid;
+	uint64_t offset;
+};
+
+/**
+ * Page id index of a sorted params file, for mmap:
+ * "MWPGIDX1", uint64 entry count, entries sorted by page id, offset. Native byte order.
+ */
+class PageIndex
+{
+public:
+	static const char MAGIC[];
+
+	PageIndex() {}
+
+	/**
+	 * Sort and write the entries.
+	 *
+	 * @param path File path
+	 * @param entries Entries, sorted in place
+	 * @return false = write failed
+	 */
+	static bool write(const std::string& path, std::vector<PageIndexEntry> *entries);
+
+	/**
+	 * Map an index file.
+	 *
+	 * @return false = open failed or not a page index
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * Use an index in memory. The memory must outlive the index.
+	 *
+	 * @return false = not a page index
+	 */
+	bool init(const char *data, size_t length);
+
+	/**
+	 * Find a page's entries.
+	 *
+	 * @param pageid Page id
+	 * @param end End of the entries
+	 * @return First entry
+	 */
+	const PageIndexEntry *find(uint32_t pageid, const PageIndexEntry **end) const;
+
+	size_t size() const { return count; }
+
+	virtual ~PageIndex() {}
+
+protected:
+	const PageIndexEntry *entries = 0;
+	size_t count = 0;
+	MappedFile file;
+
+private:
+	PageIndex(const PageIndex& other) = delete;
+	PageIndex& operator= (const PageIndex& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* PAGEINDEX_H_ */
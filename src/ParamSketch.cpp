@@ -0,0 +1,255 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ParamSketch.h"
+#include "string_util.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace phppreg {
+
+/**
+ * The HyperLogLog register index is taken from the high bits of the string_hash.
+ */
+void ParamSketch::addHash(uint64_t hashvalue)
+{
+	size_t index = hashvalue >> (64 - HLL_BITS);
+	uint64_t rest = hashvalue << HLL_BITS;
+	uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+	if (rank > registers[index]) registers[index] = rank;
+}
+
+/**
+ * The counters hold every distinct value seen until the registers are allocated.
+ */
+void ParamSketch::allocRegisters()
+{
+	registers.assign(HLL_REGISTERS, 0);
+	for (uint64_t hashvalue : hashes) addHash(hashvalue);
+}
+
+void ParamSketch::add(const char *value, size_t length)
+{
+	uint64_t hashvalue = string_hash(value, length);
+
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		if (hashes[i] == hashvalue && counters[i].value.compare(0, string::npos, value, length) == 0) {
+			++counters[i].count;
+			return;
+		}
+	}
+
+	if (counters.size() < TOPK) {
+		counters.push_back(Counter{string(value, length), 1, 0});
+		hashes.push_back(hashvalue);
+		valuebytes += length;
+		if (! registers.empty()) addHash(hashvalue);
+		return;
+	}
+
+	if (registers.empty()) allocRegisters();
+	addHash(hashvalue);
+
+	// Replace the minimum count, its count is the overestimate bound of the new value
+	size_t minpos = 0;
+	for (size_t i = 1; i < counters.size(); ++i) {
+		if (counters[i].count < counters[minpos].count) minpos = i;
+	}
+
+	Counter& counter = counters[minpos];
+	valuebytes += length - counter.value.length();
+	counter.value.assign(value, length);
+	counter.error = counter.count;
+	++counter.count;
+	hashes[minpos] = hashvalue;
+}
+
+/**
+ * Mergeable Space-Saving: a value missing from a summary that has evicted values may have been counted
+ * up to that summary's minimum count, which is added to its count and error.
+ */
+void ParamSketch::merge(const ParamSketch& other)
+{
+	long long thismin = 0;
+	long long othermin = 0;
+
+	for (auto &counter : counters) {
+		if (! registers.empty() && (thismin == 0 || counter.count < thismin)) thismin = counter.count;
+	}
+	for (auto &counter : other.counters) {
+		if (! other.registers.empty() && (othermin == 0 || counter.count < othermin)) othermin = counter.count;
+	}
+
+	vector<Counter> merged;
+	vector<uint64_t> mergedhashes;
+	vector<bool> otherfound(other.counters.size(), false);
+
+	for (size_t i = 0; i < counters.size(); ++i) {
+		Counter counter = counters[i];
+		size_t j = 0;
+		while (j < other.counters.size() && (other.hashes[j] != hashes[i] || other.counters[j].value != counter.value)) ++j;
+
+		if (j < other.counters.size()) {
+			counter.count += other.counters[j].count;
+			counter.error += other.counters[j].error;
+			otherfound[j] = true;
+		} else {
+			counter.count += othermin;
+			counter.error += othermin;
+		}
+
+		merged.push_back(counter);
+		mergedhashes.push_back(hashes[i]);
+	}
+
+	for (size_t j = 0; j < other.counters.size(); ++j) {
+		if (otherfound[j]) continue;
+		Counter counter = other.counters[j];
+		counter.count += thismin;
+		counter.error += thismin;
+		merged.push_back(counter);
+		mergedhashes.push_back(other.hashes[j]);
+	}
+
+	if (! registers.empty() || ! other.registers.empty() || merged.size() > TOPK) {
+		if (registers.empty()) allocRegisters();
+
+		if (other.registers.empty()) {
+			for (uint64_t hashvalue : other.hashes) addHash(hashvalue);
+		} else {
+			for (size_t i = 0; i < HLL_REGISTERS; ++i) registers[i] = max(registers[i], other.registers[i]);
+		}
+	}
+
+	// Keep the TOPK highest counts
+	vector<size_t> order(merged.size());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+	stable_sort(order.begin(), order.end(), [&merged](size_t a, size_t b) {
+		return merged[a].count > merged[b].count;
+	});
+	if (order.size() > TOPK) order.resize(TOPK);
+
+	counters.clear();
+	hashes.clear();
+	valuebytes = 0;
+	for (size_t i : order) {
+		valuebytes += merged[i].value.length();
+		counters.push_back(move(merged[i]));
+		hashes.push_back(mergedhashes[i]);
+	}
+}
+
+long long ParamSketch::distinct() const
+{
+	if (registers.empty()) return counters.size();
+
+	double sum = 0;
+	size_t zeros = 0;
+
+	for (uint8_t rank : registers) {
+		sum += ldexp(1.0, -rank);
+		if (rank == 0) ++zeros;
+	}
+
+	double m = HLL_REGISTERS;
+	double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+	// Linear counting for small cardinalities, a 64 bit hash needs no large range correction
+	if (estimate <= 2.5 * m && zeros) estimate = m * log(m / zeros);
+
+	return max(llround(estimate), (long long)counters.size());
+}
+
+vector<ParamSketch::Counter> ParamSketch::topValues() const
+{
+	vector<Counter> sorted(counters);
+	sort(sorted.begin(), sorted.end(), [](const Counter& a, const Counter& b) {
+		return a.count > b.count || (a.count == b.count && a.value < b.value);
+	});
+	return sorted;
+}
+
+static inline void putLE(string *dest, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i) dest->push_back((char)(value >> (i * 8)));
+}
+
+static inline uint64_t getLE(const char *src, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; ++i) value |= (uint64_t)(unsigned char)src[i] << (i * 8);
+	return value;
+}
+
+void ParamSketch::serialize(string *dest) const
+{
+	putLE(dest, counters.size(), 4);
+
+	for (auto &counter : counters) {
+		putLE(dest, counter.count, 8);
+		putLE(dest, counter.error, 8);
+		putLE(dest, counter.value.length(), 1);
+		dest->append(counter.value);
+	}
+
+	dest->push_back(registers.empty() ? 0 : 1);
+	dest->append((const char *)registers.data(), registers.size());
+}
+
+bool ParamSketch::deserialize(const char *data, size_t length)
+{
+	counters.clear();
+	hashes.clear();
+	registers.clear();
+	valuebytes = 0;
+	if (length < 4) return false;
+
+	size_t countercnt = getLE(data, 4);
+	size_t pos = 4;
+	if (countercnt > TOPK) return false;
+
+	for (size_t i = 0; i < countercnt; ++i) {
+		if (length - pos < 17) return false;
+
+		Counter counter;
+		counter.count = getLE(data + pos, 8);
+		counter.error = getLE(data + pos + 8, 8);
+		size_t valuelength = getLE(data + pos + 16, 1);
+		pos += 17;
+
+		if (length - pos < valuelength) return false;
+		counter.value.assign(data + pos, valuelength);
+		pos += valuelength;
+		valuebytes += valuelength;
+
+		hashes.push_back(string_hash(counter.value));
+		counters.push_back(move(counter));
+	}
+
+	if (length - pos < 1) return false;
+
+	if (data[pos++]) {
+		if (length - pos < HLL_REGISTERS) return false;
+		registers.assign((const uint8_t *)data + pos, (const uint8_t *)data + pos + HLL_REGISTERS);
+		pos += HLL_REGISTERS;
+	}
+
+	return pos == length;
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,117 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PARAMSKETCH_H_
+#define PARAMSKETCH_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace phppreg {
+
+/**
+ * Fixed memory value statistics of one template param: a Space-Saving top-K heavy hitter summary
+ * and a HyperLogLog distinct value estimate.
+ *
+ * Until TOPK distinct values have been seen the counters are exact and the HyperLogLog registers
+ * are not allocated. Sketches of disjoint runs (shards, threads) can be merged.
+ *
+ * Serialized (little endian): uint32 counter count, per counter: int64 count, int64 error, uint8 value length, value,
+ * followed by uint8 1 and the HLL_REGISTERS registers, or uint8 0.
+ */
+class ParamSketch
+{
+public:
+	static const size_t TOPK = 50;
+	static const int HLL_BITS = 10;
+	static const size_t HLL_REGISTERS = 1 << HLL_BITS;
+
+	struct Counter {
+		std::string value;
+		long long count;
+		long long error; // count overestimate bound, the true count is count - error .. count
+	};
+
+	ParamSketch() {}
+
+	/**
+	 * Count a value, values are at most 255 bytes.
+	 */
+	void add(const char *value, size_t length);
+	void add(const std::string& value) { add(value.data(), value.length()); }
+
+	/**
+	 * Merge the sketch of a disjoint run, the result replaces this sketch.
+	 */
+	void merge(const ParamSketch& other);
+
+	/**
+	 * @return true = TOPK distinct values have been seen
+	 */
+	bool full() const { return counters.size() >= TOPK; }
+
+	/**
+	 * @return Number of counters, the distinct values seen until full()
+	 */
+	size_t size() const { return counters.size(); }
+
+	/**
+	 * @return Distinct value count, exact when there are less than TOPK
+	 */
+	long long distinct() const;
+
+	/**
+	 * @return Counters ordered by descending count, ties by value
+	 */
+	std::vector<Counter> topValues() const;
+
+	/**
+	 * Append the serialized sketch.
+	 */
+	void serialize(std::string *dest) const;
+
+	/**
+	 * Read a serialized sketch.
+	 *
+	 * @return false = malformed
+	 */
+	bool deserialize(const char *data, size_t length);
+
+	/**
+	 * @return Approximate bytes used by the sketch
+	 */
+	size_t getMemorySize() const
+	{
+		return sizeof(ParamSketch) + counters.capacity() * sizeof(Counter) + hashes.capacity() * sizeof(uint64_t)
+			+ registers.capacity() + valuebytes;
+	}
+
+	virtual ~ParamSketch() {}
+
+protected:
+	std::vector<Counter> counters;
+	std::vector<uint64_t> hashes; // by counter
+	std::vector<uint8_t> registers; // Empty while the counters hold every distinct value
+	size_t valuebytes = 0; // Counter value lengths
+
+	void addHash(uint64_t hashvalue);
+	void allocRegisters();
+};
+
+} /* namespace phppreg */
+
+#endif /* PARAMSKETCH_H_ */
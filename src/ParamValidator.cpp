@@ -0,0 +1,321 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ParamValidator.h"
+#include "PhpPregRegistry.h"
+#include "string_util.h"
+#include <cctype>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace phppreg {
+
+static inline unsigned char foldCase(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/******************
+ * PerfectHashSet *
+ ******************/
+PerfectHashSet::PerfectHashSet(const vector<string>& values, bool caseless) : caseless(caseless)
+{
+	// Members that only differ by case would always collide
+	map<string, string> members;
+	for (auto &value : values) {
+		string key = value;
+		if (caseless) for (auto &achar : key) achar = foldCase(achar);
+		members[key] = value;
+	}
+
+	// Hash and displace: the members are put in buckets of about 4 by one hash, then the buckets, biggest first,
+	// each get the displacement (hash seed) that puts all their members in free slots of the table
+	size_t bucketcount = 1;
+	while (bucketcount * 4 < members.size()) bucketcount <<= 1;
+	bucketmask = bucketcount - 1;
+
+	size_t size = 2;
+	while (size * 4 < members.size() * 5) size <<= 1;
+
+	vector<vector<const string *>> buckets(bucketcount);
+	for (auto &member : members) {
+		buckets[hash(member.second.data(), member.second.length(), 0) & bucketmask].push_back(&member.second);
+	}
+
+	vector<size_t> order(bucketcount);
+	for (size_t b = 0; b < bucketcount; ++b) order[b] = b;
+	stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return buckets[x].size() > buckets[y].size(); });
+
+	vector<uint32_t> bucketslots;
+
+	// A bucket without a displacement within MAX_DISPLACEMENT tries grows the table
+	for (bool placed = false; ! placed; size <<= 1) {
+		mask = size - 1;
+		slots.assign(size, string());
+		used.assign(size, false);
+		displacements.assign(bucketcount, 0);
+		placed = true;
+
+		for (size_t b : order) {
+			const vector<const string *>& bucket = buckets[b];
+			if (bucket.empty()) break;
+
+			uint32_t displacement = 1;
+			for (; displacement <= MAX_DISPLACEMENT; ++displacement) {
+				bucketslots.clear();
+
+				for (const string *member : bucket) {
+					uint32_t slot = hash(member->data(), member->length(), displacement) & mask;
+					if (used[slot] || find(bucketslots.begin(), bucketslots.end(), slot) != bucketslots.end()) break;
+					bucketslots.push_back(slot);
+				}
+
+				if (bucketslots.size() == bucket.size()) break;
+			}
+
+			if (displacement > MAX_DISPLACEMENT) {
+				placed = false;
+				break;
+			}
+
+			displacements[b] = displacement;
+			for (size_t i = 0; i < bucket.size(); ++i) {
+				used[bucketslots[i]] = true;
+				slots[bucketslots[i]] = *bucket[i];
+			}
+		}
+	}
+}
+
+uint32_t PerfectHashSet::hash(const char *value, size_t length, uint32_t hashseed) const
+{
+	// FNV-1a with a murmur3 finalizer
+	uint32_t h = 2166136261u ^ (hashseed * 0x9e3779b9u);
+
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = value[i];
+		if (caseless) c = foldCase(c);
+		h ^= c;
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+bool PerfectHashSet::contains(const char *value, size_t length) const
+{
+	uint32_t displacement = displacements[hash(value, length, 0) & bucketmask];
+	if (! displacement) return false; // Empty bucket
+
+	uint32_t slot = hash(value, length, displacement) & mask;
+	if (! used[slot]) return false;
+
+	const string& member = slots[slot];
+	if (member.length() != length) return false;
+	if (! caseless) return member.compare(0, length, value, length) == 0;
+
+	for (size_t i = 0; i < length; ++i) {
+		if (foldCase(member[i]) != foldCase(value[i])) return false;
+	}
+
+	return true;
+}
+
+/*************
+ * ParamRule *
+ *************/
+bool ParamRule::validate(const string& value) const
+{
+	switch (type) {
+		case YESNO:
+		case VALUES:
+			return valueset->contains(value);
+
+		case REGEX:
+			return regex->match(value) != 0;
+
+		default:
+			int result = matchFast(value);
+			if (result == UNDECIDED) return regex->match(value) != 0;
+			return result == MATCH;
+	}
+}
+
+/**
+ * Hand rolled matchers for the common simple regexes. Anything pcre might treat differently
+ * (unicode digits with the u modifier, $ matching before a trailing newline) is left UNDECIDED.
+ */
+int ParamRule::matchFast(const string& value) const
+{
+	if (value.back() == '\n') return UNDECIDED;
+
+	switch (type) {
+		case DIGITS:
+			for (unsigned char c : value) {
+				if (c >= 0x80) return UNDECIDED;
+				if (c < '0' || c > '9') return NOMATCH;
+			}
+			return (value.length() >= minlen && value.length() <= maxlen) ? MATCH : NOMATCH;
+
+		case LENGTH:
+			for (unsigned char c : value) {
+				if (c >= 0x80 || c == '\n' || c == '\r') return UNDECIDED;
+			}
+			return (value.length() >= minlen && value.length() <= maxlen) ? MATCH : NOMATCH;
+
+		case LITERAL:
+			return valueset->contains(value) ? MATCH : NOMATCH;
+
+		default:
+			return UNDECIDED;
+	}
+}
+
+/******************
+ * ParamValidator *
+ ******************/
+int ParamValidator::addRule(char type, const string& arg)
+{
+	if (type != 'Y' && type != 'R' && type != 'V') return -1;
+
+	pair<char, string> key(type, type == 'Y' ? "" : arg);
+	auto it = ruleids.find(key);
+	if (it != ruleids.end()) return it->second;
+
+	ParamRule rule;
+	rule.pattern = arg;
+
+	if (type == 'Y') {
+		static const vector<string> yesno = {
+			"yes", "y", "true", "1",
+			"no", "n", "false", "0"
+		};
+
+		rule.type = ParamRule::YESNO;
+		rule.valueset.reset(new PerfectHashSet(yesno, true));
+
+	} else if (type == 'V') {
+		vector<string> values;
+		string_split(arg, "|", &values);
+		rule.type = ParamRule::VALUES;
+		rule.valueset.reset(new PerfectHashSet(values, false));
+
+	} else {
+		compileRegex(rule, arg);
+	}
+
+	int ruleid = rules.size();
+	rules.push_back(rule);
+	ruleids[key] = ruleid;
+
+	return ruleid;
+}
+
+void ParamValidator::compileRegex(ParamRule& rule, const string& arg)
+{
+	vector<string> literals;
+
+	// pcre is still needed for the REGEX rules and for UNDECIDED fast matches
+	rule.regex = &PhpPregRegistry::get("!^" + arg + "$!u");
+
+	if (arg.compare(0, 2, "\\d") == 0 && parseRepeat(arg, 2, &rule.minlen, &rule.maxlen)) {
+		rule.type = ParamRule::DIGITS;
+	} else if (arg.compare(0, 5, "[0-9]") == 0 && parseRepeat(arg, 5, &rule.minlen, &rule.maxlen)) {
+		rule.type = ParamRule::DIGITS;
+	} else if (arg.compare(0, 1, ".") == 0 && parseRepeat(arg, 1, &rule.minlen, &rule.maxlen)) {
+		rule.type = ParamRule::LENGTH;
+	} else if (parseLiterals(arg, &literals)) {
+		rule.type = ParamRule::LITERAL;
+		rule.valueset.reset(new PerfectHashSet(literals, false));
+	} else {
+		rule.type = ParamRule::REGEX;
+	}
+}
+
+/**
+ * Parse a greedy quantifier that ends the pattern: none, ?, *, +, {n}, {m,}, {m,n}
+ */
+bool ParamValidator::parseRepeat(const string& arg, size_t pos, size_t *minlen, size_t *maxlen)
+{
+	const size_t unbounded = numeric_limits<size_t>::max();
+	string quantifier = arg.substr(pos);
+
+	if (quantifier == "") { *minlen = 1; *maxlen = 1; return true; }
+	if (quantifier == "?") { *minlen = 0; *maxlen = 1; return true; }
+	if (quantifier == "*") { *minlen = 0; *maxlen = unbounded; return true; }
+	if (quantifier == "+") { *minlen = 1; *maxlen = unbounded; return true; }
+
+	if (quantifier.length() < 3 || quantifier.front() != '{' || quantifier.back() != '}') return false;
+
+	string bounds = quantifier.substr(1, quantifier.length() - 2);
+	string::size_type comma = bounds.find(',');
+	string low = bounds.substr(0, comma);
+	string high = (comma == string::npos) ? low : bounds.substr(comma + 1);
+
+	if (low.empty() || low.length() > 6 || high.length() > 6) return false;
+	if (low.find_first_not_of("0123456789") != string::npos || high.find_first_not_of("0123456789") != string::npos) return false;
+
+	*minlen = stoul(low);
+	*maxlen = high.empty() ? unbounded : stoul(high);
+
+	return *minlen <= *maxlen;
+}
+
+/**
+ * Parse a single literal or a grouped alternation of literals, ie. (?:abc|def)
+ * An ungrouped alternation is not a set of literals because ^a|b$ is (^a)|(b$).
+ */
+bool ParamValidator::parseLiterals(const string& arg, vector<string> *literals)
+{
+	string body = arg;
+
+	if (body.compare(0, 3, "(?:") == 0 && body.back() == ')') body = body.substr(3, body.length() - 4);
+	else if (body.compare(0, 1, "(") == 0 && body.back() == ')' && body.compare(0, 2, "(?") != 0) body = body.substr(1, body.length() - 2);
+	else if (body.find('|') != string::npos) return false;
+
+	literals->clear();
+	string literal;
+
+	for (size_t i = 0; i < body.length(); ++i) {
+		char c = body[i];
+
+		if (c == '\\') {
+			if (++i == body.length() || isalnum(static_cast<unsigned char>(body[i]))) return false; // \d, \w, etc.
+			literal += body[i];
+		} else if (c == '|') {
+			literals->push_back(literal);
+			literal.clear();
+		} else if (string("^$.[]{}()*+?").find(c) != string::npos) {
+			return false;
+		} else {
+			literal += c;
+		}
+	}
+
+	literals->push_back(literal);
+
+	return true;
+}
+
+} /* namespace phppreg */
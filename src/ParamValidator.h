@@ -0,0 +1,135 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PARAMVALIDATOR_H_
+#define PARAMVALIDATOR_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "PhpPreg.h"
+
+namespace phppreg {
+
+/**
+ * Read only string set using a hash and displace perfect hash, every member has its own slot.
+ * A lookup is two hashes and one compare.
+ */
+class PerfectHashSet
+{
+public:
+	static const uint32_t MAX_DISPLACEMENT = 4096;
+
+	/**
+	 * constructor
+	 *
+	 * @param values Set members
+	 * @param caseless Compare ASCII letters case insensitively
+	 */
+	PerfectHashSet(const std::vector<std::string>& values, bool caseless);
+
+	bool contains(const char *value, size_t length) const;
+	bool contains(const std::string& value) const { return contains(value.data(), value.length()); }
+
+protected:
+	std::vector<std::string> slots;
+	std::vector<bool> used;
+	std::vector<uint32_t> displacements; // by bucket, 0 = empty bucket
+	uint32_t bucketmask = 0;
+	uint32_t mask = 0;
+	bool caseless;
+
+	uint32_t hash(const char *value, size_t length, uint32_t hashseed) const;
+};
+
+/**
+ * A compiled TemplateIds.tsv value validation rule.
+ */
+class ParamRule
+{
+public:
+	enum RuleType {
+		YESNO,   //!< Y yes/no value, case insensitive
+		VALUES,  //!< V one of a | separated list of values
+		DIGITS,  //!< R regex of the form \d{m,n}
+		LENGTH,  //!< R regex of the form .{m,n}
+		LITERAL, //!< R regex of literal alternatives, ie. (?:abc|def)
+		REGEX    //!< R any other regex
+	};
+
+	/**
+	 * Result of a hand rolled matcher that can not decide, ie. non-ASCII digits
+	 */
+	enum { NOMATCH = 0, MATCH = 1, UNDECIDED = 2 };
+
+	RuleType type;
+	size_t minlen = 0;
+	size_t maxlen = 0;
+	std::shared_ptr<PerfectHashSet> valueset;
+	PhpPreg *regex = NULL;
+	std::string pattern;
+
+	/**
+	 * validate
+	 *
+	 * @param value Non-empty parameter value
+	 * @return true = valid
+	 */
+	bool validate(const std::string& value) const;
+
+protected:
+	int matchFast(const std::string& value) const;
+};
+
+/**
+ * Compiles TemplateIds.tsv Y/R/V validation rules into ParamRules. Identical rules share a rule id.
+ */
+class ParamValidator
+{
+public:
+	/**
+	 * addRule
+	 *
+	 * @param type Validation type Y, R or V
+	 * @param arg Regex for R, | separated values for V
+	 * @return rule id, -1 = no validation
+	 */
+	int addRule(char type, const std::string& arg);
+
+	/**
+	 * validate
+	 *
+	 * @param ruleid Rule id from addRule
+	 * @param value Non-empty parameter value
+	 * @return true = valid
+	 */
+	bool validate(int ruleid, const std::string& value) const { return rules[ruleid].validate(value); }
+
+	const ParamRule& getRule(int ruleid) const { return rules[ruleid]; }
+
+protected:
+	std::vector<ParamRule> rules;
+	std::map<std::pair<char, std::string>, int> ruleids;
+
+	static void compileRegex(ParamRule& rule, const std::string& arg);
+	static bool parseRepeat(const std::string& arg, size_t pos, size_t *minlen, size_t *maxlen);
+	static bool parseLiterals(const std::string& arg, std::vector<std::string> *literals);
+};
+
+} /* namespace phppreg */
+
+#endif /* PARAMVALIDATOR_H_ */
@@ -0,0 +1,165 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ParamsBinaryReader.h"
+#include "string_util.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace phppreg {
+
+/**
+ * Read a varint.
+ *
+ * @return false = past the end
+ */
+static inline bool getVarint(const char *data, size_t end, size_t *pos, unsigned long long *value)
+{
+	*value = 0;
+	int shift = 0;
+
+	while (*pos < end && shift < 64) {
+		unsigned char c = data[(*pos)++];
+		*value |= (unsigned long long)(c & 0x7f) << shift;
+		if (! (c & 0x80)) return true;
+		shift += 7;
+	}
+
+	return false;
+}
+
+bool ParamsBinaryReader::open(const string& path)
+{
+	if (! file.open(path, MADV_SEQUENTIAL)) return false;
+
+	return init(file.data(), file.size());
+}
+
+bool ParamsBinaryReader::init(const char *data, size_t length)
+{
+	this->data = data;
+	this->length = length;
+	index.clear();
+
+	if (length < 20 || memcmp(data, ParamsBinaryWriter::MAGIC, 8) != 0
+		|| memcmp(data + length - 4, ParamsBinaryWriter::TRAILER_MAGIC, 4) != 0) return false;
+
+	unsigned long long offset = 0;
+	for (int i = 7; i >= 0; --i) offset = (offset << 8) | (unsigned char)data[length - 12 + i];
+	if (offset < 8 || offset > length - 12) return false;
+	footeroffset = offset;
+
+	size_t pos = footeroffset;
+	size_t end = length - 12;
+	unsigned long long entrycnt;
+	if (! getVarint(data, end, &pos, &entrycnt)) return false;
+
+	for (unsigned long long i = 0; i < entrycnt; ++i) {
+		ParamsBinaryIndexEntry entry;
+		unsigned long long tmplid;
+		if (! getVarint(data, end, &pos, &tmplid) || ! getVarint(data, end, &pos, &entry.offset)
+			|| ! getVarint(data, end, &pos, &entry.rows) || ! getVarint(data, end, &pos, &entry.length)) return false;
+		if (entry.offset + entry.length > footeroffset) return false;
+		entry.tmplid = tmplid;
+		index.push_back(entry);
+	}
+
+	return true;
+}
+
+bool ParamsBinaryReader::readSection(size_t offset, size_t *sectionend, RowFunc& output)
+{
+	size_t pos = offset;
+	unsigned long long tmplid, rowcnt, bodylength;
+	if (! getVarint(data, footeroffset, &pos, &tmplid) || ! getVarint(data, footeroffset, &pos, &rowcnt)
+		|| ! getVarint(data, footeroffset, &pos, &bodylength)) return false;
+
+	size_t end = pos + bodylength;
+	if (end > footeroffset) return false;
+
+	dictionary.clear();
+	string tmplidfield;
+	string_append_uint(&tmplidfield, tmplid);
+	tmplidfield += '\t';
+
+	for (unsigned long long r = 0; r < rowcnt; ++r) {
+		unsigned long long pageid, paramcnt;
+		if (! getVarint(data, end, &pos, &pageid) || ! getVarint(data, end, &pos, &paramcnt)) return false;
+
+		row = tmplidfield;
+		string_append_uint(&row, pageid);
+
+		for (unsigned long long p = 0; p < paramcnt; ++p) {
+			unsigned long long nameref, len;
+			if (! getVarint(data, end, &pos, &nameref)) return false;
+
+			if (nameref == 0) {
+				if (! getVarint(data, end, &pos, &len) || len > end - pos) return false;
+				dictionary.emplace_back(data + pos, len);
+				pos += len;
+				nameref = dictionary.size();
+			}
+
+			if (nameref > dictionary.size()) return false;
+
+			row += '\t';
+			row += dictionary[nameref - 1];
+			row += '\t';
+
+			if (! getVarint(data, end, &pos, &len) || len > end - pos) return false;
+			row.append(data + pos, len);
+			pos += len;
+		}
+
+		row += '\n';
+		output(row);
+	}
+
+	*sectionend = end;
+
+	return pos == end;
+}
+
+bool ParamsBinaryReader::readAll(RowFunc output)
+{
+	size_t pos = 8;
+
+	while (pos < footeroffset) {
+		if (! readSection(pos, &pos, output)) return false;
+	}
+
+	return true;
+}
+
+bool ParamsBinaryReader::readTemplate(unsigned long tmplid, RowFunc output)
+{
+	auto it = lower_bound(index.begin(), index.end(), tmplid, [](const ParamsBinaryIndexEntry& entry, unsigned long id) {
+		return entry.tmplid < id;
+	});
+
+	size_t sectionend;
+
+	for (; it != index.end() && it->tmplid == tmplid; ++it) {
+		if (! readSection(it->offset, &sectionend, output)) return false;
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,92 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PARAMSBINARYREADER_H_
+#define PARAMSBINARYREADER_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "ParamsBinaryWriter.h"
+#include "MappedFile.h"
+
+namespace phppreg {
+
+/**
+ * Reads a binary params file written by ParamsBinaryWriter, returning the rows as params TSV.
+ */
+class ParamsBinaryReader
+{
+public:
+	typedef std::function<void(const std::string&)> RowFunc;
+
+	ParamsBinaryReader() {}
+
+	/**
+	 * Map a binary params file.
+	 *
+	 * @param path File path
+	 * @return false = open failed or not a binary params file
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * Use a binary params file in memory. The memory must outlive the reader.
+	 *
+	 * @return false = not a binary params file
+	 */
+	bool init(const char *data, size_t length);
+
+	/**
+	 * Stream all rows in file order.
+	 *
+	 * @param output Newline terminated TSV row handler
+	 * @return false = corrupt file
+	 */
+	bool readAll(RowFunc output);
+
+	/**
+	 * Stream the rows of one template using the footer index.
+	 *
+	 * @param tmplid Template id
+	 * @param output Newline terminated TSV row handler
+	 * @return false = corrupt file
+	 */
+	bool readTemplate(unsigned long tmplid, RowFunc output);
+
+	const std::vector<ParamsBinaryIndexEntry>& getIndex() const { return index; }
+
+	virtual ~ParamsBinaryReader() {}
+
+protected:
+	const char *data = 0;
+	size_t length = 0;
+	size_t footeroffset = 0;
+	MappedFile file;
+	std::vector<ParamsBinaryIndexEntry> index;
+	std::vector<std::string> dictionary;
+	std::string row;
+
+	bool readSection(size_t offset, size_t *sectionend, RowFunc& output);
+
+private:
+	ParamsBinaryReader(const ParamsBinaryReader& other) = delete;
+	ParamsBinaryReader& operator= (const ParamsBinaryReader& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* PARAMSBINARYREADER_H_ */
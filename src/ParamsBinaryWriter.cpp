@@ -0,0 +1,178 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ParamsBinaryWriter.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+namespace phppreg {
+
+const char ParamsBinaryWriter::MAGIC[] = "MWTPBIN1";
+const char ParamsBinaryWriter::TRAILER_MAGIC[] = "MWTP";
+
+ParamsBinaryWriter::ParamsBinaryWriter(OutputWriter *dest, size_t sectionsize)
+	: dest(dest), sectionsize(sectionsize)
+{
+	dest->write(MAGIC, 8);
+	fileoffset = 8;
+}
+
+/**
+ * Parse a decimal id field.
+ *
+ * @return false = not a number
+ */
+static bool parseId(const char *start, const char *end, unsigned long long *value)
+{
+	if (start == end) return false;
+
+	*value = 0;
+	for (const char *ptr = start; ptr < end; ++ptr) {
+		if (*ptr < '0' || *ptr > '9') return false;
+		*value = *value * 10 + (*ptr - '0');
+	}
+
+	return true;
+}
+
+bool ParamsBinaryWriter::addRow(const char *line, size_t length)
+{
+	if (length && line[length - 1] == '\n') --length;
+	const char *end = line + length;
+
+	const char *tab1 = (const char *)memchr(line, '\t', length);
+	if (! tab1) return false;
+	const char *tab2 = (const char *)memchr(tab1 + 1, '\t', end - tab1 - 1);
+	if (! tab2) tab2 = end;
+
+	unsigned long long tmplid;
+	unsigned long long pageid;
+	if (! parseId(line, tab1, &tmplid) || ! parseId(tab1 + 1, tab2, &pageid)) return false;
+
+	// Count the name/value pairs
+	size_t tabcnt = count(tab2, end, '\t');
+	if (tabcnt % 2) return false;
+
+	if (insection && (tmplid != sectiontmplid || section.length() >= sectionsize)) flushSection();
+
+	if (! insection) {
+		insection = true;
+		sectiontmplid = tmplid;
+		sectionrows = 0;
+	}
+
+	++sectionrows;
+	putVarint(&section, pageid);
+	putVarint(&section, tabcnt / 2);
+
+	const char *ptr = tab2;
+	while (ptr < end) {
+		const char *namestart = ptr + 1;
+		const char *nameend = (const char *)memchr(namestart, '\t', end - namestart);
+		const char *valuestart = nameend + 1;
+		const char *valueend = (const char *)memchr(valuestart, '\t', end - valuestart);
+		if (! valueend) valueend = end;
+
+		namebuf.assign(namestart, nameend - namestart);
+		auto dict_it = dictionary.find(namebuf);
+
+		if (dict_it == dictionary.end()) {
+			unsigned int nameref = dictionary.size() + 1;
+			dictionary[namebuf] = nameref;
+			putVarint(&section, 0);
+			putVarint(&section, namebuf.length());
+			section += namebuf;
+		} else {
+			putVarint(&section, dict_it->second);
+		}
+
+		putVarint(&section, valueend - valuestart);
+		section.append(valuestart, valueend - valuestart);
+
+		ptr = valueend;
+	}
+
+	return true;
+}
+
+void ParamsBinaryWriter::flushSection()
+{
+	if (! insection) return;
+
+	sectionheader.clear();
+	putVarint(&sectionheader, sectiontmplid);
+	putVarint(&sectionheader, sectionrows);
+	putVarint(&sectionheader, section.length());
+
+	ParamsBinaryIndexEntry entry;
+	entry.tmplid = sectiontmplid;
+	entry.offset = fileoffset;
+	entry.rows = sectionrows;
+	entry.length = sectionheader.length() + section.length();
+	index.push_back(entry);
+
+	dest->write(sectionheader);
+	dest->write(section);
+	fileoffset += entry.length;
+
+	section.clear();
+	dictionary.clear();
+	insection = false;
+}
+
+bool ParamsBinaryWriter::close()
+{
+	if (closed) return ! dest->fail();
+	closed = true;
+
+	flushSection();
+
+	stable_sort(index.begin(), index.end(), [](const ParamsBinaryIndexEntry& a, const ParamsBinaryIndexEntry& b) {
+		return a.tmplid < b.tmplid;
+	});
+
+	string footer;
+	putVarint(&footer, index.size());
+
+	for (auto &entry : index) {
+		putVarint(&footer, entry.tmplid);
+		putVarint(&footer, entry.offset);
+		putVarint(&footer, entry.rows);
+		putVarint(&footer, entry.length);
+	}
+
+	unsigned long long footeroffset = fileoffset;
+	for (int i = 0; i < 8; ++i) {
+		footer += (char)(footeroffset & 0xff);
+		footeroffset >>= 8;
+	}
+
+	footer.append(TRAILER_MAGIC, 4);
+	dest->write(footer);
+	fileoffset += footer.length();
+
+	return dest->flush();
+}
+
+ParamsBinaryWriter::~ParamsBinaryWriter()
+{
+	close();
+}
+
+} /* namespace phppreg */
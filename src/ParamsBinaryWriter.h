@@ -0,0 +1,117 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PARAMSBINARYWRITER_H_
+#define PARAMSBINARYWRITER_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Binary params file layout (varint = unsigned LEB128):
+ *
+ * header: "MWTPBIN1"
+ * sections: varint template id, varint row count, varint body length, body
+ *   body rows: varint page id, varint param count, params
+ *   params: varint name ref (0 = new name: varint length, bytes; n = name n of the section dictionary),
+ *           varint value length, value bytes
+ * footer: varint entry count, entries sorted by template id, offset:
+ *           varint template id, varint section offset, varint row count, varint section length
+ * trailer: 8 byte little endian footer offset, "MWTP"
+ *
+ * A section holds consecutive rows of one template, and a new section is started when the template
+ * changes or the section gets large. The name dictionary is per section.
+ */
+struct ParamsBinaryIndexEntry {
+	unsigned long tmplid;
+	unsigned long long offset;
+	unsigned long long rows;
+	unsigned long long length;
+};
+
+class ParamsBinaryWriter
+{
+public:
+	static const size_t SECTION_SIZE = 1024 * 1024;
+	static const char MAGIC[];
+	static const char TRAILER_MAGIC[];
+
+	/**
+	 * constructor
+	 *
+	 * @param dest Output, the header is written immediately
+	 * @param sectionsize Body size to start a new section at
+	 */
+	ParamsBinaryWriter(OutputWriter *dest, size_t sectionsize = SECTION_SIZE);
+
+	/**
+	 * Add a params TSV row: template id, page id, name/value pairs.
+	 *
+	 * @param line Row, trailing newline optional
+	 * @param length Row length
+	 * @return false = malformed row
+	 */
+	bool addRow(const char *line, size_t length);
+	bool addRow(const std::string& line) { return addRow(line.data(), line.length()); }
+
+	/**
+	 * Write the last section and the footer.
+	 *
+	 * @return false = write failed
+	 */
+	bool close();
+
+	static void putVarint(std::string *dest, unsigned long long value)
+	{
+		while (value >= 0x80) {
+			*dest += (char)(value | 0x80);
+			value >>= 7;
+		}
+
+		*dest += (char)value;
+	}
+
+	virtual ~ParamsBinaryWriter();
+
+protected:
+	OutputWriter *dest;
+	size_t sectionsize;
+	long long fileoffset = 0;
+	bool insection = false;
+	bool closed = false;
+	unsigned long sectiontmplid = 0;
+	unsigned long long sectionrows = 0;
+	std::string section;
+	std::string sectionheader;
+	std::unordered_map<std::string, unsigned int> dictionary;
+	std::string namebuf;
+	std::vector<ParamsBinaryIndexEntry> index;
+
+	void flushSection();
+
+private:
+	ParamsBinaryWriter() = delete;
+	ParamsBinaryWriter(const ParamsBinaryWriter& other) = delete;
+	ParamsBinaryWriter& operator= (const ParamsBinaryWriter& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* PARAMSBINARYWRITER_H_ */
@@ -0,0 +1,444 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ParamsDiff.h"
+#include "string_util.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+/**
+ * A param of a row, pointing into the params file.
+ */
+struct DiffField {
+	const char *name;
+	size_t namelength;
+	const char *value;
+	size_t valuelength;
+};
+
+static inline int compareBytes(const char *a, size_t alength, const char *b, size_t blength)
+{
+	int cmp = memcmp(a, b, min(alength, blength));
+	if (cmp) return cmp;
+	return (alength < blength) ? -1 : (alength > blength);
+}
+
+static bool fieldLess(const DiffField& a, const DiffField& b)
+{
+	int cmp = compareBytes(a.name, a.namelength, b.name, b.namelength);
+	if (cmp) return cmp < 0;
+	return compareBytes(a.value, a.valuelength, b.value, b.valuelength) < 0;
+}
+
+/**
+ * Reads the rows of a template range page by page.
+ */
+class PageRows
+{
+public:
+	PageRows(const char *data, size_t length) : ptr(data), end(data + length) { next(); }
+
+	bool done() const { return ! haspage; }
+	bool unsorted() const { return descending; }
+	unsigned long pageid() const { return currentpage; }
+
+	/**
+	 * Fields of the current page sorted by name and value, then move to the next page.
+	 */
+	void take(vector<DiffField> *fields)
+	{
+		fields->clear();
+
+		while (haspage && rowpage == currentpage) {
+			const char *field = rowfields;
+			while (field < rowend) {
+				DiffField f;
+				f.name = field + 1;
+				const char *nameend = (const char *)memchr(f.name, '\t', rowend - f.name);
+				if (! nameend) break;
+				f.namelength = nameend - f.name;
+				f.value = nameend + 1;
+				const char *valueend = (const char *)memchr(f.value, '\t', rowend - f.value);
+				if (! valueend) valueend = rowend;
+				f.valuelength = valueend - f.value;
+				fields->push_back(f);
+				field = valueend;
+			}
+
+			next();
+		}
+
+		if (haspage) currentpage = rowpage;
+		sort(fields->begin(), fields->end(), fieldLess);
+	}
+
+protected:
+	const char *ptr;
+	const char *end;
+	const char *rowfields = 0;
+	const char *rowend = 0;
+	unsigned long rowpage = 0;
+	unsigned long currentpage = 0;
+	bool haspage = false;
+	bool started = false;
+	bool descending = false; // A page id lower than the one before, the rows are not sorted
+
+	void next()
+	{
+		haspage = false;
+
+		while (ptr < end) {
+			const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+			const char *line = ptr;
+			rowend = eol ? eol : end;
+			ptr = eol ? eol + 1 : end;
+
+			const char *tab = (const char *)memchr(line, '\t', rowend - line);
+			if (! tab) continue; // Empty line
+
+			char *pageend;
+			unsigned long prevpage = rowpage;
+			rowpage = strtoul(tab + 1, &pageend, 10);
+			rowfields = pageend;
+
+			if (started && rowpage < prevpage) {
+				descending = true;
+				ptr = end;
+				break;
+			}
+
+			haspage = true;
+			break;
+		}
+
+		if (haspage && ! started) {
+			currentpage = rowpage;
+			started = true;
+		}
+	}
+};
+
+static void appendDiffRow(string *dest, char op, unsigned long tmplid, unsigned long pageid, const DiffField& field,
+	const DiffField *newfield = 0)
+{
+	*dest += op;
+	*dest += '\t';
+	string_append_uint(dest, tmplid);
+	*dest += '\t';
+	string_append_uint(dest, pageid);
+	*dest += '\t';
+	dest->append(field.name, field.namelength);
+	*dest += '\t';
+	dest->append(field.value, field.valuelength);
+	if (newfield) {
+		*dest += '\t';
+		dest->append(newfield->value, newfield->valuelength);
+	}
+	*dest += '\n';
+}
+
+/**
+ * Diff the fields of a page, both sorted by name and value.
+ */
+static void diffPage(unsigned long tmplid, unsigned long pageid, const vector<DiffField>& oldfields, const vector<DiffField>& newfields,
+	string *dest, long long counts[3])
+{
+	size_t oldpos = 0, newpos = 0;
+
+	while (oldpos < oldfields.size() || newpos < newfields.size()) {
+		// Fields of the next param name
+		int cmp;
+		if (oldpos == oldfields.size()) cmp = 1;
+		else if (newpos == newfields.size()) cmp = -1;
+		else cmp = compareBytes(oldfields[oldpos].name, oldfields[oldpos].namelength, newfields[newpos].name, newfields[newpos].namelength);
+
+		const DiffField& namefield = (cmp <= 0) ? oldfields[oldpos] : newfields[newpos];
+		size_t oldend = oldpos, newend = newpos;
+		if (cmp <= 0) {
+			while (oldend < oldfields.size() && compareBytes(oldfields[oldend].name, oldfields[oldend].namelength, namefield.name, namefield.namelength) == 0) ++oldend;
+		}
+		if (cmp >= 0) {
+			while (newend < newfields.size() && compareBytes(newfields[newend].name, newfields[newend].namelength, namefield.name, namefield.namelength) == 0) ++newend;
+		}
+
+		if (oldend - oldpos == 1 && newend - newpos == 1) {
+			const DiffField& oldfield = oldfields[oldpos];
+			const DiffField& newfield = newfields[newpos];
+			if (compareBytes(oldfield.value, oldfield.valuelength, newfield.value, newfield.valuelength) != 0) {
+				appendDiffRow(dest, '~', tmplid, pageid, oldfield, &newfield);
+				++counts[2];
+			}
+		} else {
+			// Values only in one of the files, both sorted
+			while (oldpos < oldend || newpos < newend) {
+				int valuecmp;
+				if (oldpos == oldend) valuecmp = 1;
+				else if (newpos == newend) valuecmp = -1;
+				else valuecmp = compareBytes(oldfields[oldpos].value, oldfields[oldpos].valuelength, newfields[newpos].value, newfields[newpos].valuelength);
+
+				if (valuecmp < 0) {
+					appendDiffRow(dest, '-', tmplid, pageid, oldfields[oldpos++]);
+					++counts[1];
+				} else if (valuecmp > 0) {
+					appendDiffRow(dest, '+', tmplid, pageid, newfields[newpos++]);
+					++counts[0];
+				} else {
+					++oldpos;
+					++newpos;
+				}
+			}
+		}
+
+		oldpos = oldend;
+		newpos = newend;
+	}
+}
+
+/**
+ * @return Page id of the row starting at row, 0 = no page id
+ */
+static unsigned long rowPage(const char *data, size_t length, size_t row)
+{
+	const char *tab = (const char *)memchr(data + row, '\t', length - row);
+	const char *eol = (const char *)memchr(data + row, '\n', length - row);
+	if (! tab || (eol && eol < tab)) return 0;
+	return strtoul(tab + 1, NULL, 10);
+}
+
+/**
+ * Binary search of the rows of a template for the first row with a page id >= pageid.
+ * The row before the result has a lower page id even if the rows are not sorted, so a split there never hides a
+ * descending page id from PageRows.
+ *
+ * @return Offset of the row, length = none
+ */
+static size_t lowerBoundPage(const char *data, size_t length, unsigned long pageid)
+{
+	size_t lo = 0; // Row start, the rows before it have lower page ids
+	size_t hi = length; // Row start with a page id >= pageid, or length
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *eol = (const char *)memchr(data + mid, '\n', hi - mid);
+		size_t row = eol ? eol + 1 - data : hi;
+
+		if (row >= hi) {
+			// No row starts after mid, step through the rows from lo
+			while (lo < hi && rowPage(data, length, lo) < pageid) {
+				eol = (const char *)memchr(data + lo, '\n', hi - lo);
+				lo = eol ? eol + 1 - data : hi;
+			}
+			return lo;
+		}
+
+		if (rowPage(data, length, row) >= pageid) {
+			hi = row;
+		} else {
+			eol = (const char *)memchr(data + row, '\n', hi - row);
+			lo = eol ? eol + 1 - data : hi;
+		}
+	}
+
+	return lo;
+}
+
+ParamsDiff::ParamsDiff(const char *olddata, size_t oldlength, const char *newdata, size_t newlength, size_t chunksize)
+	: olddata(olddata), oldlength(oldlength), newdata(newdata), newlength(newlength), chunksize(chunksize ? chunksize : 1)
+{
+}
+
+/**
+ * Split a template at page ids into chunks of about chunksize old and new bytes. The page ids are taken from the larger
+ * of the old and new rows and both are split at the first row with the page id, so a page is always in one chunk.
+ */
+void ParamsDiff::addChunks(unsigned long tmplid, const TemplateRange *oldrange, const TemplateRange *newrange, vector<DiffChunk> *chunks) const
+{
+	DiffChunk chunk;
+	chunk.tmplid = tmplid;
+	chunk.olddata = oldrange ? olddata + oldrange->offset : olddata;
+	chunk.oldlength = oldrange ? oldrange->length : 0;
+	chunk.newdata = newrange ? newdata + newrange->offset : newdata;
+	chunk.newlength = newrange ? newrange->length : 0;
+
+	size_t pieces = (chunk.oldlength + chunk.newlength) / chunksize + 1;
+	bool splitold = chunk.oldlength >= chunk.newlength;
+	const char *splitdata = splitold ? chunk.olddata : chunk.newdata;
+	size_t splitlength = splitold ? chunk.oldlength : chunk.newlength;
+	size_t oldstart = 0, newstart = 0;
+
+	for (size_t piece = 1; piece < pieces; ++piece) {
+		size_t pos = splitlength / pieces * piece;
+		const char *eol = (const char *)memchr(splitdata + pos, '\n', splitlength - pos);
+		if (! eol || eol + 1 == splitdata + splitlength) break;
+
+		unsigned long pageid = rowPage(splitdata, splitlength, eol + 1 - splitdata);
+		size_t oldsplit = oldstart + lowerBoundPage(chunk.olddata + oldstart, chunk.oldlength - oldstart, pageid);
+		size_t newsplit = newstart + lowerBoundPage(chunk.newdata + newstart, chunk.newlength - newstart, pageid);
+		if (oldsplit == oldstart && newsplit == newstart) continue; // One page, or not past the last split
+
+		DiffChunk part = {tmplid, chunk.olddata + oldstart, oldsplit - oldstart, chunk.newdata + newstart, newsplit - newstart};
+		chunks->push_back(part);
+		oldstart = oldsplit;
+		newstart = newsplit;
+	}
+
+	DiffChunk last = {tmplid, chunk.olddata + oldstart, chunk.oldlength - oldstart, chunk.newdata + newstart, chunk.newlength - newstart};
+	chunks->push_back(last);
+}
+
+bool ParamsDiff::diffTemplate(unsigned long tmplid, const char *olddata, size_t oldlength, const char *newdata, size_t newlength,
+	string *dest, long long counts[3])
+{
+	PageRows oldrows(olddata, oldlength);
+	PageRows newrows(newdata, newlength);
+	vector<DiffField> oldfields, newfields;
+
+	while (! oldrows.done() || ! newrows.done()) {
+		unsigned long pageid;
+
+		if (newrows.done() || (! oldrows.done() && oldrows.pageid() < newrows.pageid())) {
+			pageid = oldrows.pageid();
+			oldrows.take(&oldfields);
+			newfields.clear();
+		} else if (oldrows.done() || newrows.pageid() < oldrows.pageid()) {
+			pageid = newrows.pageid();
+			newrows.take(&newfields);
+			oldfields.clear();
+		} else {
+			pageid = oldrows.pageid();
+			oldrows.take(&oldfields);
+			newrows.take(&newfields);
+		}
+
+		diffPage(tmplid, pageid, oldfields, newfields, dest, counts);
+	}
+
+	return ! oldrows.unsorted() && ! newrows.unsorted();
+}
+
+bool ParamsDiff::run(const vector<TemplateRange>& oldranges, const vector<TemplateRange>& newranges, int threads, OutputWriter *dest,
+	string *errmsg)
+{
+	if (threads <= 0) threads = thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+
+	// Pair the ranges by template id
+	vector<DiffChunk> chunks;
+	auto old_it = oldranges.begin();
+	auto new_it = newranges.begin();
+
+	while (old_it != oldranges.end() || new_it != newranges.end()) {
+		const TemplateRange *oldrange = 0;
+		const TemplateRange *newrange = 0;
+		if (new_it == newranges.end() || (old_it != oldranges.end() && old_it->tmplid < new_it->tmplid)) {
+			oldrange = &*old_it++;
+		} else if (old_it == oldranges.end() || new_it->tmplid < old_it->tmplid) {
+			newrange = &*new_it++;
+		} else {
+			oldrange = &*old_it++;
+			newrange = &*new_it++;
+		}
+		addChunks(oldrange ? oldrange->tmplid : newrange->tmplid, oldrange, newrange, &chunks);
+	}
+
+	// Workers diff the chunks into a window of slots, the calling thread writes them in order
+	struct ChunkResult {
+		string output;
+		array<long long, 3> counts;
+		bool sorted = false;
+		bool done = false;
+	};
+
+	size_t windowsize = threads * CHUNKS_PER_THREAD;
+	vector<ChunkResult> window(windowsize);
+	size_t nextchunk = 0;
+	size_t written = 0;
+	bool stop = false;
+	mutex windowmutex;
+	condition_variable chunkdone;
+	condition_variable chunkwritten;
+
+	auto worker = [&]() {
+		unique_lock<mutex> lock(windowmutex);
+
+		for (;;) {
+			chunkwritten.wait(lock, [&]() { return stop || nextchunk >= chunks.size() || nextchunk < written + windowsize; });
+			if (stop || nextchunk >= chunks.size()) return;
+			size_t i = nextchunk++;
+			lock.unlock();
+
+			const DiffChunk& chunk = chunks[i];
+			ChunkResult result;
+			result.counts = array<long long, 3>{{0, 0, 0}};
+			result.sorted = diffTemplate(chunk.tmplid, chunk.olddata, chunk.oldlength, chunk.newdata, chunk.newlength,
+				&result.output, result.counts.data());
+			result.done = true;
+
+			lock.lock();
+			window[i % windowsize] = move(result);
+			chunkdone.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+	int chunkthreads = min((size_t)threads, chunks.size());
+	for (int i = 0; i < chunkthreads; ++i) workers.emplace_back(worker);
+
+	bool sorted = true;
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		ChunkResult result;
+		{
+			unique_lock<mutex> lock(windowmutex);
+			chunkdone.wait(lock, [&]() { return window[i % windowsize].done; });
+			result = move(window[i % windowsize]);
+			window[i % windowsize] = ChunkResult();
+			written = i + 1;
+			if (! result.sorted) stop = true;
+			chunkwritten.notify_all();
+		}
+
+		if (! result.sorted) {
+			*errmsg = "page ids not ascending in template " + to_string(chunks[i].tmplid) + ", the params files must be sorted";
+			sorted = false;
+			break;
+		}
+
+		dest->write(result.output);
+		for (int j = 0; j < 3; ++j) counts[j] += result.counts[j];
+	}
+
+	for (auto &t : workers) t.join();
+	if (! sorted) return false;
+
+	if (! dest->flush()) {
+		*errmsg = "write failed";
+		return false;
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
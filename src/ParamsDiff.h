@@ -0,0 +1,120 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PARAMSDIFF_H_
+#define PARAMSDIFF_H_
+
+#include <string>
+#include <vector>
+#include "OffsetsScanner.h"
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Merge join diff of two sorted params files, per template, page and param name.
+ *
+ * Output rows:
+ * +	template id	page id	param name	new value
+ * -	template id	page id	param name	old value
+ * ~	template id	page id	param name	old value	new value
+ *
+ * The values of a param are compared over all instances of the template on the page.
+ * One old and one new value that differ are a change, otherwise the values only in one file are removed or added.
+ * Templates are diffed in parallel in chunks, templates larger than a chunk are split at page ids. The chunks are
+ * written in order as they finish and only a few per thread are held, so the memory use doesn't depend on the file sizes.
+ */
+class ParamsDiff
+{
+public:
+	static const size_t CHUNK_SIZE = 4 * 1024 * 1024;
+	static const size_t CHUNKS_PER_THREAD = 4; // Finished or running chunks waiting to be written
+
+	/**
+	 * constructor
+	 *
+	 * @param olddata Old sorted params
+	 * @param oldlength Length
+	 * @param newdata New sorted params
+	 * @param newlength Length
+	 * @param chunksize Old and new bytes of a template above which it is split
+	 */
+	ParamsDiff(const char *olddata, size_t oldlength, const char *newdata, size_t newlength, size_t chunksize = CHUNK_SIZE);
+
+	/**
+	 * Diff the files.
+	 *
+	 * @param oldranges Template ranges of the old file, ascending template ids
+	 * @param newranges Template ranges of the new file, ascending template ids
+	 * @param threads Threads, 0 = hardware concurrency
+	 * @param dest Output
+	 * @param errmsg Error message
+	 * @return false = write failed, or the page ids of a template are not ascending
+	 */
+	bool run(const std::vector<TemplateRange>& oldranges, const std::vector<TemplateRange>& newranges, int threads, OutputWriter *dest,
+		std::string *errmsg);
+
+	/**
+	 * Diff one template's rows.
+	 *
+	 * @param tmplid Template id
+	 * @param olddata Old rows of the template, may be 0 length
+	 * @param oldlength Length
+	 * @param newdata New rows of the template, may be 0 length
+	 * @param newlength Length
+	 * @param dest Diff rows are appended
+	 * @param counts Added, removed, changed counts are increased
+	 * @return false = the page ids are not ascending, the diff stops there
+	 */
+	static bool diffTemplate(unsigned long tmplid, const char *olddata, size_t oldlength, const char *newdata, size_t newlength,
+		std::string *dest, long long counts[3]);
+
+	long long getAdded() const { return counts[0]; }
+	long long getRemoved() const { return counts[1]; }
+	long long getChanged() const { return counts[2]; }
+
+	virtual ~ParamsDiff() {}
+
+protected:
+	const char *olddata;
+	size_t oldlength;
+	const char *newdata;
+	size_t newlength;
+	size_t chunksize;
+	long long counts[3] = {0, 0, 0};
+
+	/**
+	 * Rows of a template to diff, all of the template or the rows of a page id range
+	 */
+	struct DiffChunk {
+		unsigned long tmplid;
+		const char *olddata;
+		size_t oldlength;
+		const char *newdata;
+		size_t newlength;
+	};
+
+	void addChunks(unsigned long tmplid, const TemplateRange *oldrange, const TemplateRange *newrange, std::vector<DiffChunk> *chunks) const;
+
+private:
+	ParamsDiff() = delete;
+	ParamsDiff(const ParamsDiff& other) = delete;
+	ParamsDiff& operator= (const ParamsDiff& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* PARAMSDIFF_H_ */
@@ -19,6 +19,7 @@
 #include <map>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 
 using namespace std;
 
@@ -26,12 +27,68 @@ namespace phppreg {
 
 PhpPreg::PhpPreg(const PhpPreg& other)
 {
+	other.ensureStudied(); // Copies share the compiled pattern, so finish it first
 	errmsg = other.errmsg;
 	re = other.re;
+#ifdef PHPPREG_PCRE2
+	jitCompiled = other.jitCompiled;
+	utf = other.utf;
+#else
 	study = other.study;
+#endif
 	nameMap = other.nameMap;
+	captureCount = other.captureCount;
 }
 
+#ifdef PHPPREG_PCRE2
+namespace {
+
+/**
+ * Match data, match context and jit stack are reused for every match on a thread.
+ * The match data is sized for OVECCOUNT so any pattern can use it.
+ */
+class MatchResources
+{
+public:
+	pcre2_match_data *match_data;
+	pcre2_match_context *mcontext;
+	pcre2_jit_stack *jit_stack;
+
+	MatchResources() {
+		match_data = pcre2_match_data_create(OVECCOUNT / 3, NULL);
+		mcontext = pcre2_match_context_create(NULL);
+		jit_stack = pcre2_jit_stack_create(32 * 1024, 1024 * 1024, NULL);
+		if (mcontext && jit_stack) pcre2_jit_stack_assign(mcontext, NULL, jit_stack);
+	}
+
+	~MatchResources() {
+		pcre2_match_data_free(match_data);
+		pcre2_match_context_free(mcontext);
+		pcre2_jit_stack_free(jit_stack);
+	}
+};
+
+MatchResources& getMatchResources()
+{
+	static thread_local MatchResources resources;
+	return resources;
+}
+
+} /* namespace */
+
+string PhpPreg::getBackend()
+{
+	char version[32];
+	pcre2_config(PCRE2_CONFIG_VERSION, version);
+	return string("pcre2 ") + version;
+}
+#else
+string PhpPreg::getBackend()
+{
+	return string("pcre ") + pcre_version();
+}
+#endif
+
 /**
  * Necessary because static initializer was not getting called before class constructor was called.
  */
@@ -41,6 +98,19 @@ unique_ptr<map<char, int>>& PhpPreg::getModTable()
 
 	if (! modifiers->empty()) return modifiers;
 
+#ifdef PHPPREG_PCRE2
+	modifiers->insert(pair<char,int>('i', PCRE2_CASELESS));
+	modifiers->insert(pair<char,int>('m', PCRE2_MULTILINE));
+	modifiers->insert(pair<char,int>('s', PCRE2_DOTALL));
+	modifiers->insert(pair<char,int>('x', PCRE2_EXTENDED));
+	modifiers->insert(pair<char,int>('A', PCRE2_ANCHORED));
+	modifiers->insert(pair<char,int>('D', PCRE2_DOLLAR_ENDONLY));
+	modifiers->insert(pair<char,int>('S', -1));
+	modifiers->insert(pair<char,int>('U', PCRE2_UNGREEDY));
+	modifiers->insert(pair<char,int>('X', -1)); // pcre2 always errors on unknown escapes
+	modifiers->insert(pair<char,int>('J', PCRE2_DUPNAMES));
+	modifiers->insert(pair<char,int>('u', PCRE2_UTF | PCRE2_UCP));
+#else
 	modifiers->insert(pair<char,int>('i', PCRE_CASELESS));
 	modifiers->insert(pair<char,int>('m', PCRE_MULTILINE));
 	modifiers->insert(pair<char,int>('s', PCRE_DOTALL));
@@ -52,6 +122,7 @@ unique_ptr<map<char, int>>& PhpPreg::getModTable()
 	modifiers->insert(pair<char,int>('X', PCRE_EXTRA));
 	modifiers->insert(pair<char,int>('J', PCRE_INFO_JCHANGED));
 	modifiers->insert(pair<char,int>('u', PCRE_UTF8 | PCRE_UCP));
+#endif
 
 	return modifiers;
 }
@@ -62,8 +133,6 @@ unique_ptr<map<char, int>>& PhpPreg::getModTable()
 void PhpPreg::init(const string& pattern, int flags)
 {
 	int options = 0;
-	const char *errptr;
-	int erroffset;
 
 	if (pattern.length() < 3) {
 		errmsg = "pattern too short - 3 char min";
@@ -119,51 +188,58 @@ void PhpPreg::init(const string& pattern, int flags)
 
 	string realpattern = pattern.substr(1, endPos - 1);
 
+	compile(realpattern, options, flags);
+}
+
+#ifdef PHPPREG_PCRE2
+/**
+ * compile
+ */
+void PhpPreg::compile(const string& realpattern, int options, int flags)
+{
+	int errorcode;
+	PCRE2_SIZE erroffset;
+
 	// Compile the pattern
-	re.reset(pcre_compile(realpattern.c_str(), options, &errptr, &erroffset, NULL), ptr_fun(pcre_free));
+	re.reset(pcre2_compile(reinterpret_cast<PCRE2_SPTR>(realpattern.c_str()), realpattern.length(), options,
+		&errorcode, &erroffset, NULL), pcre2_code_free);
 
 	if (re == NULL) {
+		PCRE2_UCHAR buffer[256];
+		pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
 		ostringstream os;
-		os << "compile error (" << errptr << ") at offset " << erroffset;
+		os << "compile error (" << buffer << ") at offset " << erroffset;
 		errmsg = os.str();
 		return ;
 	}
 
-	// Study the pattern
-	if (flags & PREG_USE_JIT) flags |= PREG_STUDY_PATTERN;
+	utf = (options & PCRE2_UTF) != 0;
 
-	if (flags & PREG_STUDY_PATTERN) {
-		int studyoptions = 0;
-		if (flags & PREG_USE_JIT) studyoptions |= PCRE_STUDY_JIT_COMPILE;
+	if (flags & PREG_LAZY_JIT) lazyFlags = flags;
+	else studyPattern(flags);
 
-		study.reset(pcre_study(re.get(), studyoptions, &errptr), ptr_fun(pcre_free_study));
-
-		if (study == NULL) {
-			ostringstream os;
-			os << "study error (" << errptr << ")";
-			errmsg = os.str();
-			return ;
-		}
-	}
+	uint32_t capturecount;
+	pcre2_pattern_info(re.get(), PCRE2_INFO_CAPTURECOUNT, &capturecount);
+	captureCount = capturecount + 1;
 
 	// Store named parameter offsets
-	int namecount;
+	uint32_t namecount;
 
-	pcre_fullinfo(re.get(), study.get(), PCRE_INFO_NAMECOUNT, &namecount);
+	pcre2_pattern_info(re.get(), PCRE2_INFO_NAMECOUNT, &namecount);
 
 	if (namecount > 0) {
-		int name_entry_size;
-		unsigned char *name_table;
+		uint32_t name_entry_size;
+		PCRE2_SPTR name_table;
 		int n;
 
 		// Get the name table address and name entry size
 
-		pcre_fullinfo(re.get(), study.get(), PCRE_INFO_NAMETABLE, &name_table);
-		pcre_fullinfo(re.get(), study.get(), PCRE_INFO_NAMEENTRYSIZE, &name_entry_size);
+		pcre2_pattern_info(re.get(), PCRE2_INFO_NAMETABLE, &name_table);
+		pcre2_pattern_info(re.get(), PCRE2_INFO_NAMEENTRYSIZE, &name_entry_size);
 
 		// Store the offsets in the name map
 
-		for (int i = 0; i < namecount; ++i)
+		for (uint32_t i = 0; i < namecount; ++i)
 		{
 			n = (name_table[0] << 8) | name_table[1];
 			nameMap[string(reinterpret_cast<const char*>(name_table + 2))] = n;
@@ -173,89 +249,221 @@ void PhpPreg::init(const string& pattern, int flags)
 }
 
 /**
- * match
+ * studyPattern
+ *
+ * pcre2 always studies the pattern, jit is optional and a failure just means the interpreter is used
  */
-int PhpPreg::match(const string& subject, MatchVector *matches, int flags, int offset)
+void PhpPreg::studyPattern(int flags) const
 {
-	return matchImpl(subject, matches, flags, offset, 0);
+	if (flags & PREG_USE_JIT) {
+		size_t jitsize = 0;
+		if (pcre2_jit_compile(re.get(), PCRE2_JIT_COMPLETE) == 0
+			&& pcre2_pattern_info(re.get(), PCRE2_INFO_JITSIZE, &jitsize) == 0 && jitsize > 0) jitCompiled = true;
+	}
 }
 
 /**
- * matchAll
+ * getMemorySize
  */
-int PhpPreg::matchAll(const string& subject, vector<shared_ptr<MatchVector>> *matches, int flags, int offset)
+size_t PhpPreg::getMemorySize() const
 {
-	return matchImpl(subject, matches, flags, offset, 1);
+	size_t size = 0;
+	size_t jitsize = 0;
+	if (! re) return 0;
+
+	pcre2_pattern_info(re.get(), PCRE2_INFO_SIZE, &size);
+	pcre2_pattern_info(re.get(), PCRE2_INFO_JITSIZE, &jitsize);
+
+	return size + jitsize;
 }
 
 /**
- * matchImpl
+ * exec
+ *
+ * Run one match. Returns the capture count (0 = ovector too small), -1 = no match, < -1 = error (errmsg set).
  */
-int PhpPreg::matchImpl(const string& subject, void *matches, int flags, int offset, int matchall)
+int PhpPreg::exec(const char *subject, int length, int offset, bool notEmptyAtStart, const ovector_t **ovector)
 {
-	int ovector[OVECCOUNT];
+	MatchResources& res = getMatchResources();
+	PCRE2_SPTR subject_ptr = reinterpret_cast<PCRE2_SPTR>(subject);
 	int rc;
-	errmsg = "";
 
-	if (matches) {
-		if (matchall) ((vector<shared_ptr<MatchVector>> *)matches)->clear();
-		else ((MatchVector *)matches)->clear();
+	if (jitCompiled && ! utf && ! notEmptyAtStart) {
+		// Fast path. Skips the argument and utf validity checks, so only used for non-utf patterns.
+		rc = pcre2_jit_match(re.get(), subject_ptr, length, offset, 0, res.match_data, res.mcontext);
+	} else {
+		uint32_t options = notEmptyAtStart ? PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED : 0;
+		rc = pcre2_match(re.get(), subject_ptr, length, offset, options, res.match_data, res.mcontext);
 	}
 
-	rc = pcre_exec(re.get(), study.get(), subject.c_str(), subject.length(), offset, 0, ovector, OVECCOUNT);
+	*ovector = pcre2_get_ovector_pointer(res.match_data);
 
-	if (rc < 0) {
-		switch (rc) {
-			case PCRE_ERROR_NOMATCH:
-				// Not an error
-				break;
+	if (rc >= 0) return rc;
+	if (rc == PCRE2_ERROR_NOMATCH) return -1;
 
-			case PCRE_ERROR_BADUTF8:
-			case PCRE_ERROR_SHORTUTF8: {
-				ostringstream os;
-				os << "UTF8 error at offset " << ovector[0];
-				errmsg = os.str();
-				}
-				break;
+	ostringstream os;
+	if (rc <= PCRE2_ERROR_UTF8_ERR1 && rc >= PCRE2_ERROR_UTF8_ERR21) {
+		os << "UTF8 error at offset " << pcre2_get_startchar(res.match_data);
+	} else {
+		os << "match error = " << rc;
+	}
+	errmsg = os.str();
 
-			default: {
-				ostringstream os;
-				os << "match error = " << rc;
-				errmsg = os.str();
-				}
-				break;
-		}
+	return -2;
+}
 
-		return 0;
+/**
+ * Determine if the match loop must step over a whole utf8 character or a CRLF after an empty match.
+ */
+static void getNewlineInfo(const pcre2_code *re, int *utf8, int *crlf_is_newline)
+{
+	uint32_t option_bits;
+	uint32_t newline;
+
+	pcre2_pattern_info(re, PCRE2_INFO_ALLOPTIONS, &option_bits);
+	*utf8 = (option_bits & PCRE2_UTF) != 0;
+
+	pcre2_pattern_info(re, PCRE2_INFO_NEWLINE, &newline);
+	*crlf_is_newline = newline == PCRE2_NEWLINE_ANY ||
+		newline == PCRE2_NEWLINE_CRLF ||
+		newline == PCRE2_NEWLINE_ANYCRLF;
+}
+#else
+/**
+ * compile
+ */
+void PhpPreg::compile(const string& realpattern, int options, int flags)
+{
+	const char *errptr;
+	int erroffset;
+
+	// Compile the pattern
+	re.reset(pcre_compile(realpattern.c_str(), options, &errptr, &erroffset, NULL), ptr_fun(pcre_free));
+
+	if (re == NULL) {
+		ostringstream os;
+		os << "compile error (" << errptr << ") at offset " << erroffset;
+		errmsg = os.str();
+		return ;
 	}
 
-	// Check for too many captures, and use max allowed captures
-	if (rc == 0) {
-		rc = OVECCOUNT/3;
+	int capturecount;
+	pcre_fullinfo(re.get(), NULL, PCRE_INFO_CAPTURECOUNT, &capturecount);
+	captureCount = capturecount + 1;
+
+	// Store named parameter offsets
+	int namecount;
+
+	pcre_fullinfo(re.get(), NULL, PCRE_INFO_NAMECOUNT, &namecount);
+
+	if (namecount > 0) {
+		int name_entry_size;
+		unsigned char *name_table;
+		int n;
+
+		// Get the name table address and name entry size
+
+		pcre_fullinfo(re.get(), NULL, PCRE_INFO_NAMETABLE, &name_table);
+		pcre_fullinfo(re.get(), NULL, PCRE_INFO_NAMEENTRYSIZE, &name_entry_size);
+
+		// Store the offsets in the name map
+
+		for (int i = 0; i < namecount; ++i)
+		{
+			n = (name_table[0] << 8) | name_table[1];
+			nameMap[string(reinterpret_cast<const char*>(name_table + 2))] = n;
+			name_table += name_entry_size;
+		}
+	}
+
+	if (flags & PREG_LAZY_JIT) lazyFlags = flags;
+	else studyPattern(flags);
+}
+
+/**
+ * studyPattern
+ */
+void PhpPreg::studyPattern(int flags) const
+{
+	const char *errptr;
+
+	// Study the pattern
+	if (flags & PREG_USE_JIT) flags |= PREG_STUDY_PATTERN;
+
+	if (flags & PREG_STUDY_PATTERN) {
+		int studyoptions = 0;
+		if (flags & PREG_USE_JIT) studyoptions |= PCRE_STUDY_JIT_COMPILE;
+
+		study.reset(pcre_study(re.get(), studyoptions, &errptr), ptr_fun(pcre_free_study));
+
+		if (study == NULL) {
+			ostringstream os;
+			os << "study error (" << errptr << ")";
+			const_cast<PhpPreg *>(this)->errmsg = os.str();
+			return ;
+		}
 	}
+}
 
-	if (! matchall) {
-		if (matches) loadMatchVector(*(MatchVector *)matches, rc, subject, ovector);
-		return 1;
+/**
+ * getMemorySize
+ */
+size_t PhpPreg::getMemorySize() const
+{
+	size_t size = 0;
+	size_t studysize = 0;
+	size_t jitsize = 0;
+	if (! re) return 0;
+
+	pcre_fullinfo(re.get(), NULL, PCRE_INFO_SIZE, &size);
+	if (study) {
+		pcre_fullinfo(re.get(), study.get(), PCRE_INFO_STUDYSIZE, &studysize);
+		pcre_fullinfo(re.get(), study.get(), PCRE_INFO_JITSIZE, &jitsize);
 	}
 
-	if (matches) {
-		MatchVector *mv = new MatchVector();
-		loadMatchVector(*mv, rc, subject, ovector);
-		((vector<shared_ptr<MatchVector>> *)matches)->emplace_back(mv);
+	return size + studysize + jitsize;
+}
+
+/**
+ * exec
+ *
+ * Run one match. Returns the capture count (0 = ovector too small), -1 = no match, < -1 = error (errmsg set).
+ */
+int PhpPreg::exec(const char *subject, int length, int offset, bool notEmptyAtStart, const ovector_t **ovector)
+{
+	static thread_local int ovec[OVECCOUNT];
+
+	int options = notEmptyAtStart ? PCRE_NOTEMPTY_ATSTART | PCRE_ANCHORED : 0;
+	int rc = pcre_exec(re.get(), study.get(), subject, length, offset, options, ovec, OVECCOUNT);
+
+	*ovector = ovec;
+
+	if (rc >= 0) return rc;
+	if (rc == PCRE_ERROR_NOMATCH) return -1;
+
+	ostringstream os;
+	if (rc == PCRE_ERROR_BADUTF8 || rc == PCRE_ERROR_SHORTUTF8) {
+		os << "UTF8 error at offset " << ovec[0];
+	} else {
+		os << "match error = " << rc;
 	}
+	errmsg = os.str();
 
-	int matchcount = 1;
+	return -2;
+}
 
-	/* Before running the loop, check for UTF-8 and whether CRLF is a valid newline
-	sequence. First, find the options with which the regex was compiled; extract
+/**
+ * Determine if the match loop must step over a whole utf8 character or a CRLF after an empty match.
+ */
+static void getNewlineInfo(const pcre *re, const pcre_extra *study, int *utf8, int *crlf_is_newline)
+{
+	/* Find the options with which the regex was compiled; extract
 	the UTF-8 state, and mask off all but the newline options. */
 
 	unsigned int option_bits;
-	int subject_length = subject.length();
 
-	pcre_fullinfo(re.get(), study.get(), PCRE_INFO_OPTIONS, &option_bits);
-	int utf8 = option_bits & PCRE_UTF8;
+	pcre_fullinfo(re, study, PCRE_INFO_OPTIONS, &option_bits);
+	*utf8 = option_bits & PCRE_UTF8;
 	option_bits &= PCRE_NEWLINE_CR | PCRE_NEWLINE_LF | PCRE_NEWLINE_CRLF |
 	               PCRE_NEWLINE_ANY |PCRE_NEWLINE_ANYCRLF;
 
@@ -275,30 +483,131 @@ int PhpPreg::matchImpl(const string& subject, void *matches, int flags, int offs
 
 	// See if CRLF is a valid newline sequence.
 
-	int crlf_is_newline =
+	*crlf_is_newline =
 	     option_bits == PCRE_NEWLINE_ANY ||
 	     option_bits == PCRE_NEWLINE_CRLF ||
 	     option_bits == PCRE_NEWLINE_ANYCRLF;
+}
+#endif
+
+/**
+ * ensureStudied
+ *
+ * Run a deferred PREG_LAZY_JIT study/jit compile once.
+ */
+void PhpPreg::ensureStudied() const
+{
+	if (! lazyFlags) return;
+
+	call_once(lazyOnce, [this]() {
+		auto start = chrono::steady_clock::now();
+		studyPattern(lazyFlags);
+		jitNanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		lazyFlags = 0;
+	});
+}
+
+/**
+ * match
+ */
+int PhpPreg::match(const string& subject, MatchVector *matches, int flags, int offset)
+{
+	return matchImpl(subject, matches, flags, offset, 0);
+}
+
+/**
+ * matchAll
+ */
+int PhpPreg::matchAll(const string& subject, vector<shared_ptr<MatchVector>> *matches, int flags, int offset)
+{
+	return matchImpl(subject, matches, flags, offset, 1);
+}
+
+/**
+ * matchImpl
+ */
+int PhpPreg::matchImpl(const string& subject, void *matches, int, int offset, int matchall)
+{
+	if (! matches) return execAll(subject.c_str(), subject.length(), offset, matchall, 0, 0);
+
+	if (matchall) {
+		((vector<shared_ptr<MatchVector>> *)matches)->clear();
+		return execAll(subject.c_str(), subject.length(), offset, true, &PhpPreg::addMatchVector, matches);
+	}
+
+	((MatchVector *)matches)->clear();
+	return execAll(subject.c_str(), subject.length(), offset, false, &PhpPreg::loadMatchVector, matches);
+}
+
+void PhpPreg::addMatchVector(const PhpPreg& preg, void *dest, int capcount, const char *subject, const ovector_t ovector[])
+{
+	MatchVector *mv = new MatchVector();
+	loadMatchVector(preg, mv, capcount, subject, ovector);
+	((vector<shared_ptr<MatchVector>> *)dest)->emplace_back(mv);
+}
+
+/**
+ * execAll
+ *
+ * The match loop, onmatch is called with the captures of each match.
+ */
+int PhpPreg::execAll(const char *subject, int subject_length, int offset, bool matchall, MatchFunc onmatch, void *dest, StopFunc stop, void *stoparg)
+{
+	const ovector_t *ovector;
+	int rc;
+	errmsg = "";
+
+	if (lazyFlags) ensureStudied();
+
+	rc = exec(subject, subject_length, offset, false, &ovector);
+
+	if (rc < 0) return 0; // No match or error
+
+	// Check for too many captures, and use max allowed captures
+	if (rc == 0) {
+		rc = OVECCOUNT/3;
+	}
+
+	if (onmatch) onmatch(*this, dest, rc, subject, ovector);
+	if (! matchall) return 1;
+
+	int matchcount = 1;
+
+	/* Before running the loop, check for UTF-8 and whether CRLF is a valid newline
+	sequence. */
+
+	int utf8;
+	int crlf_is_newline;
+
+#ifdef PHPPREG_PCRE2
+	getNewlineInfo(re.get(), &utf8, &crlf_is_newline);
+#else
+	getNewlineInfo(re.get(), study.get(), &utf8, &crlf_is_newline);
+#endif
 
 	// Loop for second and subsequent matches
 	int options;
 	int start_offset;
+	int match_start = ovector[0];
+	int end_offset = ovector[1];
 
 	for (;;) {
+		if (stop && stop(stoparg)) break;
+
 		options = 0;                 /* Normally no options */
-		start_offset = ovector[1];   /* Start at end of previous match */
+		start_offset = end_offset;   /* Start at end of previous match */
 
 		/* If the previous match was for an empty string, we are finished if we are
 		at the end of the subject. Otherwise, arrange to run another match at the
 		same point to see if a non-empty match can be found. */
 
-		if (ovector[0] == ovector[1]) {
-			if (ovector[0] == subject_length) break;
-			options = PCRE_NOTEMPTY_ATSTART | PCRE_ANCHORED;
+		if (match_start == end_offset) {
+			if (end_offset == subject_length) break;
+			options = 1;             /* Not empty at start and anchored */
 	    }
 
 		// Run the next matching operation
-		rc = pcre_exec(re.get(), study.get(), subject.c_str(), subject.length(), start_offset, options, ovector, OVECCOUNT);
+		rc = exec(subject, subject_length, start_offset, options != 0, &ovector);
 
 		/* This time, a result of NOMATCH isn't an error. If the value in "options"
 		is zero, it just means we have found all possible matches, so the loop ends.
@@ -313,20 +622,20 @@ int PhpPreg::matchImpl(const string& subject, void *matches, int flags, int offs
 		Otherwise we must ensure that we skip an entire UTF-8 character if we are in
 		UTF-8 mode. */
 
-		if (rc == PCRE_ERROR_NOMATCH) {
+		if (rc == -1) {
 			if (options == 0) break;                    // All matches found
-			ovector[1] = start_offset + 1;              // Advance one byte
+			end_offset = start_offset + 1;              // Advance one byte
 			if (crlf_is_newline &&                      // If CRLF is newline &
 					start_offset < subject_length - 1 &&    // we are at CRLF,
 					subject[start_offset] == '\r' &&
 					subject[start_offset + 1] == '\n')
-				ovector[1] += 1;                          // Advance by one more.
+				end_offset += 1;                          // Advance by one more.
 			else if (utf8)                              // Otherwise, ensure we
 			{                                         // advance a whole UTF-8
-				while (ovector[1] < subject_length)       // character.
+				while (end_offset < subject_length)       // character.
 				{
-					if ((subject[ovector[1]] & 0xc0) != 0x80) break;
-					ovector[1] += 1;
+					if ((subject[end_offset] & 0xc0) != 0x80) break;
+					end_offset += 1;
 				}
 			}
 			continue;    // Go round the loop again
@@ -334,39 +643,18 @@ int PhpPreg::matchImpl(const string& subject, void *matches, int flags, int offs
 
 		// Other matching errors are not recoverable.
 
-		if (rc < 0) {
-			switch (rc) {
-				case PCRE_ERROR_BADUTF8:
-				case PCRE_ERROR_SHORTUTF8: {
-					ostringstream os;
-					os << "UTF8 error at offset " << ovector[0];
-					errmsg = os.str();
-					}
-					break;
-
-				default: {
-					ostringstream os;
-					os << "match error = " << rc;
-					errmsg = os.str();
-					}
-					break;
-			}
-
-			return 0;
-		}
+		if (rc < 0) return 0;
 
 		++matchcount;
+		match_start = ovector[0];
+		end_offset = ovector[1];
 
 		// Check for too many captures, and use max allowed captures
 		if (rc == 0) {
 			rc = OVECCOUNT/3;
 		}
 
-		if (matches) {
-			MatchVector *mv = new MatchVector();
-			loadMatchVector(*mv, rc, subject, ovector);
-			((vector<shared_ptr<MatchVector>> *)matches)->emplace_back(mv);
-		}
+		if (onmatch) onmatch(*this, dest, rc, subject, ovector);
 	} // End of loop to find second and subsequent matches
 
 	return matchcount;
@@ -375,19 +663,28 @@ int PhpPreg::matchImpl(const string& subject, void *matches, int flags, int offs
 /**
  * loadMatchVector
  */
-void PhpPreg::loadMatchVector(MatchVector& matches, int capcount, const string& subject, const int ovector[]) const
+void PhpPreg::loadMatchVector(const PhpPreg& preg, void *dest, int capcount, const char *subject, const ovector_t ovector[])
 {
-	const char *subject_ptr = subject.c_str();
+	MatchVector& matches = *(MatchVector *)dest;
 	int startPos;
 
-	if (nameMap.size()) matches.fillMap(nameMap);
+	if (preg.nameMap.size()) matches.fillMap(preg.nameMap);
 
 	for (int i = 0; i < capcount; ++i) {
-		startPos = ovector[2*i];
-		matches.addItem(startPos, subject_ptr + startPos, ovector[2*i+1] - startPos);
+		startPos = (int)ovector[2*i]; // unset captures are -1
+		matches.addItem(startPos, subject + startPos, (int)ovector[2*i+1] - startPos);
 	}
 }
 
+/**
+ * getGroupNumber
+ */
+int PhpPreg::getGroupNumber(const string& name) const
+{
+	auto name_it = nameMap.find(name);
+	return name_it == nameMap.end() ? -1 : name_it->second;
+}
+
 /**
  * replace
  */
@@ -20,7 +20,18 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+#ifdef PHPPREG_PCRE2
+#ifndef PCRE2_CODE_UNIT_WIDTH
+#define PCRE2_CODE_UNIT_WIDTH 8
+#endif
+#include <pcre2.h>
+#else
 #include <pcre.h>
+#endif
 
 #include "PregMatch.h"
 
@@ -36,7 +47,8 @@ public:
 	 */
 	enum COMPILE_OPTIONS {
 		PREG_STUDY_PATTERN = 1,//!< PREG_STUDY_PATTERN Take extra time to study the pattern to improve performance
-		PREG_USE_JIT = 2       //!< PREG_USE_JIT Use the jit compiler if available to improve performance. implies PREG_STUDY_PATTERN
+		PREG_USE_JIT = 2,      //!< PREG_USE_JIT Use the jit compiler if available to improve performance. implies PREG_STUDY_PATTERN
+		PREG_LAZY_JIT = 4      //!< PREG_LAZY_JIT Defer the study/jit compile until the first match
 	};
 
 	/**
@@ -87,6 +99,42 @@ public:
 	 */
 	std::string getErrorMsg() const { return errmsg; }
 
+	/**
+	 * getBackend
+	 *
+	 * Get the name and version of the regex library compiled in (-DPHPPREG_PCRE2 selects pcre2)
+	 *
+	 * @return Backend name and version
+	 */
+	static std::string getBackend();
+
+	/**
+	 * getMemorySize
+	 *
+	 * Get the memory used by the compiled pattern, study data and jit code
+	 *
+	 * @return Size in bytes
+	 */
+	size_t getMemorySize() const;
+
+	/**
+	 * isStudied
+	 *
+	 * Check if a PREG_LAZY_JIT study/jit compile has been done
+	 *
+	 * @return true = study done or not deferred
+	 */
+	bool isStudied() const { return lazyFlags == 0; }
+
+	/**
+	 * getJitNanos
+	 *
+	 * Get the time spent in a deferred study/jit compile
+	 *
+	 * @return Nanoseconds
+	 */
+	long long getJitNanos() const { return jitNanos; }
+
 	/**
 	 * match
 	 *
@@ -113,6 +161,58 @@ public:
 	 */
 	int matchAll(const std::string& subject, std::vector<std::shared_ptr<MatchVector>> *matches = NULL, int flags = 0, int offset = 0);
 
+	/**
+	 * matchAllOffsets
+	 *
+	 * matchAll without the MatchVector allocations, ie. into arena memory. For each match the start and end offsets
+	 * of every capture (getCaptureCount() pairs, the whole match first, -1 = unset) are appended to offsets.
+	 *
+	 * @param subject Text to perform matching on, need not be nul terminated
+	 * @param length Subject length in bytes
+	 * @param offsets Vector of int
+	 * @return 0 = no matches or error, call isError() to determine if error; >0 = match count
+	 */
+	template <class IntVector>
+	int matchAllOffsets(const char *subject, size_t length, IntVector *offsets)
+	{
+		return execAll(subject, length, 0, true, &PhpPreg::appendOffsets<IntVector>, offsets);
+	}
+
+	typedef bool (*StopFunc)(void *stoparg);
+
+	/**
+	 * matchAllOffsets
+	 *
+	 * matchAllOffsets that calls stop before each match after the first, ie. to check a deadline.
+	 *
+	 * @param subject Text to perform matching on, need not be nul terminated
+	 * @param length Subject length in bytes
+	 * @param offsets Vector of int
+	 * @param stop true = stop matching, the matches so far are returned
+	 * @param stoparg Passed to stop
+	 * @return 0 = no matches or error, call isError() to determine if error; >0 = match count
+	 */
+	template <class IntVector>
+	int matchAllOffsets(const char *subject, size_t length, IntVector *offsets, StopFunc stop, void *stoparg)
+	{
+		return execAll(subject, length, 0, true, &PhpPreg::appendOffsets<IntVector>, offsets, stop, stoparg);
+	}
+
+	/**
+	 * getCaptureCount
+	 *
+	 * @return Number of captures including the whole match
+	 */
+	int getCaptureCount() const { return captureCount; }
+
+	/**
+	 * getGroupNumber
+	 *
+	 * @param name Named capture
+	 * @return Capture number, -1 = no such name
+	 */
+	int getGroupNumber(const std::string& name) const;
+
 	/**
 	 * replace
 	 *
@@ -129,15 +229,49 @@ public:
 	virtual ~PhpPreg() {}
 
 protected:
+#ifdef PHPPREG_PCRE2
+	typedef PCRE2_SIZE ovector_t;
+#else
+	typedef int ovector_t;
+#endif
+
 	std::string errmsg;
+#ifdef PHPPREG_PCRE2
+	std::shared_ptr<pcre2_code> re;
+	mutable bool jitCompiled = false; // pcre2_jit_match fast path available
+	bool utf = false;
+#else
 	std::shared_ptr<pcre> re;
-	std::shared_ptr<pcre_extra> study;
+	mutable std::shared_ptr<pcre_extra> study;
+#endif
 	std::map<std::string, int> nameMap;
+	int captureCount = 0;
+	mutable std::atomic<int> lazyFlags{0}; // PREG_LAZY_JIT flags waiting for the first match
+	mutable std::once_flag lazyOnce;
+	mutable long long jitNanos = 0;
 
 	std::unique_ptr<std::map<char, int>>& getModTable();
 	void init(const std::string& pattern, int flags);
+	void compile(const std::string& realpattern, int options, int flags);
+	void studyPattern(int flags) const;
+	void ensureStudied() const;
+	typedef void (*MatchFunc)(const PhpPreg& preg, void *dest, int capcount, const char *subject, const ovector_t ovector[]);
+
+	int exec(const char *subject, int length, int offset, bool notEmptyAtStart, const ovector_t **ovector);
+	int execAll(const char *subject, int length, int offset, bool matchall, MatchFunc onmatch, void *dest, StopFunc stop = 0, void *stoparg = 0);
 	int matchImpl(const std::string& subject, void *matches, int flags, int offset, int matchall);
-	void loadMatchVector(MatchVector& matches, int capcount, const std::string& subject, const int ovector[]) const;
+	static void loadMatchVector(const PhpPreg& preg, void *dest, int capcount, const char *subject, const ovector_t ovector[]);
+	static void addMatchVector(const PhpPreg& preg, void *dest, int capcount, const char *subject, const ovector_t ovector[]);
+
+	template <class IntVector>
+	static void appendOffsets(const PhpPreg& preg, void *dest, int capcount, const char *, const ovector_t ovector[])
+	{
+		IntVector *offsets = (IntVector *)dest;
+		for (int i = 0; i < preg.captureCount; ++i) {
+			offsets->push_back(i < capcount ? (int)ovector[2*i] : -1);
+			offsets->push_back(i < capcount ? (int)ovector[2*i+1] : -1);
+		}
+	}
 
 private:
 	PhpPreg(PhpPreg&& other) = delete;
@@ -0,0 +1,63 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "PhpPregRegistry.h"
+#include <chrono>
+
+using namespace std;
+
+namespace phppreg {
+
+mutex PhpPregRegistry::mtx;
+map<pair<string, int>, unique_ptr<PhpPreg>> PhpPregRegistry::patterns;
+long long PhpPregRegistry::requestcnt = 0;
+long long PhpPregRegistry::compileNanos = 0;
+
+PhpPreg& PhpPregRegistry::get(const string& pattern, int flags)
+{
+	lock_guard<mutex> lock(mtx);
+	++requestcnt;
+
+	unique_ptr<PhpPreg>& entry = patterns[make_pair(pattern, flags)];
+
+	if (! entry) {
+		auto start = chrono::steady_clock::now();
+		entry.reset(new PhpPreg(pattern, flags));
+		compileNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+
+	return *entry;
+}
+
+void PhpPregRegistry::writeStats(ostream& os)
+{
+	lock_guard<mutex> lock(mtx);
+	size_t memory = 0;
+	long long jitNanos = 0;
+	int jitcnt = 0;
+
+	for (auto &pattern_pair : patterns) {
+		const PhpPreg& preg = *pattern_pair.second;
+		memory += preg.getMemorySize();
+		if (preg.isStudied()) ++jitcnt;
+		jitNanos += preg.getJitNanos();
+	}
+
+	os << "regex registry: " << requestcnt << " requests, " << patterns.size() << " patterns, " << jitcnt << " studied, "
+		<< compileNanos / 1000 << " us compile, " << jitNanos / 1000 << " us jit, " << memory << " bytes\n";
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,66 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef PHPPREGREGISTRY_H_
+#define PHPPREGREGISTRY_H_
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include "PhpPreg.h"
+
+namespace phppreg {
+
+/**
+ * Process wide store of compiled patterns. Identical pattern/flags pairs share one PhpPreg,
+ * which lives until the process exits.
+ */
+class PhpPregRegistry
+{
+public:
+	/**
+	 * get
+	 *
+	 * Get the shared compiled instance of a pattern, compiling it on first request.
+	 * The study/jit compile is deferred to the first match.
+	 *
+	 * @param pattern Pattern to match against
+	 * @param flags PhpPreg::COMPILE_OPTIONS
+	 * @return Shared instance, check isError() for compile errors
+	 */
+	static PhpPreg& get(const std::string& pattern, int flags = PhpPreg::PREG_USE_JIT | PhpPreg::PREG_LAZY_JIT);
+
+	/**
+	 * writeStats
+	 *
+	 * Write request count, distinct pattern count, compile time and memory usage.
+	 *
+	 * @param os Output stream
+	 */
+	static void writeStats(std::ostream& os);
+
+protected:
+	static std::mutex mtx;
+	static std::map<std::pair<std::string, int>, std::unique_ptr<PhpPreg>> patterns;
+	static long long requestcnt;
+	static long long compileNanos;
+};
+
+} /* namespace phppreg */
+
+#endif /* PHPPREGREGISTRY_H_ */
@@ -21,7 +21,14 @@
 #include <map>
 #include <vector>
 #include <memory>
+
+#ifdef PHPPREG_PCRE2
+#ifndef PCRECPP_EXP_DEFN
+#define PCRECPP_EXP_DEFN
+#endif
+#else
 #include <pcre.h>
+#endif
 
 namespace phppreg {
 
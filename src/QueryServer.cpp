@@ -0,0 +1,381 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "QueryServer.h"
+#include "string_util.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace phppreg {
+
+bool QueryServer::open(const string& paramsfilepath, const string& offsetsfilepath, const string& totalsfilepath,
+	const string& indexfilepath, string *errmsg)
+{
+	if (! params.open(paramsfilepath)) {
+		*errmsg = "open failed for " + paramsfilepath;
+		return false;
+	}
+
+	if (! offsets.open(offsetsfilepath)) {
+		*errmsg = "open failed for " + offsetsfilepath;
+		return false;
+	}
+
+	if (! totals.open(totalsfilepath)) {
+		*errmsg = "open failed for " + totalsfilepath;
+		return false;
+	}
+
+	if (! indexfilepath.empty()) {
+		if (! pageindex.open(indexfilepath)) {
+			*errmsg = "open failed or not a page index " + indexfilepath;
+			return false;
+		}
+
+		haspageindex = true;
+	}
+
+	if (! parseOffsets(errmsg)) return false;
+	parseTotals();
+
+	return true;
+}
+
+bool QueryServer::parseOffsets(string *errmsg)
+{
+	vector<TemplateRange> ranges;
+	if (! OffsetsScanner::readOffsets(offsets.data(), offsets.size(), params.data(), params.size(), &ranges, errmsg)) return false;
+
+	for (auto &range : ranges) offsetstable[range.tmplid] = range;
+
+	return true;
+}
+
+/**
+ * Totals are a T line per template followed by its P lines.
+ */
+void QueryServer::parseTotals()
+{
+	const char *data = totals.data();
+	const char *ptr = data;
+	const char *end = data + totals.size();
+	unsigned long tmplid = 0;
+	bool intemplate = false;
+
+	while (ptr < end) {
+		const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+		const char *next = eol ? eol + 1 : end;
+
+		if (*ptr == 'T') {
+			tmplid = strtoul(ptr + 1, NULL, 10);
+			totalstable[tmplid] = make_pair(ptr - data, next - ptr);
+			intemplate = true;
+		} else if (intemplate) {
+			totalstable[tmplid].second += next - ptr;
+		}
+
+		ptr = next;
+	}
+}
+
+shared_ptr<const QueryServer::DecodedRange> QueryServer::decodeRange(const TemplateRange& entry)
+{
+	shared_ptr<DecodedRange> range = make_shared<DecodedRange>();
+	const char *ptr = params.data() + entry.offset;
+	const char *end = ptr + entry.length;
+
+	if (entry.rows > 0) range->rows.reserve(entry.rows);
+
+	while (ptr < end) {
+		const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+		const char *next = eol ? eol + 1 : end;
+		const char *rowend = eol ? eol : end;
+
+		if (ptr == rowend) {
+			ptr = next;
+			continue;
+		}
+
+		DecodedRow row;
+		row.row = ptr;
+		row.length = next - ptr;
+
+		// Skip the template id and page id
+		const char *field = ptr;
+		for (int i = 0; i < 2 && field; ++i) {
+			field = (const char *)memchr(field, '\t', rowend - field);
+			if (field) ++field;
+		}
+
+		while (field && field <= rowend) {
+			const char *nameend = (const char *)memchr(field, '\t', rowend - field);
+			if (! nameend) break;
+			const char *value = nameend + 1;
+			const char *valueend = (const char *)memchr(value, '\t', rowend - value);
+			if (! valueend) valueend = rowend;
+
+			Field name = {field, (size_t)(nameend - field)};
+			Field val = {value, (size_t)(valueend - value)};
+			row.params.push_back(make_pair(name, val));
+
+			field = valueend + 1;
+		}
+
+		range->bytes += sizeof(DecodedRow) + row.params.capacity() * sizeof(pair<Field, Field>);
+		range->rows.push_back(move(row));
+		ptr = next;
+	}
+
+	return range;
+}
+
+shared_ptr<const QueryServer::DecodedRange> QueryServer::getRange(unsigned long tmplid)
+{
+	auto offset_it = offsetstable.find(tmplid);
+	if (offset_it == offsetstable.end()) return shared_ptr<const DecodedRange>();
+
+	{
+		lock_guard<mutex> lock(cachemutex);
+		auto cache_it = cache.find(tmplid);
+		if (cache_it != cache.end()) {
+			lru.splice(lru.begin(), lru, cache_it->second);
+			++cachehits;
+			return cache_it->second->second;
+		}
+	}
+
+	++cachemisses;
+	shared_ptr<const DecodedRange> range = decodeRange(offset_it->second);
+
+	lock_guard<mutex> lock(cachemutex);
+	if (cache.find(tmplid) != cache.end() || range->bytes > cachesize) return range;
+
+	lru.push_front(make_pair(tmplid, range));
+	cache[tmplid] = lru.begin();
+	cachebytes += range->bytes;
+
+	while (cachebytes > cachesize) {
+		cachebytes -= lru.back().second->bytes;
+		cache.erase(lru.back().first);
+		lru.pop_back();
+	}
+
+	return range;
+}
+
+bool QueryServer::queryTemplate(unsigned long tmplid, string *body)
+{
+	auto totals_it = totalstable.find(tmplid);
+	if (totals_it != totalstable.end()) body->append(totals.data() + totals_it->second.first, totals_it->second.second);
+
+	// The rows are a contiguous range of the mapping, only param queries need them decoded
+	auto offset_it = offsetstable.find(tmplid);
+	if (offset_it == offsetstable.end()) return totals_it != totalstable.end();
+
+	body->append(params.data() + offset_it->second.offset, offset_it->second.length);
+
+	return true;
+}
+
+bool QueryServer::queryParam(unsigned long tmplid, const string& paramname, string *body)
+{
+	shared_ptr<const DecodedRange> range = getRange(tmplid);
+	if (! range) return false;
+
+	for (auto &row : range->rows) {
+		for (auto &param : row.params) {
+			if (param.first.length != paramname.length() || memcmp(param.first.data, paramname.data(), param.first.length) != 0) continue;
+
+			// template id, page id, the row has params so both tabs are there
+			const char *tmplend = (const char *)memchr(row.row, '\t', row.length);
+			const char *pageend = (const char *)memchr(tmplend + 1, '\t', row.row + row.length - tmplend - 1);
+			body->append(row.row, pageend - row.row + 1);
+			body->append(param.first.data, param.first.length);
+			*body += '\t';
+			body->append(param.second.data, param.second.length);
+			*body += '\n';
+		}
+	}
+
+	return true;
+}
+
+bool QueryServer::queryPage(unsigned long pageid, string *body)
+{
+	const PageIndexEntry *end;
+	const PageIndexEntry *entry = pageindex.find(pageid, &end);
+	const char *data = params.data();
+	size_t size = params.size();
+
+	for (; entry < end; ++entry) {
+		string rowprefix = to_string(entry->tmplid) + "\t" + to_string(entry->pageid);
+		size_t offset = entry->offset;
+
+		while (offset < size) {
+			const char *eol = (const char *)memchr(data + offset, '\n', size - offset);
+			size_t next = eol ? eol + 1 - data : size;
+			size_t prefixend = offset + rowprefix.length();
+
+			if (prefixend > next || memcmp(data + offset, rowprefix.data(), rowprefix.length()) != 0
+				|| (prefixend < next && data[prefixend] != '\t' && data[prefixend] != '\n')) break;
+
+			body->append(data + offset, next - offset);
+			offset = next;
+		}
+	}
+
+	return true;
+}
+
+string QueryServer::handleRequest(const string& request)
+{
+	auto starttime = chrono::steady_clock::now();
+	++requestcnt;
+
+	string command;
+	string arg;
+	string::size_type space = request.find(' ');
+	command = request.substr(0, space);
+	if (space != string::npos) arg = request.substr(space + 1);
+
+	string body;
+	string error;
+
+	if (command == "template") {
+		if (! queryTemplate(strtoul(arg.c_str(), NULL, 10), &body)) error = "unknown template id";
+	} else if (command == "param") {
+		string::size_type namestart = arg.find(' ');
+		if (namestart == string::npos) error = "usage: param <template id> <param name>";
+		else if (! queryParam(strtoul(arg.c_str(), NULL, 10), arg.substr(namestart + 1), &body)) error = "unknown template id";
+	} else if (command == "page") {
+		if (! haspageindex) error = "no page index";
+		else queryPage(strtoul(arg.c_str(), NULL, 10), &body);
+	} else if (command == "stats") {
+		lock_guard<mutex> lock(cachemutex);
+		body = "requests\t" + to_string(requestcnt) + "\ncache hits\t" + to_string(cachehits) + "\ncache misses\t"
+			+ to_string(cachemisses) + "\ncached templates\t" + to_string(cache.size()) + "\ncache bytes\t" + to_string(cachebytes) + "\n";
+	} else {
+		error = "unknown request";
+	}
+
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - starttime).count();
+	if (verbose) cerr << request << "\t" << elapsed << " us\n";
+
+	if (! error.empty()) return "ERR " + error + "\n";
+
+	return "OK " + to_string(body.length()) + " " + to_string(elapsed) + "\n" + body;
+}
+
+void QueryServer::handleConnection(int fd)
+{
+	string buffer;
+	char readbuf[4096];
+
+	for (;;) {
+		ssize_t bytes_read = recv(fd, readbuf, sizeof(readbuf), 0);
+		if (bytes_read <= 0) break;
+		buffer.append(readbuf, bytes_read);
+
+		string::size_type eol;
+		while ((eol = buffer.find('\n')) != string::npos) {
+			string request = buffer.substr(0, eol);
+			buffer.erase(0, eol + 1);
+			if (! request.empty() && request.back() == '\r') request.pop_back();
+
+			string response = handleRequest(request);
+			const char *ptr = response.data();
+			size_t remaining = response.length();
+
+			while (remaining) {
+				ssize_t sent = send(fd, ptr, remaining, MSG_NOSIGNAL);
+				if (sent < 0) {
+					if (errno == EINTR) continue;
+					close(fd);
+					return;
+				}
+
+				ptr += sent;
+				remaining -= sent;
+			}
+		}
+	}
+
+	close(fd);
+}
+
+int QueryServer::serve(const string& socketpath)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socketpath.length() >= sizeof(addr.sun_path)) {
+		cerr << "socket path too long " << socketpath << "\n";
+		return 1;
+	}
+
+	strcpy(addr.sun_path, socketpath.c_str());
+
+	// Only replace a stale socket, never a file given in the wrong argument
+	struct stat pathstat;
+	if (lstat(socketpath.c_str(), &pathstat) == 0) {
+		if (! S_ISSOCK(pathstat.st_mode)) {
+			cerr << "not a socket " << socketpath << "\n";
+			return 1;
+		}
+
+		unlink(socketpath.c_str());
+	}
+
+	int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd < 0) {
+		cerr << "socket failed\n";
+		return 2;
+	}
+
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenfd, 16) != 0) {
+		cerr << "bind failed for " << socketpath << "\n";
+		close(listenfd);
+		return 3;
+	}
+
+	if (verbose) cerr << "serving " << offsetstable.size() << " templates on " << socketpath << "\n";
+
+	for (;;) {
+		int fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			cerr << "accept failed\n";
+			close(listenfd);
+			return 4;
+		}
+
+		thread(&QueryServer::handleConnection, this, fd).detach();
+	}
+}
+
+} /* namespace phppreg */
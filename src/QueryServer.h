@@ -0,0 +1,145 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef QUERYSERVER_H_
+#define QUERYSERVER_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "MappedFile.h"
+#include "PageIndex.h"
+#include "OffsetsScanner.h"
+
+namespace phppreg {
+
+/**
+ * Serves template rows and totals from mmap'd sorted params, offsets, totals and page index files
+ * over a Unix domain socket.
+ *
+ * Requests are lines:
+ *   template <template id>            totals lines and rows of the template
+ *   param <template id> <param name>  template id, page id, param name, value of the rows having the param
+ *   page <page id>                    rows of the page, needs the page index
+ *   stats                             request and cache counters
+ *
+ * Responses are "OK <body bytes> <latency us>\n<body>" or "ERR <message>\n".
+ */
+class QueryServer
+{
+public:
+	static const size_t DEFAULT_CACHE_SIZE = 256 * 1024 * 1024;
+
+	/**
+	 * constructor
+	 *
+	 * @param cachesize Approximate bytes of decoded template ranges to cache for param requests
+	 */
+	QueryServer(size_t cachesize = DEFAULT_CACHE_SIZE) : cachesize(cachesize) {}
+
+	/**
+	 * Map the files and parse the offsets.
+	 *
+	 * @param paramsfilepath Sorted params file
+	 * @param offsetsfilepath Offsets file
+	 * @param totalsfilepath Totals file
+	 * @param indexfilepath Page index file, "" = no page queries
+	 * @param errmsg Error message
+	 * @return false = open failed
+	 */
+	bool open(const std::string& paramsfilepath, const std::string& offsetsfilepath, const std::string& totalsfilepath,
+		const std::string& indexfilepath, std::string *errmsg);
+
+	/**
+	 * Answer a request.
+	 *
+	 * @param request Request line, without the newline
+	 * @return Response
+	 */
+	std::string handleRequest(const std::string& request);
+
+	/**
+	 * Accept connections until an error, each connection is served by its own thread.
+	 *
+	 * @param socketpath Unix domain socket path, an existing socket file is replaced
+	 * @return 0 = ok, else error
+	 */
+	int serve(const std::string& socketpath);
+
+	size_t getCacheHits() const { return cachehits; }
+	size_t getCacheMisses() const { return cachemisses; }
+
+	bool verbose = false;
+
+	virtual ~QueryServer() {}
+
+protected:
+	struct Field {
+		const char *data;
+		size_t length;
+	};
+
+	struct DecodedRow {
+		const char *row;
+		size_t length; // with the newline
+		std::vector<std::pair<Field, Field>> params;
+	};
+
+	struct DecodedRange {
+		std::vector<DecodedRow> rows;
+		size_t bytes = 0;
+	};
+
+	typedef std::list<std::pair<unsigned long, std::shared_ptr<const DecodedRange>>> LruList;
+
+	MappedFile params;
+	MappedFile offsets;
+	MappedFile totals;
+	PageIndex pageindex;
+	bool haspageindex = false;
+	std::unordered_map<unsigned long, TemplateRange> offsetstable;
+	std::unordered_map<unsigned long, std::pair<size_t, size_t>> totalstable; // offset, length
+
+	size_t cachesize;
+	size_t cachebytes = 0;
+	LruList lru; // Most recently used first
+	std::unordered_map<unsigned long, LruList::iterator> cache;
+	std::mutex cachemutex;
+	std::atomic<size_t> requestcnt{0};
+	std::atomic<size_t> cachehits{0};
+	std::atomic<size_t> cachemisses{0};
+
+	bool parseOffsets(std::string *errmsg);
+	void parseTotals();
+	std::shared_ptr<const DecodedRange> getRange(unsigned long tmplid);
+	std::shared_ptr<const DecodedRange> decodeRange(const TemplateRange& entry);
+	bool queryTemplate(unsigned long tmplid, std::string *body);
+	bool queryParam(unsigned long tmplid, const std::string& paramname, std::string *body);
+	bool queryPage(unsigned long pageid, std::string *body);
+	void handleConnection(int fd);
+
+private:
+	QueryServer(const QueryServer& other) = delete;
+	QueryServer& operator= (const QueryServer& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* QUERYSERVER_H_ */
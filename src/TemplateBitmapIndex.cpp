@@ -0,0 +1,236 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "TemplateBitmapIndex.h"
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+using namespace std;
+
+namespace phppreg {
+
+const char TemplateBitmapIndex::MAGIC[] = "MWTBMP01";
+const char TemplateBitmapIndex::TRAILER_MAGIC[] = "MWTB";
+
+static const size_t ENTRY_SIZE = 20;
+static const size_t TRAILER_SIZE = 16;
+static const size_t MAP_NODE_BYTES = 48; // Approximate std::map node overhead
+
+static inline void putLE(string *dest, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i) *dest += (char)(value >> (8 * i));
+}
+
+static inline uint64_t getLE(const char *src, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; --i) value = (value << 8) | (unsigned char)src[i];
+	return value;
+}
+
+void TemplateBitmapIndex::add(uint32_t tmplid, uint32_t pageid)
+{
+	size_t bitmapcnt = bitmaps.size();
+	PageBitmap& bitmap = bitmaps[tmplid];
+	size_t bitmapbytes = bitmap.getMemorySize();
+	if (bitmaps.size() != bitmapcnt) buildbytes += MAP_NODE_BYTES + bitmapbytes;
+
+	bitmap.add(pageid);
+	buildbytes = buildbytes + bitmap.getMemorySize() - bitmapbytes;
+}
+
+void TemplateBitmapIndex::write(OutputWriter *dest) const
+{
+	long long start = dest->tellp();
+	string serialized;
+	string indexentries;
+
+	dest->write(MAGIC, 8);
+
+	for (auto &bitmap : bitmaps) {
+		serialized.clear();
+		bitmap.second.serialize(&serialized);
+		putLE(&indexentries, bitmap.first, 4);
+		putLE(&indexentries, dest->tellp() - start, 8);
+		putLE(&indexentries, serialized.length(), 8);
+		dest->write(serialized);
+	}
+
+	putLE(&indexentries, dest->tellp() - start, 8);
+	putLE(&indexentries, bitmaps.size(), 4);
+	indexentries.append(TRAILER_MAGIC, 4);
+	dest->write(indexentries);
+}
+
+bool TemplateBitmapIndex::write(const string& path) const
+{
+	OutputWriter *dest = OutputWriter::open(path);
+	if (! dest) return false;
+
+	write(dest);
+	bool writeok = dest->flush();
+	delete dest;
+	return writeok;
+}
+
+bool TemplateBitmapIndex::open(const string& path)
+{
+	if (! file.open(path)) return false;
+	return init(file.data(), file.size());
+}
+
+bool TemplateBitmapIndex::init(const char *data, size_t length)
+{
+	this->data = data;
+	count = 0;
+
+	if (length < 8 + TRAILER_SIZE || memcmp(data, MAGIC, 8) != 0
+		|| memcmp(data + length - 4, TRAILER_MAGIC, 4) != 0) return false;
+
+	indexoffset = getLE(data + length - TRAILER_SIZE, 8);
+	size_t entrycnt = getLE(data + length - 8, 4);
+	if (indexoffset < 8 || indexoffset > length - TRAILER_SIZE
+		|| (length - TRAILER_SIZE - indexoffset) != entrycnt * ENTRY_SIZE) return false;
+
+	index = data + indexoffset;
+	count = entrycnt;
+	return true;
+}
+
+bool TemplateBitmapIndex::get(uint32_t tmplid, PageBitmap *bitmap) const
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		uint32_t midid = getLE(index + mid * ENTRY_SIZE, 4);
+
+		if (midid < tmplid) {
+			lo = mid + 1;
+		} else if (midid > tmplid) {
+			hi = mid;
+		} else {
+			size_t offset = getLE(index + mid * ENTRY_SIZE + 4, 8);
+			size_t length = getLE(index + mid * ENTRY_SIZE + 12, 8);
+			if (offset < 8 || offset > indexoffset || length > indexoffset - offset) return false;
+			return bitmap->deserialize(data + offset, length);
+		}
+	}
+
+	*bitmap = PageBitmap();
+	return true;
+}
+
+bool TemplateBitmapIndex::evaluate(const string& expression, PageBitmap *result, string *errmsg) const
+{
+	vector<string> tokens;
+
+	for (size_t i = 0; i < expression.length(); ) {
+		char c = expression[i];
+
+		if (c == ' ' || c == '\t') {
+			++i;
+		} else if (c == '(' || c == ')') {
+			tokens.push_back(string(1, c));
+			++i;
+		} else {
+			size_t end = expression.find_first_of(" \t()", i);
+			if (end == string::npos) end = expression.length();
+			tokens.push_back(expression.substr(i, end - i));
+			i = end;
+		}
+	}
+
+	size_t pos = 0;
+	if (! parseOr(tokens, &pos, result, errmsg)) return false;
+
+	if (pos != tokens.size()) {
+		*errmsg = "unexpected " + tokens[pos];
+		return false;
+	}
+
+	return true;
+}
+
+bool TemplateBitmapIndex::parseOr(const vector<string>& tokens, size_t *pos, PageBitmap *result, string *errmsg) const
+{
+	if (! parseAnd(tokens, pos, result, errmsg)) return false;
+
+	while (*pos < tokens.size() && strcasecmp(tokens[*pos].c_str(), "OR") == 0) {
+		++*pos;
+		PageBitmap operand;
+		if (! parseAnd(tokens, pos, &operand, errmsg)) return false;
+		result->orWith(operand);
+	}
+
+	return true;
+}
+
+bool TemplateBitmapIndex::parseAnd(const vector<string>& tokens, size_t *pos, PageBitmap *result, string *errmsg) const
+{
+	if (! parseOperand(tokens, pos, result, errmsg)) return false;
+
+	while (*pos < tokens.size()) {
+		bool andnot = strcasecmp(tokens[*pos].c_str(), "ANDNOT") == 0;
+		if (! andnot && strcasecmp(tokens[*pos].c_str(), "AND") != 0) break;
+
+		++*pos;
+		PageBitmap operand;
+		if (! parseOperand(tokens, pos, &operand, errmsg)) return false;
+
+		if (andnot) result->andNotWith(operand);
+		else result->andWith(operand);
+	}
+
+	return true;
+}
+
+bool TemplateBitmapIndex::parseOperand(const vector<string>& tokens, size_t *pos, PageBitmap *result, string *errmsg) const
+{
+	if (*pos >= tokens.size()) {
+		*errmsg = "unexpected end of expression";
+		return false;
+	}
+
+	const string& token = tokens[(*pos)++];
+
+	if (token == "(") {
+		if (! parseOr(tokens, pos, result, errmsg)) return false;
+		if (*pos >= tokens.size() || tokens[*pos] != ")") {
+			*errmsg = "missing )";
+			return false;
+		}
+		++*pos;
+		return true;
+	}
+
+	char *idend;
+	unsigned long tmplid = strtoul(token.c_str(), &idend, 10);
+	if (token.empty() || *idend || tmplid > UINT32_MAX) {
+		*errmsg = "template id expected, got " + token;
+		return false;
+	}
+
+	if (! get(tmplid, result)) {
+		*errmsg = "corrupt bitmap of template " + token;
+		return false;
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
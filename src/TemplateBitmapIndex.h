@@ -0,0 +1,119 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef TEMPLATEBITMAPINDEX_H_
+#define TEMPLATEBITMAPINDEX_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "PageBitmap.h"
+#include "MappedFile.h"
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Page id bitmaps of the pages using a template, and set expressions over them.
+ *
+ * File (little endian): "MWTBMP01", serialized bitmaps, index entries sorted by template id:
+ * uint32 template id, uint64 bitmap offset, uint64 bitmap length;
+ * trailer: uint64 index offset, uint32 template count, "MWTB".
+ */
+class TemplateBitmapIndex
+{
+public:
+	static const char MAGIC[];
+	static const char TRAILER_MAGIC[];
+
+	TemplateBitmapIndex() {}
+
+	/**
+	 * Add a page using a template, while building the index.
+	 */
+	void add(uint32_t tmplid, uint32_t pageid);
+
+	/**
+	 * @return Approximate bytes of the added bitmaps
+	 */
+	size_t getMemorySize() const { return buildbytes; }
+
+	/**
+	 * Write the added bitmaps.
+	 *
+	 * @return false = write failed
+	 */
+	bool write(const std::string& path) const;
+	void write(OutputWriter *dest) const;
+
+	/**
+	 * Map an index file.
+	 *
+	 * @return false = open failed or not a bitmap index
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * Use an index in memory. The memory must outlive the index.
+	 *
+	 * @return false = not a bitmap index
+	 */
+	bool init(const char *data, size_t length);
+
+	/**
+	 * Read a template's bitmap, an unknown template is empty.
+	 *
+	 * @return false = corrupt bitmap
+	 */
+	bool get(uint32_t tmplid, PageBitmap *bitmap) const;
+
+	/**
+	 * Evaluate a set expression of template ids, e.g. "(1 OR 2) ANDNOT 3".
+	 * AND and ANDNOT bind tighter than OR, same precedence operators are evaluated left to right.
+	 *
+	 * @param expression Expression
+	 * @param result Page ids
+	 * @param errmsg Error message
+	 * @return false = syntax error or corrupt index
+	 */
+	bool evaluate(const std::string& expression, PageBitmap *result, std::string *errmsg) const;
+
+	size_t size() const { return count; }
+
+	virtual ~TemplateBitmapIndex() {}
+
+protected:
+	std::map<uint32_t, PageBitmap> bitmaps; // Building
+	size_t buildbytes = 0;
+	MappedFile file;
+	const char *data = 0;
+	const char *index = 0;
+	size_t count = 0;
+	size_t indexoffset = 0;
+
+	bool parseOr(const std::vector<std::string>& tokens, size_t *pos, PageBitmap *result, std::string *errmsg) const;
+	bool parseAnd(const std::vector<std::string>& tokens, size_t *pos, PageBitmap *result, std::string *errmsg) const;
+	bool parseOperand(const std::vector<std::string>& tokens, size_t *pos, PageBitmap *result, std::string *errmsg) const;
+
+private:
+	TemplateBitmapIndex(const TemplateBitmapIndex& other) = delete;
+	TemplateBitmapIndex& operator= (const TemplateBitmapIndex& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* TEMPLATEBITMAPINDEX_H_ */
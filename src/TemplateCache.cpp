@@ -0,0 +1,134 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#include "TemplateCache.h"
+#include <cstring>
+#include "string_util.h"
+
+using namespace std;
+
+namespace phppreg {
+
+size_t TemplateCache::capacity = 65536;
+TemplateCache::Shard TemplateCache::shards[SHARDS];
+atomic<long long> TemplateCache::lookupcnt(0);
+atomic<long long> TemplateCache::hitcnt(0);
+atomic<long long> TemplateCache::insertcnt(0);
+atomic<long long> TemplateCache::evictcnt(0);
+atomic<size_t> TemplateCache::bytecnt(0);
+
+static const size_t MAP_ENTRY_BYTES = 80; // Approximate std::map node and std::string overhead
+
+/**
+ * Approximate bytes of a cached invocation.
+ */
+static size_t entryBytes(size_t length, const MWTemplate& tmpl)
+{
+	size_t bytes = length + sizeof(MWTemplate) + tmpl.name.length();
+	for (auto &param : tmpl.params) bytes += MAP_ENTRY_BYTES + param.first.length() + param.second.length();
+	return bytes;
+}
+
+/**
+ * First slot of the bucket of hashvalue, the shard lock must be held.
+ */
+TemplateCache::Slot *TemplateCache::bucket(Shard& shard, uint64_t hashvalue)
+{
+	if (shard.slots.empty()) {
+		shard.slots.resize(max(capacity / SHARDS / WAYS, (size_t)1) * WAYS);
+		bytecnt += shard.slots.size() * sizeof(Slot);
+	}
+
+	size_t buckets = shard.slots.size() / WAYS;
+	return &shard.slots[(hashvalue / SHARDS) % buckets * WAYS];
+}
+
+shared_ptr<const MWTemplate> TemplateCache::find(const char *text, size_t length, uint64_t hashvalue)
+{
+	if (! capacity || length > MAX_TEXT_LENGTH) return nullptr;
+	++lookupcnt;
+
+	Shard& shard = shards[hashvalue % SHARDS];
+	lock_guard<mutex> lock(shard.mtx);
+	Slot *slots = bucket(shard, hashvalue);
+
+	for (size_t way = 0; way < WAYS; ++way) {
+		Slot& slot = slots[way];
+
+		if (slot.tmpl && slot.hashvalue == hashvalue && slot.text.length() == length && memcmp(slot.text.data(), text, length) == 0) {
+			++slot.hits;
+			++hitcnt;
+			return slot.tmpl;
+		}
+	}
+
+	return nullptr;
+}
+
+void TemplateCache::insert(const char *text, size_t length, uint64_t hashvalue, const MWTemplate& tmpl)
+{
+	if (! capacity || length > MAX_TEXT_LENGTH) return;
+
+	// Built outside the lock
+	shared_ptr<const MWTemplate> entry = make_shared<const MWTemplate>(tmpl);
+	size_t entrybytes = entryBytes(length, tmpl);
+
+	Shard& shard = shards[hashvalue % SHARDS];
+	lock_guard<mutex> lock(shard.mtx);
+	Slot *slots = bucket(shard, hashvalue);
+	Slot *victim = &slots[0];
+
+	for (size_t way = 0; way < WAYS; ++way) {
+		Slot& slot = slots[way];
+
+		if (! slot.tmpl) {
+			victim = &slot;
+			break;
+		}
+
+		// Another thread got here first
+		if (slot.hashvalue == hashvalue && slot.text.length() == length && memcmp(slot.text.data(), text, length) == 0) return;
+
+		if (slot.hits < victim->hits) victim = &slot;
+	}
+
+	if (victim->tmpl) {
+		++evictcnt;
+		for (size_t way = 0; way < WAYS; ++way) slots[way].hits /= 2;
+	}
+
+	victim->hashvalue = hashvalue;
+	victim->text.assign(text, length);
+	victim->tmpl = move(entry);
+	victim->hits = 0;
+	bytecnt += entrybytes - victim->bytes;
+	victim->bytes = entrybytes;
+	++insertcnt;
+}
+
+void TemplateCache::writeStats(ostream& os)
+{
+	if (! capacity) return;
+
+	long long lookups = lookupcnt;
+	long long hits = hitcnt;
+
+	os << "template cache: " << lookups << " lookups, " << hits << " hits (" << (lookups ? hits * 100 / lookups : 0) << "%), "
+		<< insertcnt << " inserts, " << evictcnt << " evictions\n";
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,111 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef TEMPLATECACHE_H_
+#define TEMPLATECACHE_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+#include "MWTemplate.h"
+
+namespace phppreg {
+
+/**
+ * Process wide cache of parsed template invocations, keyed by the invocation text ({{...}}).
+ * Many invocations are the same on every page they are on, ie. {{Reflist}} or {{Use dmy dates|date=May 2020}}.
+ *
+ * The entries are in SHARDS shards, each with its own lock, of WAYS way buckets. The shard is taken from the low bits
+ * of the string_hash and the bucket from the rest. When a bucket is full the entry with the fewest hits is replaced,
+ * and the hits of the others are halved so old favorites age out.
+ */
+class TemplateCache
+{
+public:
+	static const size_t SHARDS = 64;
+	static const size_t WAYS = 4;
+	static const size_t MAX_TEXT_LENGTH = 512; // Longer invocations are not cached
+
+	static size_t capacity; // Entries, 0 = no caching. Set before the first lookup
+
+	/**
+	 * find
+	 *
+	 * @param text Invocation text
+	 * @param hashvalue string_hash(text, length)
+	 * @return The parsed invocation, empty = not cached
+	 */
+	static std::shared_ptr<const MWTemplate> find(const char *text, size_t length, uint64_t hashvalue);
+
+	/**
+	 * insert
+	 *
+	 * Cache a parsed invocation.
+	 */
+	static void insert(const char *text, size_t length, uint64_t hashvalue, const MWTemplate& tmpl);
+
+	/**
+	 * writeStats
+	 *
+	 * Write lookup, hit, insert and eviction counts.
+	 *
+	 * @param os Output stream
+	 */
+	static void writeStats(std::ostream& os);
+
+	/**
+	 * getMemorySize
+	 *
+	 * Get the approximate memory used by the slots and the cached invocations
+	 *
+	 * @return Size in bytes
+	 */
+	static size_t getMemorySize() { return bytecnt; }
+
+protected:
+	struct Slot
+	{
+		uint64_t hashvalue = 0;
+		std::string text;
+		std::shared_ptr<const MWTemplate> tmpl; // empty = unused slot
+		unsigned hits = 0;
+		size_t bytes = 0; // of text and tmpl
+	};
+
+	struct Shard
+	{
+		std::mutex mtx;
+		std::vector<Slot> slots; // Allocated on first use
+	};
+
+	static Shard shards[SHARDS];
+	static std::atomic<long long> lookupcnt;
+	static std::atomic<long long> hitcnt;
+	static std::atomic<long long> insertcnt;
+	static std::atomic<long long> evictcnt;
+	static std::atomic<size_t> bytecnt;
+
+	static Slot *bucket(Shard& shard, uint64_t hashvalue);
+};
+
+} /* namespace phppreg */
+
+#endif /* TEMPLATECACHE_H_ */
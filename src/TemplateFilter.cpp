@@ -0,0 +1,103 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "TemplateFilter.h"
+#include "PhpPregRegistry.h"
+#include "string_util.h"
+
+using namespace std;
+
+namespace phppreg {
+
+bool TemplateFilter::addRule(const string& rule, const vector<string>& args, string *errmsg)
+{
+	if (rule == "params") {
+		if (args.size() != 1) {
+			*errmsg = "params needs a | separated param name list";
+			return false;
+		}
+
+		vector<string> names;
+		string_split(args[0], "|", &names);
+		projection.insert(names.begin(), names.end());
+		return true;
+	}
+
+	Predicate predicate;
+	predicate.regex = NULL;
+	size_t argcnt = 2;
+
+	if (rule == "regex") {
+		predicate.type = REGEX;
+	} else if (rule == "prefix") {
+		predicate.type = PREFIX;
+	} else if (rule == "empty") {
+		predicate.type = EMPTY;
+		argcnt = 1;
+	} else if (rule == "nonempty") {
+		predicate.type = NONEMPTY;
+		argcnt = 1;
+	} else {
+		*errmsg = "unknown rule " + rule;
+		return false;
+	}
+
+	if (args.size() != argcnt) {
+		*errmsg = rule + " needs " + to_string(argcnt) + " arguments";
+		return false;
+	}
+
+	predicate.paramname = args[0];
+	if (argcnt == 2) predicate.arg = args[1];
+
+	if (predicate.type == REGEX) {
+		predicate.regex = &PhpPregRegistry::get("!" + predicate.arg + "!u");
+		if (predicate.regex->isError()) {
+			*errmsg = "regex " + predicate.arg + ": " + predicate.regex->getErrorMsg();
+			return false;
+		}
+	}
+
+	predicates.push_back(predicate);
+	return true;
+}
+
+bool TemplateFilter::matches(const map<string, string>& params) const
+{
+	for (auto &predicate : predicates) {
+		auto param_it = params.find(predicate.paramname);
+		bool hasvalue = (param_it != params.end() && ! param_it->second.empty());
+
+		switch (predicate.type) {
+		case EMPTY:
+			if (hasvalue) return false;
+			break;
+		case NONEMPTY:
+			if (! hasvalue) return false;
+			break;
+		case PREFIX:
+			if (! hasvalue || param_it->second.compare(0, predicate.arg.length(), predicate.arg) != 0) return false;
+			break;
+		case REGEX:
+			if (! hasvalue || predicate.regex->match(param_it->second) <= 0) return false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,81 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef TEMPLATEFILTER_H_
+#define TEMPLATEFILTER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include "PhpPreg.h"
+
+namespace phppreg {
+
+/**
+ * TemplateFilters.tsv rules of a template: the params written (projection) and value predicates a template
+ * instance must all match to be written. Rule lines are template id, rule, rule arguments:
+ *
+ * params	name|name...	only write these params
+ * regex	name	pattern	the value matches the regex (unanchored, utf8)
+ * prefix	name	prefix	the value starts with prefix
+ * empty	name	the param is missing or empty
+ * nonempty	name	the param has a value
+ */
+class TemplateFilter
+{
+public:
+	enum PredicateType { REGEX, PREFIX, EMPTY, NONEMPTY };
+
+	struct Predicate {
+		PredicateType type;
+		std::string paramname;
+		std::string arg;
+		PhpPreg *regex;
+	};
+
+	/**
+	 * Add a rule.
+	 *
+	 * @param rule Rule name
+	 * @param args Rule arguments
+	 * @param errmsg Error message
+	 * @return false = unknown rule, wrong argument count or invalid regex
+	 */
+	bool addRule(const std::string& rule, const std::vector<std::string>& args, std::string *errmsg);
+
+	/**
+	 * @param paramname Unaliased param name
+	 * @return true = the param is written
+	 */
+	bool keepParam(const std::string& paramname) const { return projection.empty() || projection.count(paramname); }
+
+	/**
+	 * @param params Unaliased non-empty param values
+	 * @return true = all predicates match, the instance is written
+	 */
+	bool matches(const std::map<std::string, std::string>& params) const;
+
+	bool hasPredicates() const { return ! predicates.empty(); }
+
+protected:
+	std::unordered_set<std::string> projection; // Empty = all params
+	std::vector<Predicate> predicates;
+};
+
+} /* namespace phppreg */
+
+#endif /* TEMPLATEFILTER_H_ */
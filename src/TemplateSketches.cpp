@@ -0,0 +1,117 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#include "TemplateSketches.h"
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+const char TemplateSketches::MAGIC[] = "MWSKTCH1";
+
+static inline void putLE(OutputWriter *dest, uint64_t value, int bytes)
+{
+	char buffer[8];
+	for (int i = 0; i < bytes; ++i) buffer[i] = (char)(value >> (8 * i));
+	dest->write(buffer, bytes);
+}
+
+void TemplateSketches::writeTemplate(OutputWriter *dest, uint32_t tmplid, const string& name, long long pagecount,
+	long long instancecount, size_t paramcount)
+{
+	putLE(dest, tmplid, 4);
+	putLE(dest, pagecount, 8);
+	putLE(dest, instancecount, 8);
+	putLE(dest, name.length(), 4);
+	dest->write(name);
+	putLE(dest, paramcount, 4);
+}
+
+void TemplateSketches::writeParam(OutputWriter *dest, const string& name, long long count, const ParamSketch& sketch)
+{
+	string serialized;
+	sketch.serialize(&serialized);
+
+	putLE(dest, name.length(), 4);
+	dest->write(name);
+	putLE(dest, count, 8);
+	putLE(dest, serialized.length(), 4);
+	dest->write(serialized);
+}
+
+bool TemplateSketches::open(const string& path)
+{
+	finished = true;
+	if (! file.open(path) || file.size() < 8 || memcmp(file.data(), MAGIC, 8) != 0) return false;
+
+	pos = 8;
+	finished = false;
+	return next();
+}
+
+bool TemplateSketches::get(size_t bytes, uint64_t *value)
+{
+	if (file.size() - pos < bytes) return false;
+
+	const char *src = file.data() + pos;
+	*value = 0;
+	for (int i = bytes - 1; i >= 0; --i) *value = (*value << 8) | (unsigned char)src[i];
+	pos += bytes;
+	return true;
+}
+
+bool TemplateSketches::getString(string *value)
+{
+	uint64_t length;
+	if (! get(4, &length) || file.size() - pos < length) return false;
+
+	value->assign(file.data() + pos, length);
+	pos += length;
+	return true;
+}
+
+bool TemplateSketches::next()
+{
+	params.clear();
+	finished = true;
+	if (pos == file.size()) return true;
+
+	uint64_t id, pages, instances, paramcount;
+	if (! get(4, &id) || ! get(8, &pages) || ! get(8, &instances) || ! getString(&name) || ! get(4, &paramcount)) return false;
+
+	tmplid = id;
+	pagecount = pages;
+	instancecount = instances;
+
+	for (uint64_t i = 0; i < paramcount; ++i) {
+		params.emplace_back();
+		Param& param = params.back();
+		uint64_t count, sketchlength;
+
+		if (! getString(&param.name) || ! get(8, &count) || ! get(4, &sketchlength) || file.size() - pos < sketchlength
+			|| ! param.sketch.deserialize(file.data() + pos, sketchlength)) return false;
+
+		param.count = count;
+		pos += sketchlength;
+	}
+
+	finished = false;
+	return true;
+}
+
+} /* namespace phppreg */
@@ -0,0 +1,102 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+
+#ifndef TEMPLATESKETCHES_H_
+#define TEMPLATESKETCHES_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "ParamSketch.h"
+#include "MappedFile.h"
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Template and param counts with the param sketches of a -sketch-totals run (...TemplateSketches). The files of runs
+ * over disjoint pages, ie. dump shards, are merged into the totals of all the pages. Also the sketches spill format.
+ *
+ * File (little endian): "MWSKTCH1", then per template by ascending template id: uint32 template id, uint64 page count,
+ * uint64 instance count, uint32 name length, name, uint32 param count, per param: uint32 name length, name,
+ * uint64 count, uint32 sketch length, serialized ParamSketch.
+ *
+ * Written a template at a time with the static writers, read a template at a time with open() and next().
+ */
+class TemplateSketches
+{
+public:
+	static const char MAGIC[];
+
+	struct Param {
+		std::string name;
+		long long count;
+		ParamSketch sketch;
+	};
+
+	TemplateSketches() {}
+
+	static void writeHeader(OutputWriter *dest) { dest->write(MAGIC, 8); }
+
+	/**
+	 * Write a template, followed by paramcount writeParam() calls.
+	 */
+	static void writeTemplate(OutputWriter *dest, uint32_t tmplid, const std::string& name, long long pagecount,
+		long long instancecount, size_t paramcount);
+	static void writeParam(OutputWriter *dest, const std::string& name, long long count, const ParamSketch& sketch);
+
+	/**
+	 * Map a file and read its first template.
+	 *
+	 * @return false = open failed, not a sketches file or corrupt
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * Read the next template, done() after the last one or a corrupt template.
+	 *
+	 * @return false = corrupt
+	 */
+	bool next();
+
+	bool done() const { return finished; }
+
+	// The current template
+	uint32_t tmplid = 0;
+	std::string name;
+	long long pagecount = 0;
+	long long instancecount = 0;
+	std::vector<Param> params;
+
+	virtual ~TemplateSketches() {}
+
+protected:
+	MappedFile file;
+	size_t pos = 0;
+	bool finished = true;
+
+	bool get(size_t bytes, uint64_t *value);
+	bool getString(std::string *value);
+
+private:
+	TemplateSketches(const TemplateSketches& other) = delete;
+	TemplateSketches& operator= (const TemplateSketches& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* TEMPLATESKETCHES_H_ */
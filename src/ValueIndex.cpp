@@ -0,0 +1,155 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ValueIndex.h"
+#include "ValueIndexWriter.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+static inline bool getVarint(const char *data, size_t end, size_t *pos, unsigned long long *value)
+{
+	*value = 0;
+	int shift = 0;
+
+	while (*pos < end && shift < 64) {
+		unsigned char c = data[(*pos)++];
+		*value |= (unsigned long long)(c & 0x7f) << shift;
+		if (! (c & 0x80)) return true;
+		shift += 7;
+	}
+
+	return false;
+}
+
+static unsigned long long getLE64(const char *src)
+{
+	unsigned long long value = 0;
+	for (int i = 7; i >= 0; --i) value = (value << 8) | (unsigned char)src[i];
+	return value;
+}
+
+bool ValueIndex::open(const string& path)
+{
+	if (! file.open(path)) return false;
+	return init(file.data(), file.size());
+}
+
+bool ValueIndex::init(const char *data, size_t length)
+{
+	this->data = data;
+	blocks.clear();
+
+	if (length < 28 || memcmp(data, ValueIndexWriter::MAGIC, 8) != 0
+		|| memcmp(data + length - 4, ValueIndexWriter::TRAILER_MAGIC, 4) != 0) return false;
+
+	dictoffset = getLE64(data + length - 20);
+	dictend = getLE64(data + length - 12);
+	if (dictoffset < 8 || dictoffset > dictend || dictend > length - 20) return false;
+
+	size_t pos = dictend;
+	size_t end = length - 20;
+	unsigned long long blockcnt;
+	if (! getVarint(data, end, &pos, &blockcnt)) return false;
+
+	for (unsigned long long i = 0; i < blockcnt; ++i) {
+		unsigned long long keylength, blockoffset;
+		if (! getVarint(data, end, &pos, &keylength) || keylength > end - pos) return false;
+		string key(data + pos, keylength);
+		pos += keylength;
+		if (! getVarint(data, end, &pos, &blockoffset) || blockoffset > dictend - dictoffset) return false;
+		blocks.push_back(make_pair(key, dictoffset + blockoffset));
+	}
+
+	return true;
+}
+
+bool ValueIndex::readPostings(size_t offset, size_t count, vector<uint32_t> *pageids) const
+{
+	size_t pos = offset;
+	uint32_t pageid = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		unsigned long long delta;
+		if (! getVarint(data, dictoffset, &pos, &delta)) return false;
+		pageid += delta;
+		pageids->push_back(pageid);
+	}
+
+	return true;
+}
+
+bool ValueIndex::find(uint32_t tmplid, const string& paramname, const string& value, bool prefix, vector<uint32_t> *pageids) const
+{
+	pageids->clear();
+
+	string searchkey;
+	ValueIndexWriter::makeKey(tmplid, paramname.data(), paramname.length(), &searchkey);
+	ValueIndexWriter::normalize(value.data(), value.length(), &searchkey);
+
+	// Last block with a first key <= the search key
+	auto block_it = upper_bound(blocks.begin(), blocks.end(), searchkey, [](const string& key, const pair<string, size_t>& block) {
+		return key < block.first;
+	});
+	if (block_it != blocks.begin()) --block_it;
+
+	size_t termsfound = 0;
+	string termkey;
+
+	for (; block_it != blocks.end(); ++block_it) {
+		size_t pos = block_it->second;
+		size_t blockend = (block_it + 1 != blocks.end()) ? (block_it + 1)->second : dictend;
+		termkey.clear();
+
+		while (pos < blockend) {
+			unsigned long long shared, suffixlength, postingsoffset, count;
+			if (! getVarint(data, blockend, &pos, &shared) || ! getVarint(data, blockend, &pos, &suffixlength)
+				|| shared > termkey.length() || suffixlength > blockend - pos) return false;
+
+			termkey.resize(shared);
+			termkey.append(data + pos, suffixlength);
+			pos += suffixlength;
+
+			if (! getVarint(data, blockend, &pos, &postingsoffset) || ! getVarint(data, blockend, &pos, &count)
+				|| postingsoffset > dictoffset) return false;
+
+			int cmp = termkey.compare(0, prefix ? searchkey.length() : string::npos, searchkey);
+			if (cmp < 0) continue;
+			if (cmp > 0) {
+				block_it = blocks.end() - 1; // Past the matching terms
+				break;
+			}
+
+			if (! readPostings(postingsoffset, count, pageids)) return false;
+			++termsfound;
+			if (! prefix) break;
+		}
+
+		if (! prefix && termsfound) break;
+	}
+
+	if (termsfound > 1) {
+		sort(pageids->begin(), pageids->end());
+		pageids->erase(unique(pageids->begin(), pageids->end()), pageids->end());
+	}
+
+	return true;
+}
+
+} /* namespace phppreg */
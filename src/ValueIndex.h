@@ -0,0 +1,81 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef VALUEINDEX_H_
+#define VALUEINDEX_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "MappedFile.h"
+
+namespace phppreg {
+
+/**
+ * Reads an inverted value index written by ValueIndexWriter.
+ */
+class ValueIndex
+{
+public:
+	ValueIndex() {}
+
+	/**
+	 * Map an index file.
+	 *
+	 * @return false = open failed or not a value index
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * Use an index in memory. The memory must outlive the index.
+	 *
+	 * @return false = not a value index
+	 */
+	bool init(const char *data, size_t length);
+
+	/**
+	 * Page ids of a template param value. The value is normalized like the indexed values.
+	 *
+	 * @param tmplid Template id
+	 * @param paramname Param name
+	 * @param value Value, or value prefix
+	 * @param prefix true = all values starting with value
+	 * @param pageids Sorted unique page ids
+	 * @return false = corrupt index
+	 */
+	bool find(uint32_t tmplid, const std::string& paramname, const std::string& value, bool prefix, std::vector<uint32_t> *pageids) const;
+
+	size_t getBlockCount() const { return blocks.size(); }
+
+	virtual ~ValueIndex() {}
+
+protected:
+	MappedFile file;
+	const char *data = 0;
+	size_t dictoffset = 0;
+	size_t dictend = 0;
+	std::vector<std::pair<std::string, size_t>> blocks; // first key, block offset
+
+	bool readPostings(size_t offset, size_t count, std::vector<uint32_t> *pageids) const;
+
+private:
+	ValueIndex(const ValueIndex& other) = delete;
+	ValueIndex& operator= (const ValueIndex& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* VALUEINDEX_H_ */
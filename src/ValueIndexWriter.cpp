@@ -0,0 +1,185 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ValueIndexWriter.h"
+#include "ParamsBinaryWriter.h"
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+const char ValueIndexWriter::MAGIC[] = "MWVIDX01";
+const char ValueIndexWriter::TRAILER_MAGIC[] = "MWVI";
+
+ValueIndexWriter::ValueIndexWriter(OutputWriter *dest)
+	: dest(dest)
+{
+	dest->write(MAGIC, 8);
+	fileoffset = 8;
+}
+
+void ValueIndexWriter::normalize(const char *value, size_t length, string *dest)
+{
+	bool space = false;
+	size_t start = dest->length();
+
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = value[i];
+
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			space = true;
+			continue;
+		}
+
+		if (space && dest->length() > start) *dest += ' ';
+		space = false;
+
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		*dest += (char)c;
+	}
+}
+
+void ValueIndexWriter::makeKey(uint32_t tmplid, const char *name, size_t namelength, string *dest)
+{
+	dest->clear();
+	*dest += (char)(tmplid >> 24);
+	*dest += (char)(tmplid >> 16);
+	*dest += (char)(tmplid >> 8);
+	*dest += (char)tmplid;
+	dest->append(name, namelength);
+	*dest += '\0';
+}
+
+bool ValueIndexWriter::addRow(const char *line, size_t length)
+{
+	if (length && line[length - 1] == '\n') --length;
+	const char *end = line + length;
+
+	const char *tab1 = (const char *)memchr(line, '\t', length);
+	if (! tab1) return false;
+	const char *tab2 = (const char *)memchr(tab1 + 1, '\t', end - tab1 - 1);
+	if (! tab2) tab2 = end;
+
+	char *idend;
+	unsigned long rowtmplid = strtoul(line, &idend, 10);
+	if (idend != tab1) return false;
+	unsigned long pageid = strtoul(tab1 + 1, &idend, 10);
+	if (idend != tab2) return false;
+
+	if (intemplate && rowtmplid != tmplid) {
+		if (rowtmplid < tmplid) return false;
+		flushTemplate();
+	}
+
+	intemplate = true;
+	tmplid = rowtmplid;
+
+	const char *ptr = tab2;
+	while (ptr < end) {
+		const char *namestart = ptr + 1;
+		const char *nameend = (const char *)memchr(namestart, '\t', end - namestart);
+		if (! nameend) return false;
+		const char *valuestart = nameend + 1;
+		const char *valueend = (const char *)memchr(valuestart, '\t', end - valuestart);
+		if (! valueend) valueend = end;
+
+		makeKey(tmplid, namestart, nameend - namestart, &key);
+		normalize(valuestart, valueend - valuestart, &key);
+
+		// Rows are sorted by page id within a template
+		vector<uint32_t>& pages = terms[key];
+		if (pages.empty() || pages.back() != pageid) pages.push_back(pageid);
+
+		ptr = valueend;
+	}
+
+	return true;
+}
+
+void ValueIndexWriter::flushTemplate()
+{
+	for (auto &term : terms) {
+		long long postingsoffset = fileoffset;
+		uint32_t prev = 0;
+
+		postings.clear();
+		for (uint32_t pageid : term.second) {
+			ParamsBinaryWriter::putVarint(&postings, pageid - prev);
+			prev = pageid;
+		}
+
+		dest->write(postings);
+		fileoffset += postings.length();
+
+		const string& termkey = term.first;
+
+		if (termcnt % BLOCK_TERMS == 0) {
+			ParamsBinaryWriter::putVarint(&blockindex, termkey.length());
+			blockindex += termkey;
+			ParamsBinaryWriter::putVarint(&blockindex, dictionary.length());
+			++blockcnt;
+			prevkey.clear();
+		}
+
+		size_t shared = 0;
+		while (shared < prevkey.length() && shared < termkey.length() && prevkey[shared] == termkey[shared]) ++shared;
+
+		ParamsBinaryWriter::putVarint(&dictionary, shared);
+		ParamsBinaryWriter::putVarint(&dictionary, termkey.length() - shared);
+		dictionary.append(termkey, shared, string::npos);
+		ParamsBinaryWriter::putVarint(&dictionary, postingsoffset);
+		ParamsBinaryWriter::putVarint(&dictionary, term.second.size());
+
+		prevkey = termkey;
+		++termcnt;
+	}
+
+	terms.clear();
+}
+
+bool ValueIndexWriter::close()
+{
+	if (closed) return ! dest->fail();
+	closed = true;
+
+	flushTemplate();
+
+	unsigned long long dictoffset = fileoffset;
+	dest->write(dictionary);
+	fileoffset += dictionary.length();
+
+	unsigned long long blockindexoffset = fileoffset;
+	string header;
+	ParamsBinaryWriter::putVarint(&header, blockcnt);
+	dest->write(header);
+	dest->write(blockindex);
+
+	string trailer;
+	for (int i = 0; i < 8; ++i) trailer += (char)(dictoffset >> (8 * i));
+	for (int i = 0; i < 8; ++i) trailer += (char)(blockindexoffset >> (8 * i));
+	trailer.append(TRAILER_MAGIC, 4);
+	dest->write(trailer);
+
+	return dest->flush();
+}
+
+ValueIndexWriter::~ValueIndexWriter()
+{
+	close();
+}
+
+} /* namespace phppreg */
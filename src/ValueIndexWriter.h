@@ -0,0 +1,112 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef VALUEINDEXWRITER_H_
+#define VALUEINDEXWRITER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Inverted index of a sorted params file: (template id, param name, normalized value) -> page ids.
+ *
+ * Layout (varint = unsigned LEB128):
+ * header: "MWVIDX01"
+ * postings: per term, page ids ascending, varint deltas (first is the page id)
+ * dictionary: blocks of up to 64 terms sorted by key, front coded:
+ *   varint shared prefix length, varint suffix length, suffix, varint postings offset, varint page count
+ * block index: varint block count, per block: varint first key length, first key, varint block offset
+ * trailer: 8 byte little endian dictionary offset, 8 byte little endian block index offset, "MWVI"
+ *
+ * A term key is the template id (4 bytes big endian), the param name, a nul, the normalized value,
+ * so byte order is template id, param, value order.
+ */
+class ValueIndexWriter
+{
+public:
+	static const char MAGIC[];
+	static const char TRAILER_MAGIC[];
+	static const int BLOCK_TERMS = 64;
+
+	/**
+	 * constructor
+	 *
+	 * @param dest Output, the header is written immediately
+	 */
+	ValueIndexWriter(OutputWriter *dest);
+
+	/**
+	 * Add a sorted params TSV row.
+	 *
+	 * @param line Row, trailing newline optional
+	 * @param length Row length
+	 * @return false = malformed row, or rows not sorted by template id
+	 */
+	bool addRow(const char *line, size_t length);
+	bool addRow(const std::string& line) { return addRow(line.data(), line.length()); }
+
+	/**
+	 * Write the last template's terms, the dictionary and the trailer.
+	 *
+	 * @return false = write failed
+	 */
+	bool close();
+
+	size_t getTermCount() const { return termcnt; }
+
+	/**
+	 * Append a value lower cased (ASCII), trimmed and with whitespace runs collapsed to a space.
+	 */
+	static void normalize(const char *value, size_t length, std::string *dest);
+
+	/**
+	 * Term key of a template id and param name, the value is appended by the caller.
+	 */
+	static void makeKey(uint32_t tmplid, const char *name, size_t namelength, std::string *dest);
+
+	virtual ~ValueIndexWriter();
+
+protected:
+	OutputWriter *dest;
+	long long fileoffset = 0;
+	bool closed = false;
+	bool intemplate = false;
+	uint32_t tmplid = 0;
+	std::map<std::string, std::vector<uint32_t>> terms; // Current template
+	std::string key;
+	std::string postings;
+	std::string dictionary;
+	std::string blockindex;
+	std::string prevkey;
+	size_t blockcnt = 0;
+	size_t termcnt = 0;
+
+	void flushTemplate();
+
+private:
+	ValueIndexWriter() = delete;
+	ValueIndexWriter(const ValueIndexWriter& other) = delete;
+	ValueIndexWriter& operator= (const ValueIndexWriter& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* VALUEINDEXWRITER_H_ */
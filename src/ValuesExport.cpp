@@ -0,0 +1,186 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#include "ValuesExport.h"
+#include "MappedFile.h"
+#include "string_util.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+namespace phppreg {
+
+ValuesExport::ValuesExport(const string& tempprefix, bool sortbytitle, size_t sortmemory)
+{
+	if (sortbytitle) {
+		// Whole line order is page name, then template occurrence, tab sorting before any title character
+		sorter = new ExternalSort(tempprefix, sortmemory, [](const string& a, const string& b) { return a < b; });
+	} else {
+		spillpath = tempprefix + ".spill";
+		spill = OutputWriter::open(spillpath);
+		if (! spill) failed = true;
+	}
+}
+
+bool ValuesExport::add(const string& pagetitle, const string& templatename, int occurrence, const map<string, string>& params)
+{
+	if (failed) return false;
+
+	// Sanitized names can collide, the last value wins
+	rowparams.clear();
+	for (auto &pair : params) {
+		keybuf.clear();
+		string_append_field(&keybuf, pair.first); // Don't want tabs/newlines in csv file
+
+		string& value = rowparams[keybuf];
+		value.clear();
+		string_append_field(&value, pair.second);
+	}
+
+	// page name, template name{occurrence}, name, value, ...
+	row.assign(pagetitle);
+	row += '\t';
+	row += templatename;
+	if (occurrence > 1) {
+		row += '{';
+		string_append_uint(&row, occurrence);
+		row += '}';
+	}
+
+	for (auto &pair : rowparams) {
+		paramnames.insert(pair.first);
+		row += '\t';
+		row += pair.first;
+		row += '\t';
+		row += pair.second;
+	}
+
+	row += '\n';
+	++rowcnt;
+
+	if (sorter) {
+		if (! sorter->add(row)) failed = true;
+	} else {
+		spill->write(row);
+		if (spill->fail()) failed = true;
+	}
+
+	return ! failed;
+}
+
+void ValuesExport::writeRow(OutputWriter *dest, const char *line, size_t length, const map<string, size_t>& columns,
+	vector<pair<const char *, size_t>> *values)
+{
+	const char *end = line + length;
+	if (length && end[-1] == '\n') --end;
+
+	const char *titleend = (const char *)memchr(line, '\t', end - line);
+	if (! titleend) return;
+	const char *tmplname = titleend + 1;
+	const char *tmplnameend = (const char *)memchr(tmplname, '\t', end - tmplname);
+	if (! tmplnameend) tmplnameend = end;
+
+	// Strip the occurrence number
+	const char *basenameend = tmplnameend;
+	if (basenameend > tmplname && basenameend[-1] == '}') {
+		const char *brace = basenameend - 1;
+		while (brace > tmplname && brace[-1] >= '0' && brace[-1] <= '9') --brace;
+		if (brace > tmplname + 1 && brace < basenameend - 1 && brace[-1] == '{') basenameend = brace - 1;
+	}
+
+	values->assign(columns.size(), make_pair((const char *)0, (size_t)0));
+
+	const char *field = tmplnameend;
+	while (field < end) {
+		const char *name = field + 1;
+		const char *nameend = (const char *)memchr(name, '\t', end - name);
+		if (! nameend) break;
+		const char *value = nameend + 1;
+		const char *valueend = (const char *)memchr(value, '\t', end - value);
+		if (! valueend) valueend = end;
+
+		keybuf.assign(name, nameend - name);
+		auto column_it = columns.find(keybuf);
+		if (column_it != columns.end()) (*values)[column_it->second] = make_pair(value, valueend - value);
+
+		field = valueend;
+	}
+
+	dest->write(line, titleend - line);
+	dest->put('\t');
+	dest->write(tmplname, basenameend - tmplname);
+
+	for (auto &value : *values) {
+		dest->put('\t');
+		if (value.first) dest->write(value.first, value.second);
+	}
+
+	dest->put('\n');
+}
+
+bool ValuesExport::finish(OutputWriter *dest)
+{
+	if (failed) return false;
+
+	map<string, size_t> columns;
+
+	// write the header
+	dest->write("pagename\ttemplatename", 21);
+
+	for (auto &paramname : paramnames) {
+		columns.insert(make_pair(paramname, columns.size()));
+		dest->put('\t');
+		dest->write(paramname);
+	}
+
+	dest->put('\n');
+
+	vector<pair<const char *, size_t>> values;
+	bool readok = true;
+
+	if (sorter) {
+		readok = sorter->finish([&](const string& line) { writeRow(dest, line.data(), line.length(), columns, &values); });
+	} else {
+		readok = spill->flush();
+		delete spill;
+		spill = 0;
+
+		MappedFile spilled;
+		if (readok) readok = spilled.open(spillpath);
+
+		const char *data = spilled.data();
+		size_t offset = 0;
+
+		while (readok && offset < spilled.size()) {
+			const char *eol = (const char *)memchr(data + offset, '\n', spilled.size() - offset);
+			size_t next = eol ? eol + 1 - data : spilled.size();
+			writeRow(dest, data + offset, next - offset, columns, &values);
+			offset = next;
+		}
+	}
+
+	return readok && ! dest->fail();
+}
+
+ValuesExport::~ValuesExport()
+{
+	delete sorter;
+	delete spill;
+	if (! spillpath.empty()) remove(spillpath.c_str());
+}
+
+} /* namespace phppreg */
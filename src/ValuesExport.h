@@ -0,0 +1,93 @@
+/**
+ Copyright 2016 Myers Enterprises II
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#ifndef VALUESEXPORT_H_
+#define VALUESEXPORT_H_
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include "ExternalSort.h"
+#include "OutputWriter.h"
+
+namespace phppreg {
+
+/**
+ * Template parameter values table of one template group: page name, template name, a column per parameter name.
+ *
+ * Rows are spilled as they are added, to an external sort by page name (the default) or a spill file in page order,
+ * only the union of the parameter names is held in memory. finish() writes the header and the rows remapped to the columns.
+ */
+class ValuesExport
+{
+public:
+	/**
+	 * constructor
+	 *
+	 * @param tempprefix Path prefix for the spill and sort run files
+	 * @param sortbytitle true = sort the rows by page name and template occurrence, false = dump order
+	 * @param sortmemory Approximate bytes of rows to sort in memory
+	 */
+	ValuesExport(const std::string& tempprefix, bool sortbytitle = true, size_t sortmemory = 256 * 1024 * 1024);
+
+	/**
+	 * Add a template instance. Parameter names and values are sanitized for tsv.
+	 *
+	 * @param pagetitle Page title
+	 * @param templatename Template name
+	 * @param occurrence Occurrence of the template on the page, starting at 1
+	 * @param params Non empty parameter values
+	 * @return false = spill write failed
+	 */
+	bool add(const std::string& pagetitle, const std::string& templatename, int occurrence, const std::map<std::string, std::string>& params);
+
+	/**
+	 * Write the table.
+	 *
+	 * @param dest Output
+	 * @return false = spill read or write failed
+	 */
+	bool finish(OutputWriter *dest);
+
+	size_t getRowCount() const { return rowcnt; }
+	size_t getColumnCount() const { return paramnames.size(); }
+
+	virtual ~ValuesExport();
+
+protected:
+	std::string spillpath;
+	ExternalSort *sorter = 0;
+	OutputWriter *spill = 0;
+	std::set<std::string> paramnames;
+	std::map<std::string, std::string> rowparams;
+	std::string row;
+	std::string keybuf;
+	size_t rowcnt = 0;
+	bool failed = false;
+
+	void writeRow(OutputWriter *dest, const char *line, size_t length, const std::map<std::string, size_t>& columns,
+		std::vector<std::pair<const char *, size_t>> *values);
+
+private:
+	ValuesExport() = delete;
+	ValuesExport(const ValuesExport& other) = delete;
+	ValuesExport& operator= (const ValuesExport& other) = delete;
+};
+
+} /* namespace phppreg */
+
+#endif /* VALUESEXPORT_H_ */
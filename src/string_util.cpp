@@ -18,6 +18,9 @@
 #include <algorithm>
 #include <cctype>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -90,3 +93,102 @@ void string_split(const string& subject, const string& separator, vector<string>
 
 	pieces->emplace_back(subject.substr(lastPos));
 }
+
+size_t string_append_field(string *dest, const char *subject, size_t length, size_t maxlength)
+{
+	// Back up to the start of a UTF-8 character that would be split
+	if (length > maxlength) {
+		length = maxlength;
+		while (length > 0 && (subject[length] & 0xc0) == 0x80) --length;
+	}
+
+	size_t start = dest->length();
+	dest->append(subject, length);
+	char *field = &(*dest)[0] + start;
+	size_t pos = 0;
+
+#ifdef __SSE2__
+	// 16 bytes at a time, min(x, 0x1f) == x for control characters
+	const __m128i controlmax = _mm_set1_epi8(0x1f);
+
+	for (; pos + 16 <= length; pos += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(field + pos));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(chunk, controlmax), chunk));
+
+		while (mask) {
+			field[pos + __builtin_ctz(mask)] = ' ';
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; pos < length; ++pos) {
+		if (static_cast<unsigned char>(field[pos]) < 0x20) field[pos] = ' ';
+	}
+
+	return length;
+}
+
+static const char DIGIT_PAIRS[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const unsigned long long POWERS_OF_10[] = {
+	0ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+	1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+	1000000000000000000ULL, 10000000000000000000ULL
+};
+
+size_t uint_to_chars(char *dest, unsigned long long value)
+{
+	// Digit count from the bit length, log10(2) ~= 1233/4096
+	size_t approx = ((64 - __builtin_clzll(value | 1)) * 1233) >> 12;
+	size_t length = approx + (value >= POWERS_OF_10[approx]);
+
+	char *ptr = dest + length;
+
+	while (value >= 100) {
+		unsigned int pair = (value % 100) * 2;
+		value /= 100;
+		ptr -= 2;
+		ptr[0] = DIGIT_PAIRS[pair];
+		ptr[1] = DIGIT_PAIRS[pair + 1];
+	}
+
+	if (value >= 10) {
+		ptr -= 2;
+		ptr[0] = DIGIT_PAIRS[value * 2];
+		ptr[1] = DIGIT_PAIRS[value * 2 + 1];
+	} else {
+		*--ptr = '0' + value;
+	}
+
+	return length;
+}
+
+uint64_t string_hash(const char *subject, size_t length)
+{
+	uint64_t hashvalue = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < length; ++i) {
+		hashvalue ^= (unsigned char)subject[i];
+		hashvalue *= 1099511628211ULL;
+	}
+
+	hashvalue ^= hashvalue >> 33;
+	hashvalue *= 0xff51afd7ed558ccdULL;
+	hashvalue ^= hashvalue >> 33;
+	hashvalue *= 0xc4ceb9fe1a85ec53ULL;
+	hashvalue ^= hashvalue >> 33;
+
+	return hashvalue;
+}
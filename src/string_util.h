@@ -19,6 +19,7 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 
 /**
  * Replace all occurences of search string with replace string.
@@ -49,4 +50,50 @@ void string_trim(std::string *subject, const std::string& whitespace = " \r\n\t"
  */
 void string_split(const std::string& subject, const std::string& separator, std::vector<std::string> *pieces, int limit = -1);
 
+/**
+ * Append a field to a tab separated output buffer. Control characters (tab, newline, etc.) are replaced
+ * with spaces and the field is cut to at most maxlength bytes without splitting a UTF-8 character.
+ *
+ * @param dest Buffer to append to
+ * @param subject Field text
+ * @param length Field length in bytes
+ * @param maxlength Maximum bytes to append
+ * @return Number of bytes appended
+ */
+size_t string_append_field(std::string *dest, const char *subject, size_t length, size_t maxlength = 255);
+
+inline size_t string_append_field(std::string *dest, const std::string& subject, size_t maxlength = 255)
+{
+	return string_append_field(dest, subject.data(), subject.length(), maxlength);
+}
+
+/**
+ * Format an unsigned integer as decimal digits, no terminating nul.
+ *
+ * @param dest Buffer of at least 20 bytes
+ * @param value Value to format
+ * @return Number of digits written
+ */
+size_t uint_to_chars(char *dest, unsigned long long value);
+
+inline void string_append_uint(std::string *dest, unsigned long long value)
+{
+	char buf[20];
+	dest->append(buf, uint_to_chars(buf, value));
+}
+
+/**
+ * 64 bit hash of a string, FNV-1a with a 64 bit finalizer so every bit depends on every input byte.
+ *
+ * @param subject String to hash
+ * @param length Length in bytes
+ * @return Hash value
+ */
+uint64_t string_hash(const char *subject, size_t length);
+
+inline uint64_t string_hash(const std::string& subject)
+{
+	return string_hash(subject.data(), subject.length());
+}
+
 #endif /* STRING_UTIL_H_ */